@@ -92,6 +92,8 @@ static BlockDriverState *bdrv_open_inherit(const char *filename,
 static bool bdrv_recurse_has_child(BlockDriverState *bs,
                                    BlockDriverState *child);
 
+static void bdrv_csc_clear(BlockDriverState *bs);
+
 static void GRAPH_WRLOCK
 bdrv_replace_child_noperm(BdrvChild *child, BlockDriverState *new_bs);
 
@@ -429,6 +431,7 @@ BlockDriverState *bdrv_new(void)
 
     qemu_co_mutex_init(&bs->bsc_modify_lock);
     bs->block_status_cache = g_new0(BdrvBlockStatusCache, 1);
+    qemu_mutex_init(&bs->chain_status_cache.lock);
 
     for (i = 0; i < bdrv_drain_all_count; i++) {
         bdrv_drained_begin(bs);
@@ -2972,6 +2975,11 @@ bdrv_replace_child_noperm(BdrvChild *child, BlockDriverState *new_bs)
         QLIST_REMOVE(child, next_parent);
     }
 
+    /* The parent's backing chain may change */
+    if (child->klass == &child_of_bds) {
+        bdrv_csc_invalidate_range(child->opaque, 0, INT64_MAX);
+    }
+
     child->bs = new_bs;
 
     if (new_bs) {
@@ -5181,6 +5189,7 @@ static void bdrv_close(BlockDriverState *bs)
     bs->full_open_options = NULL;
     g_free(bs->block_status_cache);
     bs->block_status_cache = NULL;
+    bdrv_csc_clear(bs);
 
     bdrv_release_named_dirty_bitmaps(bs);
     assert(QLIST_EMPTY(&bs->dirty_bitmaps));
@@ -5568,6 +5577,7 @@ static void bdrv_delete(BlockDriverState *bs)
     bdrv_close(bs);
 
     qemu_mutex_destroy(&bs->reqs_lock);
+    qemu_mutex_destroy(&bs->chain_status_cache.lock);
 
     g_free(bs);
 }
@@ -5670,6 +5680,26 @@ int coroutine_fn bdrv_co_check(BlockDriverState *bs,
     return bs->drv->bdrv_co_check(bs, res, fix);
 }
 
+void bdrv_check_add_phase(BdrvCheckResult *res, const char *name,
+                          int64_t duration_ns)
+{
+    int i;
+
+    for (i = 0; i < res->nb_phases; i++) {
+        if (!strcmp(res->phases[i].name, name)) {
+            res->phases[i].duration_ns += duration_ns;
+            return;
+        }
+    }
+
+    if (res->nb_phases < BDRV_CHECK_MAX_PHASES) {
+        res->phases[res->nb_phases++] = (BdrvCheckPhase) {
+            .name = name,
+            .duration_ns = duration_ns,
+        };
+    }
+}
+
 /*
  * Return values:
  * 0        - success
@@ -6932,6 +6962,9 @@ int coroutine_fn bdrv_co_invalidate_cache(BlockDriverState *bs, Error **errp)
     assert(!(bs->open_flags & BDRV_O_INACTIVE));
     assert_bdrv_graph_readable();
 
+    /* The image may have been modified by someone else */
+    bdrv_csc_invalidate_range(bs, 0, INT64_MAX);
+
     if (bs->drv->bdrv_co_invalidate_cache) {
         bs->drv->bdrv_co_invalidate_cache(bs, &local_err);
         if (local_err) {
@@ -8242,6 +8275,7 @@ int bdrv_make_empty(BdrvChild *c, Error **errp)
     }
 
     ret = drv->bdrv_make_empty(c->bs);
+    bdrv_csc_invalidate_range(c->bs, 0, INT64_MAX);
     if (ret < 0) {
         error_setg_errno(errp, -ret, "Failed to empty %s",
                          c->bs->filename);
@@ -8486,3 +8520,185 @@ void bdrv_bsc_fill(BlockDriverState *bs, int64_t offset, int64_t bytes)
         g_free_rcu(old_bsc, rcu);
     }
 }
+
+/* Maximum number of entries in a chain status cache */
+#define BDRV_CSC_MAX_ENTRIES 16384
+
+typedef struct BdrvChainStatusEntry {
+    IntervalTreeNode node;
+
+    bool want_zero;
+    int ret;
+    int depth;
+    int64_t map;    /* Host offset of node.start if BDRV_BLOCK_OFFSET_VALID */
+    BlockDriverState *file;
+} BdrvChainStatusEntry;
+
+/* Remove all entries overlapping [start, last] */
+static void bdrv_csc_remove_locked(BdrvChainStatusCache *csc,
+                                   uint64_t start, uint64_t last)
+{
+    IntervalTreeNode *node, *next;
+
+    for (node = interval_tree_iter_first(&csc->tree, start, last);
+         node;
+         node = next)
+    {
+        next = interval_tree_iter_next(node, start, last);
+        interval_tree_remove(node, &csc->tree);
+        g_free(container_of(node, BdrvChainStatusEntry, node));
+        qatomic_set(&csc->nb_entries, csc->nb_entries - 1);
+    }
+}
+
+static void bdrv_csc_clear(BlockDriverState *bs)
+{
+    BdrvChainStatusCache *csc = &bs->chain_status_cache;
+
+    QEMU_LOCK_GUARD(&csc->lock);
+    qatomic_inc(&csc->gen);
+    bdrv_csc_remove_locked(csc, 0, UINT64_MAX);
+    assert(csc->nb_entries == 0);
+}
+
+/**
+ * See block_int.h for this function's documentation.
+ */
+int bdrv_csc_lookup(BlockDriverState *bs, bool want_zero,
+                    int64_t offset, int64_t bytes, int64_t *pnum,
+                    int64_t *map, BlockDriverState **file, int *depth,
+                    unsigned *gen)
+{
+    BdrvChainStatusCache *csc = &bs->chain_status_cache;
+    IntervalTreeNode *node;
+    BdrvChainStatusEntry *e;
+    int ret;
+    IO_CODE();
+
+    QEMU_LOCK_GUARD(&csc->lock);
+
+    *gen = qatomic_read(&csc->gen);
+    node = interval_tree_iter_first(&csc->tree, offset, offset);
+    if (!node) {
+        return -ENOENT;
+    }
+
+    e = container_of(node, BdrvChainStatusEntry, node);
+    if (want_zero && !e->want_zero) {
+        return -ENOENT;
+    }
+
+    ret = e->ret;
+    *pnum = MIN(e->node.last + 1 - offset, bytes);
+    if (offset + *pnum != e->node.last + 1) {
+        ret &= ~BDRV_BLOCK_EOF;
+    }
+    *map = e->map + (offset - e->node.start);
+    *file = e->file;
+    *depth = e->depth;
+    return ret;
+}
+
+/**
+ * See block_int.h for this function's documentation.
+ */
+void bdrv_csc_fill(BlockDriverState *bs, unsigned gen, bool want_zero,
+                   int64_t offset, int64_t bytes, int ret, int64_t map,
+                   BlockDriverState *file, int depth)
+{
+    BdrvChainStatusCache *csc = &bs->chain_status_cache;
+    BdrvChainStatusEntry *e;
+    IO_CODE();
+
+    assert(ret >= 0 && bytes > 0);
+
+    QEMU_LOCK_GUARD(&csc->lock);
+
+    if (qatomic_read(&csc->gen) != gen) {
+        return;
+    }
+
+    bdrv_csc_remove_locked(csc, offset, offset + bytes - 1);
+    if (csc->nb_entries >= BDRV_CSC_MAX_ENTRIES) {
+        bdrv_csc_remove_locked(csc, 0, UINT64_MAX);
+    }
+
+    e = g_new(BdrvChainStatusEntry, 1);
+    *e = (BdrvChainStatusEntry) {
+        .node.start = offset,
+        .node.last  = offset + bytes - 1,
+        .want_zero  = want_zero,
+        .ret        = ret,
+        .depth      = depth,
+        .map        = map,
+        .file       = file,
+    };
+    interval_tree_insert(&e->node, &csc->tree);
+    qatomic_set(&csc->nb_entries, csc->nb_entries + 1);
+
+    /*
+     * Pairs with the barrier in bdrv_csc_invalidate_recurse(): Either the
+     * invalidation sees the new entry and removes it, or we see that the
+     * generation has changed in the meantime.
+     */
+    smp_mb();
+    if (qatomic_read(&csc->gen) != gen) {
+        bdrv_csc_remove_locked(csc, offset, offset + bytes - 1);
+    }
+}
+
+/*
+ * Invalidate [offset, offset + bytes) in the cache of @bs itself if @own is
+ * true, and the caches of all of its parents that may depend on the range.
+ */
+static void GRAPH_RDLOCK
+bdrv_csc_invalidate_recurse(BlockDriverState *bs, int64_t offset,
+                            int64_t bytes, bool own)
+{
+    BdrvChainStatusCache *csc = &bs->chain_status_cache;
+    BdrvChild *c;
+
+    if (own) {
+        /*
+         * Avoid taking the lock in the write path for nodes that have no
+         * cached entries; see bdrv_csc_fill() for the barrier pairing.
+         */
+        qatomic_inc(&csc->gen);
+        smp_mb(); /* pairs with smp_mb() in bdrv_csc_fill() */
+        if (qatomic_read(&csc->nb_entries)) {
+            QEMU_LOCK_GUARD(&csc->lock);
+            bdrv_csc_remove_locked(csc, offset,
+                                   offset + MIN(bytes, INT64_MAX - offset) - 1);
+        }
+    }
+
+    QLIST_FOREACH(c, &bs->parents, next_parent) {
+        if (c->klass != &child_of_bds) {
+            continue;
+        }
+        if (c->role & (BDRV_CHILD_COW | BDRV_CHILD_FILTERED)) {
+            /* The parent sees the same range through its backing chain */
+            bdrv_csc_invalidate_recurse(c->opaque, offset, bytes, true);
+        } else {
+            /*
+             * A data or metadata child of the parent was changed.  This does
+             * not change the allocation status of the parent itself (that
+             * would be a change of the parent, invalidated separately), so
+             * its own cache stays valid.  But nodes that have the parent in
+             * their backing chain may have cached results that the parent
+             * computed from this child, at unknown offsets.
+             */
+            bdrv_csc_invalidate_recurse(c->opaque, 0, INT64_MAX, false);
+        }
+    }
+}
+
+/**
+ * See block_int.h for this function's documentation.
+ */
+void bdrv_csc_invalidate_range(BlockDriverState *bs,
+                               int64_t offset, int64_t bytes)
+{
+    IO_CODE();
+    bdrv_csc_invalidate_recurse(bs, offset, bytes, true);
+}
@@ -0,0 +1,385 @@
+/*
+ * Discard and write-zeroes coalescing filter driver
+ *
+ * Guests that trim aggressively send many small discard requests, each of
+ * which ends up as a separate operation (e.g. fallocate()) on the host.  This
+ * filter holds discard and write-zeroes requests back for a short time, merges
+ * adjacent requests that arrive within that window and submits the merged
+ * range as a single operation.  All merged requests complete together once the
+ * merged operation has completed, so the semantics of the individual requests
+ * are preserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+
+#include "qapi/error.h"
+#include "qemu/coroutine.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/units.h"
+#include "block/block-io.h"
+#include "block/block_int.h"
+#include "trace.h"
+
+
+typedef struct CoalesceOpts {
+    int64_t window_ns;
+    int64_t max_bytes;
+} CoalesceOpts;
+
+/*
+ * A range of adjacent requests of the same type that are submitted to the
+ * child node as a single request.
+ */
+typedef struct CoalesceBatch {
+    bool zeroes;                /* write-zeroes (true) or discard (false) */
+    BdrvRequestFlags flags;     /* flags of all write-zeroes requests */
+    int64_t offset;
+    int64_t bytes;
+    unsigned nb_reqs;
+
+    bool open;                  /* in the batches list, requests may join */
+    bool done;                  /* merged request has completed */
+    int ret;                    /* result of the merged request */
+
+    unsigned refcnt;
+    CoQueue waiters;            /* requests that joined the batch */
+    QLIST_ENTRY(CoalesceBatch) next;
+} CoalesceBatch;
+
+typedef struct BDRVCoalesceState {
+    CoalesceOpts opts;
+
+    /*
+     * Protects @batches and the batches in it.  Requests can come from any
+     * thread, so this is not a CoMutex: it is never held across a yield.
+     */
+    QemuMutex lock;
+    QLIST_HEAD(, CoalesceBatch) batches;
+} BDRVCoalesceState;
+
+#define COALESCE_OPT_WINDOW "window-us"
+#define COALESCE_OPT_MAX_BYTES "max-bytes"
+static QemuOptsList runtime_opts = {
+    .name = "coalesce",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = COALESCE_OPT_WINDOW,
+            .type = QEMU_OPT_NUMBER,
+            .help = "how long to wait for adjacent requests in microseconds, "
+                "0 disables coalescing, default 1000",
+        },
+        {
+            .name = COALESCE_OPT_MAX_BYTES,
+            .type = QEMU_OPT_SIZE,
+            .help = "maximum size of a coalesced request, default 64M",
+        },
+        { /* end of list */ }
+    },
+};
+
+static bool coalesce_absorb_opts(CoalesceOpts *dest, QDict *options,
+                                 Error **errp)
+{
+    QemuOpts *opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    uint64_t window_us;
+
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        qemu_opts_del(opts);
+        return false;
+    }
+
+    window_us = qemu_opt_get_number(opts, COALESCE_OPT_WINDOW, 1000);
+    dest->max_bytes = qemu_opt_get_size(opts, COALESCE_OPT_MAX_BYTES, 64 * MiB);
+    qemu_opts_del(opts);
+
+    if (window_us > 1000000) {
+        error_setg(errp, COALESCE_OPT_WINDOW " parameter of coalesce filter "
+                   "must not exceed 1000000");
+        return false;
+    }
+    dest->window_ns = window_us * SCALE_US;
+
+    if (dest->max_bytes == 0 || dest->max_bytes > BDRV_REQUEST_MAX_BYTES) {
+        error_setg(errp, COALESCE_OPT_MAX_BYTES " parameter of coalesce filter "
+                   "must be in the range [1, %" PRIu64 "]",
+                   (uint64_t)BDRV_REQUEST_MAX_BYTES);
+        return false;
+    }
+
+    return true;
+}
+
+static int coalesce_open(BlockDriverState *bs, QDict *options, int flags,
+                         Error **errp)
+{
+    BDRVCoalesceState *s = bs->opaque;
+    int ret;
+
+    GLOBAL_STATE_CODE();
+
+    ret = bdrv_open_file_child(NULL, options, "file", bs, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (!coalesce_absorb_opts(&s->opts, options, errp)) {
+        return -EINVAL;
+    }
+
+    qemu_mutex_init(&s->lock);
+    QLIST_INIT(&s->batches);
+
+    GRAPH_RDLOCK_GUARD_MAINLOOP();
+
+    bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED |
+        (BDRV_REQ_FUA & bs->file->bs->supported_write_flags);
+
+    bs->supported_zero_flags = BDRV_REQ_WRITE_UNCHANGED |
+        ((BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK) &
+            bs->file->bs->supported_zero_flags);
+
+    return 0;
+}
+
+static void coalesce_close(BlockDriverState *bs)
+{
+    BDRVCoalesceState *s = bs->opaque;
+
+    /* All requests have been drained, so there can't be any batch left */
+    assert(QLIST_EMPTY(&s->batches));
+    qemu_mutex_destroy(&s->lock);
+}
+
+static int coalesce_reopen_prepare(BDRVReopenState *reopen_state,
+                                   BlockReopenQueue *queue, Error **errp)
+{
+    CoalesceOpts *opts = g_new0(CoalesceOpts, 1);
+
+    GLOBAL_STATE_CODE();
+
+    if (!coalesce_absorb_opts(opts, reopen_state->options, errp)) {
+        g_free(opts);
+        return -EINVAL;
+    }
+
+    reopen_state->opaque = opts;
+
+    return 0;
+}
+
+static void coalesce_reopen_commit(BDRVReopenState *state)
+{
+    BDRVCoalesceState *s = state->bs->opaque;
+
+    /* The node is drained, so no request is reading the options */
+    s->opts = *(CoalesceOpts *)state->opaque;
+
+    g_free(state->opaque);
+    state->opaque = NULL;
+}
+
+static void coalesce_reopen_abort(BDRVReopenState *state)
+{
+    g_free(state->opaque);
+    state->opaque = NULL;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+coalesce_co_do_request(BlockDriverState *bs, bool zeroes, int64_t offset,
+                       int64_t bytes, BdrvRequestFlags flags)
+{
+    if (zeroes) {
+        return bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+    } else {
+        return bdrv_co_pdiscard(bs->file, offset, bytes);
+    }
+}
+
+/*
+ * Add a request to a batch that it is adjacent to, or start a new batch and
+ * wait for other requests to join it.  Returns the result of the request that
+ * was eventually submitted for the batch.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+coalesce_co_request(BlockDriverState *bs, bool zeroes, int64_t offset,
+                    int64_t bytes, BdrvRequestFlags flags)
+{
+    BDRVCoalesceState *s = bs->opaque;
+    int64_t max_bytes = s->opts.max_bytes;
+    CoalesceBatch *batch;
+    int ret;
+
+    if (!s->opts.window_ns || bytes >= max_bytes) {
+        return coalesce_co_do_request(bs, zeroes, offset, bytes, flags);
+    }
+
+    qemu_mutex_lock(&s->lock);
+
+    QLIST_FOREACH(batch, &s->batches, next) {
+        if (batch->zeroes != zeroes || batch->flags != flags ||
+            batch->bytes + bytes > max_bytes) {
+            continue;
+        }
+
+        if (offset == batch->offset + batch->bytes) {
+            batch->bytes += bytes;
+        } else if (offset + bytes == batch->offset) {
+            batch->offset = offset;
+            batch->bytes += bytes;
+        } else {
+            continue;
+        }
+
+        batch->nb_reqs++;
+        batch->refcnt++;
+        if (batch->bytes == max_bytes) {
+            /* Nothing can join any more, don't bother looking at it */
+            QLIST_REMOVE(batch, next);
+            batch->open = false;
+        }
+
+        while (!batch->done) {
+            qemu_co_queue_wait(&batch->waiters, &s->lock);
+        }
+        ret = batch->ret;
+        goto out;
+    }
+
+    batch = g_new(CoalesceBatch, 1);
+    *batch = (CoalesceBatch) {
+        .zeroes     = zeroes,
+        .flags      = flags,
+        .offset     = offset,
+        .bytes      = bytes,
+        .nb_reqs    = 1,
+        .open       = true,
+        .refcnt     = 1,
+    };
+    qemu_co_queue_init(&batch->waiters);
+    QLIST_INSERT_HEAD(&s->batches, batch, next);
+    qemu_mutex_unlock(&s->lock);
+
+    qemu_co_sleep_ns(QEMU_CLOCK_REALTIME, s->opts.window_ns);
+
+    qemu_mutex_lock(&s->lock);
+    if (batch->open) {
+        QLIST_REMOVE(batch, next);
+        batch->open = false;
+    }
+    offset = batch->offset;
+    bytes = batch->bytes;
+    trace_coalesce_co_request(bs, zeroes, offset, bytes, batch->nb_reqs);
+    qemu_mutex_unlock(&s->lock);
+
+    ret = coalesce_co_do_request(bs, zeroes, offset, bytes, flags);
+
+    qemu_mutex_lock(&s->lock);
+    batch->ret = ret;
+    batch->done = true;
+    qemu_co_queue_restart_all(&batch->waiters);
+
+out:
+    if (--batch->refcnt == 0) {
+        g_free(batch);
+    }
+    qemu_mutex_unlock(&s->lock);
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+coalesce_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                          BdrvRequestFlags flags)
+{
+    return coalesce_co_request(bs, true, offset, bytes, flags);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+coalesce_co_pdiscard(BlockDriverState *bs, int64_t offset, int64_t bytes)
+{
+    return coalesce_co_request(bs, false, offset, bytes, 0);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+coalesce_co_preadv_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                        QEMUIOVector *qiov, size_t qiov_offset,
+                        BdrvRequestFlags flags)
+{
+    return bdrv_co_preadv_part(bs->file, offset, bytes, qiov, qiov_offset,
+                               flags);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+coalesce_co_pwritev_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                         QEMUIOVector *qiov, size_t qiov_offset,
+                         BdrvRequestFlags flags)
+{
+    return bdrv_co_pwritev_part(bs->file, offset, bytes, qiov, qiov_offset,
+                                flags);
+}
+
+static int coroutine_fn GRAPH_RDLOCK coalesce_co_flush(BlockDriverState *bs)
+{
+    return bdrv_co_flush(bs->file->bs);
+}
+
+static int64_t coroutine_fn GRAPH_RDLOCK
+coalesce_co_getlength(BlockDriverState *bs)
+{
+    return bdrv_co_getlength(bs->file->bs);
+}
+
+static void GRAPH_RDLOCK
+coalesce_refresh_limits(BlockDriverState *bs, Error **errp)
+{
+    /*
+     * Let unaligned discard requests through, they may well become aligned
+     * once they are merged with their neighbours.  bdrv_co_pdiscard() on the
+     * child still takes care of its alignment.
+     */
+    bs->bl.pdiscard_alignment = 0;
+}
+
+static BlockDriver bdrv_coalesce_filter = {
+    .format_name = "coalesce",
+    .instance_size = sizeof(BDRVCoalesceState),
+
+    .bdrv_open            = coalesce_open,
+    .bdrv_close           = coalesce_close,
+    .bdrv_child_perm      = bdrv_default_perms,
+    .bdrv_refresh_limits  = coalesce_refresh_limits,
+
+    .bdrv_reopen_prepare  = coalesce_reopen_prepare,
+    .bdrv_reopen_commit   = coalesce_reopen_commit,
+    .bdrv_reopen_abort    = coalesce_reopen_abort,
+
+    .bdrv_co_getlength    = coalesce_co_getlength,
+    .bdrv_co_preadv_part = coalesce_co_preadv_part,
+    .bdrv_co_pwritev_part = coalesce_co_pwritev_part,
+    .bdrv_co_pwrite_zeroes = coalesce_co_pwrite_zeroes,
+    .bdrv_co_pdiscard = coalesce_co_pdiscard,
+    .bdrv_co_flush = coalesce_co_flush,
+
+    .is_filter = true,
+};
+
+static void bdrv_coalesce_init(void)
+{
+    bdrv_register(&bdrv_coalesce_filter);
+}
+
+block_init(bdrv_coalesce_init);
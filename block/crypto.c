@@ -20,8 +20,10 @@
 
 #include "qemu/osdep.h"
 
+#include "block/aio_task.h"
 #include "block/block_int.h"
 #include "block/qdict.h"
+#include "block/thread-pool.h"
 #include "system/block-backend.h"
 #include "crypto/block.h"
 #include "qapi/opts-visitor.h"
@@ -36,10 +38,19 @@
 
 typedef struct BlockCrypto BlockCrypto;
 
+/* Upper limit for the number of threads that en/decrypt for one node */
+#define BLOCK_CRYPTO_MAX_THREADS 16
+
 struct BlockCrypto {
     QCryptoBlock *block;
     bool updating_keys;
     BdrvChild *header;  /* Reference to the detached LUKS header */
+
+    /* Thread pool usage for encryption and decryption */
+    CoMutex threads_lock;
+    CoQueue thread_task_queue;
+    int nb_threads;
+    int max_threads;
 };
 
 
@@ -372,6 +383,11 @@ static int block_crypto_open_generic(QCryptoBlockFormat format,
 
     bs->encrypted = true;
 
+    qemu_co_mutex_init(&crypto->threads_lock);
+    qemu_co_queue_init(&crypto->thread_task_queue);
+    crypto->max_threads = MIN(g_get_num_processors(),
+                              BLOCK_CRYPTO_MAX_THREADS);
+
     ret = 0;
  cleanup:
     qobject_unref(cryptoopts);
@@ -466,6 +482,124 @@ static int block_crypto_reopen_prepare(BDRVReopenState *state,
  */
 #define BLOCK_CRYPTO_MAX_IO_SIZE (1024 * 1024)
 
+/*
+ * Requests are split into pieces of at least this size for en/decryption so
+ * that large requests can use several threads.
+ */
+#define BLOCK_CRYPTO_MIN_TASK_SIZE (64 * 1024)
+
+/*
+ * BlockCryptoEncDecFunc: common prototype of qcrypto_block_encrypt() and
+ * qcrypto_block_decrypt() functions.
+ */
+typedef int (*BlockCryptoEncDecFunc)(QCryptoBlock *block, uint64_t offset,
+                                     uint8_t *buf, size_t len, Error **errp);
+
+typedef struct BlockCryptoTask {
+    AioTask task;
+
+    BlockDriverState *bs;
+    uint64_t offset;
+    uint8_t *buf;
+    size_t len;
+
+    BlockCryptoEncDecFunc func;
+} BlockCryptoTask;
+
+static int block_crypto_encdec_pool_func(void *opaque)
+{
+    BlockCryptoTask *t = opaque;
+    BlockCrypto *crypto = t->bs->opaque;
+
+    return t->func(crypto->block, t->offset, t->buf, t->len, NULL);
+}
+
+/* Run one piece in the thread pool, limited to max_threads at a time */
+static int coroutine_fn block_crypto_co_encdec_task_entry(AioTask *task)
+{
+    BlockCryptoTask *t = container_of(task, BlockCryptoTask, task);
+    BlockCrypto *crypto = t->bs->opaque;
+    int ret;
+
+    qemu_co_mutex_lock(&crypto->threads_lock);
+    while (crypto->nb_threads >= crypto->max_threads) {
+        qemu_co_queue_wait(&crypto->thread_task_queue, &crypto->threads_lock);
+    }
+    crypto->nb_threads++;
+    qemu_co_mutex_unlock(&crypto->threads_lock);
+
+    ret = thread_pool_submit_co(block_crypto_encdec_pool_func, t);
+
+    qemu_co_mutex_lock(&crypto->threads_lock);
+    crypto->nb_threads--;
+    qemu_co_queue_next(&crypto->thread_task_queue);
+    qemu_co_mutex_unlock(&crypto->threads_lock);
+
+    return ret < 0 ? -EIO : 0;
+}
+
+/*
+ * En/decrypt @len bytes in @buf, which correspond to guest @offset, without
+ * blocking the AioContext.  Large buffers are processed by several threads in
+ * parallel.
+ */
+static int coroutine_fn
+block_crypto_co_encdec(BlockDriverState *bs, uint64_t offset, uint8_t *buf,
+                       size_t len, BlockCryptoEncDecFunc func)
+{
+    BlockCrypto *crypto = bs->opaque;
+    uint64_t sector_size = qcrypto_block_get_sector_size(crypto->block);
+    AioTaskPool *pool;
+    size_t task_size;
+    int ret;
+
+    assert(QEMU_IS_ALIGNED(offset, sector_size));
+    assert(QEMU_IS_ALIGNED(len, sector_size));
+
+    task_size = QEMU_ALIGN_UP(DIV_ROUND_UP(len, crypto->max_threads),
+                              sector_size);
+    task_size = MAX(task_size, BLOCK_CRYPTO_MIN_TASK_SIZE);
+
+    if (len <= task_size) {
+        BlockCryptoTask t = {
+            .bs = bs,
+            .offset = offset,
+            .buf = buf,
+            .len = len,
+            .func = func,
+        };
+
+        return block_crypto_co_encdec_task_entry(&t.task);
+    }
+
+    pool = aio_task_pool_new(crypto->max_threads);
+
+    while (len && aio_task_pool_status(pool) == 0) {
+        size_t cur_len = MIN(len, task_size);
+        BlockCryptoTask *t = g_new(BlockCryptoTask, 1);
+
+        *t = (BlockCryptoTask) {
+            .task.func = block_crypto_co_encdec_task_entry,
+            .bs = bs,
+            .offset = offset,
+            .buf = buf,
+            .len = cur_len,
+            .func = func,
+        };
+        aio_task_pool_start_task(pool, &t->task);
+
+        offset += cur_len;
+        buf += cur_len;
+        len -= cur_len;
+    }
+
+    aio_task_pool_wait_all(pool);
+    ret = aio_task_pool_status(pool);
+    aio_task_pool_free(pool);
+
+    return ret;
+}
+
 static int coroutine_fn GRAPH_RDLOCK
 block_crypto_co_preadv(BlockDriverState *bs, int64_t offset, int64_t bytes,
                        QEMUIOVector *qiov, BdrvRequestFlags flags)
@@ -508,9 +642,9 @@ block_crypto_co_preadv(BlockDriverState *bs, int64_t offset, int64_t bytes,
             goto cleanup;
         }
 
-        if (qcrypto_block_decrypt(crypto->block, offset + bytes_done,
-                                  cipher_data, cur_bytes, NULL) < 0) {
-            ret = -EIO;
+        ret = block_crypto_co_encdec(bs, offset + bytes_done, cipher_data,
+                                     cur_bytes, qcrypto_block_decrypt);
+        if (ret < 0) {
             goto cleanup;
         }
 
@@ -565,9 +699,9 @@ block_crypto_co_pwritev(BlockDriverState *bs, int64_t offset, int64_t bytes,
 
         qemu_iovec_to_buf(qiov, bytes_done, cipher_data, cur_bytes);
 
-        if (qcrypto_block_encrypt(crypto->block, offset + bytes_done,
-                                  cipher_data, cur_bytes, NULL) < 0) {
-            ret = -EIO;
+        ret = block_crypto_co_encdec(bs, offset + bytes_done, cipher_data,
+                                     cur_bytes, qcrypto_block_encrypt);
+        if (ret < 0) {
             goto cleanup;
         }
 
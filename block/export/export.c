@@ -19,6 +19,7 @@
 #include "block/export.h"
 #include "block/fuse.h"
 #include "block/nbd.h"
+#include "block/shm-cache.h"
 #include "qapi/error.h"
 #include "qapi/qapi-commands-block-export.h"
 #include "qapi/qapi-events-block-export.h"
@@ -41,6 +42,9 @@ static const BlockExportDriver *blk_exp_drivers[] = {
 #ifdef CONFIG_VDUSE_BLK_EXPORT
     &blk_exp_vduse_blk,
 #endif
+#ifdef CONFIG_POSIX
+    &blk_exp_shm_cache,
+#endif
 };
 
 /* Only accessed from the main thread */
@@ -72,6 +76,43 @@ static const BlockExportDriver *blk_exp_find_driver(BlockExportType type)
     return NULL;
 }
 
+/*
+ * Resolves the names in @iothreads to their AioContexts.  Returns a newly
+ * allocated array of *@count contexts on success, NULL on error (unknown
+ * iothread or duplicate entries).
+ */
+static AioContext **blk_exp_multithread_contexts(strList *iothreads,
+                                                 size_t *count, Error **errp)
+{
+    g_autoptr(GHashTable) seen = g_hash_table_new(g_str_hash, g_str_equal);
+    g_autofree AioContext **ctxs = NULL;
+    size_t n = 0;
+
+    for (strList *e = iothreads; e; e = e->next) {
+        n++;
+    }
+    ctxs = g_new(AioContext *, n);
+
+    n = 0;
+    for (strList *e = iothreads; e; e = e->next) {
+        IOThread *iothread = iothread_by_id(e->value);
+
+        if (!iothread) {
+            error_setg(errp, "iothread \"%s\" not found", e->value);
+            return NULL;
+        }
+        if (!g_hash_table_add(seen, e->value)) {
+            error_setg(errp, "Duplicate iothread \"%s\" in the iothread list",
+                       e->value);
+            return NULL;
+        }
+        ctxs[n++] = iothread_get_aio_context(iothread);
+    }
+
+    *count = n;
+    return g_steal_pointer(&ctxs);
+}
+
 BlockExport *blk_exp_add(BlockExportOptions *export, Error **errp)
 {
     bool fixed_iothread = export->has_fixed_iothread && export->fixed_iothread;
@@ -81,6 +122,8 @@ BlockExport *blk_exp_add(BlockExportOptions *export, Error **errp)
     BlockDriverState *bs;
     BlockBackend *blk = NULL;
     AioContext *ctx;
+    g_autofree AioContext **multithread = NULL;
+    size_t mt_count = 0;
     uint64_t perm;
     int ret;
 
@@ -120,10 +163,35 @@ BlockExport *blk_exp_add(BlockExportOptions *export, Error **errp)
         IOThread *iothread;
         AioContext *new_ctx;
         Error **set_context_errp;
+        const char *iothread_name;
+
+        if (export->iothread->type == QTYPE_QSTRING) {
+            iothread_name = export->iothread->u.single;
+        } else {
+            assert(export->iothread->type == QTYPE_QLIST);
+            if (!drv->supports_multithread) {
+                error_setg(errp, "The %s export type does not support "
+                           "multi-threading",
+                           BlockExportType_str(export->type));
+                goto fail;
+            }
+            if (!export->iothread->u.multi) {
+                error_setg(errp, "The list of iothreads must not be empty");
+                goto fail;
+            }
+
+            multithread =
+                blk_exp_multithread_contexts(export->iothread->u.multi,
+                                             &mt_count, errp);
+            if (!multithread) {
+                goto fail;
+            }
+            iothread_name = export->iothread->u.multi->value;
+        }
 
-        iothread = iothread_by_id(export->iothread);
+        iothread = iothread_by_id(iothread_name);
         if (!iothread) {
-            error_setg(errp, "iothread \"%s\" not found", export->iothread);
+            error_setg(errp, "iothread \"%s\" not found", iothread_name);
             goto fail;
         }
 
@@ -195,7 +263,7 @@ BlockExport *blk_exp_add(BlockExportOptions *export, Error **errp)
         .blk        = blk,
     };
 
-    ret = drv->create(exp, export, errp);
+    ret = drv->create(exp, export, multithread, mt_count, errp);
     if (ret < 0) {
         goto fail;
     }
@@ -365,6 +433,10 @@ BlockExportInfoList *qmp_query_block_exports(Error **errp)
             .shutting_down  = !exp->user_owned,
         };
 
+        if (exp->drv->query_threads) {
+            info->threads = exp->drv->query_threads(exp);
+        }
+
         QAPI_LIST_APPEND(tail, info);
     }
 
@@ -27,42 +27,111 @@
 #include "block/qapi.h"
 #include "qapi/error.h"
 #include "qapi/qapi-commands-block.h"
+#include "qemu/coroutine.h"
+#include "qemu/error-report.h"
 #include "qemu/main-loop.h"
 #include "system/block-backend.h"
 
 #include <fuse.h>
 #include <fuse_lowlevel.h>
 
+#include "standard-headers/linux/fuse.h"
+
 #if defined(CONFIG_FALLOCATE_ZERO_RANGE)
 #include <linux/falloc.h>
 #endif
 
 #ifdef __linux__
 #include <linux/fs.h>
+#include <sys/ioctl.h>
 #endif
 
 /* Prevent overly long bounce buffer allocations */
-#define FUSE_MAX_BOUNCE_BYTES (MIN(BDRV_REQUEST_MAX_BYTES, 64 * 1024 * 1024))
+#define FUSE_MAX_READ_BYTES (MIN(BDRV_REQUEST_MAX_BYTES, 64 * 1024 * 1024))
+
+/*
+ * Largest write request we accept from the kernel.  Every queue needs a
+ * request buffer of (roughly) this size.
+ */
+#define FUSE_MAX_WRITE_BYTES (1 * 1024 * 1024)
+
+/*
+ * Write data up to this length is read into the queue's request buffer
+ * (and copied from there); longer writes spill over into a separate
+ * buffer whose ownership is then passed to the request coroutine.
+ */
+#define FUSE_IN_PLACE_WRITE_BYTES (4 * 1024)
+
+#define FUSE_WRITE_DATA_OFFSET \
+    (sizeof(struct fuse_in_header) + sizeof(struct fuse_write_in))
+
+#define FUSE_REQUEST_BUF_SIZE \
+    (FUSE_WRITE_DATA_OFFSET + FUSE_IN_PLACE_WRITE_BYTES)
+
+#define FUSE_SPILLOVER_BUF_SIZE \
+    (FUSE_MAX_WRITE_BYTES - FUSE_IN_PLACE_WRITE_BYTES)
 
+typedef struct FuseExport FuseExport;
 
-typedef struct FuseExport {
+/*
+ * A FUSE request queue: One /dev/fuse file descriptor whose requests are
+ * processed in one AioContext.  Replies must be written to the FD from which
+ * the respective request was read.
+ */
+typedef struct FuseQueue {
+    FuseExport *exp;
+
+    AioContext *ctx;
+    int fuse_fd;
+
+    /*
+     * Receives the request header and argument, and the first
+     * FUSE_IN_PLACE_WRITE_BYTES of write data.  Only valid until the request
+     * coroutine yields for the first time.
+     */
+    char request_buf[FUSE_REQUEST_BUF_SIZE] QEMU_ALIGNED(8);
+    size_t request_len;
+
+    /* Receives write data beyond FUSE_IN_PLACE_WRITE_BYTES */
+    void *spillover_buf;
+} FuseQueue;
+
+struct FuseExport {
     BlockExport common;
 
     struct fuse_session *fuse_session;
-    struct fuse_buf fuse_buf;
     unsigned int in_flight; /* atomic */
     bool mounted, fd_handler_set_up;
 
+    /*
+     * With multi-threading, each queue stays in the AioContext it has been
+     * created for; otherwise, the single queue follows the BlockBackend.
+     */
+    bool multithread;
+    FuseQueue *queues;
+    size_t num_queues;
+
+    /*
+     * Serializes changes of the image size (growing it for writes beyond the
+     * EOF, truncate and fallocate) against each other
+     */
+    CoMutex grow_lock;
+
     char *mountpoint;
     bool writable;
     bool growable;
     /* Whether allow_other was used as a mount option or not */
     bool allow_other;
 
+    /*
+     * Protects st_mode, st_uid and st_gid, which requests in any queue may
+     * access.  Never held across a yield.
+     */
+    QemuMutex attr_lock;
     mode_t st_mode;
     uid_t st_uid;
     gid_t st_gid;
-} FuseExport;
+};
 
 static GHashTable *exports;
 static const struct fuse_lowlevel_ops fuse_ops;
@@ -74,19 +143,39 @@ static void init_exports_table(void);
 
 static int setup_fuse_export(FuseExport *exp, const char *mountpoint,
                              bool allow_other, Error **errp);
-static void read_from_fuse_export(void *opaque);
+static int setup_fuse_queues(FuseExport *exp, Error **errp);
+static void read_from_fuse_fd(void *opaque);
 
 static bool is_regular_file(const char *path, Error **errp);
 
 
+static void fuse_attach_handlers(FuseExport *exp)
+{
+    for (size_t i = 0; i < exp->num_queues; i++) {
+        FuseQueue *q = &exp->queues[i];
+
+        aio_set_fd_handler(q->ctx, q->fuse_fd,
+                           read_from_fuse_fd, NULL, NULL, NULL, q);
+    }
+    exp->fd_handler_set_up = true;
+}
+
+static void fuse_detach_handlers(FuseExport *exp)
+{
+    for (size_t i = 0; i < exp->num_queues; i++) {
+        FuseQueue *q = &exp->queues[i];
+
+        aio_set_fd_handler(q->ctx, q->fuse_fd,
+                           NULL, NULL, NULL, NULL, NULL);
+    }
+    exp->fd_handler_set_up = false;
+}
+
 static void fuse_export_drained_begin(void *opaque)
 {
     FuseExport *exp = opaque;
 
-    aio_set_fd_handler(exp->common.ctx,
-                       fuse_session_fd(exp->fuse_session),
-                       NULL, NULL, NULL, NULL, NULL);
-    exp->fd_handler_set_up = false;
+    fuse_detach_handlers(exp);
 }
 
 static void fuse_export_drained_end(void *opaque)
@@ -95,11 +184,11 @@ static void fuse_export_drained_end(void *opaque)
 
     /* Refresh AioContext in case it changed */
     exp->common.ctx = blk_get_aio_context(exp->common.blk);
+    if (!exp->multithread) {
+        exp->queues[0].ctx = exp->common.ctx;
+    }
 
-    aio_set_fd_handler(exp->common.ctx,
-                       fuse_session_fd(exp->fuse_session),
-                       read_from_fuse_export, NULL, NULL, NULL, exp);
-    exp->fd_handler_set_up = true;
+    fuse_attach_handlers(exp);
 }
 
 static bool fuse_export_drained_poll(void *opaque)
@@ -117,6 +206,8 @@ static const BlockDevOps fuse_export_blk_dev_ops = {
 
 static int fuse_export_create(BlockExport *blk_exp,
                               BlockExportOptions *blk_exp_args,
+                              AioContext *const *multithread,
+                              size_t mt_count,
                               Error **errp)
 {
     FuseExport *exp = container_of(blk_exp, FuseExport, common);
@@ -125,7 +216,40 @@ static int fuse_export_create(BlockExport *blk_exp,
 
     assert(blk_exp_args->type == BLOCK_EXPORT_TYPE_FUSE);
 
-    /* For growable and writable exports, take the RESIZE permission */
+#ifndef __linux__
+    if (mt_count > 1) {
+        error_setg(errp, "Multi-threaded FUSE exports are only supported on "
+                   "Linux hosts");
+        return -ENOTSUP;
+    }
+#endif
+
+    if (multithread) {
+        exp->multithread = true;
+        exp->num_queues = mt_count;
+        exp->queues = g_new0(FuseQueue, mt_count);
+        for (size_t i = 0; i < mt_count; i++) {
+            exp->queues[i].ctx = multithread[i];
+        }
+    } else {
+        exp->num_queues = 1;
+        exp->queues = g_new0(FuseQueue, 1);
+        exp->queues[0].ctx = exp->common.ctx;
+    }
+    for (size_t i = 0; i < exp->num_queues; i++) {
+        exp->queues[i].exp = exp;
+        exp->queues[i].fuse_fd = -1;
+    }
+
+    qemu_co_mutex_init(&exp->grow_lock);
+    qemu_mutex_init(&exp->attr_lock);
+
+    /*
+     * For growable and writable exports, take the RESIZE permission.  Writable
+     * exports can be truncated by their users at any time, and requests may
+     * run in iothreads, where the permission can't be taken just for the
+     * duration of the truncate, so it is held for the lifetime of the export.
+     */
     if (args->growable || blk_exp_args->writable) {
         uint64_t blk_perm, blk_shared_perm;
 
@@ -134,7 +258,7 @@ static int fuse_export_create(BlockExport *blk_exp,
         ret = blk_set_perm(exp->common.blk, blk_perm | BLK_PERM_RESIZE,
                            blk_shared_perm, errp);
         if (ret < 0) {
-            return ret;
+            goto fail;
         }
     }
 
@@ -237,11 +361,11 @@ static int setup_fuse_export(FuseExport *exp, const char *mountpoint,
     int ret;
 
     /*
-     * max_read needs to match what fuse_init() sets.
+     * max_read needs to match what fuse_co_init() sets.
      * max_write need not be supplied.
      */
     mount_opts = g_strdup_printf("max_read=%zu,default_permissions%s",
-                                 FUSE_MAX_BOUNCE_BYTES,
+                                 FUSE_MAX_READ_BYTES,
                                  allow_other ? ",allow_other" : "");
 
     fuse_argv[0] = ""; /* Dummy program name */
@@ -269,10 +393,12 @@ static int setup_fuse_export(FuseExport *exp, const char *mountpoint,
 
     g_hash_table_insert(exports, g_strdup(mountpoint), NULL);
 
-    aio_set_fd_handler(exp->common.ctx,
-                       fuse_session_fd(exp->fuse_session),
-                       read_from_fuse_export, NULL, NULL, NULL, exp);
-    exp->fd_handler_set_up = true;
+    ret = setup_fuse_queues(exp, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    fuse_attach_handlers(exp);
 
     return 0;
 
@@ -281,27 +407,166 @@ fail:
     return ret;
 }
 
+#ifdef __linux__
 /**
- * Callback to be invoked when the FUSE session FD can be read from.
- * (This is basically the FUSE event loop.)
+ * Open a new /dev/fuse FD that is attached to the same FUSE connection as
+ * @session_fd.  Requests for the connection can be read from either FD, but
+ * must be answered on the FD they have been read from.
+ */
+static int clone_fuse_fd(int session_fd, Error **errp)
+{
+    uint32_t src_fd = session_fd;
+    int fd;
+
+    fd = qemu_open("/dev/fuse", O_RDWR, errp);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    if (ioctl(fd, FUSE_DEV_IOC_CLONE, &src_fd) < 0) {
+        int ret = -errno;
+
+        error_setg_errno(errp, errno, "Failed to clone FUSE device FD");
+        close(fd);
+        return ret;
+    }
+
+    return fd;
+}
+#endif
+
+/**
+ * Assign a /dev/fuse FD to every queue: The first queue uses the session FD,
+ * all others (only in multi-threaded mode) use clones of it.
  */
-static void read_from_fuse_export(void *opaque)
+static int setup_fuse_queues(FuseExport *exp, Error **errp)
+{
+    int session_fd = fuse_session_fd(exp->fuse_session);
+
+    for (size_t i = 0; i < exp->num_queues; i++) {
+        FuseQueue *q = &exp->queues[i];
+
+        if (i == 0) {
+            q->fuse_fd = session_fd;
+        } else {
+#ifdef __linux__
+            q->fuse_fd = clone_fuse_fd(session_fd, errp);
+            if (q->fuse_fd < 0) {
+                return q->fuse_fd;
+            }
+#else
+            g_assert_not_reached();
+#endif
+        }
+
+        /*
+         * In multi-threaded mode, all queues are woken up for a new request,
+         * but only one of them will get it.  The others must not block.
+         */
+        if (!g_unix_set_fd_nonblocking(q->fuse_fd, true, NULL)) {
+            error_setg_errno(errp, errno, "Failed to make FUSE FD "
+                             "non-blocking");
+            return -errno;
+        }
+    }
+
+    return 0;
+}
+
+static void coroutine_fn co_fuse_process_request(void *opaque);
+
+static void fuse_export_halted_bh(void *opaque)
 {
     FuseExport *exp = opaque;
-    int ret;
+
+    blk_exp_request_shutdown(&exp->common);
+    blk_exp_unref(&exp->common);
+}
+
+/*
+ * Stop reading from @q's FUSE FD, which cannot deliver any more requests,
+ * and shut the export down.  Called in @q's thread; the shutdown itself
+ * happens in the main loop.
+ */
+static void fuse_export_halted(FuseQueue *q)
+{
+    FuseExport *exp = q->exp;
+
+    aio_set_fd_handler(q->ctx, q->fuse_fd, NULL, NULL, NULL, NULL, NULL);
+
+    blk_exp_ref(&exp->common);
+    aio_bh_schedule_oneshot(qemu_get_aio_context(), fuse_export_halted_bh,
+                            exp);
+}
+
+/**
+ * Callback to be invoked when a FUSE queue FD can be read from.
+ * (This is basically the FUSE event loop.)
+ */
+static void read_from_fuse_fd(void *opaque)
+{
+    FuseQueue *q = opaque;
+    FuseExport *exp = q->exp;
+    struct iovec iov[2];
+    Coroutine *co;
+    ssize_t ret;
 
     blk_exp_ref(&exp->common);
 
     qatomic_inc(&exp->in_flight);
 
+    /*
+     * The kernel refuses reads into buffers that cannot hold a maximum-sized
+     * write request, so the spill-over buffer must always be present.
+     */
+    if (!q->spillover_buf) {
+        q->spillover_buf = qemu_memalign(qemu_real_host_page_size(),
+                                         FUSE_SPILLOVER_BUF_SIZE);
+    }
+
+    iov[0] = (struct iovec) {
+        .iov_base = q->request_buf,
+        .iov_len = sizeof(q->request_buf),
+    };
+    iov[1] = (struct iovec) {
+        .iov_base = q->spillover_buf,
+        .iov_len = FUSE_SPILLOVER_BUF_SIZE,
+    };
+
     do {
-        ret = fuse_session_receive_buf(exp->fuse_session, &exp->fuse_buf);
-    } while (ret == -EINTR);
+        ret = readv(q->fuse_fd, iov, ARRAY_SIZE(iov));
+    } while (ret < 0 && errno == EINTR);
     if (ret < 0) {
+        if (errno == EAGAIN) {
+            /* Another queue has taken the request */
+            goto out;
+        }
+
+        /*
+         * ENODEV means that the FUSE connection is gone (e.g. the file system
+         * has been unmounted externally).  Other errors are not expected to
+         * go away either, and the FD would stay readable, so stop polling it
+         * in any case.
+         */
+        if (errno != ENODEV) {
+            error_report("Failed to read from FUSE device: %s",
+                         strerror(errno));
+        }
+        fuse_export_halted(q);
+        goto out;
+    }
+    if (ret < sizeof(struct fuse_in_header)) {
+        error_report("FUSE request truncated (%zd bytes)", ret);
         goto out;
     }
 
-    fuse_session_process_buf(exp->fuse_session, &exp->fuse_buf);
+    /*
+     * The coroutine takes its own references and consumes the request
+     * buffer before yielding, so the buffer can be reused afterwards.
+     */
+    q->request_len = ret;
+    co = qemu_coroutine_create(co_fuse_process_request, q);
+    qemu_coroutine_enter(co);
 
 out:
     if (qatomic_fetch_dec(&exp->in_flight) == 1) {
@@ -319,10 +584,7 @@ static void fuse_export_shutdown(BlockExport *blk_exp)
         fuse_session_exit(exp->fuse_session);
 
         if (exp->fd_handler_set_up) {
-            aio_set_fd_handler(exp->common.ctx,
-                               fuse_session_fd(exp->fuse_session),
-                               NULL, NULL, NULL, NULL, NULL);
-            exp->fd_handler_set_up = false;
+            fuse_detach_handlers(exp);
         }
     }
 
@@ -339,6 +601,18 @@ static void fuse_export_delete(BlockExport *blk_exp)
 {
     FuseExport *exp = container_of(blk_exp, FuseExport, common);
 
+    for (size_t i = 0; i < exp->num_queues; i++) {
+        FuseQueue *q = &exp->queues[i];
+
+        /* The first queue's FD belongs to the session */
+        if (i > 0 && q->fuse_fd >= 0) {
+            close(q->fuse_fd);
+        }
+        qemu_vfree(q->spillover_buf);
+    }
+    g_free(exp->queues);
+    qemu_mutex_destroy(&exp->attr_lock);
+
     if (exp->fuse_session) {
         if (exp->mounted) {
             fuse_session_unmount(exp->fuse_session);
@@ -347,7 +621,6 @@ static void fuse_export_delete(BlockExport *blk_exp)
         fuse_session_destroy(exp->fuse_session);
     }
 
-    free(exp->fuse_buf.mem);
     g_free(exp->mountpoint);
 }
 
@@ -375,114 +648,157 @@ static bool is_regular_file(const char *path, Error **errp)
 }
 
 /**
- * A chance to set change some parameters supplied to FUSE_INIT.
+ * Send a reply for the request @unique on the queue's FD.  @error is either
+ * 0 or a negative errno value; in the latter case, no data is sent.
  */
-static void fuse_init(void *userdata, struct fuse_conn_info *conn)
+static void fuse_write_reply(FuseQueue *q, uint64_t unique, int error,
+                             const void *data, size_t size)
 {
+    struct fuse_out_header out_hdr;
+    struct iovec iov[2];
+    int iovcnt = 1;
+    ssize_t ret;
+
+    if (error < 0) {
+        size = 0;
+    }
+
+    out_hdr = (struct fuse_out_header) {
+        .len = sizeof(out_hdr) + size,
+        .error = error,
+        .unique = unique,
+    };
+    iov[0] = (struct iovec) {
+        .iov_base = &out_hdr,
+        .iov_len = sizeof(out_hdr),
+    };
+    if (size) {
+        iov[1] = (struct iovec) {
+            .iov_base = (void *)data,
+            .iov_len = size,
+        };
+        iovcnt++;
+    }
+
+    do {
+        ret = writev(q->fuse_fd, iov, iovcnt);
+    } while (ret < 0 && errno == EINTR);
+
     /*
-     * MIN_NON_ZERO() would not be wrong here, but what we set here
-     * must equal what has been passed to fuse_session_new().
-     * Therefore, as long as max_read must be passed as a mount option
-     * (which libfuse claims will be changed at some point), we have
-     * to set max_read to a fixed value here.
+     * ENOENT means that the request has been interrupted in the meantime,
+     * which is not an error on our side.
      */
-    conn->max_read = FUSE_MAX_BOUNCE_BYTES;
-
-    conn->max_write = MIN_NON_ZERO(BDRV_REQUEST_MAX_BYTES, conn->max_write);
+    if (ret < 0 && errno != ENOENT) {
+        error_report("Failed to send FUSE reply: %s", strerror(errno));
+    }
 }
 
 /**
- * Let clients look up files.  Always return ENOENT because we only
- * care about the mountpoint itself.
+ * Handle the FUSE_INIT request, i.e. negotiate the protocol version and
+ * parameters with the kernel.
  */
-static void fuse_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+static ssize_t fuse_init(FuseExport *exp, struct fuse_init_out *out,
+                         const struct fuse_init_in *in)
 {
-    fuse_reply_err(req, ENOENT);
+    const uint32_t supported_flags = FUSE_ASYNC_READ | FUSE_BIG_WRITES |
+                                     FUSE_MAX_PAGES;
+
+    if (in->major != FUSE_KERNEL_VERSION) {
+        error_report("Unsupported FUSE kernel protocol version %" PRIu32
+                     ".%" PRIu32, in->major, in->minor);
+        return -EPROTO;
+    }
+    /* Since 7.23, fuse_init_out has its current size */
+    if (in->minor < 23) {
+        error_report("FUSE kernel protocol version 7.%" PRIu32 " is too old, "
+                     "7.23 or newer is required", in->minor);
+        return -EPROTO;
+    }
+
+    *out = (struct fuse_init_out) {
+        .major = FUSE_KERNEL_VERSION,
+        .minor = FUSE_KERNEL_MINOR_VERSION,
+        .max_readahead = in->max_readahead,
+        .flags = in->flags & supported_flags,
+        /* Allow many concurrent requests, so all queues can be kept busy */
+        .max_background = UINT16_MAX,
+        .congestion_threshold = UINT16_MAX / 4 * 3,
+        .max_write = FUSE_MAX_WRITE_BYTES,
+        .time_gran = 1,
+        .max_pages = MIN(FUSE_MAX_WRITE_BYTES / qemu_real_host_page_size(),
+                         UINT16_MAX),
+    };
+
+    return sizeof(*out);
 }
 
 /**
  * Let clients get file attributes (i.e., stat() the file).
  */
-static void fuse_getattr(fuse_req_t req, fuse_ino_t inode,
-                         struct fuse_file_info *fi)
+static ssize_t coroutine_fn
+fuse_co_getattr(FuseExport *exp, struct fuse_attr_out *out, uint64_t inode)
 {
-    struct stat statbuf;
     int64_t length, allocated_blocks;
+    uint32_t blksize;
     time_t now = time(NULL);
-    FuseExport *exp = fuse_req_userdata(req);
 
-    length = blk_getlength(exp->common.blk);
+    length = blk_co_getlength(exp->common.blk);
     if (length < 0) {
-        fuse_reply_err(req, -length);
-        return;
+        return length;
     }
 
-    allocated_blocks = bdrv_get_allocated_file_size(blk_bs(exp->common.blk));
+    WITH_GRAPH_RDLOCK_GUARD() {
+        BlockDriverState *bs = blk_bs(exp->common.blk);
+
+        allocated_blocks = bdrv_co_get_allocated_file_size(bs);
+        blksize = bs->bl.request_alignment;
+    }
     if (allocated_blocks <= 0) {
         allocated_blocks = DIV_ROUND_UP(length, 512);
     } else {
         allocated_blocks = DIV_ROUND_UP(allocated_blocks, 512);
     }
 
-    statbuf = (struct stat) {
-        .st_ino     = inode,
-        .st_mode    = exp->st_mode,
-        .st_nlink   = 1,
-        .st_uid     = exp->st_uid,
-        .st_gid     = exp->st_gid,
-        .st_size    = length,
-        .st_blksize = blk_bs(exp->common.blk)->bl.request_alignment,
-        .st_blocks  = allocated_blocks,
-        .st_atime   = now,
-        .st_mtime   = now,
-        .st_ctime   = now,
+    qemu_mutex_lock(&exp->attr_lock);
+    *out = (struct fuse_attr_out) {
+        .attr_valid = 1,
+        .attr = {
+            .ino        = inode,
+            .mode       = exp->st_mode,
+            .nlink      = 1,
+            .uid        = exp->st_uid,
+            .gid        = exp->st_gid,
+            .size       = length,
+            .blksize    = blksize,
+            .blocks     = allocated_blocks,
+            .atime      = now,
+            .mtime      = now,
+            .ctime      = now,
+        },
     };
+    qemu_mutex_unlock(&exp->attr_lock);
 
-    fuse_reply_attr(req, &statbuf, 1.);
+    return sizeof(*out);
 }
 
-static int fuse_do_truncate(const FuseExport *exp, int64_t size,
-                            bool req_zero_write, PreallocMode prealloc)
+static int coroutine_fn
+fuse_co_do_truncate(const FuseExport *exp, int64_t size, bool req_zero_write,
+                    PreallocMode prealloc)
 {
-    uint64_t blk_perm, blk_shared_perm;
     BdrvRequestFlags truncate_flags = 0;
-    bool add_resize_perm;
-    int ret, ret_check;
 
-    /* Growable and writable exports have a permanent RESIZE permission */
-    add_resize_perm = !exp->growable && !exp->writable;
+    /*
+     * Only writable exports can be resized, and those hold the RESIZE
+     * permission for their whole lifetime (see fuse_export_create())
+     */
+    assert(exp->writable);
 
     if (req_zero_write) {
         truncate_flags |= BDRV_REQ_ZERO_WRITE;
     }
 
-    if (add_resize_perm) {
-
-        if (!qemu_in_main_thread()) {
-            /* Changing permissions like below only works in the main thread */
-            return -EPERM;
-        }
-
-        blk_get_perm(exp->common.blk, &blk_perm, &blk_shared_perm);
-
-        ret = blk_set_perm(exp->common.blk, blk_perm | BLK_PERM_RESIZE,
-                           blk_shared_perm, NULL);
-        if (ret < 0) {
-            return ret;
-        }
-    }
-
-    ret = blk_truncate(exp->common.blk, size, true, prealloc,
-                       truncate_flags, NULL);
-
-    if (add_resize_perm) {
-        /* Must succeed, because we are only giving up the RESIZE permission */
-        ret_check = blk_set_perm(exp->common.blk, blk_perm,
-                                 blk_shared_perm, &error_abort);
-        assert(ret_check == 0);
-    }
-
-    return ret;
+    return blk_co_truncate(exp->common.blk, size, true, prealloc,
+                           truncate_flags, NULL);
 }
 
 /**
@@ -493,201 +809,250 @@ static int fuse_do_truncate(const FuseExport *exp, int64_t size,
  * without allow_other cannot be given a different UID or GID, and
  * they cannot be given non-owner access.
  */
-static void fuse_setattr(fuse_req_t req, fuse_ino_t inode, struct stat *statbuf,
-                         int to_set, struct fuse_file_info *fi)
+static ssize_t coroutine_fn
+fuse_co_setattr(FuseExport *exp, struct fuse_attr_out *out, uint64_t inode,
+                const struct fuse_setattr_in *in)
 {
-    FuseExport *exp = fuse_req_userdata(req);
-    int supported_attrs;
+    uint32_t to_set, supported_attrs;
     int ret;
 
-    supported_attrs = FUSE_SET_ATTR_SIZE | FUSE_SET_ATTR_MODE;
+    /* The file handle and lock owner are only informational */
+    to_set = in->valid & ~(FATTR_FH | FATTR_LOCKOWNER);
+
+    supported_attrs = FATTR_SIZE | FATTR_MODE;
     if (exp->allow_other) {
-        supported_attrs |= FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID;
+        supported_attrs |= FATTR_UID | FATTR_GID;
     }
 
     if (to_set & ~supported_attrs) {
-        fuse_reply_err(req, ENOTSUP);
-        return;
+        return -ENOTSUP;
     }
 
     /* Do some argument checks first before committing to anything */
-    if (to_set & FUSE_SET_ATTR_MODE) {
+    if (to_set & FATTR_MODE) {
         /*
          * Without allow_other, non-owners can never access the export, so do
          * not allow setting permissions for them
          */
-        if (!exp->allow_other &&
-            (statbuf->st_mode & (S_IRWXG | S_IRWXO)) != 0)
-        {
-            fuse_reply_err(req, EPERM);
-            return;
+        if (!exp->allow_other && (in->mode & (S_IRWXG | S_IRWXO)) != 0) {
+            return -EPERM;
         }
 
         /* +w for read-only exports makes no sense, disallow it */
-        if (!exp->writable &&
-            (statbuf->st_mode & (S_IWUSR | S_IWGRP | S_IWOTH)) != 0)
-        {
-            fuse_reply_err(req, EROFS);
-            return;
+        if (!exp->writable && (in->mode & (S_IWUSR | S_IWGRP | S_IWOTH)) != 0) {
+            return -EROFS;
         }
     }
 
-    if (to_set & FUSE_SET_ATTR_SIZE) {
+    if (to_set & FATTR_SIZE) {
         if (!exp->writable) {
-            fuse_reply_err(req, EACCES);
-            return;
+            return -EACCES;
         }
 
-        ret = fuse_do_truncate(exp, statbuf->st_size, true, PREALLOC_MODE_OFF);
+        qemu_co_mutex_lock(&exp->grow_lock);
+        ret = fuse_co_do_truncate(exp, in->size, true, PREALLOC_MODE_OFF);
+        qemu_co_mutex_unlock(&exp->grow_lock);
         if (ret < 0) {
-            fuse_reply_err(req, -ret);
-            return;
+            return ret;
         }
     }
 
-    if (to_set & FUSE_SET_ATTR_MODE) {
+    qemu_mutex_lock(&exp->attr_lock);
+    if (to_set & FATTR_MODE) {
         /* Ignore FUSE-supplied file type, only change the mode */
-        exp->st_mode = (statbuf->st_mode & 07777) | S_IFREG;
+        exp->st_mode = (in->mode & 07777) | S_IFREG;
     }
 
-    if (to_set & FUSE_SET_ATTR_UID) {
-        exp->st_uid = statbuf->st_uid;
+    if (to_set & FATTR_UID) {
+        exp->st_uid = in->uid;
     }
 
-    if (to_set & FUSE_SET_ATTR_GID) {
-        exp->st_gid = statbuf->st_gid;
+    if (to_set & FATTR_GID) {
+        exp->st_gid = in->gid;
     }
+    qemu_mutex_unlock(&exp->attr_lock);
 
-    fuse_getattr(req, inode, fi);
-}
-
-/**
- * Let clients open a file (i.e., the exported image).
- */
-static void fuse_open(fuse_req_t req, fuse_ino_t inode,
-                      struct fuse_file_info *fi)
-{
-    fuse_reply_open(req, fi);
+    return fuse_co_getattr(exp, out, inode);
 }
 
 /**
- * Handle client reads from the exported image.
+ * Handle client reads from the exported image.  On success, *bufptr is set
+ * to a buffer holding the data, which must be freed with qemu_vfree().
  */
-static void fuse_read(fuse_req_t req, fuse_ino_t inode,
-                      size_t size, off_t offset, struct fuse_file_info *fi)
+static ssize_t coroutine_fn
+fuse_co_read(FuseExport *exp, void **bufptr, uint64_t offset, uint32_t size)
 {
-    FuseExport *exp = fuse_req_userdata(req);
     int64_t length;
     void *buf;
     int ret;
 
     /* Limited by max_read, should not happen */
-    if (size > FUSE_MAX_BOUNCE_BYTES) {
-        fuse_reply_err(req, EINVAL);
-        return;
+    if (size > FUSE_MAX_READ_BYTES) {
+        return -EINVAL;
     }
 
     /**
      * Clients will expect short reads at EOF, so we have to limit
      * offset+size to the image length.
      */
-    length = blk_getlength(exp->common.blk);
+    length = blk_co_getlength(exp->common.blk);
     if (length < 0) {
-        fuse_reply_err(req, -length);
-        return;
+        return length;
     }
 
+    if (offset >= length) {
+        return 0;
+    }
     if (offset + size > length) {
         size = length - offset;
     }
 
     buf = qemu_try_blockalign(blk_bs(exp->common.blk), size);
     if (!buf) {
-        fuse_reply_err(req, ENOMEM);
-        return;
+        return -ENOMEM;
     }
 
-    ret = blk_pread(exp->common.blk, offset, size, buf, 0);
-    if (ret >= 0) {
-        fuse_reply_buf(req, buf, size);
-    } else {
-        fuse_reply_err(req, -ret);
+    ret = blk_co_pread(exp->common.blk, offset, size, buf, 0);
+    if (ret < 0) {
+        qemu_vfree(buf);
+        return ret;
     }
 
-    qemu_vfree(buf);
+    *bufptr = buf;
+    return size;
+}
+
+/**
+ * Collect the data of a FUSE_WRITE request into @qiov.  The part of the data
+ * that has been read into the queue's request buffer is copied, and the
+ * spill-over buffer is taken over from the queue, so this must be called
+ * before the request coroutine yields for the first time.  Free the buffers
+ * with fuse_free_write_data().
+ */
+static int fuse_get_write_data(FuseQueue *q, uint32_t size,
+                               QEMUIOVector *qiov)
+{
+    size_t data_len, in_place_len;
+
+    if (q->request_len < FUSE_WRITE_DATA_OFFSET) {
+        return -EINVAL;
+    }
+    data_len = q->request_len - FUSE_WRITE_DATA_OFFSET;
+    if (data_len != size) {
+        return -EINVAL;
+    }
+    in_place_len = MIN(data_len, FUSE_IN_PLACE_WRITE_BYTES);
+
+    qemu_iovec_init(qiov, 2);
+    if (in_place_len) {
+        void *buf = blk_blockalign(q->exp->common.blk, in_place_len);
+
+        memcpy(buf, q->request_buf + FUSE_WRITE_DATA_OFFSET, in_place_len);
+        qemu_iovec_add(qiov, buf, in_place_len);
+    }
+    if (data_len > in_place_len) {
+        qemu_iovec_add(qiov, q->spillover_buf, data_len - in_place_len);
+        q->spillover_buf = NULL;
+    }
+
+    return 0;
+}
+
+static void fuse_free_write_data(QEMUIOVector *qiov)
+{
+    for (int i = 0; i < qiov->niov; i++) {
+        qemu_vfree(qiov->iov[i].iov_base);
+    }
+    qemu_iovec_destroy(qiov);
 }
 
 /**
  * Handle client writes to the exported image.
  */
-static void fuse_write(fuse_req_t req, fuse_ino_t inode, const char *buf,
-                       size_t size, off_t offset, struct fuse_file_info *fi)
+static ssize_t coroutine_fn
+fuse_co_write(FuseExport *exp, struct fuse_write_out *out, uint64_t offset,
+              QEMUIOVector *qiov)
 {
-    FuseExport *exp = fuse_req_userdata(req);
+    uint64_t size = qiov->size;
     int64_t length;
     int ret;
 
-    /* Limited by max_write, should not happen */
-    if (size > BDRV_REQUEST_MAX_BYTES) {
-        fuse_reply_err(req, EINVAL);
-        return;
-    }
-
     if (!exp->writable) {
-        fuse_reply_err(req, EACCES);
-        return;
+        return -EACCES;
     }
 
     /**
      * Clients will expect short writes at EOF, so we have to limit
      * offset+size to the image length.
      */
-    length = blk_getlength(exp->common.blk);
+    length = blk_co_getlength(exp->common.blk);
     if (length < 0) {
-        fuse_reply_err(req, -length);
-        return;
+        return length;
     }
 
-    if (offset + size > length) {
-        if (exp->growable) {
-            ret = fuse_do_truncate(exp, offset + size, true, PREALLOC_MODE_OFF);
+    if (offset + size > length && exp->growable) {
+        /* Another request may have grown the image in the meantime */
+        qemu_co_mutex_lock(&exp->grow_lock);
+        length = blk_co_getlength(exp->common.blk);
+        if (length >= 0 && offset + size > length) {
+            ret = fuse_co_do_truncate(exp, offset + size, true,
+                                      PREALLOC_MODE_OFF);
             if (ret < 0) {
-                fuse_reply_err(req, -ret);
-                return;
+                length = ret;
+            } else {
+                length = offset + size;
             }
-        } else {
-            size = length - offset;
+        }
+        qemu_co_mutex_unlock(&exp->grow_lock);
+        if (length < 0) {
+            return length;
         }
     }
 
-    ret = blk_pwrite(exp->common.blk, offset, size, buf, 0);
-    if (ret >= 0) {
-        fuse_reply_write(req, size);
-    } else {
-        fuse_reply_err(req, -ret);
+    if (offset >= length) {
+        size = 0;
+    } else if (offset + size > length) {
+        size = length - offset;
+    }
+
+    ret = blk_co_pwritev(exp->common.blk, offset, size, qiov, 0);
+    if (ret < 0) {
+        return ret;
     }
+
+    *out = (struct fuse_write_out) {
+        .size = size,
+    };
+    return sizeof(*out);
 }
 
 /**
  * Let clients perform various fallocate() operations.
  */
-static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
-                           off_t offset, off_t length,
-                           struct fuse_file_info *fi)
+static int coroutine_fn
+fuse_co_fallocate(FuseExport *exp, int64_t offset, int64_t length,
+                  uint32_t mode)
 {
-    FuseExport *exp = fuse_req_userdata(req);
+    bool may_resize = true;
     int64_t blk_len;
     int ret;
 
     if (!exp->writable) {
-        fuse_reply_err(req, EACCES);
-        return;
+        return -EACCES;
     }
 
-    blk_len = blk_getlength(exp->common.blk);
+#ifdef CONFIG_FALLOCATE_PUNCH_HOLE
+    may_resize = !(mode & FALLOC_FL_KEEP_SIZE);
+#endif
+    if (may_resize) {
+        /* The size must not change between checking it and truncating */
+        qemu_co_mutex_lock(&exp->grow_lock);
+    }
+
+    blk_len = blk_co_getlength(exp->common.blk);
     if (blk_len < 0) {
-        fuse_reply_err(req, -blk_len);
-        return;
+        ret = blk_len;
+        goto out;
     }
 
 #ifdef CONFIG_FALLOCATE_PUNCH_HOLE
@@ -699,34 +1064,34 @@ static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
     if (!mode) {
         /* We can only fallocate at the EOF with a truncate */
         if (offset < blk_len) {
-            fuse_reply_err(req, EOPNOTSUPP);
-            return;
+            ret = -EOPNOTSUPP;
+            goto out;
         }
 
         if (offset > blk_len) {
             /* No preallocation needed here */
-            ret = fuse_do_truncate(exp, offset, true, PREALLOC_MODE_OFF);
+            ret = fuse_co_do_truncate(exp, offset, true, PREALLOC_MODE_OFF);
             if (ret < 0) {
-                fuse_reply_err(req, -ret);
-                return;
+                goto out;
             }
         }
 
-        ret = fuse_do_truncate(exp, offset + length, true,
-                               PREALLOC_MODE_FALLOC);
+        ret = fuse_co_do_truncate(exp, offset + length, true,
+                                  PREALLOC_MODE_FALLOC);
     }
 #ifdef CONFIG_FALLOCATE_PUNCH_HOLE
     else if (mode & FALLOC_FL_PUNCH_HOLE) {
         if (!(mode & FALLOC_FL_KEEP_SIZE)) {
-            fuse_reply_err(req, EINVAL);
-            return;
+            ret = -EINVAL;
+            goto out;
         }
 
         do {
             int size = MIN(length, BDRV_REQUEST_MAX_BYTES);
 
-            ret = blk_pwrite_zeroes(exp->common.blk, offset, size,
-                                    BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK);
+            ret = blk_co_pwrite_zeroes(exp->common.blk, offset, size,
+                                       BDRV_REQ_MAY_UNMAP |
+                                       BDRV_REQ_NO_FALLBACK);
             if (ret == -ENOTSUP) {
                 /*
                  * fallocate() specifies to return EOPNOTSUPP for unsupported
@@ -744,19 +1109,18 @@ static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
     else if (mode & FALLOC_FL_ZERO_RANGE) {
         if (!(mode & FALLOC_FL_KEEP_SIZE) && offset + length > blk_len) {
             /* No need for zeroes, we are going to write them ourselves */
-            ret = fuse_do_truncate(exp, offset + length, false,
-                                   PREALLOC_MODE_OFF);
+            ret = fuse_co_do_truncate(exp, offset + length, false,
+                                      PREALLOC_MODE_OFF);
             if (ret < 0) {
-                fuse_reply_err(req, -ret);
-                return;
+                goto out;
             }
         }
 
         do {
             int size = MIN(length, BDRV_REQUEST_MAX_BYTES);
 
-            ret = blk_pwrite_zeroes(exp->common.blk,
-                                    offset, size, 0);
+            ret = blk_co_pwrite_zeroes(exp->common.blk,
+                                       offset, size, 0);
             offset += size;
             length -= size;
         } while (ret == 0 && length > 0);
@@ -766,55 +1130,41 @@ static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
         ret = -EOPNOTSUPP;
     }
 
-    fuse_reply_err(req, ret < 0 ? -ret : 0);
+out:
+    if (may_resize) {
+        qemu_co_mutex_unlock(&exp->grow_lock);
+    }
+    return ret < 0 ? ret : 0;
 }
 
 /**
  * Let clients fsync the exported image.
  */
-static void fuse_fsync(fuse_req_t req, fuse_ino_t inode, int datasync,
-                       struct fuse_file_info *fi)
-{
-    FuseExport *exp = fuse_req_userdata(req);
-    int ret;
-
-    ret = blk_flush(exp->common.blk);
-    fuse_reply_err(req, ret < 0 ? -ret : 0);
-}
-
-/**
- * Called before an FD to the exported image is closed.  (libfuse
- * notes this to be a way to return last-minute errors.)
- */
-static void fuse_flush(fuse_req_t req, fuse_ino_t inode,
-                        struct fuse_file_info *fi)
+static int coroutine_fn fuse_co_fsync(FuseExport *exp)
 {
-    fuse_fsync(req, inode, 1, fi);
+    return blk_co_flush(exp->common.blk);
 }
 
 #ifdef CONFIG_FUSE_LSEEK
 /**
  * Let clients inquire allocation status.
  */
-static void fuse_lseek(fuse_req_t req, fuse_ino_t inode, off_t offset,
-                       int whence, struct fuse_file_info *fi)
+static ssize_t coroutine_fn
+fuse_co_lseek(FuseExport *exp, struct fuse_lseek_out *out, int64_t offset,
+              uint32_t whence)
 {
-    FuseExport *exp = fuse_req_userdata(req);
-
     if (whence != SEEK_HOLE && whence != SEEK_DATA) {
-        fuse_reply_err(req, EINVAL);
-        return;
+        return -EINVAL;
     }
 
     while (true) {
         int64_t pnum;
         int ret;
 
-        ret = bdrv_block_status_above(blk_bs(exp->common.blk), NULL,
-                                      offset, INT64_MAX, &pnum, NULL, NULL);
+        ret = blk_co_block_status_above(exp->common.blk, NULL, offset,
+                                        INT64_MAX, &pnum, NULL, NULL);
         if (ret < 0) {
-            fuse_reply_err(req, -ret);
-            return;
+            return ret;
         }
 
         if (!pnum && (ret & BDRV_BLOCK_EOF)) {
@@ -829,63 +1179,226 @@ static void fuse_lseek(fuse_req_t req, fuse_ino_t inode, off_t offset,
              * and @blk_len (the client-visible EOF).
              */
 
-            blk_len = blk_getlength(exp->common.blk);
+            blk_len = blk_co_getlength(exp->common.blk);
             if (blk_len < 0) {
-                fuse_reply_err(req, -blk_len);
-                return;
+                return blk_len;
             }
 
             if (offset > blk_len || whence == SEEK_DATA) {
-                fuse_reply_err(req, ENXIO);
-            } else {
-                fuse_reply_lseek(req, offset);
+                return -ENXIO;
             }
-            return;
+            break;
         }
 
         if (ret & BDRV_BLOCK_DATA) {
             if (whence == SEEK_DATA) {
-                fuse_reply_lseek(req, offset);
-                return;
+                break;
             }
         } else {
             if (whence == SEEK_HOLE) {
-                fuse_reply_lseek(req, offset);
-                return;
+                break;
             }
         }
 
         /* Safety check against infinite loops */
         if (!pnum) {
-            fuse_reply_err(req, ENXIO);
-            return;
+            return -ENXIO;
         }
 
         offset += pnum;
     }
+
+    *out = (struct fuse_lseek_out) {
+        .offset = offset,
+    };
+    return sizeof(*out);
 }
 #endif
 
-static const struct fuse_lowlevel_ops fuse_ops = {
-    .init       = fuse_init,
-    .lookup     = fuse_lookup,
-    .getattr    = fuse_getattr,
-    .setattr    = fuse_setattr,
-    .open       = fuse_open,
-    .read       = fuse_read,
-    .write      = fuse_write,
-    .fallocate  = fuse_fallocate,
-    .flush      = fuse_flush,
-    .fsync      = fuse_fsync,
+/**
+ * Return the minimum length of the fixed-size argument of @opcode.
+ */
+static size_t fuse_in_arg_size(uint32_t opcode)
+{
+    switch (opcode) {
+    case FUSE_INIT:
+        /* Older kernels only send the fields up to @flags */
+        return offsetof(struct fuse_init_in, flags2);
+    case FUSE_SETATTR:
+        return sizeof(struct fuse_setattr_in);
+    case FUSE_READ:
+        return sizeof(struct fuse_read_in);
+    case FUSE_WRITE:
+        return sizeof(struct fuse_write_in);
+    case FUSE_FALLOCATE:
+        return sizeof(struct fuse_fallocate_in);
+    case FUSE_LSEEK:
+        return sizeof(struct fuse_lseek_in);
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Process the request that has just been read into @opaque (a FuseQueue)
+ * and send the reply.
+ */
+static void coroutine_fn co_fuse_process_request(void *opaque)
+{
+    FuseQueue *q = opaque;
+    FuseExport *exp = q->exp;
+    struct fuse_in_header in_hdr;
+    union {
+        struct fuse_init_in init;
+        struct fuse_setattr_in setattr;
+        struct fuse_read_in read;
+        struct fuse_write_in write;
+        struct fuse_fallocate_in fallocate;
+        struct fuse_lseek_in lseek;
+    } in = {};
+    union {
+        struct fuse_init_out init;
+        struct fuse_attr_out attr;
+        struct fuse_open_out open;
+        struct fuse_write_out write;
+        struct fuse_lseek_out lseek;
+        struct fuse_statfs_out statfs;
+    } out;
+    const void *out_buf = &out;
+    void *read_buf = NULL;
+    QEMUIOVector write_qiov;
+    bool has_write_data = false;
+    size_t arg_len;
+    ssize_t ret;
+
+    blk_exp_ref(&exp->common);
+    qatomic_inc(&exp->in_flight);
+
+    /* Copy everything we need out of the request buffer before yielding */
+    memcpy(&in_hdr, q->request_buf, sizeof(in_hdr));
+    arg_len = MIN(q->request_len, sizeof(q->request_buf)) - sizeof(in_hdr);
+    memcpy(&in, q->request_buf + sizeof(in_hdr), MIN(arg_len, sizeof(in)));
+
+    if (arg_len < fuse_in_arg_size(in_hdr.opcode)) {
+        ret = -EINVAL;
+        goto reply;
+    }
+
+    if (in_hdr.opcode == FUSE_WRITE) {
+        ret = fuse_get_write_data(q, in.write.size, &write_qiov);
+        if (ret < 0) {
+            goto reply;
+        }
+        has_write_data = true;
+    }
+
+    switch (in_hdr.opcode) {
+    case FUSE_INIT:
+        ret = fuse_init(exp, &out.init, &in.init);
+        break;
+
+    case FUSE_FORGET:
+    case FUSE_BATCH_FORGET:
+    case FUSE_INTERRUPT:
+        /* These must not be replied to */
+        goto out;
+
+    case FUSE_LOOKUP:
+        /* We only care about the mountpoint itself */
+        ret = -ENOENT;
+        break;
+
+    case FUSE_GETATTR:
+        ret = fuse_co_getattr(exp, &out.attr, in_hdr.nodeid);
+        break;
+
+    case FUSE_SETATTR:
+        ret = fuse_co_setattr(exp, &out.attr, in_hdr.nodeid, &in.setattr);
+        break;
+
+    case FUSE_OPEN:
+        out.open = (struct fuse_open_out) {};
+        ret = sizeof(out.open);
+        break;
+
+    case FUSE_RELEASE:
+    case FUSE_DESTROY:
+        ret = 0;
+        break;
+
+    case FUSE_READ:
+        ret = fuse_co_read(exp, &read_buf, in.read.offset, in.read.size);
+        out_buf = read_buf;
+        break;
+
+    case FUSE_WRITE:
+        ret = fuse_co_write(exp, &out.write, in.write.offset, &write_qiov);
+        break;
+
+    case FUSE_FALLOCATE:
+        ret = fuse_co_fallocate(exp, in.fallocate.offset, in.fallocate.length,
+                                in.fallocate.mode);
+        break;
+
+    /*
+     * FLUSH is called before an FD to the exported image is closed.  (libfuse
+     * notes this to be a way to return last-minute errors.)
+     */
+    case FUSE_FLUSH:
+    case FUSE_FSYNC:
+        ret = fuse_co_fsync(exp);
+        break;
+
+    case FUSE_STATFS:
+        /* Same defaults as libfuse uses when no statfs handler is given */
+        out.statfs = (struct fuse_statfs_out) {
+            .st = {
+                .bsize = 512,
+                .namelen = 255,
+            },
+        };
+        ret = sizeof(out.statfs);
+        break;
+
 #ifdef CONFIG_FUSE_LSEEK
-    .lseek      = fuse_lseek,
+    case FUSE_LSEEK:
+        ret = fuse_co_lseek(exp, &out.lseek, in.lseek.offset,
+                            in.lseek.whence);
+        break;
 #endif
-};
+
+    default:
+        ret = -ENOSYS;
+        break;
+    }
+
+reply:
+    fuse_write_reply(q, in_hdr.unique, MIN(ret, 0), out_buf, MAX(ret, 0));
+
+out:
+    if (has_write_data) {
+        fuse_free_write_data(&write_qiov);
+    }
+    qemu_vfree(read_buf);
+
+    if (qatomic_fetch_dec(&exp->in_flight) == 1) {
+        aio_wait_kick(); /* wake AIO_WAIT_WHILE() */
+    }
+
+    blk_exp_unref(&exp->common);
+}
+
+/*
+ * Requests are read and processed by the export itself, libfuse is only used
+ * to set up and mount the session.
+ */
+static const struct fuse_lowlevel_ops fuse_ops = {};
 
 const BlockExportDriver blk_exp_fuse = {
-    .type               = BLOCK_EXPORT_TYPE_FUSE,
-    .instance_size      = sizeof(FuseExport),
-    .create             = fuse_export_create,
-    .delete             = fuse_export_delete,
-    .request_shutdown   = fuse_export_shutdown,
+    .type                   = BLOCK_EXPORT_TYPE_FUSE,
+    .instance_size          = sizeof(FuseExport),
+    .supports_multithread   = true,
+    .create                 = fuse_export_create,
+    .delete                 = fuse_export_delete,
+    .request_shutdown       = fuse_export_shutdown,
 };
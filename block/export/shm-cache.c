@@ -0,0 +1,186 @@
+/*
+ * Export a read-only block node through a shared-memory cache
+ *
+ * The export creates the cache file that the shm-cache block driver in other
+ * processes maps read-only, and fills it with the data of the exported node
+ * in the background.  The file is never written by any other process, so a
+ * misbehaving client can't make the others read wrong data.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+
+#include "block/export.h"
+#include "block/shm-cache.h"
+#include "qapi/error.h"
+#include "qemu/coroutine.h"
+#include "qemu/memalign.h"
+#include "qemu/units.h"
+#include "system/block-backend.h"
+
+/* Number of bytes that are read at once to fill the cache */
+#define SHM_CACHE_POPULATE_BYTES (1 * MiB)
+
+typedef struct ShmCacheExport {
+    BlockExport common;
+
+    char *path;
+    ShmCache cache;
+    bool stopping;
+} ShmCacheExport;
+
+/*
+ * Fill the cache with the data of the exported node, from the start of the
+ * image until the cache is full.  Ranges that read as zeroes are skipped:
+ * the clients' children serve them cheaply.
+ *
+ * Holds a reference to the export while it runs.
+ */
+static void coroutine_fn shm_cache_export_populate(void *opaque)
+{
+    ShmCacheExport *exp = opaque;
+    ShmCache *c = &exp->cache;
+    BlockBackend *blk = exp->common.blk;
+    uint64_t cluster_size = 1ULL << c->cluster_bits;
+    uint64_t chunk = MAX(SHM_CACHE_POPULATE_BYTES, cluster_size);
+    uint64_t nb_slots = 1ULL << c->slot_bits;
+    uint64_t nb_cached = 0;
+    uint64_t offset, pos;
+    int64_t bytes, pnum;
+    uint8_t *buf;
+    int ret;
+
+    buf = blk_try_blockalign(blk, chunk);
+    if (!buf) {
+        goto out;
+    }
+
+    for (offset = 0; offset < c->image_size && nb_cached < nb_slots;
+         offset += chunk)
+    {
+        if (qatomic_read(&exp->stopping)) {
+            break;
+        }
+
+        bytes = MIN(chunk, c->image_size - offset);
+        ret = blk_co_block_status_above(blk, NULL, offset, bytes, &pnum,
+                                        NULL, NULL);
+        if (ret >= 0 && (ret & BDRV_BLOCK_ZERO) && pnum == bytes) {
+            continue;
+        }
+
+        ret = blk_co_pread(blk, offset, bytes, buf, 0);
+        if (ret < 0) {
+            /* Clients will read this range from their own child */
+            continue;
+        }
+        memset(buf + bytes, 0, QEMU_ALIGN_UP(bytes, cluster_size) - bytes);
+
+        for (pos = 0; pos < bytes; pos += cluster_size) {
+            if (shm_cache_insert(c, (offset + pos) >> c->cluster_bits,
+                                 buf + pos)) {
+                nb_cached++;
+            }
+        }
+    }
+
+    qemu_vfree(buf);
+out:
+    blk_exp_unref(&exp->common);
+}
+
+static int shm_cache_export_create(BlockExport *blk_exp,
+                                   BlockExportOptions *blk_exp_args,
+                                   AioContext *const *multithread,
+                                   size_t mt_count,
+                                   Error **errp)
+{
+    ShmCacheExport *exp = container_of(blk_exp, ShmCacheExport, common);
+    BlockExportOptionsShmCache *args = &blk_exp_args->u.shm_cache;
+    uint64_t cluster_size = args->has_cluster_size ? args->cluster_size
+                                                   : 64 * KiB;
+    ShmCacheImageId image_id;
+    Coroutine *co;
+    int64_t len;
+    int ret;
+
+    assert(blk_exp_args->type == BLOCK_EXPORT_TYPE_SHM_CACHE);
+
+    if (multithread) {
+        error_setg(errp, "The shm-cache export does not support "
+                   "multi-threading");
+        return -EINVAL;
+    }
+
+    if (blk_exp_args->writable) {
+        error_setg(errp, "The shm-cache export only supports read-only "
+                   "images");
+        return -EINVAL;
+    }
+
+    if (cluster_size < 4 * KiB || cluster_size > 2 * MiB ||
+        !is_power_of_2(cluster_size)) {
+        error_setg(errp, "cluster-size must be a power of two between 4k "
+                   "and 2M");
+        return -EINVAL;
+    }
+
+    len = blk_getlength(exp->common.blk);
+    if (len < 0) {
+        error_setg_errno(errp, -len, "Could not get the image size");
+        return len;
+    }
+
+    bdrv_graph_rdlock_main_loop();
+    ret = shm_cache_get_image_id(blk_bs(exp->common.blk), &image_id, errp);
+    bdrv_graph_rdunlock_main_loop();
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = shm_cache_create(&exp->cache, args->path, args->size, cluster_size,
+                           len, &image_id, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    exp->path = g_strdup(args->path);
+
+    blk_exp_ref(&exp->common);
+    co = qemu_coroutine_create(shm_cache_export_populate, exp);
+    aio_co_enter(exp->common.ctx, co);
+    return 0;
+}
+
+static void shm_cache_export_delete(BlockExport *blk_exp)
+{
+    ShmCacheExport *exp = container_of(blk_exp, ShmCacheExport, common);
+
+    shm_cache_close(&exp->cache);
+    g_free(exp->path);
+}
+
+static void shm_cache_export_shutdown(BlockExport *blk_exp)
+{
+    ShmCacheExport *exp = container_of(blk_exp, ShmCacheExport, common);
+
+    qatomic_set(&exp->stopping, true);
+
+    /*
+     * Processes that have the cache mapped can continue to use it, but no new
+     * processes should find it anymore.
+     */
+    if (exp->path) {
+        unlink(exp->path);
+    }
+}
+
+const BlockExportDriver blk_exp_shm_cache = {
+    .type               = BLOCK_EXPORT_TYPE_SHM_CACHE,
+    .instance_size      = sizeof(ShmCacheExport),
+    .create             = shm_cache_export_create,
+    .delete             = shm_cache_export_delete,
+    .request_shutdown   = shm_cache_export_shutdown,
+};
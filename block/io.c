@@ -1279,6 +1279,7 @@ bdrv_co_do_copy_on_readv(BdrvChild *child, int64_t offset, int64_t bytes,
                                           &local_qiov, 0,
                                           BDRV_REQ_WRITE_UNCHANGED);
             }
+            bdrv_csc_invalidate_range(bs, align_offset, pnum);
 
             if (ret < 0) {
                 /* It might be okay to ignore write errors for guest
@@ -2022,6 +2023,18 @@ bdrv_co_write_req_finish(BdrvChild *child, int64_t offset, int64_t bytes,
 
     qatomic_inc(&bs->write_gen);
 
+    /*
+     * Drop cached backing chain status only now that the request has
+     * completed, so that no concurrent block status query can cache the
+     * state from before the write.  Queries that are still in flight will
+     * notice the invalidation and not fill the cache.
+     */
+    if (req->type == BDRV_TRACKED_TRUNCATE) {
+        bdrv_csc_invalidate_range(bs, 0, INT64_MAX);
+    } else {
+        bdrv_csc_invalidate_range(bs, offset, bytes);
+    }
+
     /*
      * Discard cannot extend the image, but in error handling cases, such as
      * when reverting a qcow2 cluster allocation, the discarded range can pass
@@ -2619,36 +2632,21 @@ early_out:
     return ret;
 }
 
-int coroutine_fn
-bdrv_co_common_block_status_above(BlockDriverState *bs,
-                                  BlockDriverState *base,
-                                  bool include_base,
-                                  bool want_zero,
-                                  int64_t offset,
-                                  int64_t bytes,
-                                  int64_t *pnum,
-                                  int64_t *map,
-                                  BlockDriverState **file,
-                                  int *depth)
+static int coroutine_fn GRAPH_RDLOCK
+bdrv_co_do_block_status_above(BlockDriverState *bs,
+                              BlockDriverState *base,
+                              bool include_base,
+                              bool want_zero,
+                              int64_t offset,
+                              int64_t bytes,
+                              int64_t *pnum,
+                              int64_t *map,
+                              BlockDriverState **file,
+                              int *depth)
 {
     int ret;
     BlockDriverState *p;
     int64_t eof = 0;
-    int dummy;
-    IO_CODE();
-
-    assert(!include_base || base); /* Can't include NULL base */
-    assert_bdrv_graph_readable();
-
-    if (!depth) {
-        depth = &dummy;
-    }
-    *depth = 0;
-
-    if (!include_base && bs == base) {
-        *pnum = bytes;
-        return 0;
-    }
 
     ret = bdrv_co_do_block_status(bs, want_zero, offset, bytes, pnum,
                                   map, file);
@@ -2723,6 +2721,73 @@ bdrv_co_common_block_status_above(BlockDriverState *bs,
     return ret;
 }
 
+int coroutine_fn
+bdrv_co_common_block_status_above(BlockDriverState *bs,
+                                  BlockDriverState *base,
+                                  bool include_base,
+                                  bool want_zero,
+                                  int64_t offset,
+                                  int64_t bytes,
+                                  int64_t *pnum,
+                                  int64_t *map,
+                                  BlockDriverState **file,
+                                  int *depth)
+{
+    int ret;
+    int64_t local_map = 0;
+    BlockDriverState *local_file = NULL;
+    bool use_cache;
+    unsigned gen = 0;
+    int dummy;
+    IO_CODE();
+
+    assert(!include_base || base); /* Can't include NULL base */
+    assert_bdrv_graph_readable();
+
+    if (!depth) {
+        depth = &dummy;
+    }
+    *depth = 0;
+
+    if (!include_base && bs == base) {
+        *pnum = bytes;
+        return 0;
+    }
+
+    /*
+     * Queries for the status of the whole backing chain can be answered
+     * from the chain status cache of @bs.  Only ranges that are not
+     * allocated in @bs itself are cached there (the status of the top node
+     * is already cheap or covered by the driver's block status cache), so
+     * that this is where the expensive walk down the chain is saved.
+     */
+    use_cache = !base && bdrv_filter_or_cow_bs(bs);
+    if (use_cache) {
+        ret = bdrv_csc_lookup(bs, want_zero, offset, bytes, pnum,
+                              &local_map, &local_file, depth, &gen);
+        if (ret >= 0) {
+            goto out;
+        }
+    }
+
+    ret = bdrv_co_do_block_status_above(bs, base, include_base, want_zero,
+                                        offset, bytes, pnum, &local_map,
+                                        &local_file, depth);
+    if (use_cache && ret >= 0 && *pnum > 0 && *depth > 1) {
+        bdrv_csc_fill(bs, gen, want_zero, offset, *pnum, ret, local_map,
+                      local_file, *depth);
+    }
+
+out:
+    if (map) {
+        *map = local_map;
+    }
+    if (file) {
+        *file = local_file;
+    }
+    return ret;
+}
+
 int coroutine_fn bdrv_co_block_status_above(BlockDriverState *bs,
                                             BlockDriverState *base,
                                             int64_t offset, int64_t bytes,
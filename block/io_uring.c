@@ -29,6 +29,7 @@
 typedef struct LuringAIOCB {
     Coroutine *co;
     struct io_uring_sqe sqeq;
+    CqeHandler cqe_handler; /* only used with aio_add_sqe() */
     ssize_t ret;
     QEMUIOVector *qiov;
     bool is_read;
@@ -75,8 +76,8 @@ static void luring_resubmit(LuringState *s, LuringAIOCB *luringcb)
 /**
  * luring_resubmit_short_read:
  *
- * Short reads are rare but may occur. The remaining read request needs to be
- * resubmitted.
+ * Short reads are rare but may occur. Update the request so that the caller
+ * can resubmit the remaining read request.
  */
 static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
                                        int nread)
@@ -104,8 +105,67 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
     luringcb->sqeq.off += nread;
     luringcb->sqeq.addr = (uintptr_t)luringcb->resubmit_qiov.iov;
     luringcb->sqeq.len = luringcb->resubmit_qiov.niov;
+}
+
+/**
+ * luring_complete_request:
+ * @s: AIO state, or NULL if the request was submitted with aio_add_sqe()
+ * @luringcb: the request
+ * @ret: result from the cqe
+ *
+ * Fill in luringcb->ret for a completed request.
+ *
+ * Returns: false if the request must be resubmitted, true otherwise.
+ */
+static bool luring_complete_request(LuringState *s, LuringAIOCB *luringcb,
+                                    int ret)
+{
+    /* total_read is non-zero only for resubmitted read requests */
+    int total_bytes = ret + luringcb->total_read;
 
-    luring_resubmit(s, luringcb);
+    if (ret < 0) {
+        /*
+         * Only writev/readv/fsync requests on regular files or host block
+         * devices are submitted. Therefore -EAGAIN is not expected but it's
+         * known to happen sometimes with Linux SCSI. Submit again and hope
+         * the request completes successfully.
+         *
+         * For more information, see:
+         * https://lore.kernel.org/io-uring/20210727165811.284510-3-axboe@kernel.dk/T/#u
+         *
+         * If the code is changed to submit other types of requests in the
+         * future, then this workaround may need to be extended to deal with
+         * genuine -EAGAIN results that should not be resubmitted
+         * immediately.
+         */
+        if (ret == -EINTR || ret == -EAGAIN) {
+            return false;
+        }
+    } else if (!luringcb->qiov) {
+        goto end;
+    } else if (total_bytes == luringcb->qiov->size) {
+        ret = 0;
+    /* Only read/write */
+    } else {
+        /* Short Read/Write */
+        if (luringcb->is_read) {
+            if (ret > 0) {
+                luring_resubmit_short_read(s, luringcb, ret);
+                return false;
+            } else {
+                /* Pad with zeroes */
+                qemu_iovec_memset(luringcb->qiov, total_bytes, 0,
+                                  luringcb->qiov->size - total_bytes);
+                ret = 0;
+            }
+        } else {
+            ret = -ENOSPC;
+        }
+    }
+end:
+    luringcb->ret = ret;
+    qemu_iovec_destroy(&luringcb->resubmit_qiov);
+    return true;
 }
 
 /**
@@ -124,7 +184,6 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
 static void luring_process_completions(LuringState *s)
 {
     struct io_uring_cqe *cqes;
-    int total_bytes;
 
     defer_call_begin();
 
@@ -162,52 +221,10 @@ static void luring_process_completions(LuringState *s)
         s->io_q.in_flight--;
         trace_luring_process_completion(s, luringcb, ret);
 
-        /* total_read is non-zero only for resubmitted read requests */
-        total_bytes = ret + luringcb->total_read;
-
-        if (ret < 0) {
-            /*
-             * Only writev/readv/fsync requests on regular files or host block
-             * devices are submitted. Therefore -EAGAIN is not expected but it's
-             * known to happen sometimes with Linux SCSI. Submit again and hope
-             * the request completes successfully.
-             *
-             * For more information, see:
-             * https://lore.kernel.org/io-uring/20210727165811.284510-3-axboe@kernel.dk/T/#u
-             *
-             * If the code is changed to submit other types of requests in the
-             * future, then this workaround may need to be extended to deal with
-             * genuine -EAGAIN results that should not be resubmitted
-             * immediately.
-             */
-            if (ret == -EINTR || ret == -EAGAIN) {
-                luring_resubmit(s, luringcb);
-                continue;
-            }
-        } else if (!luringcb->qiov) {
-            goto end;
-        } else if (total_bytes == luringcb->qiov->size) {
-            ret = 0;
-        /* Only read/write */
-        } else {
-            /* Short Read/Write */
-            if (luringcb->is_read) {
-                if (ret > 0) {
-                    luring_resubmit_short_read(s, luringcb, ret);
-                    continue;
-                } else {
-                    /* Pad with zeroes */
-                    qemu_iovec_memset(luringcb->qiov, total_bytes, 0,
-                                      luringcb->qiov->size - total_bytes);
-                    ret = 0;
-                }
-            } else {
-                ret = -ENOSPC;
-            }
+        if (!luring_complete_request(s, luringcb, ret)) {
+            luring_resubmit(s, luringcb);
+            continue;
         }
-end:
-        luringcb->ret = ret;
-        qemu_iovec_destroy(&luringcb->resubmit_qiov);
 
         /*
          * If the coroutine is already entered it must be in ioq_submit()
@@ -323,21 +340,10 @@ static void luring_deferred_fn(void *opaque)
     }
 }
 
-/**
- * luring_do_submit:
- * @fd: file descriptor for I/O
- * @luringcb: AIO control block
- * @s: AIO state
- * @offset: offset for request
- * @type: type of request
- *
- * Fetches sqes from ring, adds to pending queue and preps them
- *
- */
-static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
-                            uint64_t offset, int type)
+/* Prepare luringcb->sqeq for a request */
+static void luring_prep_request(int fd, LuringAIOCB *luringcb,
+                                uint64_t offset, int type)
 {
-    int ret;
     struct io_uring_sqe *sqes = &luringcb->sqeq;
 
     switch (type) {
@@ -362,6 +368,19 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
         abort();
     }
     io_uring_sqe_set_data(sqes, luringcb);
+}
+
+/**
+ * luring_do_submit:
+ * @luringcb: AIO control block
+ * @s: AIO state
+ *
+ * Adds a prepared request to the pending queue and submits it
+ *
+ */
+static int luring_do_submit(LuringAIOCB *luringcb, LuringState *s)
+{
+    int ret;
 
     QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
     s->io_q.in_queue++;
@@ -379,21 +398,63 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
     return 0;
 }
 
+static void luring_prep_sqe(struct io_uring_sqe *sqe, void *opaque)
+{
+    LuringAIOCB *luringcb = opaque;
+
+    *sqe = luringcb->sqeq;
+}
+
+/* Completion of a request submitted with aio_add_sqe() */
+static void luring_cqe_handler(CqeHandler *cqe_handler)
+{
+    LuringAIOCB *luringcb = container_of(cqe_handler, LuringAIOCB,
+                                         cqe_handler);
+    int ret = cqe_handler->cqe.res;
+
+    trace_luring_process_completion(NULL, luringcb, ret);
+
+    if (!luring_complete_request(NULL, luringcb, ret)) {
+        aio_add_sqe(luring_prep_sqe, luringcb, &luringcb->cqe_handler);
+        return;
+    }
+
+    aio_co_wake(luringcb->co);
+}
+
 int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd, uint64_t offset,
                                   QEMUIOVector *qiov, int type)
 {
     int ret;
     AioContext *ctx = qemu_get_current_aio_context();
-    LuringState *s = aio_get_linux_io_uring(ctx);
+    LuringState *s;
     LuringAIOCB luringcb = {
         .co         = qemu_coroutine_self(),
         .ret        = -EINPROGRESS,
         .qiov       = qiov,
         .is_read    = (type == QEMU_AIO_READ),
+        .cqe_handler.cb = luring_cqe_handler,
     };
+
+    luring_prep_request(fd, &luringcb, offset, type);
+
+    /*
+     * Use the event loop's ring if it has one, so that requests are
+     * submitted and completed together with fd monitoring.  The event loop
+     * submits the request before it waits for events next time.
+     */
+    if (aio_has_io_uring(ctx)) {
+        trace_luring_co_submit(bs, NULL, &luringcb, fd, offset,
+                               qiov ? qiov->size : 0, type);
+        aio_add_sqe(luring_prep_sqe, &luringcb, &luringcb.cqe_handler);
+        qemu_coroutine_yield();
+        return luringcb.ret;
+    }
+
+    s = aio_get_linux_io_uring(ctx);
     trace_luring_co_submit(bs, s, &luringcb, fd, offset, qiov ? qiov->size : 0,
                            type);
-    ret = luring_do_submit(fd, &luringcb, s, offset, type);
+    ret = luring_do_submit(&luringcb, s);
 
     if (ret < 0) {
         return ret;
@@ -24,11 +24,19 @@
 #include "qemu/ratelimit.h"
 #include "qemu/bitmap.h"
 #include "qemu/memalign.h"
+#include "qemu/units.h"
 
 #define MAX_IN_FLIGHT 16
 #define MAX_IO_BYTES (1 << 20) /* 1 Mb */
 #define DEFAULT_MIRROR_BUF_SIZE (MAX_IN_FLIGHT * MAX_IO_BYTES)
 
+/* Limits and parameters for the adaptive mode, see mirror_adapt() */
+#define MIRROR_ADAPT_MIN_IN_FLIGHT 2
+#define MIRROR_ADAPT_MAX_IN_FLIGHT 256
+#define MIRROR_ADAPT_MAX_IO_BYTES (16 * MiB)
+#define MIRROR_ADAPT_PERIOD_NS (100 * SCALE_MS)
+#define MIRROR_ADAPT_PERIOD_MIN_OPS 8
+
 /* The mirroring buffer is a list of granularity-sized chunks.
  * Free chunks are organized in a list.
  */
@@ -38,6 +46,23 @@ typedef struct MirrorBuffer {
 
 typedef struct MirrorOp MirrorOp;
 
+/* Measurements of the adaptive mode, see mirror_adapt() */
+typedef struct MirrorAdaptState {
+    /* Copy operations completed in the current period */
+    int64_t period_start_ns;
+    uint64_t period_ops;
+    uint64_t period_bytes;
+    uint64_t period_latency_ns;
+    /* Whether copying had to wait for the in-flight limit in this period */
+    bool window_full;
+
+    /* Results of the last period, also read by mirror_query() */
+    aligned_uint64_t throughput;
+    aligned_uint64_t latency_ns;
+    /* Lowest average latency seen with the current chunk size */
+    uint64_t min_latency_ns;
+} MirrorAdaptState;
+
 typedef struct MirrorBlockJob {
     BlockJob common;
     BlockBackend *target;
@@ -94,6 +119,17 @@ typedef struct MirrorBlockJob {
     bool prepared;
     bool in_drain;
     bool base_ro;
+
+    /*
+     * Limits for background copy operations.  They are only changed at
+     * runtime if @adaptive is true.  Only the job coroutine writes them,
+     * with atomic accesses because mirror_query() reads them from the main
+     * loop.
+     */
+    unsigned max_in_flight;
+    aligned_uint64_t max_io_bytes;
+    bool adaptive;
+    MirrorAdaptState adapt;
 } MirrorBlockJob;
 
 typedef struct MirrorBDSOpaque {
@@ -115,6 +151,8 @@ struct MirrorOp {
     bool is_pseudo_op;
     bool is_active_write;
     bool is_in_flight;
+    /* Start time of copy operations, for the adaptive mode */
+    int64_t start_ns;
     CoQueue waiting_requests;
     Coroutine *co;
     MirrorOp *waiting_for_op;
@@ -194,6 +232,91 @@ static void coroutine_fn mirror_wait_on_conflicts(MirrorOp *self,
     }
 }
 
+/*
+ * Tune the number of parallel copy operations and their size from the
+ * observed throughput and latency, similar to TCP congestion control:
+ *
+ * - If the average latency of a period is more than twice the lowest one
+ *   seen, requests are queuing up somewhere, so the in-flight limit is
+ *   reduced multiplicatively.
+ * - Otherwise, if the in-flight limit was reached and throughput still
+ *   improved, more parallel operations help (e.g. a high-latency link), so
+ *   the limit is raised.  When it cannot be raised any further because the
+ *   buffer is exhausted, operations are made smaller instead.
+ * - If throughput stopped improving even though the limit was reached and
+ *   latency is low, more parallelism does not help (e.g. local NVMe), so
+ *   use fewer, larger operations to reduce per-request overhead.
+ */
+static void mirror_adapt(MirrorBlockJob *s, MirrorOp *op)
+{
+    MirrorAdaptState *a = &s->adapt;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t min_io_bytes = MAX(s->granularity, s->target_cluster_size);
+    int64_t max_io_bytes = MAX(MIN(MIRROR_ADAPT_MAX_IO_BYTES,
+                                   s->buf_size / MIRROR_ADAPT_MIN_IN_FLIGHT),
+                               min_io_bytes);
+    unsigned buf_limit;
+    unsigned in_flight = s->max_in_flight;
+    uint64_t io_bytes = s->max_io_bytes;
+    uint64_t last_throughput = a->throughput;
+    uint64_t throughput, latency_ns;
+    int64_t elapsed;
+
+    a->period_ops++;
+    a->period_bytes += op->bytes;
+    a->period_latency_ns += now - op->start_ns;
+
+    elapsed = now - a->period_start_ns;
+    if (elapsed < MIRROR_ADAPT_PERIOD_NS ||
+        a->period_ops < MIRROR_ADAPT_PERIOD_MIN_OPS) {
+        return;
+    }
+
+    throughput = muldiv64(a->period_bytes, G_USEC_PER_SEC,
+                          elapsed / SCALE_US);
+    latency_ns = a->period_latency_ns / a->period_ops;
+    if (!a->min_latency_ns || latency_ns < a->min_latency_ns) {
+        a->min_latency_ns = latency_ns;
+    }
+
+    /* How many operations of the current size fit into the buffer */
+    buf_limit = MAX(s->buf_size / io_bytes, MIRROR_ADAPT_MIN_IN_FLIGHT);
+
+    if (latency_ns > 2 * a->min_latency_ns) {
+        in_flight = MAX(in_flight * 3 / 4, MIRROR_ADAPT_MIN_IN_FLIGHT);
+    } else if (a->window_full && throughput > last_throughput +
+                                              last_throughput / 16) {
+        if (in_flight < MIN(buf_limit, MIRROR_ADAPT_MAX_IN_FLIGHT)) {
+            in_flight += MAX(in_flight / 8, 1);
+        } else if (io_bytes / 2 >= min_io_bytes &&
+                   in_flight < MIRROR_ADAPT_MAX_IN_FLIGHT) {
+            io_bytes = QEMU_ALIGN_DOWN(io_bytes / 2, s->granularity);
+            in_flight = MIN(in_flight * 2, MIRROR_ADAPT_MAX_IN_FLIGHT);
+            a->min_latency_ns = 0;
+        }
+    } else if (a->window_full &&
+               latency_ns < a->min_latency_ns + a->min_latency_ns / 4 &&
+               io_bytes * 2 <= max_io_bytes) {
+        io_bytes *= 2;
+        in_flight = MAX(in_flight / 2, MIRROR_ADAPT_MIN_IN_FLIGHT);
+        a->min_latency_ns = 0;
+    }
+
+    /* Pairs with the atomic reads in mirror_query() */
+    qatomic_set_u64(&a->throughput, throughput);
+    qatomic_set_u64(&a->latency_ns, latency_ns);
+    qatomic_set(&s->max_in_flight, in_flight);
+    qatomic_set_u64(&s->max_io_bytes, io_bytes);
+
+    trace_mirror_adapt(s, throughput, latency_ns, in_flight, io_bytes);
+
+    a->period_start_ns = now;
+    a->period_ops = 0;
+    a->period_bytes = 0;
+    a->period_latency_ns = 0;
+    a->window_full = false;
+}
+
 static void coroutine_fn mirror_iteration_done(MirrorOp *op, int ret)
 {
     MirrorBlockJob *s = op->s;
@@ -224,6 +347,9 @@ static void coroutine_fn mirror_iteration_done(MirrorOp *op, int ret)
         if (!s->initial_zeroing_ongoing) {
             job_progress_update(&s->common.job, op->bytes);
         }
+        if (s->adaptive && op->start_ns) {
+            mirror_adapt(s, op);
+        }
     }
     qemu_iovec_destroy(&op->qiov);
 
@@ -396,6 +522,7 @@ static void coroutine_fn mirror_co_read(void *opaque)
     s->in_flight++;
     s->bytes_in_flight += op->bytes;
     op->is_in_flight = true;
+    op->start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     trace_mirror_one_iteration(s, op->offset, op->bytes);
 
     WITH_GRAPH_RDLOCK_GUARD() {
@@ -488,7 +615,7 @@ static void coroutine_fn GRAPH_UNLOCKED mirror_iteration(MirrorBlockJob *s)
     /* At least the first dirty chunk is mirrored in one iteration. */
     int nb_chunks = 1;
     bool write_zeroes_ok = bdrv_can_write_zeroes_with_unmap(blk_bs(s->target));
-    int max_io_bytes = MAX(s->buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES);
+    int64_t max_io_bytes = s->max_io_bytes;
 
     bdrv_graph_co_rdlock();
     source = s->mirror_top_bs->backing->bs;
@@ -600,8 +727,9 @@ static void coroutine_fn GRAPH_UNLOCKED mirror_iteration(MirrorBlockJob *s)
             }
         }
 
-        while (s->in_flight >= MAX_IN_FLIGHT) {
+        while (s->in_flight >= s->max_in_flight) {
             trace_mirror_yield_in_flight(s, offset, s->in_flight);
+            s->adapt.window_full = true;
             mirror_wait_for_free_in_flight_slot(s);
         }
 
@@ -866,7 +994,7 @@ static int coroutine_fn GRAPH_UNLOCKED mirror_dirty_init(MirrorBlockJob *s)
                 return 0;
             }
 
-            if (s->in_flight >= MAX_IN_FLIGHT) {
+            if (s->in_flight >= s->max_in_flight) {
                 trace_mirror_yield(s, UINT64_MAX, s->buf_free_count,
                                    s->in_flight);
                 mirror_wait_for_free_in_flight_slot(s);
@@ -1011,6 +1139,11 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
     s->max_iov = MIN(bs->bl.max_iov, target_bs->bl.max_iov);
     bdrv_graph_co_rdunlock();
 
+    qatomic_set(&s->max_in_flight, MAX_IN_FLIGHT);
+    qatomic_set_u64(&s->max_io_bytes,
+                    MAX(s->buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES));
+    s->adapt.period_start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
     s->buf = qemu_try_blockalign(bs, s->buf_size);
     if (s->buf == NULL) {
         ret = -ENOMEM;
@@ -1069,9 +1202,12 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
         }
         if (delta < BLOCK_JOB_SLICE_TIME &&
             iostatus == BLOCK_DEVICE_IO_STATUS_OK) {
-            if (s->in_flight >= MAX_IN_FLIGHT || s->buf_free_count == 0 ||
+            if (s->in_flight >= s->max_in_flight || s->buf_free_count == 0 ||
                 (cnt == 0 && s->in_flight > 0)) {
                 trace_mirror_yield(s, cnt, s->buf_free_count, s->in_flight);
+                if (s->in_flight >= s->max_in_flight) {
+                    s->adapt.window_full = true;
+                }
                 mirror_wait_for_free_in_flight_slot(s);
                 continue;
             } else if (cnt != 0) {
@@ -1298,6 +1434,16 @@ static void mirror_query(BlockJob *job, BlockJobInfo *info)
     info->u.mirror = (BlockJobInfoMirror) {
         .actively_synced = qatomic_read(&s->actively_synced),
     };
+
+    if (s->adaptive) {
+        info->u.mirror.adaptive = g_new(MirrorAdaptiveInfo, 1);
+        *info->u.mirror.adaptive = (MirrorAdaptiveInfo) {
+            .max_in_flight  = qatomic_read(&s->max_in_flight),
+            .chunk_size     = qatomic_read_u64(&s->max_io_bytes),
+            .throughput     = qatomic_read_u64(&s->adapt.throughput),
+            .latency        = qatomic_read_u64(&s->adapt.latency_ns),
+        };
+    }
 }
 
 static const BlockJobDriver mirror_job_driver = {
@@ -1722,7 +1868,7 @@ static BlockJob *mirror_start_job(
                              bool is_none_mode, BlockDriverState *base,
                              bool auto_complete, const char *filter_node_name,
                              bool is_mirror, MirrorCopyMode copy_mode,
-                             bool base_ro,
+                             bool adaptive, bool base_ro,
                              Error **errp)
 {
     MirrorBlockJob *s;
@@ -1882,6 +2028,7 @@ static BlockJob *mirror_start_job(
     s->backing_mode = backing_mode;
     s->zero_target = zero_target;
     qatomic_set(&s->copy_mode, copy_mode);
+    s->adaptive = adaptive;
     s->base = base;
     s->base_overlay = bdrv_find_overlay(bs, base);
     s->granularity = granularity;
@@ -2013,7 +2160,7 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   bool unmap, const char *filter_node_name,
-                  MirrorCopyMode copy_mode, Error **errp)
+                  MirrorCopyMode copy_mode, bool adaptive, Error **errp)
 {
     bool is_none_mode;
     BlockDriverState *base;
@@ -2036,7 +2183,8 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                      speed, granularity, buf_size, backing_mode, zero_target,
                      on_source_error, on_target_error, unmap, NULL, NULL,
                      &mirror_job_driver, is_none_mode, base, false,
-                     filter_node_name, true, copy_mode, false, errp);
+                     filter_node_name, true, copy_mode, adaptive, false,
+                     errp);
 }
 
 BlockJob *commit_active_start(const char *job_id, BlockDriverState *bs,
@@ -2065,7 +2213,7 @@ BlockJob *commit_active_start(const char *job_id, BlockDriverState *bs,
                      on_error, on_error, true, cb, opaque,
                      &commit_active_job_driver, false, base, auto_complete,
                      filter_node_name, false, MIRROR_COPY_MODE_BACKGROUND,
-                     base_read_only, errp);
+                     false, base_read_only, errp);
     if (!job) {
         goto error_restore_flags;
     }
@@ -1052,10 +1052,12 @@ static int GRAPH_RDLOCK qcow_make_empty(BlockDriverState *bs)
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
 static int coroutine_fn GRAPH_RDLOCK
-qcow_co_pwritev_compressed(BlockDriverState *bs, int64_t offset, int64_t bytes,
-                           QEMUIOVector *qiov)
+qcow_co_pwritev_compressed_cluster(BlockDriverState *bs, int64_t offset,
+                                   int64_t bytes, QEMUIOVector *qiov,
+                                   size_t qiov_offset)
 {
     BDRVQcowState *s = bs->opaque;
+    QEMUIOVector local_qiov;
     z_stream strm;
     int ret, out_len;
     uint8_t *buf, *out_buf;
@@ -1072,7 +1074,7 @@ qcow_co_pwritev_compressed(BlockDriverState *bs, int64_t offset, int64_t bytes,
         /* Zero-pad last write if image size is not cluster aligned */
         memset(buf + bytes, 0, s->cluster_size - bytes);
     }
-    qemu_iovec_to_buf(qiov, 0, buf, qiov->size);
+    qemu_iovec_to_buf(qiov, qiov_offset, buf, bytes);
 
     out_buf = g_malloc(s->cluster_size);
 
@@ -1103,7 +1105,9 @@ qcow_co_pwritev_compressed(BlockDriverState *bs, int64_t offset, int64_t bytes,
 
     if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
         /* could not compress: write normal cluster */
-        ret = qcow_co_pwritev(bs, offset, bytes, qiov, 0);
+        qemu_iovec_init_slice(&local_qiov, qiov, qiov_offset, bytes);
+        ret = qcow_co_pwritev(bs, offset, bytes, &local_qiov, 0);
+        qemu_iovec_destroy(&local_qiov);
         if (ret < 0) {
             goto fail;
         }
@@ -1134,6 +1138,40 @@ fail:
     return ret;
 }
 
+static int coroutine_fn GRAPH_RDLOCK
+qcow_co_pwritev_compressed_part(BlockDriverState *bs, int64_t offset,
+                                int64_t bytes, QEMUIOVector *qiov,
+                                size_t qiov_offset)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret;
+
+    if (bytes <= s->cluster_size) {
+        return qcow_co_pwritev_compressed_cluster(bs, offset, bytes, qiov,
+                                                  qiov_offset);
+    }
+
+    if (offset & (s->cluster_size - 1)) {
+        return -EINVAL;
+    }
+
+    /* Compress requests spanning multiple clusters one cluster at a time */
+    while (bytes) {
+        int64_t chunk_size = MIN(bytes, s->cluster_size);
+
+        ret = qcow_co_pwritev_compressed_cluster(bs, offset, chunk_size, qiov,
+                                                 qiov_offset);
+        if (ret < 0) {
+            return ret;
+        }
+        qiov_offset += chunk_size;
+        offset += chunk_size;
+        bytes -= chunk_size;
+    }
+
+    return 0;
+}
+
 static int coroutine_fn
 qcow_co_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 {
@@ -1203,7 +1241,7 @@ static BlockDriver bdrv_qcow = {
     .bdrv_co_block_status   = qcow_co_block_status,
 
     .bdrv_make_empty        = qcow_make_empty,
-    .bdrv_co_pwritev_compressed = qcow_co_pwritev_compressed,
+    .bdrv_co_pwritev_compressed_part = qcow_co_pwritev_compressed_part,
     .bdrv_co_get_info       = qcow_co_get_info,
 
     .create_opts            = &qcow_create_opts,
@@ -0,0 +1,276 @@
+/*
+ * Cache of decompressed clusters for the QCOW2 format
+ *
+ * Guests typically read compressed images in requests that are much smaller
+ * than a cluster, and without a cache, every one of these requests reads and
+ * decompresses the whole cluster again.  This cache keeps the most recently
+ * used decompressed clusters, keyed by the host offset of their compressed
+ * data, and makes concurrent readers of the same cluster wait for a single
+ * decompression instead of each doing their own.
+ *
+ * Entries are dropped when the refcount of the host cluster that contains the
+ * start of their compressed data drops to zero: compressed data is never
+ * written in place, so this is the only way how the data at a cached offset
+ * can change.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/coroutine.h"
+#include "qemu/memalign.h"
+#include "qcow2.h"
+#include "trace.h"
+
+typedef struct Qcow2CompressedEntry {
+    uint64_t offset;        /* host offset of the compressed data, 0 if free */
+    uint64_t lru_counter;
+    int      ref;
+    bool     loading;       /* the reference holder is decompressing */
+    bool     cached;        /* in the lookup table, valid once !loading */
+    CoQueue  waiters;       /* readers waiting for the decompression */
+} Qcow2CompressedEntry;
+
+struct Qcow2CompressedCache {
+    /*
+     * Protects everything below.  Compressed reads are not serialised by the
+     * qcow2 lock and may come from several threads.
+     */
+    QemuMutex               lock;
+    Qcow2CompressedEntry   *entries;
+    GHashTable             *table;    /* offset -> Qcow2CompressedEntry */
+    int                     size;
+    int                     cluster_size;
+    uint8_t                *data;
+    uint64_t                lru_counter;
+};
+
+static inline uint8_t *qcow2_compressed_cache_get_data(Qcow2CompressedCache *c,
+                                                       int i)
+{
+    return c->data + (size_t) i * c->cluster_size;
+}
+
+static inline int qcow2_compressed_cache_get_idx(Qcow2CompressedCache *c,
+                                                 uint8_t *data)
+{
+    ptrdiff_t data_offset = data - c->data;
+    int idx = data_offset / c->cluster_size;
+    assert(idx >= 0 && idx < c->size && data_offset % c->cluster_size == 0);
+    return idx;
+}
+
+Qcow2CompressedCache *qcow2_compressed_cache_create(BlockDriverState *bs,
+                                                    int num_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedCache *c;
+    int i;
+
+    assert(num_clusters > 0);
+
+    c = g_new0(Qcow2CompressedCache, 1);
+    c->size = num_clusters;
+    c->cluster_size = s->cluster_size;
+    c->entries = g_try_new0(Qcow2CompressedEntry, num_clusters);
+    c->data = qemu_try_blockalign(bs->file->bs,
+                                  (size_t) num_clusters * c->cluster_size);
+
+    if (!c->entries || !c->data) {
+        qemu_vfree(c->data);
+        g_free(c->entries);
+        g_free(c);
+        return NULL;
+    }
+
+    for (i = 0; i < num_clusters; i++) {
+        qemu_co_queue_init(&c->entries[i].waiters);
+    }
+    c->table = g_hash_table_new(g_int64_hash, g_int64_equal);
+    qemu_mutex_init(&c->lock);
+
+    return c;
+}
+
+void qcow2_compressed_cache_destroy(Qcow2CompressedCache *c)
+{
+    int i;
+
+    for (i = 0; i < c->size; i++) {
+        assert(c->entries[i].ref == 0);
+    }
+
+    qemu_mutex_destroy(&c->lock);
+    g_hash_table_destroy(c->table);
+    qemu_vfree(c->data);
+    g_free(c->entries);
+    g_free(c);
+}
+
+/* Called with c->lock held */
+static void qcow2_compressed_cache_uncache(Qcow2CompressedCache *c, int i)
+{
+    Qcow2CompressedEntry *e = &c->entries[i];
+
+    if (e->cached) {
+        g_hash_table_remove(c->table, &e->offset);
+        e->cached = false;
+    }
+    if (e->ref == 0) {
+        e->offset = 0;
+        e->lru_counter = 0;
+    }
+}
+
+/*
+ * Look up the decompressed cluster whose compressed data starts at @offset
+ * and take a reference to it.  The cluster data is returned in @data.
+ *
+ * Returns 1 if the cached data is valid.  Returns 0 if the cluster was not
+ * cached and the caller must decompress it into @data, and then call
+ * qcow2_compressed_cache_loaded().  Returns -EAGAIN without taking a
+ * reference if the cluster can't be cached right now; the caller should read
+ * it without the cache then.
+ *
+ * In all cases but -EAGAIN, the reference must be dropped with
+ * qcow2_compressed_cache_put() when the caller is done with @data.
+ */
+int coroutine_fn qcow2_compressed_cache_co_get(Qcow2CompressedCache *c,
+                                               uint64_t offset, void **data)
+{
+    Qcow2CompressedEntry *e;
+    int i, min_lru_index = -1;
+    uint64_t min_lru_counter = UINT64_MAX;
+
+    assert(offset != 0);
+
+    QEMU_LOCK_GUARD(&c->lock);
+
+    e = g_hash_table_lookup(c->table, &offset);
+    if (e) {
+        e->ref++;
+        while (e->loading) {
+            qemu_co_queue_wait(&e->waiters, &c->lock);
+        }
+        if (!e->cached) {
+            /* Decompression failed, or the cluster was freed meanwhile */
+            if (--e->ref == 0) {
+                e->offset = 0;
+                e->lru_counter = 0;
+            }
+            return -EAGAIN;
+        }
+
+        i = e - c->entries;
+        e->lru_counter = ++c->lru_counter;
+        *data = qcow2_compressed_cache_get_data(c, i);
+        trace_qcow2_compressed_cache_get(qemu_coroutine_self(), offset, true);
+        return 1;
+    }
+
+    for (i = 0; i < c->size; i++) {
+        e = &c->entries[i];
+        if (e->ref == 0 && e->lru_counter < min_lru_counter) {
+            min_lru_counter = e->lru_counter;
+            min_lru_index = i;
+        }
+    }
+
+    if (min_lru_index == -1) {
+        /* All entries are in use by in-flight requests */
+        return -EAGAIN;
+    }
+
+    i = min_lru_index;
+    qcow2_compressed_cache_uncache(c, i);
+
+    e = &c->entries[i];
+    e->offset = offset;
+    e->lru_counter = ++c->lru_counter;
+    e->ref = 1;
+    e->loading = true;
+    e->cached = true;
+    g_hash_table_insert(c->table, &e->offset, e);
+
+    *data = qcow2_compressed_cache_get_data(c, i);
+    trace_qcow2_compressed_cache_get(qemu_coroutine_self(), offset, false);
+    return 0;
+}
+
+/*
+ * Complete the decompression of a cluster for which
+ * qcow2_compressed_cache_co_get() returned 0.  @ret is the result of the
+ * decompression; on failure, the entry is dropped from the cache and any
+ * waiting readers fall back to reading the cluster themselves.
+ */
+void qcow2_compressed_cache_loaded(Qcow2CompressedCache *c, void *data,
+                                   int ret)
+{
+    int i;
+
+    QEMU_LOCK_GUARD(&c->lock);
+
+    i = qcow2_compressed_cache_get_idx(c, data);
+    assert(c->entries[i].loading);
+
+    c->entries[i].loading = false;
+    if (ret < 0) {
+        qcow2_compressed_cache_uncache(c, i);
+    }
+    qemu_co_queue_restart_all(&c->entries[i].waiters);
+}
+
+void qcow2_compressed_cache_put(Qcow2CompressedCache *c, void *data)
+{
+    Qcow2CompressedEntry *e;
+
+    QEMU_LOCK_GUARD(&c->lock);
+
+    e = &c->entries[qcow2_compressed_cache_get_idx(c, data)];
+    assert(e->ref > 0);
+    if (--e->ref == 0 && !e->cached) {
+        e->offset = 0;
+        e->lru_counter = 0;
+    }
+}
+
+/*
+ * Drop all cached clusters whose compressed data starts in the host cluster
+ * at @cluster_offset.  Must be called before that host cluster can be
+ * reused, i.e. when its refcount drops to zero.
+ */
+void qcow2_compressed_cache_discard(Qcow2CompressedCache *c,
+                                    uint64_t cluster_offset)
+{
+    int i;
+
+    QEMU_LOCK_GUARD(&c->lock);
+
+    if (g_hash_table_size(c->table) == 0) {
+        return;
+    }
+
+    for (i = 0; i < c->size; i++) {
+        uint64_t offset = c->entries[i].offset;
+
+        if (offset && QEMU_ALIGN_DOWN(offset, c->cluster_size) ==
+                      cluster_offset) {
+            qcow2_compressed_cache_uncache(c, i);
+        }
+    }
+}
+
+/* Drop all cached clusters */
+void qcow2_compressed_cache_empty(Qcow2CompressedCache *c)
+{
+    int i;
+
+    QEMU_LOCK_GUARD(&c->lock);
+
+    for (i = 0; i < c->size; i++) {
+        if (c->entries[i].offset) {
+            qcow2_compressed_cache_uncache(c, i);
+        }
+    }
+}
@@ -24,6 +24,7 @@
 
 #include "qemu/osdep.h"
 #include "block/block-io.h"
+#include "block/aio_task.h"
 #include "qapi/error.h"
 #include "qcow2.h"
 #include "qemu/range.h"
@@ -901,6 +902,11 @@ update_refcount(BlockDriverState *bs, int64_t offset, int64_t length,
                 qcow2_cache_discard(s->l2_table_cache, table);
             }
 
+            if (s->compressed_cache) {
+                qcow2_compressed_cache_discard(s->compressed_cache,
+                                               cluster_offset);
+            }
+
             if (s->discard_passthrough[type]) {
                 update_refcount_discard(bs, cluster_offset, s->cluster_size);
             }
@@ -1653,8 +1659,8 @@ fail:
 
 /*
  * Increases the refcount in the given refcount table for the all clusters
- * referenced in the L2 table. While doing so, performs some checks on L2
- * entries.
+ * referenced in the L2 table at @l2_offset, which has already been read into
+ * @l2_table. While doing so, performs some checks on L2 entries.
  *
  * Returns the number of errors found by the checks or -errno if an internal
  * error occurred.
@@ -1663,24 +1669,15 @@ static int coroutine_fn GRAPH_RDLOCK
 check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                    void **refcount_table,
                    int64_t *refcount_table_size, int64_t l2_offset,
-                   int flags, BdrvCheckMode fix, bool active)
+                   uint64_t *l2_table, int flags, BdrvCheckMode fix,
+                   bool active)
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t l2_entry, l2_bitmap;
     uint64_t next_contiguous_offset = 0;
     int i, ret;
-    size_t l2_size_bytes = s->l2_size * l2_entry_size(s);
-    g_autofree uint64_t *l2_table = g_malloc(l2_size_bytes);
     bool metadata_overlap;
 
-    /* Read L2 table from disk */
-    ret = bdrv_co_pread(bs->file, l2_offset, l2_size_bytes, l2_table, 0);
-    if (ret < 0) {
-        fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
-        res->check_errors++;
-        return ret;
-    }
-
     /* Do the actual checks */
     for (i = 0; i < s->l2_size; i++) {
         uint64_t coffset;
@@ -1851,11 +1848,111 @@ check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
     return 0;
 }
 
+/* Maximum size of L2 tables that check_refcounts_l1() reads ahead at once */
+#define CHECK_L2_BATCH_BYTES (4 * MiB)
+#define CHECK_L2_BATCH_MAX 64
+
+/*
+ * A batch of L2 tables referenced by consecutive (non-zero) L1 entries.  L2
+ * tables that are contiguous in the image file are read with one request,
+ * and up to QCOW2_MAX_WORKERS of these requests run in parallel.
+ */
+typedef struct CheckL2Batch {
+    AioTaskPool *pool;
+    uint64_t *tables;
+    int nb_tables;
+    int l1_index[CHECK_L2_BATCH_MAX];
+    int ret[CHECK_L2_BATCH_MAX];
+} CheckL2Batch;
+
+typedef struct CheckL2ReadTask {
+    AioTask task;
+
+    BlockDriverState *bs;
+    CheckL2Batch *batch;
+    uint64_t offset;
+    int first;
+    int count;
+} CheckL2ReadTask;
+
+static int coroutine_fn GRAPH_RDLOCK check_l2_read_task_entry(AioTask *task)
+{
+    CheckL2ReadTask *t = container_of(task, CheckL2ReadTask, task);
+    BDRVQcow2State *s = t->bs->opaque;
+    uint64_t *buf = t->batch->tables +
+                    (size_t)t->first * (s->cluster_size / sizeof(uint64_t));
+    int i, ret;
+
+    ret = bdrv_co_pread(t->bs->file, t->offset,
+                        (int64_t)t->count * s->cluster_size, buf, 0);
+    for (i = 0; i < t->count; i++) {
+        t->batch->ret[t->first + i] = ret;
+    }
+
+    /* Errors are reported when the respective table is checked */
+    return 0;
+}
+
+/*
+ * Start reading the L2 tables for the next up to @max_tables non-zero entries
+ * of @l1_table, beginning at *@l1_index.  *@l1_index is advanced past the
+ * last entry that was added to the batch.
+ */
+static void coroutine_fn GRAPH_RDLOCK
+check_l2_batch_start(BlockDriverState *bs, CheckL2Batch *batch,
+                     const uint64_t *l1_table, int l1_size, int *l1_index,
+                     int max_tables)
+{
+    BDRVQcow2State *s = bs->opaque;
+    CheckL2ReadTask *task = NULL;
+    uint64_t l2_offset;
+
+    batch->nb_tables = 0;
+    for (; *l1_index < l1_size && batch->nb_tables < max_tables;
+         (*l1_index)++)
+    {
+        if (!l1_table[*l1_index]) {
+            continue;
+        }
+
+        l2_offset = l1_table[*l1_index] & L1E_OFFSET_MASK;
+        batch->l1_index[batch->nb_tables] = *l1_index;
+
+        if (task && l2_offset == task->offset +
+                                 (uint64_t)task->count * s->cluster_size)
+        {
+            task->count++;
+        } else {
+            if (task) {
+                aio_task_pool_start_task(batch->pool, &task->task);
+            }
+            task = g_new(CheckL2ReadTask, 1);
+            *task = (CheckL2ReadTask) {
+                .task.func  = check_l2_read_task_entry,
+                .bs         = bs,
+                .batch      = batch,
+                .offset     = l2_offset,
+                .first      = batch->nb_tables,
+                .count      = 1,
+            };
+        }
+        batch->nb_tables++;
+    }
+
+    if (task) {
+        aio_task_pool_start_task(batch->pool, &task->task);
+    }
+}
+
 /*
  * Increases the refcount for the L1 table, its L2 tables and all referenced
  * clusters in the given refcount table. While doing so, performs some checks
  * on L1 and L2 entries.
  *
+ * The L2 tables are read ahead in batches, so that reading the next batch
+ * overlaps with checking the current one.  The tables are still checked in
+ * L1 order.
+ *
  * Returns the number of errors found by the checks or -errno if an internal
  * error occurred.
  */
@@ -1868,8 +1965,13 @@ check_refcounts_l1(BlockDriverState *bs, BdrvCheckResult *res,
     BDRVQcow2State *s = bs->opaque;
     size_t l1_size_bytes = l1_size * L1E_SIZE;
     g_autofree uint64_t *l1_table = NULL;
+    g_autoptr(GHashTable) fixed_l2 = NULL;
+    CheckL2Batch batches[2] = {};
+    CheckL2Batch *batch;
     uint64_t l2_offset;
-    int i, ret;
+    uint64_t *l2_table;
+    int batch_size, next_l1_index, cur, corruptions_fixed;
+    int i, j, ret;
 
     if (!l1_size) {
         return 0;
@@ -1900,45 +2002,109 @@ check_refcounts_l1(BlockDriverState *bs, BdrvCheckResult *res,
         be64_to_cpus(&l1_table[i]);
     }
 
-    /* Do the actual checks */
-    for (i = 0; i < l1_size; i++) {
-        if (!l1_table[i]) {
-            continue;
+    batch_size = MAX(1, MIN(CHECK_L2_BATCH_MAX,
+                            CHECK_L2_BATCH_BYTES / s->cluster_size));
+    for (i = 0; i < ARRAY_SIZE(batches); i++) {
+        batches[i].tables = qemu_try_blockalign(bs->file->bs,
+                                                (size_t)batch_size *
+                                                s->cluster_size);
+        if (!batches[i].tables) {
+            res->check_errors++;
+            ret = -ENOMEM;
+            goto out;
         }
+        batches[i].pool = aio_task_pool_new(QCOW2_MAX_WORKERS);
+    }
 
-        if (l1_table[i] & L1E_RESERVED_MASK) {
-            fprintf(stderr, "ERROR found L1 entry with reserved bits set: "
-                    "%" PRIx64 "\n", l1_table[i]);
-            res->corruptions++;
-        }
+    next_l1_index = 0;
+    for (i = 0; i < ARRAY_SIZE(batches); i++) {
+        check_l2_batch_start(bs, &batches[i], l1_table, l1_size,
+                             &next_l1_index, batch_size);
+    }
 
-        l2_offset = l1_table[i] & L1E_OFFSET_MASK;
+    /* Do the actual checks */
+    for (cur = 0; batches[cur].nb_tables; cur = !cur) {
+        batch = &batches[cur];
+        aio_task_pool_wait_all(batch->pool);
+
+        for (j = 0; j < batch->nb_tables; j++) {
+            i = batch->l1_index[j];
+            l2_table = batch->tables +
+                       (size_t)j * (s->cluster_size / sizeof(uint64_t));
+
+            if (l1_table[i] & L1E_RESERVED_MASK) {
+                fprintf(stderr, "ERROR found L1 entry with reserved bits set: "
+                        "%" PRIx64 "\n", l1_table[i]);
+                res->corruptions++;
+            }
 
-        /* Mark L2 table as used */
-        ret = qcow2_inc_refcounts_imrt(bs, res,
-                                       refcount_table, refcount_table_size,
-                                       l2_offset, s->cluster_size);
-        if (ret < 0) {
-            return ret;
-        }
+            l2_offset = l1_table[i] & L1E_OFFSET_MASK;
 
-        /* L2 tables are cluster aligned */
-        if (offset_into_cluster(s, l2_offset)) {
-            fprintf(stderr, "ERROR l2_offset=%" PRIx64 ": Table is not "
-                "cluster aligned; L1 entry corrupted\n", l2_offset);
-            res->corruptions++;
-        }
+            /* Mark L2 table as used */
+            ret = qcow2_inc_refcounts_imrt(bs, res,
+                                           refcount_table, refcount_table_size,
+                                           l2_offset, s->cluster_size);
+            if (ret < 0) {
+                goto out;
+            }
 
-        /* Process and check L2 entries */
-        ret = check_refcounts_l2(bs, res, refcount_table,
-                                 refcount_table_size, l2_offset, flags,
-                                 fix, active);
-        if (ret < 0) {
-            return ret;
+            /* L2 tables are cluster aligned */
+            if (offset_into_cluster(s, l2_offset)) {
+                fprintf(stderr, "ERROR l2_offset=%" PRIx64 ": Table is not "
+                    "cluster aligned; L1 entry corrupted\n", l2_offset);
+                res->corruptions++;
+            }
+
+            /*
+             * A table that has been repaired before may have been read ahead
+             * in its old state if it is referenced more than once
+             */
+            ret = batch->ret[j];
+            if (ret == 0 && fixed_l2 &&
+                g_hash_table_contains(fixed_l2, &l2_offset))
+            {
+                ret = bdrv_co_pread(bs->file, l2_offset, s->cluster_size,
+                                    l2_table, 0);
+            }
+            if (ret < 0) {
+                fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
+                res->check_errors++;
+                goto out;
+            }
+
+            /* Process and check L2 entries */
+            corruptions_fixed = res->corruptions_fixed;
+            ret = check_refcounts_l2(bs, res, refcount_table,
+                                     refcount_table_size, l2_offset, l2_table,
+                                     flags, fix, active);
+            if (res->corruptions_fixed != corruptions_fixed) {
+                if (!fixed_l2) {
+                    fixed_l2 = g_hash_table_new_full(g_int64_hash,
+                                                     g_int64_equal,
+                                                     g_free, NULL);
+                }
+                g_hash_table_add(fixed_l2, g_memdup2(&l2_offset,
+                                                     sizeof(l2_offset)));
+            }
+            if (ret < 0) {
+                goto out;
+            }
         }
+
+        check_l2_batch_start(bs, batch, l1_table, l1_size, &next_l1_index,
+                             batch_size);
     }
 
-    return 0;
+    ret = 0;
+out:
+    for (i = 0; i < ARRAY_SIZE(batches); i++) {
+        if (batches[i].pool) {
+            aio_task_pool_wait_all(batches[i].pool);
+            aio_task_pool_free(batches[i].pool);
+        }
+        qemu_vfree(batches[i].tables);
+    }
+    return ret;
 }
 
 /*
@@ -2773,6 +2939,19 @@ fail:
     return ret;
 }
 
+/*
+ * Accounts the time since *@start_ns to the check phase @name in @timing and
+ * resets *@start_ns to the current time.
+ */
+static void check_phase_done(BdrvCheckResult *timing, const char *name,
+                             int64_t *start_ns)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    bdrv_check_add_phase(timing, name, now - *start_ns);
+    *start_ns = now;
+}
+
 /*
  * Checks an image for refcount consistency.
  *
@@ -2784,10 +2963,13 @@ qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res, BdrvCheckMode
 {
     BDRVQcow2State *s = bs->opaque;
     BdrvCheckResult pre_compare_res;
+    /* Kept separately because *res is reset in between */
+    BdrvCheckResult timing = {};
+    int64_t start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     int64_t size, highest_cluster, nb_clusters;
     void *refcount_table = NULL;
     bool rebuild = false;
-    int ret;
+    int ret, i;
 
     size = bdrv_co_getlength(bs->file->bs);
     if (size < 0) {
@@ -2806,6 +2988,7 @@ qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res, BdrvCheckMode
 
     ret = calculate_refcounts(bs, res, fix, &rebuild, &refcount_table,
                               &nb_clusters);
+    check_phase_done(&timing, "refcount calculation", &start_ns);
     if (ret < 0) {
         goto fail;
     }
@@ -2816,6 +2999,7 @@ qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res, BdrvCheckMode
     pre_compare_res = *res;
     compare_refcounts(bs, res, 0, &rebuild, &highest_cluster, refcount_table,
                       nb_clusters);
+    check_phase_done(&timing, "refcount comparison", &start_ns);
 
     if (rebuild && (fix & BDRV_FIX_ERRORS)) {
         BdrvCheckResult old_res = *res;
@@ -2839,6 +3023,7 @@ qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res, BdrvCheckMode
         memset(refcount_table, 0, refcount_array_byte_size(s, nb_clusters));
         ret = calculate_refcounts(bs, res, 0, &rebuild, &refcount_table,
                                   &nb_clusters);
+        check_phase_done(&timing, "refcount rebuild", &start_ns);
         if (ret < 0) {
             goto fail;
         }
@@ -2862,6 +3047,7 @@ qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res, BdrvCheckMode
              * new refcount structure from scratch */
             fresh_leaks = res->leaks;
             *res = saved_res;
+            check_phase_done(&timing, "refcount repair", &start_ns);
         }
 
         if (res->corruptions < old_res.corruptions) {
@@ -2883,11 +3069,13 @@ qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res, BdrvCheckMode
             *res = pre_compare_res;
             compare_refcounts(bs, res, fix, &rebuild, &highest_cluster,
                               refcount_table, nb_clusters);
+            check_phase_done(&timing, "refcount repair", &start_ns);
         }
     }
 
     /* check OFLAG_COPIED */
     ret = check_oflag_copied(bs, res, fix);
+    check_phase_done(&timing, "copied flags", &start_ns);
     if (ret < 0) {
         goto fail;
     }
@@ -2897,6 +3085,10 @@ qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res, BdrvCheckMode
 
 fail:
     g_free(refcount_table);
+    for (i = 0; i < timing.nb_phases; i++) {
+        bdrv_check_add_phase(res, timing.phases[i].name,
+                             timing.phases[i].duration_ns);
+    }
 
     return ret;
 }
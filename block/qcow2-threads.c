@@ -38,14 +38,19 @@
 #include "block/thread-pool.h"
 #include "crypto.h"
 
+/*
+ * Run @func in the thread pool once fewer than @max_threads requests of @bs
+ * are being processed there.
+ */
 static int coroutine_fn
-qcow2_co_process(BlockDriverState *bs, ThreadPoolFunc *func, void *arg)
+qcow2_co_process(BlockDriverState *bs, ThreadPoolFunc *func, void *arg,
+                 int max_threads)
 {
     int ret;
     BDRVQcow2State *s = bs->opaque;
 
     qemu_co_mutex_lock(&s->lock);
-    while (s->nb_threads >= QCOW2_MAX_THREADS) {
+    while (s->nb_threads >= max_threads) {
         qemu_co_queue_wait(&s->thread_task_queue, &s->lock);
     }
     s->nb_threads++;
@@ -337,7 +342,8 @@ static int qcow2_compress_pool_func(void *opaque)
 
 static ssize_t coroutine_fn
 qcow2_co_do_compress(BlockDriverState *bs, void *dest, size_t dest_size,
-                     const void *src, size_t src_size, Qcow2CompressFunc func)
+                     const void *src, size_t src_size, Qcow2CompressFunc func,
+                     int max_threads)
 {
     Qcow2CompressData arg = {
         .dest = dest,
@@ -347,7 +353,7 @@ qcow2_co_do_compress(BlockDriverState *bs, void *dest, size_t dest_size,
         .func = func,
     };
 
-    qcow2_co_process(bs, qcow2_compress_pool_func, &arg);
+    qcow2_co_process(bs, qcow2_compress_pool_func, &arg, max_threads);
 
     return arg.ret;
 }
@@ -385,7 +391,8 @@ qcow2_co_compress(BlockDriverState *bs, void *dest, size_t dest_size,
         abort();
     }
 
-    return qcow2_co_do_compress(bs, dest, dest_size, src, src_size, fn);
+    return qcow2_co_do_compress(bs, dest, dest_size, src, src_size, fn,
+                                s->compress_threads);
 }
 
 /*
@@ -422,7 +429,8 @@ qcow2_co_decompress(BlockDriverState *bs, void *dest, size_t dest_size,
         abort();
     }
 
-    return qcow2_co_do_compress(bs, dest, dest_size, src, src_size, fn);
+    return qcow2_co_do_compress(bs, dest, dest_size, src, src_size, fn,
+                                QCOW2_MAX_THREADS);
 }
 
 
@@ -475,7 +483,8 @@ qcow2_co_encdec(BlockDriverState *bs, uint64_t host_offset,
     assert(QEMU_IS_ALIGNED(host_offset, sector_size));
     assert(QEMU_IS_ALIGNED(len, sector_size));
 
-    return len == 0 ? 0 : qcow2_co_process(bs, qcow2_encdec_pool_func, &arg);
+    return len == 0 ? 0 : qcow2_co_process(bs, qcow2_encdec_pool_func, &arg,
+                                           QCOW2_MAX_THREADS);
 }
 
 /*
@@ -592,6 +592,8 @@ static void qcow2_add_check_result(BdrvCheckResult *out,
                                    const BdrvCheckResult *src,
                                    bool set_allocation_info)
 {
+    int i;
+
     out->corruptions += src->corruptions;
     out->leaks += src->leaks;
     out->check_errors += src->check_errors;
@@ -602,19 +604,28 @@ static void qcow2_add_check_result(BdrvCheckResult *out,
         out->image_end_offset = src->image_end_offset;
         out->bfi = src->bfi;
     }
+
+    for (i = 0; i < src->nb_phases; i++) {
+        bdrv_check_add_phase(out, src->phases[i].name,
+                             src->phases[i].duration_ns);
+    }
 }
 
 static int coroutine_fn GRAPH_RDLOCK
 qcow2_co_check_locked(BlockDriverState *bs, BdrvCheckResult *result,
                       BdrvCheckMode fix)
 {
+    BDRVQcow2State *s = bs->opaque;
     BdrvCheckResult snapshot_res = {};
     BdrvCheckResult refcount_res = {};
+    int64_t start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     int ret;
 
     memset(result, 0, sizeof(*result));
 
     ret = qcow2_check_read_snapshot_table(bs, &snapshot_res, fix);
+    bdrv_check_add_phase(result, "snapshot table",
+                         qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start_ns);
     if (ret < 0) {
         qcow2_add_check_result(result, &snapshot_res, false);
         return ret;
@@ -622,12 +633,19 @@ qcow2_co_check_locked(BlockDriverState *bs, BdrvCheckResult *result,
 
     ret = qcow2_check_refcounts(bs, &refcount_res, fix);
     qcow2_add_check_result(result, &refcount_res, true);
+    if (fix && s->compressed_cache) {
+        /* Repairing may have freed clusters without going through refcounts */
+        qcow2_compressed_cache_empty(s->compressed_cache);
+    }
     if (ret < 0) {
         qcow2_add_check_result(result, &snapshot_res, false);
         return ret;
     }
 
+    start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     ret = qcow2_check_fix_snapshot_table(bs, &snapshot_res, fix);
+    bdrv_check_add_phase(result, "snapshot table",
+                         qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start_ns);
     qcow2_add_check_result(result, &snapshot_res, false);
     if (ret < 0) {
         return ret;
@@ -701,6 +719,7 @@ static const char *const mutable_opts[] = {
     QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
     QCOW2_OPT_REFCOUNT_CACHE_SIZE,
     QCOW2_OPT_CACHE_CLEAN_INTERVAL,
+    QCOW2_OPT_COMPRESSED_CACHE_SIZE,
     NULL
 };
 
@@ -817,6 +836,12 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_COMPRESSED_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum size of the cache of decompressed clusters "
+                    "(0 disables the cache)",
+        },
         BLOCK_CRYPTO_OPT_DEF_KEY_SECRET("encrypt.",
             "ID of secret providing qcow2 AES key or LUKS passphrase"),
         { /* end of list */ }
@@ -979,6 +1004,7 @@ typedef struct Qcow2ReopenState {
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     bool discard_no_unref;
     uint64_t cache_clean_interval;
+    Qcow2CompressedCache *compressed_cache;
     QCryptoBlockOpenOptions *crypto_opts; /* Disk encryption runtime options */
 } Qcow2ReopenState;
 
@@ -991,6 +1017,7 @@ qcow2_update_options_prepare(BlockDriverState *bs, Qcow2ReopenState *r,
     const char *opt_overlap_check, *opt_overlap_check_template;
     int overlap_check_template = 0;
     uint64_t l2_cache_size, l2_cache_entry_size, refcount_cache_size;
+    uint64_t compressed_cache_size;
     int i;
     const char *encryptfmt;
     QDict *encryptopts = NULL;
@@ -1079,6 +1106,24 @@ qcow2_update_options_prepare(BlockDriverState *bs, Qcow2ReopenState *r,
         goto fail;
     }
 
+    compressed_cache_size =
+        qemu_opt_get_size(opts, QCOW2_OPT_COMPRESSED_CACHE_SIZE, 0);
+    compressed_cache_size /= s->cluster_size;
+    if (compressed_cache_size > INT_MAX) {
+        error_setg(errp, "Compressed cluster cache size too big");
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (compressed_cache_size > 0) {
+        r->compressed_cache =
+            qcow2_compressed_cache_create(bs, compressed_cache_size);
+        if (r->compressed_cache == NULL) {
+            error_setg(errp, "Could not allocate compressed cluster cache");
+            ret = -ENOMEM;
+            goto fail;
+        }
+    }
+
     /* lazy-refcounts; flush if going from enabled to disabled */
     r->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
@@ -1230,6 +1275,11 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
     s->refcount_block_cache = r->refcount_block_cache;
     s->l2_slice_size = r->l2_slice_size;
 
+    if (s->compressed_cache) {
+        qcow2_compressed_cache_destroy(s->compressed_cache);
+    }
+    s->compressed_cache = r->compressed_cache;
+
     s->overlap_check = r->overlap_check;
     s->use_lazy_refcounts = r->use_lazy_refcounts;
 
@@ -1258,6 +1308,9 @@ static void qcow2_update_options_abort(BlockDriverState *bs,
     if (r->refcount_block_cache) {
         qcow2_cache_destroy(r->refcount_block_cache);
     }
+    if (r->compressed_cache) {
+        qcow2_compressed_cache_destroy(r->compressed_cache);
+    }
     qapi_free_QCryptoBlockOpenOptions(r->crypto_opts);
 }
 
@@ -1888,6 +1941,8 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
 #endif
 
     qemu_co_queue_init(&s->thread_task_queue);
+    s->compress_threads = MIN(MAX(g_get_num_processors(), QCOW2_MAX_THREADS),
+                              QCOW2_MAX_COMPRESS_THREADS);
 
     return ret;
 
@@ -1913,6 +1968,10 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
     if (s->refcount_block_cache) {
         qcow2_cache_destroy(s->refcount_block_cache);
     }
+    if (s->compressed_cache) {
+        qcow2_compressed_cache_destroy(s->compressed_cache);
+        s->compressed_cache = NULL;
+    }
     qcrypto_block_free(s->crypto);
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
     return ret;
@@ -2806,6 +2865,10 @@ qcow2_do_close(BlockDriverState *bs, bool close_data_file)
     cache_clean_timer_del(bs);
     qcow2_cache_destroy(s->l2_table_cache);
     qcow2_cache_destroy(s->refcount_block_cache);
+    if (s->compressed_cache) {
+        qcow2_compressed_cache_destroy(s->compressed_cache);
+        s->compressed_cache = NULL;
+    }
 
     qcrypto_block_free(s->crypto);
     s->crypto = NULL;
@@ -4671,8 +4734,32 @@ fail:
     return ret;
 }
 
+/*
+ * The clusters of a compressed write request are compressed concurrently, but
+ * allocated strictly in guest offset order.  This makes compressed data in the
+ * image file sequential, and it makes the result of compressing the same data
+ * reproducible, while allocation and compression of different clusters still
+ * overlap.
+ */
+typedef struct Qcow2CompressedWrite {
+    CoQueue alloc_queue;
+    uint64_t next_offset; /* guest offset of the next cluster to allocate */
+} Qcow2CompressedWrite;
+
+typedef struct Qcow2CompressedTask {
+    AioTask task;
+
+    BlockDriverState *bs;
+    Qcow2CompressedWrite *write;
+    uint64_t offset;
+    uint64_t bytes;
+    QEMUIOVector *qiov;
+    size_t qiov_offset;
+} Qcow2CompressedTask;
+
 static int coroutine_fn GRAPH_RDLOCK
 qcow2_co_pwritev_compressed_task(BlockDriverState *bs,
+                                 Qcow2CompressedWrite *write,
                                  uint64_t offset, uint64_t bytes,
                                  QEMUIOVector *qiov, size_t qiov_offset)
 {
@@ -4696,40 +4783,43 @@ qcow2_co_pwritev_compressed_task(BlockDriverState *bs,
 
     out_len = qcow2_co_compress(bs, out_buf, s->cluster_size - 1,
                                 buf, s->cluster_size);
+
+    /* Wait until all preceding clusters of the request are allocated */
+    while (write->next_offset != offset) {
+        qemu_co_queue_wait(&write->alloc_queue, NULL);
+    }
+
     if (out_len == -ENOMEM) {
         /* could not compress: write normal cluster */
         ret = qcow2_co_pwritev_part(bs, offset, bytes, qiov, qiov_offset, 0);
-        if (ret < 0) {
-            goto fail;
-        }
-        goto success;
+        cluster_offset = 0;
     } else if (out_len < 0) {
         ret = -EINVAL;
-        goto fail;
-    }
-
-    qemu_co_mutex_lock(&s->lock);
-    ret = qcow2_alloc_compressed_cluster_offset(bs, offset, out_len,
-                                                &cluster_offset);
-    if (ret < 0) {
+    } else {
+        qemu_co_mutex_lock(&s->lock);
+        ret = qcow2_alloc_compressed_cluster_offset(bs, offset, out_len,
+                                                    &cluster_offset);
+        if (ret == 0) {
+            ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset,
+                                                out_len, true);
+        }
         qemu_co_mutex_unlock(&s->lock);
-        goto fail;
     }
 
-    ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len, true);
-    qemu_co_mutex_unlock(&s->lock);
-    if (ret < 0) {
-        goto fail;
+    /* Let the next cluster be allocated even if this one failed */
+    write->next_offset += bytes;
+    qemu_co_queue_restart_all(&write->alloc_queue);
+
+    if (ret < 0 || !cluster_offset) {
+        goto out;
     }
 
     BLKDBG_CO_EVENT(s->data_file, BLKDBG_WRITE_COMPRESSED);
     ret = bdrv_co_pwrite(s->data_file, cluster_offset, out_len, out_buf, 0);
-    if (ret < 0) {
-        goto fail;
+    if (ret > 0) {
+        ret = 0;
     }
-success:
-    ret = 0;
-fail:
+out:
     qemu_vfree(buf);
     g_free(out_buf);
     return ret;
@@ -4743,12 +4833,10 @@ fail:
 static int coroutine_fn GRAPH_RDLOCK
 qcow2_co_pwritev_compressed_task_entry(AioTask *task)
 {
-    Qcow2AioTask *t = container_of(task, Qcow2AioTask, task);
-
-    assert(!t->subcluster_type && !t->l2meta);
+    Qcow2CompressedTask *t = container_of(task, Qcow2CompressedTask, task);
 
-    return qcow2_co_pwritev_compressed_task(t->bs, t->offset, t->bytes, t->qiov,
-                                            t->qiov_offset);
+    return qcow2_co_pwritev_compressed_task(t->bs, t->write, t->offset,
+                                            t->bytes, t->qiov, t->qiov_offset);
 }
 
 /*
@@ -4761,6 +4849,7 @@ qcow2_co_pwritev_compressed_part(BlockDriverState *bs,
                                  QEMUIOVector *qiov, size_t qiov_offset)
 {
     BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedWrite write = { .next_offset = offset };
     AioTaskPool *aio = NULL;
     int ret = 0;
 
@@ -4790,31 +4879,76 @@ qcow2_co_pwritev_compressed_part(BlockDriverState *bs,
         return -EINVAL;
     }
 
+    qemu_co_queue_init(&write.alloc_queue);
+    if (bytes <= s->cluster_size) {
+        return qcow2_co_pwritev_compressed_task(bs, &write, offset, bytes,
+                                                qiov, qiov_offset);
+    }
+
+    /*
+     * Keep twice as many clusters in flight as can be compressed at the same
+     * time, so that the compression threads stay busy while clusters are
+     * waiting for their allocation.
+     */
+    aio = aio_task_pool_new(MAX(QCOW2_MAX_WORKERS, 2 * s->compress_threads));
+
     while (bytes && aio_task_pool_status(aio) == 0) {
         uint64_t chunk_size = MIN(bytes, s->cluster_size);
+        Qcow2CompressedTask *task = g_new(Qcow2CompressedTask, 1);
+
+        *task = (Qcow2CompressedTask) {
+            .task.func = qcow2_co_pwritev_compressed_task_entry,
+            .bs = bs,
+            .write = &write,
+            .offset = offset,
+            .bytes = chunk_size,
+            .qiov = qiov,
+            .qiov_offset = qiov_offset,
+        };
+        aio_task_pool_start_task(aio, &task->task);
 
-        if (!aio && chunk_size != bytes) {
-            aio = aio_task_pool_new(QCOW2_MAX_WORKERS);
-        }
-
-        ret = qcow2_add_task(bs, aio, qcow2_co_pwritev_compressed_task_entry,
-                             0, 0, offset, chunk_size, qiov, qiov_offset, NULL);
-        if (ret < 0) {
-            break;
-        }
         qiov_offset += chunk_size;
         offset += chunk_size;
         bytes -= chunk_size;
     }
 
-    if (aio) {
-        aio_task_pool_wait_all(aio);
-        if (ret == 0) {
-            ret = aio_task_pool_status(aio);
-        }
-        g_free(aio);
+    aio_task_pool_wait_all(aio);
+    ret = aio_task_pool_status(aio);
+    g_free(aio);
+
+    return ret;
+}
+
+/*
+ * Read the compressed data of a cluster at host offset @coffset and
+ * decompress it into @out_buf, which must be cluster_size bytes large.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+qcow2_co_read_compressed_cluster(BlockDriverState *bs, uint64_t coffset,
+                                 int csize, uint8_t *out_buf)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint8_t *buf;
+    int ret;
+
+    buf = g_try_malloc(csize);
+    if (!buf) {
+        return -ENOMEM;
+    }
+
+    BLKDBG_CO_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
+    ret = bdrv_co_pread(bs->file, coffset, csize, buf, 0);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    if (qcow2_co_decompress(bs, out_buf, s->cluster_size, buf, csize) < 0) {
+        ret = -EIO;
+        goto fail;
     }
 
+fail:
+    g_free(buf);
     return ret;
 }
 
@@ -4829,34 +4963,42 @@ qcow2_co_preadv_compressed(BlockDriverState *bs,
     BDRVQcow2State *s = bs->opaque;
     int ret = 0, csize;
     uint64_t coffset;
-    uint8_t *buf, *out_buf;
+    uint8_t *out_buf;
+    void *cached;
     int offset_in_cluster = offset_into_cluster(s, offset);
 
     qcow2_parse_compressed_l2_entry(bs, l2_entry, &coffset, &csize);
 
-    buf = g_try_malloc(csize);
-    if (!buf) {
-        return -ENOMEM;
+    if (s->compressed_cache) {
+        ret = qcow2_compressed_cache_co_get(s->compressed_cache, coffset,
+                                            &cached);
+        if (ret >= 0) {
+            if (ret == 0) {
+                ret = qcow2_co_read_compressed_cluster(bs, coffset, csize,
+                                                       cached);
+                qcow2_compressed_cache_loaded(s->compressed_cache, cached,
+                                              ret);
+            }
+            if (ret >= 0) {
+                qemu_iovec_from_buf(qiov, qiov_offset,
+                                    (uint8_t *)cached + offset_in_cluster,
+                                    bytes);
+            }
+            qcow2_compressed_cache_put(s->compressed_cache, cached);
+            return ret < 0 ? ret : 0;
+        }
+        /* No free cache entry, read the cluster without the cache */
     }
 
     out_buf = qemu_blockalign(bs, s->cluster_size);
 
-    BLKDBG_CO_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
-    ret = bdrv_co_pread(bs->file, coffset, csize, buf, 0);
-    if (ret < 0) {
-        goto fail;
-    }
-
-    if (qcow2_co_decompress(bs, out_buf, s->cluster_size, buf, csize) < 0) {
-        ret = -EIO;
-        goto fail;
+    ret = qcow2_co_read_compressed_cluster(bs, coffset, csize, out_buf);
+    if (ret == 0) {
+        qemu_iovec_from_buf(qiov, qiov_offset, out_buf + offset_in_cluster,
+                            bytes);
     }
 
-    qemu_iovec_from_buf(qiov, qiov_offset, out_buf + offset_in_cluster, bytes);
-
-fail:
     qemu_vfree(out_buf);
-    g_free(buf);
 
     return ret;
 }
@@ -4885,6 +5027,10 @@ static int GRAPH_RDLOCK make_completely_empty(BlockDriverState *bs)
         goto fail;
     }
 
+    if (s->compressed_cache) {
+        qcow2_compressed_cache_empty(s->compressed_cache);
+    }
+
     /* Refcounts will be broken utterly */
     ret = qcow2_mark_dirty(bs);
     if (ret < 0) {
@@ -150,6 +150,7 @@
 #define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 #define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
+#define QCOW2_OPT_COMPRESSED_CACHE_SIZE "compressed-cache-size"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -231,6 +232,8 @@ typedef struct QCowSnapshot {
 struct Qcow2Cache;
 typedef struct Qcow2Cache Qcow2Cache;
 
+typedef struct Qcow2CompressedCache Qcow2CompressedCache;
+
 typedef struct Qcow2CryptoHeaderExtension {
     uint64_t offset;
     uint64_t length;
@@ -324,6 +327,13 @@ typedef struct Qcow2BitmapHeaderExt {
 
 #define QCOW2_MAX_THREADS 4
 
+/*
+ * Compressing clusters is only done for writes that are explicitly requested
+ * to be compressed (e.g. qemu-img convert -c), so it may use one thread per
+ * host CPU, up to this limit.
+ */
+#define QCOW2_MAX_COMPRESS_THREADS 64
+
 typedef struct BDRVQcow2State {
     int cluster_bits;
     int cluster_size;
@@ -347,6 +357,7 @@ typedef struct BDRVQcow2State {
     Qcow2Cache *refcount_block_cache;
     QEMUTimer *cache_clean_timer;
     unsigned cache_clean_interval;
+    Qcow2CompressedCache *compressed_cache; /* NULL if disabled */
 
     QLIST_HEAD(, QCowL2Meta) cluster_allocs;
 
@@ -410,6 +421,7 @@ typedef struct BDRVQcow2State {
 
     CoQueue thread_task_queue;
     int nb_threads;
+    int compress_threads;
 
     BdrvChild *data_file;
 
@@ -1022,6 +1034,21 @@ void qcow2_cache_put(Qcow2Cache *c, void **table);
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset);
 void qcow2_cache_discard(Qcow2Cache *c, void *table);
 
+/* qcow2-compressed-cache.c functions */
+Qcow2CompressedCache * GRAPH_RDLOCK
+qcow2_compressed_cache_create(BlockDriverState *bs, int num_clusters);
+
+void qcow2_compressed_cache_destroy(Qcow2CompressedCache *c);
+
+int coroutine_fn qcow2_compressed_cache_co_get(Qcow2CompressedCache *c,
+                                               uint64_t offset, void **data);
+void qcow2_compressed_cache_loaded(Qcow2CompressedCache *c, void *data,
+                                   int ret);
+void qcow2_compressed_cache_put(Qcow2CompressedCache *c, void *data);
+void qcow2_compressed_cache_discard(Qcow2CompressedCache *c,
+                                    uint64_t cluster_offset);
+void qcow2_compressed_cache_empty(Qcow2CompressedCache *c);
+
 /* qcow2-bitmap.c functions */
 int coroutine_fn GRAPH_RDLOCK
 qcow2_check_bitmaps_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
@@ -0,0 +1,588 @@
+/*
+ * Shared-memory cache of read-only image data
+ *
+ * Many VMs on a host are often backed by the same read-only base image.  This
+ * driver sits on top of such a base image (or of an NBD connection to a
+ * qemu-storage-daemon serving it) and looks up reads in a cache file that is
+ * created and filled by the shm-cache export of qemu-storage-daemon and
+ * shared by all processes on the host.  Cached clusters are therefore read
+ * (and possibly decompressed and looked up in format metadata) only once per
+ * host instead of once per VM.  Misses are read from the child node.
+ *
+ * The cache is keyed by guest offset rather than sharing the format driver's
+ * metadata tables between processes: a hit then needs no metadata at all,
+ * and the format drivers need no changes.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <sys/mman.h>
+
+#include "qapi/error.h"
+#include "qemu/atomic.h"
+#include "qemu/cutils.h"
+#include "qemu/host-utils.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/units.h"
+#include "block/block-io.h"
+#include "block/block_int.h"
+#include "block/shm-cache.h"
+#include "trace.h"
+
+static size_t shm_cache_index_offset(void)
+{
+    return QEMU_ALIGN_UP(sizeof(ShmCacheHeader), 64);
+}
+
+static int shm_cache_map(ShmCache *c, int fd, size_t size, bool writable,
+                         Error **errp)
+{
+    int prot = PROT_READ | (writable ? PROT_WRITE : 0);
+
+    c->map = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+    if (c->map == MAP_FAILED) {
+        c->map = NULL;
+        error_setg_errno(errp, errno, "Could not map shm-cache file");
+        return -errno;
+    }
+    c->map_size = size;
+    c->writable = writable;
+    return 0;
+}
+
+static void shm_cache_init_layout(ShmCache *c, const ShmCacheHeader *hdr)
+{
+    c->cluster_bits = hdr->cluster_bits;
+    c->slot_bits = hdr->slot_bits;
+    c->image_size = hdr->image_size;
+    c->image_id = hdr->image_id;
+    c->index = (ShmCacheEntry *)((uint8_t *)c->map + hdr->index_offset);
+    c->data = (uint8_t *)c->map + hdr->data_offset;
+}
+
+static int shm_cache_file_id_cmp(const void *a, const void *b)
+{
+    const ShmCacheFileId *fa = a, *fb = b;
+
+    if (fa->dev != fb->dev) {
+        return fa->dev < fb->dev ? -1 : 1;
+    }
+    if (fa->ino != fb->ino) {
+        return fa->ino < fb->ino ? -1 : 1;
+    }
+    return 0;
+}
+
+static int GRAPH_RDLOCK
+shm_cache_add_file_ids(BlockDriverState *bs, ShmCacheImageId *id,
+                       Error **errp)
+{
+    BdrvChild *child;
+    ShmCacheFileId *f;
+    struct stat st;
+    uint32_t i;
+    int ret;
+
+    if (!QLIST_EMPTY(&bs->children)) {
+        QLIST_FOREACH(child, &bs->children, next) {
+            ret = shm_cache_add_file_ids(child->bs, id, errp);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        return 0;
+    }
+
+    if (!bs->drv->protocol_name ||
+        (strcmp(bs->drv->protocol_name, "file") &&
+         strcmp(bs->drv->protocol_name, "host_device")))
+    {
+        error_setg(errp, "Node '%s' is not stored in a local file",
+                   bdrv_get_node_name(bs));
+        return -ENOTSUP;
+    }
+
+    if (stat(bs->filename, &st) < 0) {
+        error_setg_errno(errp, errno, "Could not stat '%s'", bs->filename);
+        return -errno;
+    }
+
+    for (i = 0; i < id->nb_files; i++) {
+        if (id->files[i].dev == st.st_dev && id->files[i].ino == st.st_ino) {
+            return 0;
+        }
+    }
+    if (id->nb_files == SHM_CACHE_MAX_FILES) {
+        error_setg(errp, "Image is stored in more than %d files",
+                   SHM_CACHE_MAX_FILES);
+        return -ENOTSUP;
+    }
+
+    f = &id->files[id->nb_files++];
+    *f = (ShmCacheFileId) {
+        .dev        = st.st_dev,
+        .ino        = st.st_ino,
+        .size       = st.st_size,
+        .mtime_sec  = st.st_mtime,
+#ifdef CONFIG_DARWIN
+        .mtime_nsec = st.st_mtimespec.tv_nsec,
+#else
+        .mtime_nsec = st.st_mtim.tv_nsec,
+#endif
+    };
+    return 0;
+}
+
+/*
+ * Identify the data of @bs by the host files that it and its backing chain
+ * are stored in.  A cache must only be used for exactly the same files, and
+ * files that were modified since the cache was created make it stale, too.
+ *
+ * Returns -ENOTSUP if some of the data isn't stored in local files (e.g. on
+ * an NBD server), so that it can't be identified.
+ */
+int shm_cache_get_image_id(BlockDriverState *bs, ShmCacheImageId *id,
+                           Error **errp)
+{
+    int ret;
+
+    memset(id, 0, sizeof(*id));
+    ret = shm_cache_add_file_ids(bs, id, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    qsort(id->files, id->nb_files, sizeof(id->files[0]),
+          shm_cache_file_id_cmp);
+    return 0;
+}
+
+/*
+ * Create a new cache file at @path for an image of @image_size bytes that is
+ * identified by @image_id, using at most @size bytes for the cached data.
+ * The file is created under a temporary name and then atomically renamed, so
+ * processes that open @path never see a partially initialised file, and
+ * processes that still have a previous file at @path mapped keep using that
+ * one.
+ */
+int shm_cache_create(ShmCache *c, const char *path, uint64_t size,
+                     uint32_t cluster_size, uint64_t image_size,
+                     const ShmCacheImageId *image_id, Error **errp)
+{
+    g_autofree char *tmp_path = g_strdup_printf("%s.XXXXXX", path);
+    ShmCacheHeader *hdr;
+    uint64_t nb_slots, data_offset, file_size;
+    size_t index_offset = shm_cache_index_offset();
+    unsigned cluster_bits = ctz32(cluster_size);
+    int fd, ret;
+
+    if (!is_power_of_2(cluster_size)) {
+        error_setg(errp, "Cluster size must be a power of two");
+        return -EINVAL;
+    }
+    if (DIV_ROUND_UP(image_size, cluster_size) >= UINT32_MAX) {
+        error_setg(errp, "Image is too large for the cluster size");
+        return -EINVAL;
+    }
+
+    nb_slots = pow2floor(size / cluster_size);
+    if (nb_slots < SHM_CACHE_PROBE) {
+        error_setg(errp, "Cache size must be at least %u clusters",
+                   SHM_CACHE_PROBE);
+        return -EINVAL;
+    }
+    nb_slots = MIN(nb_slots, 1ULL << 31);
+
+    data_offset = QEMU_ALIGN_UP(index_offset + nb_slots * sizeof(ShmCacheEntry),
+                                qemu_real_host_page_size());
+    file_size = data_offset + (nb_slots << cluster_bits);
+    if (file_size > SIZE_MAX) {
+        error_setg(errp, "Cache size too large");
+        return -EINVAL;
+    }
+
+    fd = g_mkstemp_full(tmp_path, O_RDWR | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "Could not create '%s'", tmp_path);
+        return -errno;
+    }
+
+    if (ftruncate(fd, file_size) < 0) {
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not resize '%s'", tmp_path);
+        goto fail;
+    }
+
+    ret = shm_cache_map(c, fd, file_size, true, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    /* The file is zeroed, so the index is empty already */
+    hdr = c->map;
+    *hdr = (ShmCacheHeader) {
+        .magic          = SHM_CACHE_MAGIC,
+        .version        = SHM_CACHE_VERSION,
+        .cluster_bits   = cluster_bits,
+        .image_size     = image_size,
+        .slot_bits      = ctz64(nb_slots),
+        .index_offset   = index_offset,
+        .data_offset    = data_offset,
+        .image_id       = *image_id,
+    };
+    shm_cache_init_layout(c, hdr);
+
+    if (rename(tmp_path, path) < 0) {
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not rename '%s' to '%s'",
+                         tmp_path, path);
+        munmap(c->map, c->map_size);
+        c->map = NULL;
+        goto fail;
+    }
+
+    close(fd);
+    return 0;
+
+fail:
+    close(fd);
+    unlink(tmp_path);
+    return ret;
+}
+
+/*
+ * Map an existing cache file read-only.  Only the process that created it
+ * writes to it.
+ */
+int shm_cache_open(ShmCache *c, const char *path, Error **errp)
+{
+    ShmCacheHeader hdr;
+    struct stat st;
+    int fd, ret;
+
+    fd = qemu_open(path, O_RDONLY, NULL);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "Could not open '%s'", path);
+        return -errno;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not stat '%s'", path);
+        goto out;
+    }
+
+    if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        hdr.magic != SHM_CACHE_MAGIC)
+    {
+        error_setg(errp, "'%s' is not a shm-cache file", path);
+        ret = -EINVAL;
+        goto out;
+    }
+    if (hdr.version != SHM_CACHE_VERSION) {
+        error_setg(errp, "Unsupported shm-cache version %" PRIu32,
+                   hdr.version);
+        ret = -ENOTSUP;
+        goto out;
+    }
+    if (hdr.cluster_bits < BDRV_SECTOR_BITS || hdr.cluster_bits > 30 ||
+        hdr.slot_bits < ctz32(SHM_CACHE_PROBE) || hdr.slot_bits > 31 ||
+        hdr.image_id.nb_files > SHM_CACHE_MAX_FILES ||
+        (hdr.image_size >> hdr.cluster_bits) >= UINT32_MAX ||
+        hdr.index_offset < sizeof(hdr) ||
+        hdr.index_offset + ((uint64_t)sizeof(ShmCacheEntry) << hdr.slot_bits)
+            > hdr.data_offset ||
+        hdr.data_offset + ((uint64_t)1 << (hdr.cluster_bits + hdr.slot_bits))
+            > st.st_size)
+    {
+        error_setg(errp, "'%s' has an invalid layout", path);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    ret = shm_cache_map(c, fd, st.st_size, false, errp);
+    if (ret < 0) {
+        goto out;
+    }
+    shm_cache_init_layout(c, &hdr);
+
+out:
+    close(fd);
+    return ret;
+}
+
+void shm_cache_close(ShmCache *c)
+{
+    if (c->map) {
+        munmap(c->map, c->map_size);
+        c->map = NULL;
+    }
+}
+
+static inline uint32_t shm_cache_hash(ShmCache *c, uint64_t cluster)
+{
+    return (cluster * 0x9e3779b97f4a7c15ULL) >> (64 - c->slot_bits);
+}
+
+static inline uint8_t *shm_cache_slot_data(ShmCache *c, uint32_t slot)
+{
+    return c->data + ((uint64_t)slot << c->cluster_bits);
+}
+
+/*
+ * Copy @bytes bytes at @offset into cluster @cluster from the cache into
+ * @qiov.  Returns false if the cluster is not cached, in which case the
+ * content of @qiov is undefined.
+ */
+bool shm_cache_read(ShmCache *c, uint64_t cluster, size_t offset,
+                    size_t bytes, QEMUIOVector *qiov, size_t qiov_offset)
+{
+    uint32_t key = cluster + 1;
+    uint32_t mask = (1U << c->slot_bits) - 1;
+    uint32_t slot = shm_cache_hash(c, cluster);
+    int i;
+
+    for (i = 0; i < SHM_CACHE_PROBE; i++, slot = (slot + 1) & mask) {
+        ShmCacheEntry *e = &c->index[slot];
+        uint32_t seq = qatomic_load_acquire(&e->seq);
+
+        if ((seq & 1) || qatomic_read(&e->key) != key) {
+            continue;
+        }
+
+        qemu_iovec_from_buf(qiov, qiov_offset,
+                            shm_cache_slot_data(c, slot) + offset, bytes);
+
+        /* The slot may have been replaced while we copied the data */
+        smp_rmb();
+        return qatomic_read(&e->seq) == seq;
+    }
+
+    return false;
+}
+
+/*
+ * Insert cluster @cluster, whose data is in @buf, into a free slot of the
+ * cache.  Only the process that created the cache may call this.  Returns
+ * false if all slots that the cluster may be stored in are taken already.
+ */
+bool shm_cache_insert(ShmCache *c, uint64_t cluster, const uint8_t *buf)
+{
+    uint32_t key = cluster + 1;
+    uint32_t mask = (1U << c->slot_bits) - 1;
+    uint32_t slot = shm_cache_hash(c, cluster);
+    ShmCacheEntry *e;
+    uint32_t seq;
+    int i;
+
+    assert(c->writable);
+
+    for (i = 0; i < SHM_CACHE_PROBE; i++, slot = (slot + 1) & mask) {
+        e = &c->index[slot];
+        if (e->key == key) {
+            return true;
+        } else if (e->key == 0) {
+            break;
+        }
+    }
+    if (i == SHM_CACHE_PROBE) {
+        return false;
+    }
+
+    /* Readers that see the odd sequence number skip the slot */
+    seq = e->seq;
+    qatomic_set(&e->seq, seq + 1);
+    smp_wmb(); /* pairs with smp_rmb() in shm_cache_read() */
+    memcpy(shm_cache_slot_data(c, slot), buf, 1ULL << c->cluster_bits);
+    smp_wmb(); /* the data must be complete before readers can find it */
+    qatomic_set(&e->key, key);
+    qatomic_store_release(&e->seq, seq + 2);
+    return true;
+}
+
+
+typedef struct BDRVShmCacheState {
+    ShmCache cache;
+} BDRVShmCacheState;
+
+#define SHM_CACHE_OPT_PATH "path"
+static QemuOptsList runtime_opts = {
+    .name = "shm-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = SHM_CACHE_OPT_PATH,
+            .type = QEMU_OPT_STRING,
+            .help = "path of the cache file created by qemu-storage-daemon",
+        },
+        { /* end of list */ }
+    },
+};
+
+static int shm_cache_open_bs(BlockDriverState *bs, QDict *options, int flags,
+                             Error **errp)
+{
+    BDRVShmCacheState *s = bs->opaque;
+    ShmCacheImageId image_id;
+    Error *local_err = NULL;
+    QemuOpts *opts;
+    const char *path;
+    int64_t len;
+    int ret;
+
+    GLOBAL_STATE_CODE();
+
+    if (flags & BDRV_O_RDWR) {
+        error_setg(errp, "The shm-cache driver only supports read-only nodes");
+        return -EINVAL;
+    }
+
+    ret = bdrv_open_file_child(NULL, options, "file", bs, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    path = qemu_opt_get(opts, SHM_CACHE_OPT_PATH);
+    if (!path) {
+        error_setg(errp, "shm-cache requires the 'path' option");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    ret = shm_cache_open(&s->cache, path, errp);
+    if (ret < 0) {
+        goto out;
+    }
+
+    bdrv_graph_rdlock_main_loop();
+    len = bdrv_getlength(bs->file->bs);
+    ret = shm_cache_get_image_id(bs->file->bs, &image_id, &local_err);
+    bdrv_graph_rdunlock_main_loop();
+
+    if (ret == -ENOTSUP) {
+        /*
+         * The child can't be identified, e.g. because it is an NBD
+         * connection.  It must lead to the daemon that created the cache;
+         * at least the size has to match.
+         */
+        error_free(local_err);
+        ret = 0;
+    } else if (ret < 0) {
+        error_propagate(errp, local_err);
+    } else if (memcmp(&image_id, &s->cache.image_id, sizeof(image_id))) {
+        error_setg(errp, "The image does not match the cached image or has "
+                   "been modified since the cache was created");
+        ret = -EINVAL;
+    }
+
+    if (ret < 0) {
+        /* Error set above */
+    } else if (len < 0) {
+        error_setg_errno(errp, -len, "Could not get the image size");
+        ret = len;
+    } else if (len != s->cache.image_size) {
+        error_setg(errp, "Image size %" PRId64 " does not match the size of "
+                   "the cached image (%" PRIu64 ")", len, s->cache.image_size);
+        ret = -EINVAL;
+    }
+    if (ret < 0) {
+        shm_cache_close(&s->cache);
+    }
+
+out:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void shm_cache_close_bs(BlockDriverState *bs)
+{
+    BDRVShmCacheState *s = bs->opaque;
+
+    shm_cache_close(&s->cache);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+shm_cache_co_preadv_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                         QEMUIOVector *qiov, size_t qiov_offset,
+                         BdrvRequestFlags flags)
+{
+    BDRVShmCacheState *s = bs->opaque;
+    ShmCache *c = &s->cache;
+    uint64_t cluster_size = 1ULL << c->cluster_bits;
+    int64_t miss_offset = 0, miss_bytes = 0;
+    size_t miss_qiov_offset = 0;
+    int ret;
+
+    /*
+     * Serve cached clusters directly, and collect runs of consecutive misses
+     * so that they can be read from the child in a single request.
+     */
+    while (bytes > 0) {
+        uint64_t cluster = offset >> c->cluster_bits;
+        size_t in_cluster = offset & (cluster_size - 1);
+        int64_t cur_bytes = MIN(bytes, cluster_size - in_cluster);
+
+        if (!shm_cache_read(c, cluster, in_cluster, cur_bytes,
+                            qiov, qiov_offset)) {
+            if (miss_bytes == 0) {
+                miss_offset = offset;
+                miss_qiov_offset = qiov_offset;
+            }
+            miss_bytes += cur_bytes;
+        }
+
+        offset += cur_bytes;
+        bytes -= cur_bytes;
+        qiov_offset += cur_bytes;
+
+        if (miss_bytes > 0 &&
+            (miss_offset + miss_bytes != offset || bytes == 0))
+        {
+            trace_shm_cache_co_miss(bs, miss_offset, miss_bytes);
+            ret = bdrv_co_preadv_part(bs->file, miss_offset, miss_bytes,
+                                      qiov, miss_qiov_offset, 0);
+            if (ret < 0) {
+                return ret;
+            }
+            miss_bytes = 0;
+        }
+    }
+
+    return 0;
+}
+
+static int64_t coroutine_fn GRAPH_RDLOCK
+shm_cache_co_getlength(BlockDriverState *bs)
+{
+    return bdrv_co_getlength(bs->file->bs);
+}
+
+static BlockDriver bdrv_shm_cache = {
+    .format_name            = "shm-cache",
+    .instance_size          = sizeof(BDRVShmCacheState),
+
+    .bdrv_open              = shm_cache_open_bs,
+    .bdrv_close             = shm_cache_close_bs,
+    .bdrv_child_perm        = bdrv_default_perms,
+
+    .bdrv_co_getlength      = shm_cache_co_getlength,
+    .bdrv_co_preadv_part    = shm_cache_co_preadv_part,
+
+    .is_filter              = true,
+};
+
+static void bdrv_shm_cache_init(void)
+{
+    bdrv_register(&bdrv_shm_cache);
+}
+
+block_init(bdrv_shm_cache_init);
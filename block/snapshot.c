@@ -255,6 +255,11 @@ int bdrv_snapshot_goto(BlockDriverState *bs,
 
     if (drv->bdrv_snapshot_goto) {
         ret = drv->bdrv_snapshot_goto(bs, snapshot_id);
+
+        bdrv_graph_rdlock_main_loop();
+        bdrv_csc_invalidate_range(bs, 0, INT64_MAX);
+        bdrv_graph_rdunlock_main_loop();
+
         if (ret < 0) {
             error_setg_errno(errp, -ret, "Failed to load snapshot");
         }
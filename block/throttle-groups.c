@@ -62,6 +62,16 @@ static void timer_cb(ThrottleGroupMember *tgm, ThrottleDirection direction);
  * blk_set_aio_context()). Therefore in this file a thread will
  * access some other ThrottleGroupMember's timers only after verifying that
  * that ThrottleGroupMember has throttled requests in the queue.
+ *
+ * So that requests don't have to take the lock one by one, members borrow
+ * budget from the group in advance.  The borrowed bytes and operations are
+ * accounted in the shared ThrottleState right away and stored in the
+ * member's 'credit' field.  throttle_group_co_io_limits_intercept() then
+ * consumes them with a compare-and-swap instead of taking the lock.
+ * Members only borrow a small share of what the group can still do without
+ * waiting, and the credit of all members is given back before any request
+ * is throttled, so that credit sitting with idle members does not hold
+ * back the others.
  */
 struct ThrottleGroup {
     Object parent_obj;
@@ -70,13 +80,22 @@ struct ThrottleGroup {
     bool is_initialized;
     char *name; /* This is constant during the lifetime of the group */
 
-    QemuMutex lock; /* This lock protects the following four fields */
+    QemuMutex lock; /* This lock protects the following fields */
     ThrottleState ts;
     QLIST_HEAD(, ThrottleGroupMember) head;
+    unsigned nr_members;
     ThrottleGroupMember *tokens[THROTTLE_MAX];
-    bool any_timer_armed[THROTTLE_MAX];
     QEMUClockType clock_type;
 
+    /*
+     * These are only written with the lock held, but they are also read
+     * without the lock to decide whether a request can be accounted with
+     * the member's credit.
+     */
+    bool any_timer_armed[THROTTLE_MAX];
+    unsigned nr_pending_reqs[THROTTLE_MAX];
+    aligned_uint64_t op_size;
+
     /* This field is protected by the global QEMU mutex */
     QTAILQ_ENTRY(ThrottleGroup) list;
 };
@@ -254,6 +273,196 @@ static ThrottleGroupMember *next_throttle_token(ThrottleGroupMember *tgm,
     return token;
 }
 
+/*
+ * A member's credit packs the number of bytes into the lower 32 bits and
+ * the number of operations, in fixed point with THROTTLE_CREDIT_OPS_SHIFT
+ * fractional bits, into the upper 32 bits.
+ */
+#define THROTTLE_CREDIT_OPS_SHIFT   10
+#define THROTTLE_CREDIT(bytes, ops) (((uint64_t)(ops) << 32) | (bytes))
+#define THROTTLE_CREDIT_BYTES(c)    ((uint32_t)(c))
+#define THROTTLE_CREDIT_OPS(c)      ((uint32_t)((c) >> 32))
+
+/* A member borrows at most what the group may do during this period */
+#define THROTTLE_CREDIT_PERIOD_NS   (1 * SCALE_MS)
+
+#ifdef CONFIG_ATOMIC64
+/*
+ * Return the number of operations of a request in fixed point, see
+ * throttle_account() for the floating point version.
+ *
+ * @tg:    the ThrottleGroup
+ * @bytes: the number of bytes for this I/O
+ * @ret:   the number of operations
+ */
+static uint64_t throttle_group_credit_ops(ThrottleGroup *tg, int64_t bytes)
+{
+    uint64_t op_size = qatomic_read_u64(&tg->op_size);
+
+    if (op_size && bytes > op_size) {
+        return DIV_ROUND_UP((uint64_t)bytes << THROTTLE_CREDIT_OPS_SHIFT,
+                            op_size);
+    }
+    return 1 << THROTTLE_CREDIT_OPS_SHIFT;
+}
+#endif
+
+/*
+ * Try to account an I/O request with the credit of a ThrottleGroupMember,
+ * without taking tg->lock.
+ *
+ * This is only done if no request in the group is throttled in this
+ * direction, otherwise the request must go through the round-robin
+ * scheduling so that all members get their turn.  Seeing stale values
+ * here is harmless: the credit has been accounted in the group already.
+ *
+ * @tgm:       the ThrottleGroupMember
+ * @bytes:     the number of bytes for this I/O
+ * @direction: the ThrottleDirection
+ * @ret:       whether the request was accounted
+ */
+static bool throttle_group_consume_credit(ThrottleGroupMember *tgm,
+                                          int64_t bytes,
+                                          ThrottleDirection direction)
+{
+#ifdef CONFIG_ATOMIC64
+    ThrottleGroup *tg = container_of(tgm->throttle_state, ThrottleGroup, ts);
+    uint64_t ops, old, cur;
+
+    if (bytes > UINT32_MAX ||
+        qatomic_read(&tg->nr_pending_reqs[direction]) ||
+        qatomic_read(&tg->any_timer_armed[direction])) {
+        return false;
+    }
+
+    ops = throttle_group_credit_ops(tg, bytes);
+    cur = qatomic_read__nocheck(&tgm->credit[direction]);
+    do {
+        if (THROTTLE_CREDIT_BYTES(cur) < bytes ||
+            THROTTLE_CREDIT_OPS(cur) < ops) {
+            return false;
+        }
+        old = cur;
+        cur = qatomic_cmpxchg__nocheck(&tgm->credit[direction], old,
+                                       old - THROTTLE_CREDIT(bytes, ops));
+    } while (cur != old);
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+/*
+ * Give the unused credit of a ThrottleGroupMember back to the group.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @tgm:       the ThrottleGroupMember
+ * @direction: the ThrottleDirection
+ * @ret:       whether there was any credit to give back
+ */
+static bool throttle_group_return_credit(ThrottleGroupMember *tgm,
+                                         ThrottleDirection direction)
+{
+#ifdef CONFIG_ATOMIC64
+    uint64_t credit = qatomic_xchg__nocheck(&tgm->credit[direction], 0);
+
+    if (!credit) {
+        return false;
+    }
+
+    throttle_account_units(tgm->throttle_state, direction,
+                           -(double)THROTTLE_CREDIT_BYTES(credit),
+                           -(double)THROTTLE_CREDIT_OPS(credit) /
+                           (1 << THROTTLE_CREDIT_OPS_SHIFT));
+    return true;
+#else
+    return false;
+#endif
+}
+
+/*
+ * Give the unused credit of all members of a group back to the group.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @tg:  the ThrottleGroup
+ * @ret: whether there was any credit to give back
+ */
+static bool throttle_group_reclaim_credit(ThrottleGroup *tg)
+{
+    ThrottleGroupMember *tgm;
+    ThrottleDirection dir;
+    bool ret = false;
+
+    QLIST_FOREACH(tgm, &tg->head, round_robin) {
+        for (dir = THROTTLE_READ; dir < THROTTLE_MAX; dir++) {
+            ret |= throttle_group_return_credit(tgm, dir);
+        }
+    }
+
+    return ret;
+}
+
+/*
+ * Borrow budget from the group for the next requests of a
+ * ThrottleGroupMember.  Nothing is borrowed while requests are throttled.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @tgm:       the ThrottleGroupMember
+ * @direction: the ThrottleDirection
+ */
+static void throttle_group_borrow_credit(ThrottleGroupMember *tgm,
+                                         ThrottleDirection direction)
+{
+#ifdef CONFIG_ATOMIC64
+    ThrottleState *ts = tgm->throttle_state;
+    ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
+    double bytes = UINT32_MAX;
+    double units = (double)UINT32_MAX / (1 << THROTTLE_CREDIT_OPS_SHIFT);
+    uint64_t credit_bytes, credit_ops;
+
+    if (tg->nr_pending_reqs[direction] || tg->any_timer_armed[direction]) {
+        return;
+    }
+
+    throttle_group_return_credit(tgm, direction);
+    throttle_headroom(ts, direction, qemu_clock_get_ns(tg->clock_type),
+                      THROTTLE_CREDIT_PERIOD_NS, &bytes, &units);
+
+    /* Leave something for the other members */
+    credit_bytes = bytes / tg->nr_members;
+    credit_ops = units * (1 << THROTTLE_CREDIT_OPS_SHIFT) / tg->nr_members;
+    if (!credit_bytes || !credit_ops) {
+        return;
+    }
+
+    throttle_account_units(ts, direction, credit_bytes,
+                           (double)credit_ops /
+                           (1 << THROTTLE_CREDIT_OPS_SHIFT));
+    qatomic_set__nocheck(&tgm->credit[direction],
+                         THROTTLE_CREDIT(credit_bytes, credit_ops));
+#endif
+}
+
+/*
+ * Update the throttle configuration of a group.  The credit of the members
+ * is dropped because throttle_config() resets the buckets.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @tg:  the ThrottleGroup
+ * @cfg: the configuration to set
+ */
+static void throttle_group_do_config(ThrottleGroup *tg, ThrottleConfig *cfg)
+{
+    throttle_group_reclaim_credit(tg);
+    throttle_config(&tg->ts, tg->clock_type, cfg);
+    qatomic_set_u64(&tg->op_size, cfg->op_size);
+}
+
 /* Check if the next I/O request for a ThrottleGroupMember needs to be
  * throttled or not. If there's no timer set in this group, set one and update
  * the token accordingly.
@@ -270,7 +479,7 @@ static bool throttle_group_schedule_timer(ThrottleGroupMember *tgm,
     ThrottleState *ts = tgm->throttle_state;
     ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
     ThrottleTimers *tt = &tgm->throttle_timers;
-    bool must_wait;
+    bool timer_was_pending, must_wait;
 
     if (qatomic_read(&tgm->io_limits_disabled)) {
         return false;
@@ -281,12 +490,21 @@ static bool throttle_group_schedule_timer(ThrottleGroupMember *tgm,
         return true;
     }
 
+    timer_was_pending = timer_pending(tt->timers[direction]);
     must_wait = throttle_schedule_timer(ts, tt, direction);
 
+    /* Before throttling anything, take back what the members borrowed */
+    if (must_wait && throttle_group_reclaim_credit(tg)) {
+        if (!timer_was_pending) {
+            timer_del(tt->timers[direction]);
+        }
+        must_wait = throttle_schedule_timer(ts, tt, direction);
+    }
+
     /* If a timer just got armed, set tgm as the current token */
     if (must_wait) {
         tg->tokens[direction] = tgm;
-        tg->any_timer_armed[direction] = true;
+        qatomic_set(&tg->any_timer_armed[direction], true);
     }
 
     return must_wait;
@@ -344,7 +562,7 @@ static void coroutine_mixed_fn schedule_next_request(ThrottleGroupMember *tgm,
             ThrottleTimers *tt = &token->throttle_timers;
             int64_t now = qemu_clock_get_ns(tg->clock_type);
             timer_mod(tt->timers[direction], now);
-            tg->any_timer_armed[direction] = true;
+            qatomic_set(&tg->any_timer_armed[direction], true);
         }
         tg->tokens[direction] = token;
     }
@@ -354,6 +572,9 @@ static void coroutine_mixed_fn schedule_next_request(ThrottleGroupMember *tgm,
  * if necessary, and schedule the next request using a round robin
  * algorithm.
  *
+ * Requests that can be accounted with the member's credit skip all of
+ * this and do not take tg->lock.
+ *
  * @tgm:       the current ThrottleGroupMember
  * @bytes:     the number of bytes for this I/O
  * @direction: the ThrottleDirection
@@ -369,6 +590,10 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
     assert(bytes >= 0);
     assert(direction < THROTTLE_MAX);
 
+    if (throttle_group_consume_credit(tgm, bytes, direction)) {
+        return;
+    }
+
     qemu_mutex_lock(&tg->lock);
 
     /* First we check if this I/O has to be throttled. */
@@ -378,6 +603,7 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
     /* Wait if there's a timer set or queued requests of this type */
     if (must_wait || tgm->pending_reqs[direction]) {
         tgm->pending_reqs[direction]++;
+        qatomic_inc(&tg->nr_pending_reqs[direction]);
         qemu_mutex_unlock(&tg->lock);
         qemu_co_mutex_lock(&tgm->throttled_reqs_lock);
         qemu_co_queue_wait(&tgm->throttled_reqs[direction],
@@ -385,6 +611,7 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
         qemu_co_mutex_unlock(&tgm->throttled_reqs_lock);
         qemu_mutex_lock(&tg->lock);
         tgm->pending_reqs[direction]--;
+        qatomic_dec(&tg->nr_pending_reqs[direction]);
     }
 
     /* The I/O will be executed, so do the accounting */
@@ -393,6 +620,9 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
     /* Schedule the next request */
     schedule_next_request(tgm, direction);
 
+    /* Get credit for the next requests if nothing is throttled */
+    throttle_group_borrow_credit(tgm, direction);
+
     qemu_mutex_unlock(&tg->lock);
 }
 
@@ -477,7 +707,7 @@ void throttle_group_config(ThrottleGroupMember *tgm, ThrottleConfig *cfg)
     ThrottleState *ts = tgm->throttle_state;
     ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
     qemu_mutex_lock(&tg->lock);
-    throttle_config(ts, tg->clock_type, cfg);
+    throttle_group_do_config(tg, cfg);
     qemu_mutex_unlock(&tg->lock);
 
     throttle_group_restart_tgm(tgm);
@@ -512,7 +742,7 @@ static void timer_cb(ThrottleGroupMember *tgm, ThrottleDirection direction)
 
     /* The timer has just been fired, so we can update the flag */
     qemu_mutex_lock(&tg->lock);
-    tg->any_timer_armed[direction] = false;
+    qatomic_set(&tg->any_timer_armed[direction], false);
     qemu_mutex_unlock(&tg->lock);
 
     /* Run the request that was waiting for this timer */
@@ -559,9 +789,11 @@ void throttle_group_register_tgm(ThrottleGroupMember *tgm,
             tg->tokens[dir] = tgm;
         }
         qemu_co_queue_init(&tgm->throttled_reqs[dir]);
+        tgm->credit[dir] = 0;
     }
 
     QLIST_INSERT_HEAD(&tg->head, tgm, round_robin);
+    tg->nr_members++;
 
     throttle_timers_init(&tgm->throttle_timers,
                          tgm->aio_context,
@@ -602,6 +834,7 @@ void throttle_group_unregister_tgm(ThrottleGroupMember *tgm)
             assert(tgm->pending_reqs[dir] == 0);
             assert(qemu_co_queue_empty(&tgm->throttled_reqs[dir]));
             assert(!timer_pending(tgm->throttle_timers.timers[dir]));
+            throttle_group_return_credit(tgm, dir);
             if (tg->tokens[dir] == tgm) {
                 token = throttle_group_next_tgm(tgm);
                 /* Take care of the case where this is the last tgm in the group */
@@ -614,6 +847,7 @@ void throttle_group_unregister_tgm(ThrottleGroupMember *tgm)
 
         /* remove the current tgm from the list */
         QLIST_REMOVE(tgm, round_robin);
+        tg->nr_members--;
         throttle_timers_destroy(&tgm->throttle_timers);
     }
 
@@ -645,7 +879,7 @@ void throttle_group_detach_aio_context(ThrottleGroupMember *tgm)
     WITH_QEMU_LOCK_GUARD(&tg->lock) {
         for (dir = THROTTLE_READ; dir < THROTTLE_MAX; dir++) {
             if (timer_pending(tt->timers[dir])) {
-                tg->any_timer_armed[dir] = false;
+                qatomic_set(&tg->any_timer_armed[dir], false);
                 schedule_next_request(tgm, dir);
             }
         }
@@ -791,7 +1025,9 @@ static void throttle_group_obj_complete(UserCreatable *obj, Error **errp)
     if (!throttle_is_valid(&cfg, errp)) {
         return;
     }
-    throttle_config(&tg->ts, tg->clock_type, &cfg);
+    WITH_QEMU_LOCK_GUARD(&tg->lock) {
+        throttle_group_do_config(tg, &cfg);
+    }
     QTAILQ_INSERT_TAIL(&throttle_groups, tg, list);
     tg->is_initialized = true;
 }
@@ -902,7 +1138,7 @@ static void throttle_group_set_limits(Object *obj, Visitor *v,
     if (local_err) {
         goto unlock;
     }
-    throttle_config(&tg->ts, tg->clock_type, &cfg);
+    throttle_group_do_config(tg, &cfg);
 
 unlock:
     qemu_mutex_unlock(&tg->lock);
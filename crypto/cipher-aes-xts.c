@@ -0,0 +1,264 @@
+/*
+ * QEMU Crypto AES-XTS cipher support using host AES instructions
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qapi/error.h"
+#include "crypto/aes.h"
+#include "crypto/aes-round.h"
+#include "crypto/cipher.h"
+#include "cipherpriv.h"
+
+/*
+ * Number of blocks that go through the AES rounds together.  The round
+ * instructions have a latency of several cycles but can start one or two
+ * per cycle, so independent blocks are interleaved to keep them busy.
+ */
+#define AES_XTS_LANES 8
+
+typedef struct QCryptoCipherAESXTS QCryptoCipherAESXTS;
+struct QCryptoCipherAESXTS {
+    QCryptoCipher base;
+    int rounds;
+    /* Data key, for encryption and for the equivalent inverse cipher */
+    AESState enc_key[AES_MAXNR + 1];
+    AESState dec_key[AES_MAXNR + 1];
+    /* Tweak key, only ever used for encryption */
+    AESState tweak_key[AES_MAXNR + 1];
+    AESState iv;
+};
+
+static void qcrypto_aes_xts_load_key(AESState *rk, const AES_KEY *key)
+{
+    int i;
+
+    /* The round key words are in host order, with the first byte on top */
+    for (i = 0; i <= key->rounds; i++) {
+        stl_be_p(&rk[i].b[0], key->rd_key[i * 4]);
+        stl_be_p(&rk[i].b[4], key->rd_key[i * 4 + 1]);
+        stl_be_p(&rk[i].b[8], key->rd_key[i * 4 + 2]);
+        stl_be_p(&rk[i].b[12], key->rd_key[i * 4 + 3]);
+    }
+}
+
+/*
+ * The round functions are called directly rather than through the wrappers
+ * in crypto/aes-round.h, so that they are inlined here and the CPU feature
+ * is checked once per batch.  Contexts are only created if HAVE_AES_ACCEL.
+ */
+static inline void ATTR_AES_ACCEL
+qcrypto_aes_xts_encrypt_blocks(const AESState *rk, int rounds,
+                               AESState *st, int n)
+{
+    int i, r;
+
+    if (!HAVE_AES_ACCEL) {
+        g_assert_not_reached();
+    } else {
+        for (i = 0; i < n; i++) {
+            st[i].v ^= rk[0].v;
+        }
+        for (r = 1; r < rounds; r++) {
+            for (i = 0; i < n; i++) {
+                aesenc_SB_SR_MC_AK_accel(&st[i], &st[i], &rk[r], false);
+            }
+        }
+        for (i = 0; i < n; i++) {
+            aesenc_SB_SR_AK_accel(&st[i], &st[i], &rk[rounds], false);
+        }
+    }
+}
+
+static inline void ATTR_AES_ACCEL
+qcrypto_aes_xts_decrypt_blocks(const AESState *rk, int rounds,
+                               AESState *st, int n)
+{
+    int i, r;
+
+    if (!HAVE_AES_ACCEL) {
+        g_assert_not_reached();
+    } else {
+        for (i = 0; i < n; i++) {
+            st[i].v ^= rk[0].v;
+        }
+        for (r = 1; r < rounds; r++) {
+            for (i = 0; i < n; i++) {
+                aesdec_ISB_ISR_IMC_AK_accel(&st[i], &st[i], &rk[r], false);
+            }
+        }
+        for (i = 0; i < n; i++) {
+            aesdec_ISB_ISR_AK_accel(&st[i], &st[i], &rk[rounds], false);
+        }
+    }
+}
+
+/* Multiply the tweak by x in GF(2^128), see IEEE P1619 */
+static inline void qcrypto_aes_xts_mult_x(AESState *t)
+{
+    uint64_t lo = le64_to_cpu(t->d[0]);
+    uint64_t hi = le64_to_cpu(t->d[1]);
+
+    t->d[0] = cpu_to_le64((lo << 1) ^ ((hi >> 63) * 0x87));
+    t->d[1] = cpu_to_le64((hi << 1) | (lo >> 63));
+}
+
+static void ATTR_AES_ACCEL
+qcrypto_aes_xts_crypt(QCryptoCipherAESXTS *ctx, const uint8_t *in,
+                      uint8_t *out, size_t len, bool encrypt)
+{
+    AESState tweak = ctx->iv;
+    AESState tweaks[AES_XTS_LANES];
+    AESState st[AES_XTS_LANES];
+    int i, n;
+
+    qcrypto_aes_xts_encrypt_blocks(ctx->tweak_key, ctx->rounds, &tweak, 1);
+
+    while (len) {
+        n = MIN(len / AES_BLOCK_SIZE, AES_XTS_LANES);
+
+        /* Compute the next tweaks while loading the blocks */
+        for (i = 0; i < n; i++) {
+            memcpy(&st[i], in + i * AES_BLOCK_SIZE, AES_BLOCK_SIZE);
+            tweaks[i] = tweak;
+            st[i].v ^= tweak.v;
+            qcrypto_aes_xts_mult_x(&tweak);
+        }
+
+        if (encrypt) {
+            if (n == AES_XTS_LANES) {
+                qcrypto_aes_xts_encrypt_blocks(ctx->enc_key, ctx->rounds,
+                                               st, AES_XTS_LANES);
+            } else {
+                qcrypto_aes_xts_encrypt_blocks(ctx->enc_key, ctx->rounds,
+                                               st, n);
+            }
+        } else {
+            if (n == AES_XTS_LANES) {
+                qcrypto_aes_xts_decrypt_blocks(ctx->dec_key, ctx->rounds,
+                                               st, AES_XTS_LANES);
+            } else {
+                qcrypto_aes_xts_decrypt_blocks(ctx->dec_key, ctx->rounds,
+                                               st, n);
+            }
+        }
+
+        for (i = 0; i < n; i++) {
+            st[i].v ^= tweaks[i].v;
+            memcpy(out + i * AES_BLOCK_SIZE, &st[i], AES_BLOCK_SIZE);
+        }
+
+        in += n * AES_BLOCK_SIZE;
+        out += n * AES_BLOCK_SIZE;
+        len -= n * AES_BLOCK_SIZE;
+    }
+}
+
+static int qcrypto_aes_xts_check_len(size_t len, Error **errp)
+{
+    if (len & (AES_BLOCK_SIZE - 1)) {
+        error_setg(errp, "Length %zu must be a multiple of block size %d",
+                   len, AES_BLOCK_SIZE);
+        return -1;
+    }
+    return 0;
+}
+
+static int qcrypto_aes_xts_encrypt(QCryptoCipher *cipher, const void *in,
+                                   void *out, size_t len, Error **errp)
+{
+    QCryptoCipherAESXTS *ctx = container_of(cipher, QCryptoCipherAESXTS,
+                                            base);
+
+    if (qcrypto_aes_xts_check_len(len, errp) < 0) {
+        return -1;
+    }
+    qcrypto_aes_xts_crypt(ctx, in, out, len, true);
+    return 0;
+}
+
+static int qcrypto_aes_xts_decrypt(QCryptoCipher *cipher, const void *in,
+                                   void *out, size_t len, Error **errp)
+{
+    QCryptoCipherAESXTS *ctx = container_of(cipher, QCryptoCipherAESXTS,
+                                            base);
+
+    if (qcrypto_aes_xts_check_len(len, errp) < 0) {
+        return -1;
+    }
+    qcrypto_aes_xts_crypt(ctx, in, out, len, false);
+    return 0;
+}
+
+static int qcrypto_aes_xts_setiv(QCryptoCipher *cipher, const uint8_t *iv,
+                                 size_t niv, Error **errp)
+{
+    QCryptoCipherAESXTS *ctx = container_of(cipher, QCryptoCipherAESXTS,
+                                            base);
+
+    if (niv != AES_BLOCK_SIZE) {
+        error_setg(errp, "Expected IV size %d not %zu", AES_BLOCK_SIZE, niv);
+        return -1;
+    }
+    memcpy(&ctx->iv, iv, AES_BLOCK_SIZE);
+    return 0;
+}
+
+static void qcrypto_aes_xts_free(QCryptoCipher *cipher)
+{
+    g_free(container_of(cipher, QCryptoCipherAESXTS, base));
+}
+
+static const struct QCryptoCipherDriver qcrypto_aes_xts_driver = {
+    .cipher_encrypt = qcrypto_aes_xts_encrypt,
+    .cipher_decrypt = qcrypto_aes_xts_decrypt,
+    .cipher_setiv = qcrypto_aes_xts_setiv,
+    .cipher_free = qcrypto_aes_xts_free,
+};
+
+QCryptoCipher *qcrypto_aes_xts_cipher_ctx_new(QCryptoCipherAlgo alg,
+                                              QCryptoCipherMode mode,
+                                              const uint8_t *key, size_t nkey)
+{
+    QCryptoCipherAESXTS *ctx;
+    AES_KEY enc, dec, tweak;
+    size_t key_len;
+
+    /* Without AES instructions, the crypto library is faster */
+    if (!HAVE_AES_ACCEL || mode != QCRYPTO_CIPHER_MODE_XTS) {
+        return NULL;
+    }
+
+    switch (alg) {
+    case QCRYPTO_CIPHER_ALGO_AES_128:
+    case QCRYPTO_CIPHER_ALGO_AES_192:
+    case QCRYPTO_CIPHER_ALGO_AES_256:
+        break;
+    default:
+        return NULL;
+    }
+
+    /* Let the library report invalid keys */
+    key_len = qcrypto_cipher_get_key_len(alg);
+    if (nkey != key_len * 2) {
+        return NULL;
+    }
+
+    if (AES_set_encrypt_key(key, key_len * 8, &enc) != 0 ||
+        AES_set_decrypt_key(key, key_len * 8, &dec) != 0 ||
+        AES_set_encrypt_key(key + key_len, key_len * 8, &tweak) != 0) {
+        return NULL;
+    }
+
+    ctx = g_new0(QCryptoCipherAESXTS, 1);
+    ctx->rounds = enc.rounds;
+    qcrypto_aes_xts_load_key(ctx->enc_key, &enc);
+    qcrypto_aes_xts_load_key(ctx->dec_key, &dec);
+    qcrypto_aes_xts_load_key(ctx->tweak_key, &tweak);
+
+    ctx->base.driver = &qcrypto_aes_xts_driver;
+    return &ctx->base;
+}
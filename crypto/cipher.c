@@ -159,6 +159,10 @@ QCryptoCipher *qcrypto_cipher_new(QCryptoCipherAlgo alg,
     cipher = qcrypto_afalg_cipher_ctx_new(alg, mode, key, nkey, NULL);
 #endif
 
+    if (!cipher && qcrypto_cipher_supports(alg, mode)) {
+        cipher = qcrypto_aes_xts_cipher_ctx_new(alg, mode, key, nkey);
+    }
+
     if (!cipher) {
         cipher = qcrypto_cipher_ctx_new(alg, mode, key, nkey, errp);
         if (!cipher) {
@@ -37,6 +37,15 @@ struct QCryptoCipherDriver {
     void (*cipher_free)(QCryptoCipher *cipher);
 };
 
+/*
+ * Returns an AES-XTS context that uses the host's AES instructions, or NULL
+ * if @alg and @mode are not AES-XTS, the host has no AES instructions, or
+ * the key is invalid.
+ */
+QCryptoCipher *qcrypto_aes_xts_cipher_ctx_new(QCryptoCipherAlgo alg,
+                                              QCryptoCipherMode mode,
+                                              const uint8_t *key, size_t nkey);
+
 #ifdef CONFIG_AF_ALG
 
 #include "afalgpriv.h"
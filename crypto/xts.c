@@ -99,6 +99,65 @@ static inline void xts_tweak_encdec(const void *ctx,
 }
 
 
+/*
+ * Number of blocks that xts_tweak_encdec_blocks() passes to the cipher
+ * function at once, i.e. one 512 byte sector.
+ *
+ * Note that this file is only built for nettle versions without their own
+ * XTS implementation (nettle < 3.5), and that AES-XTS doesn't come here at
+ * all on hosts with AES instructions, see crypto/cipher-aes-xts.c.
+ */
+#define XTS_BATCH_BLOCKS 32
+
+/**
+ * xts_tweak_encdec_blocks:
+ * @param ctxt: the cipher context
+ * @param func: the cipher function
+ * @src: buffer providing the input text of @nblocks * XTS_BLOCK_SIZE bytes
+ * @dst: buffer to output the output text of @nblocks * XTS_BLOCK_SIZE bytes
+ * @nblocks: number of blocks to process
+ * @iv: the initialization vector tweak of XTS_BLOCK_SIZE bytes
+ *
+ * Encrypt/decrypt multiple blocks with consecutive tweaks.  The tweaks for a
+ * whole batch are computed up front, so that the cipher function is called
+ * only once per batch and can process several blocks in parallel, which
+ * accelerated implementations (e.g. using AES-NI) are much faster at than
+ * processing one block at a time.
+ */
+static void xts_tweak_encdec_blocks(const void *ctx,
+                                    xts_cipher_func *func,
+                                    const uint8_t *src,
+                                    uint8_t *dst,
+                                    unsigned long nblocks,
+                                    xts_uint128 *iv)
+{
+    xts_uint128 tweak[XTS_BATCH_BLOCKS];
+    xts_uint128 buf[XTS_BATCH_BLOCKS];
+
+    while (nblocks > 0) {
+        unsigned long i, n = MIN(nblocks, XTS_BATCH_BLOCKS);
+
+        memcpy(buf, src, n * XTS_BLOCK_SIZE);
+        for (i = 0; i < n; i++) {
+            tweak[i] = *iv;
+            xts_uint128_xor(&buf[i], &buf[i], iv);
+            xts_mult_x(iv);
+        }
+
+        func(ctx, n * XTS_BLOCK_SIZE, buf[0].b, buf[0].b);
+
+        for (i = 0; i < n; i++) {
+            xts_uint128_xor(&buf[i], &buf[i], &tweak[i]);
+        }
+        memcpy(dst, buf, n * XTS_BLOCK_SIZE);
+
+        src += n * XTS_BLOCK_SIZE;
+        dst += n * XTS_BLOCK_SIZE;
+        nblocks -= n;
+    }
+}
+
+
 void xts_decrypt(const void *datactx,
                  const void *tweakctx,
                  xts_cipher_func *encfunc,
@@ -127,24 +186,9 @@ void xts_decrypt(const void *datactx,
     /* encrypt the iv */
     encfunc(tweakctx, XTS_BLOCK_SIZE, T.b, iv);
 
-    if (QEMU_PTR_IS_ALIGNED(src, sizeof(uint64_t)) &&
-        QEMU_PTR_IS_ALIGNED(dst, sizeof(uint64_t))) {
-        xts_uint128 *S = (xts_uint128 *)src;
-        xts_uint128 *D = (xts_uint128 *)dst;
-        for (i = 0; i < lim; i++, S++, D++) {
-            xts_tweak_encdec(datactx, decfunc, S, D, &T);
-        }
-    } else {
-        xts_uint128 D;
-
-        for (i = 0; i < lim; i++) {
-            memcpy(&D, src, XTS_BLOCK_SIZE);
-            xts_tweak_encdec(datactx, decfunc, &D, &D, &T);
-            memcpy(dst, &D, XTS_BLOCK_SIZE);
-            src += XTS_BLOCK_SIZE;
-            dst += XTS_BLOCK_SIZE;
-        }
-    }
+    xts_tweak_encdec_blocks(datactx, decfunc, src, dst, lim, &T);
+    src += lim * XTS_BLOCK_SIZE;
+    dst += lim * XTS_BLOCK_SIZE;
 
     /* if length is not a multiple of XTS_BLOCK_SIZE then */
     if (mo > 0) {
@@ -203,25 +247,9 @@ void xts_encrypt(const void *datactx,
     /* encrypt the iv */
     encfunc(tweakctx, XTS_BLOCK_SIZE, T.b, iv);
 
-    if (QEMU_PTR_IS_ALIGNED(src, sizeof(uint64_t)) &&
-        QEMU_PTR_IS_ALIGNED(dst, sizeof(uint64_t))) {
-        xts_uint128 *S = (xts_uint128 *)src;
-        xts_uint128 *D = (xts_uint128 *)dst;
-        for (i = 0; i < lim; i++, S++, D++) {
-            xts_tweak_encdec(datactx, encfunc, S, D, &T);
-        }
-    } else {
-        xts_uint128 D;
-
-        for (i = 0; i < lim; i++) {
-            memcpy(&D, src, XTS_BLOCK_SIZE);
-            xts_tweak_encdec(datactx, encfunc, &D, &D, &T);
-            memcpy(dst, &D, XTS_BLOCK_SIZE);
-
-            dst += XTS_BLOCK_SIZE;
-            src += XTS_BLOCK_SIZE;
-        }
-    }
+    xts_tweak_encdec_blocks(datactx, encfunc, src, dst, lim, &T);
+    src += lim * XTS_BLOCK_SIZE;
+    dst += lim * XTS_BLOCK_SIZE;
 
     /* if length is not a multiple of XTS_BLOCK_SIZE then */
     if (mo > 0) {
@@ -14,6 +14,7 @@
 #include "qemu/osdep.h"
 #include "qom/object_interfaces.h"
 #include "qapi/error.h"
+#include "qapi/qapi-builtin-visit.h"
 #include "block/thread-pool.h"
 #include "system/event-loop-base.h"
 
@@ -29,6 +30,13 @@ static void event_loop_base_instance_init(Object *obj)
     base->thread_pool_max = THREAD_POOL_MAX_THREADS_DEFAULT;
 }
 
+static void event_loop_base_instance_finalize(Object *obj)
+{
+    EventLoopBase *base = EVENT_LOOP_BASE(obj);
+
+    qapi_free_uint16List(base->thread_pool_cpus);
+}
+
 static EventLoopBaseParamInfo aio_max_batch_info = {
     "aio-max-batch", offsetof(EventLoopBase, aio_max_batch),
 };
@@ -77,6 +85,33 @@ static void event_loop_base_set_param(Object *obj, Visitor *v,
     return;
 }
 
+static void event_loop_base_get_cpus(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    EventLoopBase *base = EVENT_LOOP_BASE(obj);
+
+    visit_type_uint16List(v, name, &base->thread_pool_cpus, errp);
+}
+
+static void event_loop_base_set_cpus(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    EventLoopBaseClass *bc = EVENT_LOOP_BASE_GET_CLASS(obj);
+    EventLoopBase *base = EVENT_LOOP_BASE(obj);
+    uint16List *cpus = NULL;
+
+    if (!visit_type_uint16List(v, name, &cpus, errp)) {
+        return;
+    }
+
+    qapi_free_uint16List(base->thread_pool_cpus);
+    base->thread_pool_cpus = cpus;
+
+    if (bc->update_params) {
+        bc->update_params(base, errp);
+    }
+}
+
 static void event_loop_base_complete(UserCreatable *uc, Error **errp)
 {
     EventLoopBaseClass *bc = EVENT_LOOP_BASE_GET_CLASS(uc);
@@ -117,6 +152,10 @@ static void event_loop_base_class_init(ObjectClass *klass, void *class_data)
                               event_loop_base_get_param,
                               event_loop_base_set_param,
                               NULL, &thread_pool_max_info);
+    object_class_property_add(klass, "thread-pool-cpus", "int",
+                              event_loop_base_get_cpus,
+                              event_loop_base_set_cpus,
+                              NULL, NULL);
 }
 
 static const TypeInfo event_loop_base_info = {
@@ -124,6 +163,7 @@ static const TypeInfo event_loop_base_info = {
     .parent = TYPE_OBJECT,
     .instance_size = sizeof(EventLoopBase),
     .instance_init = event_loop_base_instance_init,
+    .instance_finalize = event_loop_base_instance_finalize,
     .class_size = sizeof(EventLoopBaseClass),
     .class_init = event_loop_base_class_init,
     .abstract = true,
@@ -296,6 +296,34 @@ SRST
     being coalesced.
 ERST
 
+    {
+        .name       = "rcu",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show RCU grace period and callback statistics",
+        .cmd        = hmp_info_rcu,
+    },
+
+SRST
+  ``info rcu``
+    Show the number and latency of RCU grace periods, and the number of
+    RCU callbacks that were run.
+ERST
+
+    {
+        .name       = "coroutines",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show coroutine creation and pool statistics",
+        .cmd        = hmp_info_coroutines,
+    },
+
+SRST
+  ``info coroutines``
+    Show how many coroutines were created and reused from the coroutine
+    pool, and the size of the global coroutine pool.
+ERST
+
     {
         .name       = "kvm",
         .args_type  = "",
@@ -627,16 +627,23 @@ ERST
     {
         .name       = "sync-profile",
         .args_type  = "op:s?",
-        .params     = "[on|off|reset]",
-        .help       = "enable, disable or reset synchronization profiling. "
-                      "With no arguments, prints whether profiling is on or off.",
+        .params     = "[on|sample|off|reset]",
+        .help       = "enable, enable in sampling mode, disable or reset "
+                      "synchronization profiling. With no arguments, prints "
+                      "whether profiling is on or off.",
         .cmd        = hmp_sync_profile,
     },
 
 SRST
-``sync-profile [on|off|reset]``
+``sync-profile [on|sample|off|reset]``
   Enable, disable or reset synchronization profiling. With no arguments, prints
   whether profiling is on or off.
+
+  ``sample`` enables profiling in sampling mode, which is cheap enough to
+  leave enabled on production hosts: only one lock acquisition out of 1000
+  in each thread, plus all acquisitions that waited for at least 100
+  microseconds, are recorded.  Counts and wait times in ``info sync-profile``
+  are then estimates.
 ERST
 
     {
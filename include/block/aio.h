@@ -21,10 +21,12 @@
 #include "qemu/queue.h"
 #include "qemu/event_notifier.h"
 #include "qemu/lockcnt.h"
+#include "qemu/stats64.h"
 #include "qemu/thread.h"
 #include "qemu/timer.h"
 #include "block/graph-lock.h"
 #include "hw/qdev-core.h"
+#include "qapi/qapi-builtin-types.h"
 
 
 typedef struct BlockAIOCB BlockAIOCB;
@@ -61,6 +63,23 @@ typedef struct LuringState LuringState;
 /* Is polling disabled? */
 bool aio_poll_disabled(AioContext *ctx);
 
+#ifdef CONFIG_LINUX_IO_URING
+typedef struct CqeHandler CqeHandler;
+typedef void CqeHandlerCb(CqeHandler *cqe_handler);
+
+/* Completion of a request submitted with aio_add_sqe() */
+struct CqeHandler {
+    /* Called by the caller of aio_add_sqe() */
+    CqeHandlerCb *cb;
+
+    /* Filled in by the event loop when the request completes */
+    struct io_uring_cqe cqe;
+
+    /* Used internally, do not access this */
+    QSIMPLEQ_ENTRY(CqeHandler) next;
+};
+#endif /* CONFIG_LINUX_IO_URING */
+
 /* Callbacks for file descriptor monitoring implementations */
 typedef struct {
     /*
@@ -106,6 +125,19 @@ typedef struct {
      * Returns: true if ->wait() should be called, false otherwise.
      */
     bool (*need_wait)(AioContext *ctx);
+
+    /*
+     * dispatch:
+     * @ctx: the AioContext
+     *
+     * Invoke callbacks for requests other than file descriptor monitoring
+     * that completed during ->wait().  Optional.
+     *
+     * Called with ctx->list_lock incremented but not locked.
+     *
+     * Returns: true if a callback was invoked, false otherwise.
+     */
+    bool (*dispatch)(AioContext *ctx);
 } FDMonOps;
 
 /*
@@ -121,6 +153,15 @@ struct BHListSlice {
     QSIMPLEQ_ENTRY(BHListSlice) next;
 };
 
+/*
+ * Scheduled bottom halves are normally queued on a bounded lock-free ring
+ * that aio_bh_poll() drains in batches.  One-shot bottom halves are stored
+ * in the ring directly, without allocating a QEMUBH.  The BH list above is
+ * used for idle bottom halves and when the ring is full.
+ */
+#define BH_RING_SIZE 256
+typedef struct BHRing BHRing;
+
 typedef QSLIST_HEAD(, AioHandler) AioHandlerSList;
 
 struct AioContext {
@@ -179,6 +220,7 @@ struct AioContext {
     QemuLockCnt list_lock;
 
     /* Bottom Halves pending aio_bh_poll() processing */
+    BHRing *bh_ring;
     BHList bh_list;
 
     /* Chained BH list slices for each nested aio_bh_poll() call */
@@ -197,6 +239,18 @@ struct AioContext {
      * in the docs/aio_notify_accept.promela formal model.
      */
     bool notified;
+
+    /*
+     * Used by aio_notify to write the EventNotifier at most once per
+     * wakeup.  It is set by the thread that writes the EventNotifier, and
+     * cleared in the AioContext home thread right after the EventNotifier
+     * is read.  A set flag means that a wakeup is already on its way and
+     * the write can be skipped; notifications that raced with the read are
+     * caught by checking ctx->notified after clearing the flag.  With many
+     * threads handing work to a sleeping AioContext, only the first one pays
+     * for the system call.
+     */
+    bool notifier_kicked;
     EventNotifier notifier;
 
     QSLIST_HEAD(, Coroutine) scheduled_coroutines;
@@ -204,6 +258,9 @@ struct AioContext {
 
     int thread_pool_min;
     int thread_pool_max;
+    /* CPUs the thread pool workers run on, NULL if not restricted */
+    unsigned long *thread_pool_cpus;
+    unsigned long thread_pool_nr_cpus;
     /* Thread pool for performing work and receiving completion callbacks.
      * Has its own locking.
      */
@@ -218,6 +275,9 @@ struct AioContext {
     /* State for file descriptor monitoring using Linux io_uring */
     struct io_uring fdmon_io_uring;
     AioHandlerSList submit_list;
+    QSIMPLEQ_HEAD(, CqeHandler) cqe_handler_ready_list;
+    unsigned fdmon_io_uring_inflight; /* aio_add_sqe() requests in flight */
+    bool fdmon_io_uring_multishot; /* does the kernel support multishot poll? */
 #endif
 
     /* TimerLists for calling timers - one per clock type.  Has its own
@@ -234,6 +294,12 @@ struct AioContext {
     int64_t poll_grow;      /* polling time growth factor */
     int64_t poll_shrink;    /* polling time shrink factor */
 
+    /* Polling statistics, see aio_context_get_poll_stats() */
+    Stat64 poll_attempts;
+    Stat64 poll_successes;
+    Stat64 poll_time_ns;
+    Stat64 poll_wasted_ns;
+
     /* AIO engine parameters */
     int64_t aio_max_batch;  /* maximum number of requests in a batch */
 
@@ -343,6 +409,11 @@ QEMUBH *aio_bh_new_full(AioContext *ctx, QEMUBHFunc *cb, void *opaque,
  *
  * Calling aio_notify is rarely necessary, because for example scheduling
  * a bottom half calls it already.
+ *
+ * aio_notify is cheap if the AioContext is not sleeping: while it runs
+ * handlers or busy-polls, the notification is only published in memory and
+ * picked up by the next iteration.  The EventNotifier is written only if
+ * the AioContext may be blocked, and only once until it wakes up.
  */
 void aio_notify(AioContext *ctx);
 
@@ -514,6 +585,37 @@ LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp);
 
 /* Return the LuringState bound to this AioContext */
 LuringState *aio_get_linux_io_uring(AioContext *ctx);
+
+#ifdef CONFIG_LINUX_IO_URING
+/**
+ * aio_has_io_uring:
+ * @ctx: the AioContext
+ *
+ * Returns: true if @ctx monitors file descriptors with io_uring, so that
+ * aio_add_sqe() can be used in @ctx.
+ */
+bool aio_has_io_uring(AioContext *ctx);
+
+/**
+ * aio_add_sqe:
+ * @prep_sqe: function to fill in the sqe
+ * @opaque: data passed to @prep_sqe
+ * @cqe_handler: completion handler, must stay valid until @cqe_handler->cb
+ *               has been called
+ *
+ * Submit an io_uring request in the current AioContext, which must use
+ * io_uring (see aio_has_io_uring()).  @prep_sqe must not change the
+ * user_data field.  The request is submitted by the event loop together with
+ * other requests, normally when aio_poll() next waits for events.
+ *
+ * @cqe_handler->cb is invoked from aio_poll() in the current AioContext after
+ * the request has completed.  If the AioContext stops using io_uring, for
+ * example because aio_get_g_source() is called, in-flight requests are
+ * waited for and their @cqe_handler->cb is invoked before that returns.
+ */
+void aio_add_sqe(void (*prep_sqe)(struct io_uring_sqe *sqe, void *opaque),
+                 void *opaque, CqeHandler *cqe_handler);
+#endif /* CONFIG_LINUX_IO_URING */
 /**
  * aio_timer_new_with_attrs:
  * @ctx: the aio context
@@ -705,6 +807,22 @@ void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
                                  int64_t grow, int64_t shrink,
                                  Error **errp);
 
+typedef struct AioPollStats {
+    uint64_t attempts;      /* busy polling rounds */
+    uint64_t successes;     /* ... that found an event */
+    uint64_t time_ns;       /* time spent busy polling */
+    uint64_t wasted_ns;     /* ... in rounds that did not find an event */
+} AioPollStats;
+
+/**
+ * aio_context_get_poll_stats:
+ * @ctx: the aio context
+ * @stats: filled in with the polling statistics of @ctx
+ *
+ * Can be called from any thread.
+ */
+void aio_context_get_poll_stats(AioContext *ctx, AioPollStats *stats);
+
 /**
  * aio_context_set_aio_params:
  * @ctx: the aio context
@@ -721,4 +839,14 @@ void aio_context_set_aio_params(AioContext *ctx, int64_t max_batch);
  */
 void aio_context_set_thread_pool_params(AioContext *ctx, int64_t min,
                                         int64_t max, Error **errp);
+
+/**
+ * aio_context_set_thread_pool_cpus:
+ * @ctx: the aio context
+ * @cpus: host CPUs that the thread pool workers may run on, NULL or an empty
+ *        list means that workers inherit the affinity of the thread that
+ *        creates them
+ */
+void aio_context_set_thread_pool_cpus(AioContext *ctx, const uint16List *cpus,
+                                      Error **errp);
 #endif
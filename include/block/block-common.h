@@ -511,6 +511,13 @@ enum BdrvChildRoleBits {
 /* Mask of BdrvChildRoleBits values */
 typedef unsigned int BdrvChildRole;
 
+#define BDRV_CHECK_MAX_PHASES 8
+
+typedef struct BdrvCheckPhase {
+    const char *name;
+    int64_t duration_ns;
+} BdrvCheckPhase;
+
 typedef struct BdrvCheckResult {
     int corruptions;
     int leaks;
@@ -519,6 +526,10 @@ typedef struct BdrvCheckResult {
     int leaks_fixed;
     int64_t image_end_offset;
     BlockFragInfo bfi;
+
+    /* Wall clock time spent in the phases of the check, if reported */
+    int nb_phases;
+    BdrvCheckPhase phases[BDRV_CHECK_MAX_PHASES];
 } BdrvCheckResult;
 
 typedef enum {
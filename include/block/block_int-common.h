@@ -29,6 +29,7 @@
 #include "block/block-global-state.h"
 #include "block/snapshot.h"
 #include "qemu/clang-tsa.h"
+#include "qemu/interval-tree.h"
 #include "qemu/iov.h"
 #include "qemu/rcu.h"
 #include "qemu/stats64.h"
@@ -1067,6 +1068,29 @@ typedef struct BdrvBlockStatusCache {
     int64_t data_end;
 } BdrvBlockStatusCache;
 
+/*
+ * Caches the results of block-status queries for the whole backing chain
+ * of a node (i.e. with a NULL base), so that deep chains do not need to be
+ * walked layer by layer for every query.
+ *
+ * Only results for ranges that are not allocated in the node itself are
+ * cached; those are the expensive ones.  This also means that the cache does
+ * not depend on the node's own data children, only on its allocation status
+ * and the chain below it.  See bdrv_csc_invalidate_range() for the rules.
+ *
+ * @lock: Protects @tree and writes to @nb_entries
+ * @tree: BdrvChainStatusEntry objects by guest offset, never overlapping
+ * @nb_entries: Number of entries in @tree, can be read with atomics
+ * @gen: Incremented (atomically) on every invalidation, so that results
+ *       which were computed concurrently with an invalidation are not cached
+ */
+typedef struct BdrvChainStatusCache {
+    QemuMutex lock;
+    IntervalTreeRoot tree;
+    unsigned nb_entries;
+    unsigned gen;
+} BdrvChainStatusCache;
+
 struct BlockDriverState {
     /*
      * Protected by big QEMU lock or read-only after opening.  No special
@@ -1253,6 +1277,9 @@ struct BlockDriverState {
     /* Always non-NULL, but must only be dereferenced under an RCU read guard */
     BdrvBlockStatusCache *block_status_cache;
 
+    /* Block-status cache for the whole backing chain */
+    BdrvChainStatusCache chain_status_cache;
+
     /* array of write pointers' location of each zone in the zoned device. */
     BlockZoneWps *wps;
 };
@@ -191,4 +191,48 @@ void bdrv_bsc_invalidate_range(BlockDriverState *bs,
  */
 void bdrv_bsc_fill(BlockDriverState *bs, int64_t offset, int64_t bytes);
 
+/**
+ * Add @duration_ns to the time spent in the check phase @name in @res.
+ * @name must be a string literal (or otherwise outlive @res).  Phases with
+ * the same name are accumulated; phases beyond BDRV_CHECK_MAX_PHASES are
+ * silently dropped.
+ */
+void bdrv_check_add_phase(BdrvCheckResult *res, const char *name,
+                          int64_t duration_ns);
+
+/**
+ * Look up the block status of the backing chain of @bs at @offset in the
+ * chain status cache.
+ *
+ * If there is a cached result that is at least as precise as @want_zero
+ * requests, return it like bdrv_co_common_block_status_above() with a NULL
+ * base would and fill *pnum (limited to @bytes), *map, *file and *depth.
+ * Otherwise, return -ENOENT and store the cache generation in *gen, which
+ * must be passed to bdrv_csc_fill() for the result of the actual query.
+ */
+int bdrv_csc_lookup(BlockDriverState *bs, bool want_zero,
+                    int64_t offset, int64_t bytes, int64_t *pnum,
+                    int64_t *map, BlockDriverState **file, int *depth,
+                    unsigned *gen);
+
+/**
+ * Store the result of a block-status query of the backing chain of @bs for
+ * [offset, offset + bytes), unless the cache was invalidated since @gen was
+ * returned by bdrv_csc_lookup().
+ */
+void bdrv_csc_fill(BlockDriverState *bs, unsigned gen, bool want_zero,
+                   int64_t offset, int64_t bytes, int ret, int64_t map,
+                   BlockDriverState *file, int depth);
+
+/**
+ * Invalidate cached chain block-status results that may be affected by a
+ * change of the allocation status or data of [offset, offset + bytes) in
+ * @bs, in the cache of @bs itself and all of its parents.
+ *
+ * (To be used by I/O paths that write to a node, and whenever the graph
+ * or image metadata change in another way.)
+ */
+void GRAPH_RDLOCK bdrv_csc_invalidate_range(BlockDriverState *bs,
+                                            int64_t offset, int64_t bytes);
+
 #endif /* BLOCK_INT_IO_H */
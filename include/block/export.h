@@ -32,8 +32,23 @@ typedef struct BlockExportDriver {
     /* True if the export type supports running on an inactive node */
     bool supports_inactive;
 
-    /* Creates and starts a new block export */
-    int (*create)(BlockExport *, BlockExportOptions *, Error **);
+    /*
+     * True if the export type can process requests in multiple AioContexts
+     * concurrently, i.e. if it accepts a list of iothreads.
+     */
+    bool supports_multithread;
+
+    /*
+     * Creates and starts a new block export.
+     *
+     * If the user has requested multi-threading, @multithread is an array of
+     * @mt_count AioContexts in which the export should process requests.
+     * Otherwise, @multithread is NULL and @mt_count is 0.  The array is only
+     * valid for the duration of the call.
+     */
+    int (*create)(BlockExport *, BlockExportOptions *,
+                  AioContext *const *multithread, size_t mt_count,
+                  Error **);
 
     /*
      * Frees a removed block export. This function is only called after all
@@ -48,6 +63,12 @@ typedef struct BlockExportDriver {
      * shutting down.
      */
     void (*request_shutdown)(BlockExport *);
+
+    /*
+     * Returns per-thread request statistics for query-block-exports, or NULL
+     * if there are none.  Optional.
+     */
+    BlockExportThreadInfoList *(*query_threads)(BlockExport *);
 } BlockExportDriver;
 
 struct BlockExport {
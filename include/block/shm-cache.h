@@ -0,0 +1,108 @@
+/*
+ * Shared-memory cache of read-only image data
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef BLOCK_SHM_CACHE_H
+#define BLOCK_SHM_CACHE_H
+
+#ifdef CONFIG_POSIX
+
+#include "block/export.h"
+#include "block/graph-lock.h"
+
+/*
+ * The cache file is created by the shm-cache export of qemu-storage-daemon
+ * and mapped by any number of processes using the shm-cache block driver on
+ * top of the same (read-only) image.
+ *
+ * It consists of a header, an index with one entry per data slot, and the
+ * data slots, each holding one cluster of guest data.  Clusters are
+ * identified by their guest offset, so a hit does not need any format
+ * metadata.  Index entries are protected by a sequence counter that is odd
+ * while the slot is being filled; readers copy the data and then check that
+ * the counter hasn't changed, so no locks are shared between processes.
+ *
+ * Only the daemon writes to the file: it fills the cache from the exported
+ * node in the background, and all other processes map it read-only.  The
+ * header identifies the host files that the exported node is stored in, so
+ * that processes can refuse a cache that was created for another image.
+ *
+ * All fields are in host byte order: the file is only ever shared between
+ * processes on the same host.
+ */
+
+#define SHM_CACHE_MAGIC     0x4348534d55454d51ULL   /* "QEMUSHCH" */
+#define SHM_CACHE_VERSION   1
+
+/* Number of index entries in which a cluster may be stored */
+#define SHM_CACHE_PROBE     8
+
+/* Maximum number of host files that an image can be stored in */
+#define SHM_CACHE_MAX_FILES 16
+
+typedef struct ShmCacheFileId {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+} ShmCacheFileId;
+
+/* The host files of an image and its backing chain, sorted by dev and ino */
+typedef struct ShmCacheImageId {
+    uint32_t nb_files;
+    uint32_t reserved;
+    ShmCacheFileId files[SHM_CACHE_MAX_FILES];
+} ShmCacheImageId;
+
+typedef struct ShmCacheHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t cluster_bits;
+    uint64_t image_size;
+    uint32_t slot_bits;         /* log2 of the number of slots */
+    uint32_t index_offset;
+    uint64_t data_offset;
+    ShmCacheImageId image_id;
+} ShmCacheHeader;
+
+typedef struct ShmCacheEntry {
+    uint32_t seq;               /* odd while the slot is being replaced */
+    uint32_t key;               /* cluster index + 1, 0 if the slot is empty */
+} ShmCacheEntry;
+
+typedef struct ShmCache {
+    void *map;
+    size_t map_size;
+    bool writable;
+
+    ShmCacheEntry *index;
+    uint8_t *data;
+    unsigned cluster_bits;
+    unsigned slot_bits;
+    uint64_t image_size;
+    ShmCacheImageId image_id;
+} ShmCache;
+
+int GRAPH_RDLOCK
+shm_cache_get_image_id(BlockDriverState *bs, ShmCacheImageId *id,
+                       Error **errp);
+
+int shm_cache_create(ShmCache *c, const char *path, uint64_t size,
+                     uint32_t cluster_size, uint64_t image_size,
+                     const ShmCacheImageId *image_id, Error **errp);
+int shm_cache_open(ShmCache *c, const char *path, Error **errp);
+void shm_cache_close(ShmCache *c);
+
+bool shm_cache_read(ShmCache *c, uint64_t cluster, size_t offset,
+                    size_t bytes, QEMUIOVector *qiov, size_t qiov_offset);
+bool shm_cache_insert(ShmCache *c, uint64_t cluster, const uint8_t *buf);
+
+extern const BlockExportDriver blk_exp_shm_cache;
+
+#endif /* CONFIG_POSIX */
+
+#endif
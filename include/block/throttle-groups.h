@@ -49,6 +49,13 @@ typedef struct ThrottleGroupMember {
      */
     unsigned int restart_pending;
 
+    /*
+     * Budget borrowed from the group, so that requests can be accounted
+     * without taking the ThrottleGroup lock.  Accessed with atomic
+     * operations, see block/throttle-groups.c for details.
+     */
+    aligned_uint64_t credit[THROTTLE_MAX];
+
     /* The following fields are protected by the ThrottleGroup lock.
      * See the ThrottleGroup documentation for details.
      * throttle_state tells us if I/O limits are configured. */
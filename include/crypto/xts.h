@@ -29,6 +29,12 @@
 
 #define XTS_BLOCK_SIZE 16
 
+/*
+ * The cipher functions are called with @length being a multiple of
+ * XTS_BLOCK_SIZE, possibly covering many blocks, which must be processed
+ * independently of each other (i.e. in ECB mode).  @dst and @src may be
+ * the same buffer.
+ */
 typedef void xts_cipher_func(const void *ctx,
                              size_t length,
                              uint8_t *dst,
@@ -49,6 +49,14 @@ struct QIOChannelSocket {
     socklen_t remoteAddrLen;
     ssize_t zero_copy_queued;
     ssize_t zero_copy_sent;
+    /*
+     * zero_copy_sent at the last qio_channel_flush(), and whether all
+     * sends completed since then fell back to copying.  Notifications
+     * that qio_channel_socket_zero_copy_reap() processes count towards
+     * the next flush.
+     */
+    ssize_t zero_copy_flushed;
+    bool zero_copy_copied;
 };
 
 
@@ -261,5 +269,44 @@ QIOChannelSocket *
 qio_channel_socket_accept(QIOChannelSocket *ioc,
                           Error **errp);
 
+/**
+ * qio_channel_socket_enable_zero_copy:
+ * @ioc: the socket channel object
+ *
+ * Try to enable zero copy sends (MSG_ZEROCOPY) on the
+ * connected socket, and set QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY
+ * if that succeeds. This is done automatically for client
+ * connections made with qio_channel_socket_connect_sync(),
+ * while servers have to call it on accepted connections
+ * before they can use QIO_CHANNEL_WRITE_FLAG_ZERO_COPY.
+ *
+ * Returns: true if zero copy sends are available, false otherwise
+ */
+bool
+qio_channel_socket_enable_zero_copy(QIOChannelSocket *ioc);
+
+/**
+ * qio_channel_socket_zero_copy_reap:
+ * @ioc: the socket channel object
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Process the zero copy completion notifications that the
+ * kernel has already queued on the socket, without waiting
+ * for further ones. Unlike qio_channel_flush(), this never
+ * blocks, so it is suitable for callers that keep their
+ * buffers alive until the send that used them completes:
+ * a send has completed once the returned count reaches the
+ * value @zero_copy_queued had right after the send.
+ * Reads and writes that would block also process pending
+ * notifications, so that they don't keep the socket readable
+ * by way of POLLERR.  Notifications processed this way are
+ * still taken into account by the next qio_channel_flush().
+ *
+ * Returns: the number of completed zero copy sends, or -1 on error
+ */
+ssize_t
+qio_channel_socket_zero_copy_reap(QIOChannelSocket *ioc,
+                                  Error **errp);
+
 
 #endif /* QIO_CHANNEL_SOCKET_H */
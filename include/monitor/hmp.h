@@ -166,6 +166,8 @@ void hmp_info_trace_events(Monitor *mon, const QDict *qdict);
 void hmp_help(Monitor *mon, const QDict *qdict);
 void hmp_info_help(Monitor *mon, const QDict *qdict);
 void hmp_info_sync_profile(Monitor *mon, const QDict *qdict);
+void hmp_info_rcu(Monitor *mon, const QDict *qdict);
+void hmp_info_coroutines(Monitor *mon, const QDict *qdict);
 void hmp_info_history(Monitor *mon, const QDict *qdict);
 void hmp_logfile(Monitor *mon, const QDict *qdict);
 void hmp_log(Monitor *mon, const QDict *qdict);
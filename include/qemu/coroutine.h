@@ -284,6 +284,22 @@ void qemu_coroutine_inc_pool_size(unsigned int additional_pool_size);
  */
 void qemu_coroutine_dec_pool_size(unsigned int additional_pool_size);
 
+typedef struct CoroutinePoolStats {
+    uint64_t created;           /* coroutines allocated from scratch */
+    uint64_t pool_hits;         /* coroutines taken from a local pool */
+    uint64_t global_gets;       /* batches taken from the global pool */
+    uint64_t global_puts;       /* batches returned to the global pool */
+    uint64_t discarded;         /* coroutines freed because the pool was full */
+    uint64_t trimmed;           /* idle coroutines freed from the pool */
+    unsigned int pool_size;     /* coroutines in the global pool */
+    unsigned int pool_max_size; /* maximum size of the global pool */
+} CoroutinePoolStats;
+
+/**
+ * Get coroutine creation and pool statistics
+ */
+void qemu_coroutine_get_pool_stats(CoroutinePoolStats *stats);
+
 /**
  * Sends a (part of) iovec down a socket, yielding when the socket is full, or
  * Receives data into a (part of) iovec from a socket,
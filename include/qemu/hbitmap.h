@@ -261,6 +261,15 @@ void hbitmap_deserialize_finish(HBitmap *hb);
  */
 char *hbitmap_sha256(const HBitmap *bitmap, Error **errp);
 
+/**
+ * hbitmap_allocated_bytes:
+ * @hb: HBitmap to operate on.
+ *
+ * Returns the amount of memory currently used by @hb.  Parts of the bitmap
+ * that are all zeroes or all ones need (almost) no memory.
+ */
+uint64_t hbitmap_allocated_bytes(const HBitmap *hb);
+
 /**
  * hbitmap_free:
  * @hb: HBitmap to operate on.
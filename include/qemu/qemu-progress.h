@@ -4,5 +4,6 @@
 void qemu_progress_init(int enabled, float min_skip);
 void qemu_progress_end(void);
 void qemu_progress_print(float delta, int max);
+void qemu_progress_enable_rate(uint64_t total_bytes);
 
 #endif /* QEMU_PROGRESS_H */
@@ -33,6 +33,8 @@ struct qht {
  * An entry is a pointer-hash pair.
  * Each bucket can host several entries.
  * Chains are chains of buckets, whose first link is always a head bucket.
+ * While a resize is in progress, head buckets of both the old and the new
+ * map are accounted for, except for those already moved to the new map.
  */
 struct qht_stats {
     size_t head_buckets;
@@ -80,6 +82,9 @@ void qht_destroy(struct qht *ht);
  * In case of successful operation, smp_wmb() is implied before the pointer is
  * inserted into the hash table.
  *
+ * Does not need to be called under an RCU read-critical section; the
+ * resize that it may help with takes care of that internally.
+ *
  * Returns true on success.
  * Returns false if there is an existing entry in the table that is equivalent
  * (i.e. ht->cmp matches and the hash is the same) to @p-@h. If @existing
@@ -130,6 +135,9 @@ void *qht_lookup(const struct qht *ht, const void *userp, uint32_t hash);
  * This guarantees that concurrent lookups will always compare against valid
  * data.
  *
+ * Like qht_insert(), does not need to be called under an RCU read-critical
+ * section.
+ *
  * Returns true on success.
  * Returns false if the @p-@hash pair was not found.
  */
@@ -166,6 +174,10 @@ bool qht_reset_size(struct qht *ht, size_t n_elems);
  * @ht: QHT to be resized
  * @n_elems: number of entries the resized hash table should be optimized for
  *
+ * The resize is done one bucket at a time, so that concurrent readers and
+ * writers are not stalled; entries are visible throughout. Returns once all
+ * entries have been moved to the resized hash table.
+ *
  * Returns true on success.
  * Returns false if the resize was not necessary and therefore not performed.
  * See also: qht_reset_size().
@@ -16,12 +16,49 @@ enum QSPSortBy {
     QSP_SORT_BY_AVG_WAIT_TIME,
 };
 
+enum QSPType {
+    QSP_MUTEX,
+    QSP_BQL_MUTEX,
+    QSP_REC_MUTEX,
+    QSP_CONDVAR,
+};
+
+typedef struct QSPReportEntry {
+    const void *obj;
+    char *callsite_at;
+    enum QSPType type;
+    const char *typename;
+    uint64_t ns;
+    double time_s;
+    double ns_avg;
+    uint64_t n_acqs;
+    unsigned int n_objs;
+} QSPReportEntry;
+
+typedef void QSPReportFunc(const QSPReportEntry *entry, void *opaque);
+
 void qsp_report(size_t max, enum QSPSortBy sort_by,
                 bool callsite_coalesce);
+void qsp_report_foreach(size_t max, enum QSPSortBy sort_by,
+                        bool callsite_coalesce, QSPReportFunc *func,
+                        void *opaque);
 
 bool qsp_is_enabled(void);
 void qsp_enable(void);
 void qsp_disable(void);
 void qsp_reset(void);
 
+/* defaults for sampling mode */
+#define QSP_SAMPLE_PERIOD        1000
+#define QSP_SAMPLE_THRESHOLD_NS  100000
+
+/*
+ * Profile only one acquisition out of @period in each thread, plus all
+ * acquisitions that waited for at least @threshold_ns (0 disables the
+ * threshold).  Recorded counts and wait times are scaled by @period, so
+ * reports estimate the totals.
+ */
+void qsp_enable_sampling(unsigned int period, int64_t threshold_ns);
+bool qsp_is_sampling(unsigned int *period, int64_t *threshold_ns);
+
 #endif /* QEMU_QSP_H */
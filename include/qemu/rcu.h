@@ -120,6 +120,25 @@ static inline void rcu_read_unlock(void)
 
 void synchronize_rcu(void);
 
+/*
+ * Like synchronize_rcu(), but use IPIs and polling to end the grace period
+ * as soon as possible.  This is more expensive for the rest of the system,
+ * so only use it when somebody is actively waiting.
+ */
+void synchronize_rcu_expedited(void);
+
+typedef struct RCUStats {
+    uint64_t grace_periods;     /* grace periods that were run */
+    uint64_t expedited;         /* ... of which expedited */
+    uint64_t shared;            /* synchronize_rcu() calls served by others */
+    uint64_t total_ns;          /* total grace period latency */
+    uint64_t max_ns;            /* maximum grace period latency */
+    uint64_t callbacks;         /* call_rcu() callbacks invoked */
+    uint64_t batches;           /* batches handed to the call_rcu thread */
+} RCUStats;
+
+void rcu_get_stats(RCUStats *stats);
+
 /*
  * Reader thread registration.
  */
@@ -141,6 +160,8 @@ struct rcu_head {
 };
 
 void call_rcu1(struct rcu_head *head, RCUCBFunc *func);
+void call_rcu_batch_begin(void);
+void call_rcu_batch_end(void);
 void drain_call_rcu(void);
 
 /* The operands of the minus operator must have the same type,
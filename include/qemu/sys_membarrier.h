@@ -16,11 +16,13 @@
  */
 void smp_mb_global_init(void);
 void smp_mb_global(void);
+void smp_mb_global_expedited(void);
 #define smp_mb_placeholder()       barrier()
 #else
 /* Keep it simple, execute a real memory barrier on both sides.  */
 static inline void smp_mb_global_init(void) {}
 #define smp_mb_global()            smp_mb()
+#define smp_mb_global_expedited()  smp_mb()     /* as smp_mb_global() */
 #define smp_mb_placeholder()       smp_mb()
 #endif
 
@@ -158,6 +158,11 @@ bool throttle_schedule_timer(ThrottleState *ts,
 
 void throttle_account(ThrottleState *ts, ThrottleDirection direction,
                       uint64_t size);
+void throttle_account_units(ThrottleState *ts, ThrottleDirection direction,
+                            double bytes, double units);
+void throttle_headroom(ThrottleState *ts, ThrottleDirection direction,
+                       int64_t now, int64_t period_ns,
+                       double *bytes, double *units);
 void throttle_limits_to_config(ThrottleLimits *arg, ThrottleConfig *cfg,
                                Error **errp);
 void throttle_config_to_limits(ThrottleConfig *cfg, ThrottleLimits *var);
@@ -86,7 +86,8 @@ struct QEMUTimer {
     QEMUTimerList *timer_list;
     QEMUTimerCB *cb;
     void *opaque;
-    QEMUTimer *next;
+    uint64_t arm_seq;           /* orders timers with the same expire_time */
+    unsigned int heap_index;    /* position in the timer list's heap */
     int attributes;
     int scale;
 };
@@ -36,5 +36,6 @@ struct EventLoopBase {
     /* AioContext thread pool parameters */
     int64_t thread_pool_min;
     int64_t thread_pool_max;
+    uint16List *thread_pool_cpus;
 };
 #endif
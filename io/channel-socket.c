@@ -164,15 +164,7 @@ int qio_channel_socket_connect_sync(QIOChannelSocket *ioc,
         return -1;
     }
 
-#ifdef QEMU_MSG_ZEROCOPY
-    int ret, v = 1;
-    ret = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &v, sizeof(v));
-    if (ret == 0) {
-        /* Zero copy available on host */
-        qio_channel_set_feature(QIO_CHANNEL(ioc),
-                                QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY);
-    }
-#endif
+    qio_channel_socket_enable_zero_copy(ioc);
 
     qio_channel_set_feature(QIO_CHANNEL(ioc),
                             QIO_CHANNEL_FEATURE_READ_MSG_PEEK);
@@ -421,10 +413,27 @@ qio_channel_socket_accept(QIOChannelSocket *ioc,
     return NULL;
 }
 
+bool
+qio_channel_socket_enable_zero_copy(QIOChannelSocket *ioc)
+{
+#ifdef QEMU_MSG_ZEROCOPY
+    int v = 1;
+
+    if (setsockopt(ioc->fd, SOL_SOCKET, SO_ZEROCOPY, &v, sizeof(v)) == 0) {
+        /* Zero copy available on host */
+        qio_channel_set_feature(QIO_CHANNEL(ioc),
+                                QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY);
+        return true;
+    }
+#endif
+    return false;
+}
+
 static void qio_channel_socket_init(Object *obj)
 {
     QIOChannelSocket *ioc = QIO_CHANNEL_SOCKET(obj);
     ioc->fd = -1;
+    ioc->zero_copy_copied = true;
 }
 
 static void qio_channel_socket_finalize(Object *obj)
@@ -533,6 +542,11 @@ static ssize_t qio_channel_socket_readv(QIOChannel *ioc,
     ret = recvmsg(sioc->fd, &msg, sflags);
     if (ret < 0) {
         if (errno == EAGAIN) {
+            /*
+             * Unprocessed zero copy notifications make the socket report
+             * POLLERR, which would wake up the caller again right away.
+             */
+            qio_channel_socket_zero_copy_reap(sioc, NULL);
             return QIO_CHANNEL_ERR_BLOCK;
         }
         if (errno == EINTR) {
@@ -607,10 +621,16 @@ static ssize_t qio_channel_socket_writev(QIOChannel *ioc,
     if (ret <= 0) {
         switch (errno) {
         case EAGAIN:
+            /* See qio_channel_socket_readv() */
+            qio_channel_socket_zero_copy_reap(sioc, NULL);
             return QIO_CHANNEL_ERR_BLOCK;
         case EINTR:
             goto retry;
         case ENOBUFS:
+            /*
+             * errno is preserved, so that callers can fall back to
+             * copying the data
+             */
             if (flags & QIO_CHANNEL_WRITE_FLAG_ZERO_COPY) {
                 error_setg_errno(errp, errno,
                                  "Process can't lock enough memory for using MSG_ZEROCOPY");
@@ -725,83 +745,124 @@ static ssize_t qio_channel_socket_writev(QIOChannel *ioc,
 
 
 #ifdef QEMU_MSG_ZEROCOPY
-static int qio_channel_socket_flush(QIOChannel *ioc,
-                                    Error **errp)
+/*
+ * Process one zero copy completion notification from the socket's error
+ * queue.  @sioc->zero_copy_copied is cleared if any of the completed sends
+ * really avoided copying the data.
+ *
+ * Returns 1 if a notification was processed, 0 if the error queue is empty
+ * and -1 on error.
+ */
+static int qio_channel_socket_read_errqueue(QIOChannelSocket *sioc,
+                                            Error **errp)
 {
-    QIOChannelSocket *sioc = QIO_CHANNEL_SOCKET(ioc);
     struct msghdr msg = {};
     struct sock_extended_err *serr;
     struct cmsghdr *cm;
     char control[CMSG_SPACE(sizeof(*serr))];
     int received;
-    int ret;
-
-    if (sioc->zero_copy_queued == sioc->zero_copy_sent) {
-        return 0;
-    }
 
     msg.msg_control = control;
     msg.msg_controllen = sizeof(control);
     memset(control, 0, sizeof(control));
 
-    ret = 1;
-
-    while (sioc->zero_copy_sent < sioc->zero_copy_queued) {
-        received = recvmsg(sioc->fd, &msg, MSG_ERRQUEUE);
-        if (received < 0) {
-            switch (errno) {
-            case EAGAIN:
-                /* Nothing on errqueue, wait until something is available */
-                qio_channel_wait(ioc, G_IO_ERR);
-                continue;
-            case EINTR:
-                continue;
-            default:
-                error_setg_errno(errp, errno,
-                                 "Unable to read errqueue");
-                return -1;
-            }
-        }
-
-        cm = CMSG_FIRSTHDR(&msg);
-        if (cm->cmsg_level != SOL_IP   && cm->cmsg_type != IP_RECVERR &&
-            cm->cmsg_level != SOL_IPV6 && cm->cmsg_type != IPV6_RECVERR) {
-            error_setg_errno(errp, EPROTOTYPE,
-                             "Wrong cmsg in errqueue");
+ retry:
+    received = recvmsg(sioc->fd, &msg, MSG_ERRQUEUE);
+    if (received < 0) {
+        switch (errno) {
+        case EAGAIN:
+            return 0;
+        case EINTR:
+            goto retry;
+        default:
+            error_setg_errno(errp, errno,
+                             "Unable to read errqueue");
             return -1;
         }
+    }
 
-        serr = (void *) CMSG_DATA(cm);
-        if (serr->ee_errno != SO_EE_ORIGIN_NONE) {
-            error_setg_errno(errp, serr->ee_errno,
-                             "Error on socket");
-            return -1;
-        }
-        if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
-            error_setg_errno(errp, serr->ee_origin,
-                             "Error not from zero copy");
-            return -1;
-        }
-        if (serr->ee_data < serr->ee_info) {
-            error_setg_errno(errp, serr->ee_origin,
-                             "Wrong notification bounds");
-            return -1;
-        }
+    cm = CMSG_FIRSTHDR(&msg);
+    if (cm->cmsg_level != SOL_IP   && cm->cmsg_type != IP_RECVERR &&
+        cm->cmsg_level != SOL_IPV6 && cm->cmsg_type != IPV6_RECVERR) {
+        error_setg_errno(errp, EPROTOTYPE,
+                         "Wrong cmsg in errqueue");
+        return -1;
+    }
+
+    serr = (void *) CMSG_DATA(cm);
+    if (serr->ee_errno != SO_EE_ORIGIN_NONE) {
+        error_setg_errno(errp, serr->ee_errno,
+                         "Error on socket");
+        return -1;
+    }
+    if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+        error_setg_errno(errp, serr->ee_origin,
+                         "Error not from zero copy");
+        return -1;
+    }
+    if (serr->ee_data < serr->ee_info) {
+        error_setg_errno(errp, serr->ee_origin,
+                         "Wrong notification bounds");
+        return -1;
+    }
+
+    /* No errors, count successfully finished sendmsg()*/
+    sioc->zero_copy_sent += serr->ee_data - serr->ee_info + 1;
+
+    if (serr->ee_code != SO_EE_CODE_ZEROCOPY_COPIED) {
+        sioc->zero_copy_copied = false;
+    }
+    return 1;
+}
+
+static int qio_channel_socket_flush(QIOChannel *ioc,
+                                    Error **errp)
+{
+    QIOChannelSocket *sioc = QIO_CHANNEL_SOCKET(ioc);
+    int ret;
 
-        /* No errors, count successfully finished sendmsg()*/
-        sioc->zero_copy_sent += serr->ee_data - serr->ee_info + 1;
+    if (sioc->zero_copy_queued == sioc->zero_copy_flushed) {
+        return 0;
+    }
 
-        /* If any sendmsg() succeeded using zero copy, return 0 at the end */
-        if (serr->ee_code != SO_EE_CODE_ZEROCOPY_COPIED) {
-            ret = 0;
+    while (sioc->zero_copy_sent < sioc->zero_copy_queued) {
+        ret = qio_channel_socket_read_errqueue(sioc, errp);
+        if (ret < 0) {
+            return -1;
+        } else if (ret == 0) {
+            /* Nothing on errqueue, wait until something is available */
+            qio_channel_wait(ioc, G_IO_ERR);
         }
     }
 
+    /* If any sendmsg() since the last flush used zero copy, return 0 */
+    ret = sioc->zero_copy_copied ? 1 : 0;
+    sioc->zero_copy_flushed = sioc->zero_copy_sent;
+    sioc->zero_copy_copied = true;
     return ret;
 }
 
 #endif /* QEMU_MSG_ZEROCOPY */
 
+ssize_t
+qio_channel_socket_zero_copy_reap(QIOChannelSocket *ioc,
+                                  Error **errp)
+{
+#ifdef QEMU_MSG_ZEROCOPY
+    int ret;
+
+    while (ioc->zero_copy_sent < ioc->zero_copy_queued) {
+        ret = qio_channel_socket_read_errqueue(ioc, errp);
+        if (ret < 0) {
+            return -1;
+        } else if (ret == 0) {
+            break;
+        }
+    }
+#endif
+    return ioc->zero_copy_sent;
+}
+
 static int
 qio_channel_socket_set_blocking(QIOChannel *ioc,
                                 bool enabled,
@@ -19,6 +19,7 @@
 #include "block/block.h"
 #include "system/event-loop-base.h"
 #include "system/iothread.h"
+#include "system/stats.h"
 #include "qapi/error.h"
 #include "qapi/qapi-commands-misc.h"
 #include "qemu/error-report.h"
@@ -174,6 +175,12 @@ static void iothread_set_aio_context_params(EventLoopBase *base, Error **errp)
 
     aio_context_set_thread_pool_params(iothread->ctx, base->thread_pool_min,
                                        base->thread_pool_max, errp);
+    if (*errp) {
+        return;
+    }
+
+    aio_context_set_thread_pool_cpus(iothread->ctx, base->thread_pool_cpus,
+                                     errp);
 }
 
 
@@ -292,6 +299,106 @@ static void iothread_set_poll_param(Object *obj, Visitor *v,
     }
 }
 
+static StatsList *iothread_stats_add(StatsList *list, strList *names,
+                                     const char *name, uint64_t value)
+{
+    Stats *stats;
+
+    if (!apply_str_list_filter(name, names)) {
+        return list;
+    }
+
+    stats = g_new0(Stats, 1);
+    stats->name = g_strdup(name);
+    stats->value = g_new0(StatsValue, 1);
+    stats->value->type = QTYPE_QNUM;
+    stats->value->u.scalar = value;
+
+    QAPI_LIST_PREPEND(list, stats);
+    return list;
+}
+
+typedef struct IOThreadStatsArgs {
+    StatsResultList **result;
+    strList *names;
+} IOThreadStatsArgs;
+
+static int iothread_stats_query(Object *obj, void *opaque)
+{
+    IOThreadStatsArgs *args = opaque;
+    IOThread *iothread;
+    AioPollStats poll;
+    StatsList *list = NULL;
+    g_autofree char *qom_path = NULL;
+
+    iothread = (IOThread *)object_dynamic_cast(obj, TYPE_IOTHREAD);
+    if (!iothread || !iothread->ctx) {
+        return 0;
+    }
+
+    aio_context_get_poll_stats(iothread->ctx, &poll);
+    list = iothread_stats_add(list, args->names, "poll-attempts",
+                              poll.attempts);
+    list = iothread_stats_add(list, args->names, "poll-successes",
+                              poll.successes);
+    list = iothread_stats_add(list, args->names, "poll-time",
+                              poll.time_ns);
+    list = iothread_stats_add(list, args->names, "poll-wasted-time",
+                              poll.wasted_ns);
+    if (!list) {
+        return 0;
+    }
+
+    qom_path = object_get_canonical_path(obj);
+    add_stats_entry(args->result, STATS_PROVIDER_AIO, qom_path, list);
+    return 0;
+}
+
+static void iothread_stats_cb(StatsResultList **result, StatsTarget target,
+                              strList *names, strList *targets, Error **errp)
+{
+    IOThreadStatsArgs args = {
+        .result = result,
+        .names = names,
+    };
+
+    if (target == STATS_TARGET_IOTHREAD) {
+        object_child_foreach(object_get_objects_root(),
+                             iothread_stats_query, &args);
+    }
+}
+
+static StatsSchemaValueList *iothread_schema_add(StatsSchemaValueList *list,
+                                                 const char *name,
+                                                 bool is_time)
+{
+    StatsSchemaValue *value = g_new0(StatsSchemaValue, 1);
+
+    value->name = g_strdup(name);
+    value->type = STATS_TYPE_CUMULATIVE;
+    if (is_time) {
+        value->has_unit = true;
+        value->unit = STATS_UNIT_SECONDS;
+        value->has_base = true;
+        value->base = 10;
+        value->exponent = -9;
+    }
+
+    QAPI_LIST_PREPEND(list, value);
+    return list;
+}
+
+static void iothread_stats_schemas_cb(StatsSchemaList **result, Error **errp)
+{
+    StatsSchemaValueList *list = NULL;
+
+    list = iothread_schema_add(list, "poll-attempts", false);
+    list = iothread_schema_add(list, "poll-successes", false);
+    list = iothread_schema_add(list, "poll-time", true);
+    list = iothread_schema_add(list, "poll-wasted-time", true);
+    add_stats_schema(result, STATS_PROVIDER_AIO, STATS_TARGET_IOTHREAD, list);
+}
+
 static void iothread_class_init(ObjectClass *klass, void *class_data)
 {
     EventLoopBaseClass *bc = EVENT_LOOP_BASE_CLASS(klass);
@@ -325,6 +432,8 @@ static const TypeInfo iothread_info = {
 static void iothread_register_types(void)
 {
     type_register_static(&iothread_info);
+    add_stats_callbacks(STATS_PROVIDER_AIO, iothread_stats_cb,
+                        iothread_stats_schemas_cb);
 }
 
 type_init(iothread_register_types)
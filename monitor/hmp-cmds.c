@@ -26,8 +26,10 @@
 #include "qapi/qapi-commands-machine.h"
 #include "qapi/qapi-commands-misc.h"
 #include "qobject/qdict.h"
+#include "qemu/coroutine.h"
 #include "qemu/cutils.h"
 #include "qemu/log.h"
+#include "qemu/rcu.h"
 #include "system/system.h"
 
 bool hmp_handle_error(Monitor *mon, Error *err)
@@ -99,12 +101,22 @@ void hmp_sync_profile(Monitor *mon, const QDict *qdict)
 
     if (op == NULL) {
         bool on = qsp_is_enabled();
+        unsigned int period;
+        int64_t threshold_ns;
 
+        if (qsp_is_sampling(&period, &threshold_ns)) {
+            monitor_printf(mon, "sync-profile is sampling one acquisition "
+                           "out of %u, and waits of at least %" PRId64
+                           " ns\n", period, threshold_ns);
+            return;
+        }
         monitor_printf(mon, "sync-profile is %s\n", on ? "on" : "off");
         return;
     }
     if (!strcmp(op, "on")) {
         qsp_enable();
+    } else if (!strcmp(op, "sample")) {
+        qsp_enable_sampling(QSP_SAMPLE_PERIOD, QSP_SAMPLE_THRESHOLD_NS);
     } else if (!strcmp(op, "off")) {
         qsp_disable();
     } else if (!strcmp(op, "reset")) {
@@ -113,7 +125,7 @@ void hmp_sync_profile(Monitor *mon, const QDict *qdict)
         Error *err = NULL;
 
         error_setg(&err, "invalid parameter '%s',"
-                   " expecting 'on', 'off', or 'reset'", op);
+                   " expecting 'on', 'sample', 'off', or 'reset'", op);
         hmp_handle_error(mon, err);
     }
 }
@@ -228,6 +240,38 @@ void hmp_info_sync_profile(Monitor *mon, const QDict *qdict)
     qsp_report(max, sort_by, coalesce);
 }
 
+void hmp_info_rcu(Monitor *mon, const QDict *qdict)
+{
+    RCUStats stats;
+
+    rcu_get_stats(&stats);
+    monitor_printf(mon, "grace periods: %" PRIu64 " (%" PRIu64 " expedited, "
+                   "%" PRIu64 " shared synchronize_rcu calls)\n",
+                   stats.grace_periods, stats.expedited, stats.shared);
+    monitor_printf(mon, "grace period latency: avg %" PRIu64 " us, "
+                   "max %" PRIu64 " us\n",
+                   stats.grace_periods ?
+                   stats.total_ns / stats.grace_periods / 1000 : 0,
+                   stats.max_ns / 1000);
+    monitor_printf(mon, "callbacks: %" PRIu64 " in %" PRIu64 " batches\n",
+                   stats.callbacks, stats.batches);
+}
+
+void hmp_info_coroutines(Monitor *mon, const QDict *qdict)
+{
+    CoroutinePoolStats stats;
+
+    qemu_coroutine_get_pool_stats(&stats);
+    monitor_printf(mon, "created: %" PRIu64 ", pool hits: %" PRIu64 "\n",
+                   stats.created, stats.pool_hits);
+    monitor_printf(mon, "global pool: %u/%u coroutines, %" PRIu64 " batches "
+                   "taken, %" PRIu64 " returned\n",
+                   stats.pool_size, stats.pool_max_size,
+                   stats.global_gets, stats.global_puts);
+    monitor_printf(mon, "freed: %" PRIu64 " (pool full), %" PRIu64
+                   " (idle)\n", stats.discarded, stats.trimmed);
+}
+
 void hmp_info_history(Monitor *mon, const QDict *qdict)
 {
     MonitorHMP *hmp_mon = container_of(mon, MonitorHMP, common);
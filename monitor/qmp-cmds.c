@@ -187,6 +187,104 @@ out:
     return output;
 }
 
+void qmp_x_sync_profile_set(SyncProfileMode mode,
+                            bool has_sample_period, uint32_t sample_period,
+                            bool has_wait_threshold_ns,
+                            uint64_t wait_threshold_ns,
+                            bool has_reset, bool reset, Error **errp)
+{
+    if (mode != SYNC_PROFILE_MODE_SAMPLING &&
+        (has_sample_period || has_wait_threshold_ns)) {
+        error_setg(errp, "'sample-period' and 'wait-threshold-ns' are only "
+                   "valid in sampling mode");
+        return;
+    }
+    if (has_sample_period && !sample_period) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "sample-period",
+                   "a positive number");
+        return;
+    }
+    switch (mode) {
+    case SYNC_PROFILE_MODE_OFF:
+        qsp_disable();
+        break;
+    case SYNC_PROFILE_MODE_FULL:
+        qsp_enable();
+        break;
+    case SYNC_PROFILE_MODE_SAMPLING:
+        qsp_enable_sampling(has_sample_period ? sample_period
+                                              : QSP_SAMPLE_PERIOD,
+                            has_wait_threshold_ns
+                            ? MIN(wait_threshold_ns, INT64_MAX)
+                            : QSP_SAMPLE_THRESHOLD_NS);
+        break;
+    default:
+        g_assert_not_reached();
+    }
+
+    if (has_reset && reset) {
+        qsp_reset();
+    }
+}
+
+static void qmp_sync_profile_entry(const QSPReportEntry *e, void *opaque)
+{
+    static const SyncProfileType types[] = {
+        [QSP_MUTEX]     = SYNC_PROFILE_TYPE_MUTEX,
+        [QSP_BQL_MUTEX] = SYNC_PROFILE_TYPE_BQL_MUTEX,
+        [QSP_REC_MUTEX] = SYNC_PROFILE_TYPE_REC_MUTEX,
+        [QSP_CONDVAR]   = SYNC_PROFILE_TYPE_CONDVAR,
+    };
+    SyncProfileEntryList ***tail = opaque;
+    SyncProfileEntry *entry = g_new0(SyncProfileEntry, 1);
+
+    entry->type = types[e->type];
+    if (e->n_objs <= 1) {
+        entry->has_object = true;
+        entry->object = (uintptr_t)e->obj;
+    }
+    entry->objects = MAX(e->n_objs, 1);
+    entry->callsite = g_strdup(e->callsite_at);
+    entry->wait_time_ns = e->ns;
+    entry->count = e->n_acqs;
+    entry->average_ns = e->ns_avg;
+    QAPI_LIST_APPEND(*tail, entry);
+}
+
+/* Bounds the report buffer, which is allocated for @max entries upfront */
+#define SYNC_PROFILE_MAX_ENTRIES 1000
+
+SyncProfileInfo *qmp_x_query_sync_profile(bool has_max, uint32_t max,
+                                          bool has_sort_by_average,
+                                          bool sort_by_average,
+                                          bool has_coalesce, bool coalesce,
+                                          Error **errp)
+{
+    SyncProfileInfo *info = g_new0(SyncProfileInfo, 1);
+    SyncProfileEntryList **tail = &info->entries;
+    unsigned int period;
+    int64_t threshold_ns;
+
+    if (qsp_is_sampling(&period, &threshold_ns)) {
+        info->mode = SYNC_PROFILE_MODE_SAMPLING;
+        info->has_sample_period = true;
+        info->sample_period = period;
+        info->has_wait_threshold_ns = true;
+        info->wait_threshold_ns = threshold_ns;
+    } else if (qsp_is_enabled()) {
+        info->mode = SYNC_PROFILE_MODE_FULL;
+    } else {
+        info->mode = SYNC_PROFILE_MODE_OFF;
+    }
+
+    qsp_report_foreach(has_max ? MIN(max, SYNC_PROFILE_MAX_ENTRIES) : 10,
+                       sort_by_average ? QSP_SORT_BY_AVG_WAIT_TIME
+                                       : QSP_SORT_BY_TOTAL_WAIT_TIME,
+                       has_coalesce ? coalesce : true,
+                       qmp_sync_profile_entry, &tail);
+    return info;
+}
+
 static void __attribute__((__constructor__)) monitor_init_qmp_commands(void)
 {
     /*
@@ -28,6 +28,7 @@
 #include "nbd-internal.h"
 #include "qemu/units.h"
 #include "qemu/memalign.h"
+#include "qemu/stats64.h"
 
 #define NBD_META_ID_BASE_ALLOCATION 0
 #define NBD_META_ID_ALLOCATION_DEPTH 1
@@ -42,6 +43,18 @@
  */
 #define NBD_MAX_BLOCK_STATUS_EXTENTS (1 * MiB / 8)
 
+/*
+ * Read payloads of at least NBD_ZERO_COPY_MIN_BYTES are sent with
+ * MSG_ZEROCOPY on exports with zero-copy=on; below that, page pinning and
+ * completion handling cost more than copying the data.  The buffers must stay
+ * untouched until the kernel reports the send complete, and at most
+ * NBD_ZERO_COPY_MAX_PENDING bytes per client are kept pinned like this (also
+ * to stay within typical locked memory limits); beyond that, replies are
+ * copied as usual.
+ */
+#define NBD_ZERO_COPY_MIN_BYTES (64 * KiB)
+#define NBD_ZERO_COPY_MAX_PENDING (4 * MiB)
+
 static int system_errno_to_nbd_errno(int err)
 {
     switch (err) {
@@ -83,8 +96,41 @@ struct NBDRequestData {
     NBDClient *client;
     uint8_t *data;
     bool complete;
+
+    /*
+     * If @data was sent with MSG_ZEROCOPY: the socket's zero copy send count
+     * that must be reached before @data may be freed, and the number of
+     * bytes sent from it.  0 otherwise.
+     */
+    ssize_t zero_copy_seq;
+    size_t zero_copy_bytes;
 };
 
+/* A read buffer waiting for its zero copy sends to complete */
+typedef struct NBDZeroCopyBuffer {
+    uint8_t *data;
+    ssize_t seq;
+    size_t bytes;
+    QSIMPLEQ_ENTRY(NBDZeroCopyBuffer) next;
+} NBDZeroCopyBuffer;
+
+/*
+ * A thread in which an export serves clients.  Without multi-threading, an
+ * export has a single thread with @ctx == NULL that follows the export's
+ * AioContext.
+ */
+typedef struct NBDExportThread {
+    AioContext *ctx;
+    char *iothread;
+
+    int nr_clients; /* main loop thread only */
+
+    Stat64 rd_bytes;
+    Stat64 wr_bytes;
+    Stat64 rd_ops;
+    Stat64 wr_ops;
+} NBDExportThread;
+
 struct NBDExport {
     BlockExport common;
 
@@ -99,8 +145,13 @@ struct NBDExport {
     Notifier eject_notifier;
 
     bool allocation_depth;
+    bool zero_copy;
     BdrvDirtyBitmap **export_bitmaps;
     size_t nr_export_bitmaps;
+
+    NBDExportThread *threads;
+    size_t nr_threads;
+    size_t next_thread; /* round-robin position for new clients */
 };
 
 static QTAILQ_HEAD(, NBDExport) exports = QTAILQ_HEAD_INITIALIZER(exports);
@@ -129,6 +180,7 @@ struct NBDClient {
     QemuMutex lock;
 
     NBDExport *exp;
+    NBDExportThread *thread; /* Thread of @exp serving this client */
     QCryptoTLSCreds *tlscreds;
     char *tlsauthz;
     uint32_t handshake_max_secs;
@@ -140,6 +192,13 @@ struct NBDClient {
     CoMutex send_lock;
     Coroutine *send_coroutine;
 
+    /* Send large read payloads with MSG_ZEROCOPY, protected by send_lock */
+    bool zero_copy;
+
+    /* Read buffers still pinned by zero copy sends, protected by lock */
+    QSIMPLEQ_HEAD(, NBDZeroCopyBuffer) zero_copy_buffers;
+    size_t zero_copy_pending; /* total bytes pinned */
+
     bool read_yielding; /* protected by lock */
     bool quiescing; /* protected by lock */
 
@@ -159,6 +218,62 @@ struct NBDClient {
 
 static void nbd_client_receive_next_request(NBDClient *client);
 
+/*
+ * Bind @client to @exp and pick the thread that will process its requests.
+ * Clients are distributed round-robin across the export's threads.
+ */
+static void nbd_client_attach_export(NBDClient *client, NBDExport *exp)
+{
+    assert(qemu_in_main_thread());
+
+    client->exp = exp;
+    client->thread = &exp->threads[exp->next_thread];
+    client->thread->nr_clients++;
+    exp->next_thread = (exp->next_thread + 1) % exp->nr_threads;
+
+    QTAILQ_INSERT_TAIL(&exp->clients, client, next);
+    blk_exp_ref(&exp->common);
+
+    /* TLS channels copy the data anyway, so only plain sockets qualify */
+    if (exp->zero_copy && client->ioc == QIO_CHANNEL(client->sioc)) {
+        client->zero_copy = qio_channel_socket_enable_zero_copy(client->sioc);
+    }
+}
+
+/*
+ * Free the read buffers whose zero copy sends have completed.  Must be called
+ * with client->lock held.
+ */
+static void nbd_client_reap_zero_copy(NBDClient *client)
+{
+    NBDZeroCopyBuffer *buf;
+    ssize_t sent;
+
+    if (QSIMPLEQ_EMPTY(&client->zero_copy_buffers)) {
+        return;
+    }
+
+    /*
+     * Errors are left for the regular send path to notice; until then the
+     * buffers stay around and further replies are simply copied.
+     */
+    sent = qio_channel_socket_zero_copy_reap(client->sioc, NULL);
+
+    while ((buf = QSIMPLEQ_FIRST(&client->zero_copy_buffers)) &&
+           buf->seq <= sent) {
+        QSIMPLEQ_REMOVE_HEAD(&client->zero_copy_buffers, next);
+        client->zero_copy_pending -= buf->bytes;
+        qemu_vfree(buf->data);
+        g_free(buf);
+    }
+}
+
+/* The AioContext in which requests of @client are processed */
+static AioContext *nbd_client_aio_context(NBDClient *client)
+{
+    return client->thread->ctx ?: nbd_export_aio_context(client->exp);
+}
+
 /* Basic flow for negotiation
 
    Server         Client
@@ -483,6 +598,7 @@ nbd_negotiate_handle_export_name(NBDClient *client, bool no_zeroes,
     ERRP_GUARD();
     g_autofree char *name = NULL;
     char buf[NBD_REPLY_EXPORT_NAME_SIZE] = "";
+    NBDExport *exp;
     size_t len;
     int ret;
     uint16_t myflags;
@@ -512,22 +628,22 @@ nbd_negotiate_handle_export_name(NBDClient *client, bool no_zeroes,
 
     trace_nbd_negotiate_handle_export_name_request(name);
 
-    client->exp = nbd_export_find(name);
-    if (!client->exp) {
+    exp = nbd_export_find(name);
+    if (!exp) {
         error_setg(errp, "export not found");
         return -EINVAL;
     }
-    nbd_check_meta_export(client, client->exp);
+    nbd_check_meta_export(client, exp);
 
-    myflags = client->exp->nbdflags;
+    myflags = exp->nbdflags;
     if (client->mode >= NBD_MODE_STRUCTURED) {
         myflags |= NBD_FLAG_SEND_DF;
     }
     if (client->mode >= NBD_MODE_EXTENDED && client->contexts.count) {
         myflags |= NBD_FLAG_BLOCK_STAT_PAYLOAD;
     }
-    trace_nbd_negotiate_new_style_size_flags(client->exp->size, myflags);
-    stq_be_p(buf, client->exp->size);
+    trace_nbd_negotiate_new_style_size_flags(exp->size, myflags);
+    stq_be_p(buf, exp->size);
     stw_be_p(buf + 8, myflags);
     len = no_zeroes ? 10 : sizeof(buf);
     ret = nbd_write(client->ioc, buf, len, errp);
@@ -536,8 +652,7 @@ nbd_negotiate_handle_export_name(NBDClient *client, bool no_zeroes,
         return ret;
     }
 
-    QTAILQ_INSERT_TAIL(&client->exp->clients, client, next);
-    blk_exp_ref(&client->exp->common);
+    nbd_client_attach_export(client, exp);
 
     return 0;
 }
@@ -750,10 +865,8 @@ nbd_negotiate_handle_info(NBDClient *client, Error **errp)
     }
 
     if (client->opt == NBD_OPT_GO) {
-        client->exp = exp;
         client->check_align = check_align;
-        QTAILQ_INSERT_TAIL(&client->exp->clients, client, next);
-        blk_exp_ref(&client->exp->common);
+        nbd_client_attach_export(client, exp);
         rc = 1;
     }
     return rc;
@@ -1572,11 +1685,22 @@ void nbd_client_put(NBDClient *client)
 
         object_unref(OBJECT(client->sioc));
         object_unref(OBJECT(client->ioc));
+
+        /* The socket is closed, so nothing can be sent from these anymore */
+        while (!QSIMPLEQ_EMPTY(&client->zero_copy_buffers)) {
+            NBDZeroCopyBuffer *buf = QSIMPLEQ_FIRST(&client->zero_copy_buffers);
+
+            QSIMPLEQ_REMOVE_HEAD(&client->zero_copy_buffers, next);
+            qemu_vfree(buf->data);
+            g_free(buf);
+        }
+
         if (client->tlscreds) {
             object_unref(OBJECT(client->tlscreds));
         }
         g_free(client->tlsauthz);
         if (client->exp) {
+            client->thread->nr_clients--;
             QTAILQ_REMOVE(&client->exp->clients, client, next);
             blk_exp_unref(&client->exp->common);
         }
@@ -1653,7 +1777,21 @@ static void nbd_request_put(NBDRequestData *req)
 {
     NBDClient *client = req->client;
 
-    if (req->data) {
+    if (req->zero_copy_seq) {
+        NBDZeroCopyBuffer *buf = g_new(NBDZeroCopyBuffer, 1);
+
+        /*
+         * Requests can finish out of order; a buffer queued behind one with
+         * a higher seq is then freed a bit late, but never too early.
+         */
+        *buf = (NBDZeroCopyBuffer) {
+            .data = req->data,
+            .seq = req->zero_copy_seq,
+            .bytes = req->zero_copy_bytes,
+        };
+        QSIMPLEQ_INSERT_TAIL(&client->zero_copy_buffers, buf, next);
+        nbd_client_reap_zero_copy(client);
+    } else if (req->data) {
         qemu_vfree(req->data);
     }
     g_free(req);
@@ -1753,7 +1891,7 @@ static bool nbd_drained_poll(void *opaque)
                  * qio_channel_yield().
                  */
                 if (client->recv_coroutine != NULL && client->read_yielding) {
-                    aio_bh_schedule_oneshot(nbd_export_aio_context(client->exp),
+                    aio_bh_schedule_oneshot(nbd_client_aio_context(client),
                                             nbd_wake_read_bh, client);
                 }
 
@@ -1793,6 +1931,7 @@ static const BlockDevOps nbd_block_ops = {
 };
 
 static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
+                             AioContext *const *multithread, size_t mt_count,
                              Error **errp)
 {
     NBDExport *exp = container_of(blk_exp, NBDExport, common);
@@ -1931,6 +2070,21 @@ static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
     }
 
     exp->allocation_depth = arg->allocation_depth;
+    exp->zero_copy = arg->zero_copy;
+
+    if (multithread) {
+        strList *iothreads = exp_args->iothread->u.multi;
+
+        exp->nr_threads = mt_count;
+        exp->threads = g_new0(NBDExportThread, mt_count);
+        for (i = 0; i < mt_count; i++, iothreads = iothreads->next) {
+            exp->threads[i].ctx = multithread[i];
+            exp->threads[i].iothread = g_strdup(iothreads->value);
+        }
+    } else {
+        exp->nr_threads = 1;
+        exp->threads = g_new0(NBDExportThread, 1);
+    }
 
     /*
      * We need to inhibit request queuing in the block layer to ensure we can
@@ -2021,19 +2175,149 @@ static void nbd_export_delete(BlockExport *blk_exp)
     for (i = 0; i < exp->nr_export_bitmaps; i++) {
         bdrv_dirty_bitmap_set_busy(exp->export_bitmaps[i], false);
     }
+
+    for (i = 0; i < exp->nr_threads; i++) {
+        g_free(exp->threads[i].iothread);
+    }
+    g_free(exp->threads);
+}
+
+static BlockExportThreadInfoList *nbd_export_query_threads(BlockExport *blk_exp)
+{
+    NBDExport *exp = container_of(blk_exp, NBDExport, common);
+    BlockExportThreadInfoList *head = NULL, **tail = &head;
+    size_t i;
+
+    /* Only report statistics for exports with a list of iothreads */
+    if (!exp->threads[0].ctx) {
+        return NULL;
+    }
+
+    for (i = 0; i < exp->nr_threads; i++) {
+        NBDExportThread *thread = &exp->threads[i];
+        BlockExportThreadInfo *info = g_new(BlockExportThreadInfo, 1);
+
+        *info = (BlockExportThreadInfo) {
+            .iothread       = g_strdup(thread->iothread),
+            .clients        = thread->nr_clients,
+            .rd_bytes       = stat64_get(&thread->rd_bytes),
+            .wr_bytes       = stat64_get(&thread->wr_bytes),
+            .rd_operations  = stat64_get(&thread->rd_ops),
+            .wr_operations  = stat64_get(&thread->wr_ops),
+        };
+        QAPI_LIST_APPEND(tail, info);
+    }
+
+    return head;
 }
 
 const BlockExportDriver blk_exp_nbd = {
-    .type               = BLOCK_EXPORT_TYPE_NBD,
-    .instance_size      = sizeof(NBDExport),
-    .supports_inactive  = true,
-    .create             = nbd_export_create,
-    .delete             = nbd_export_delete,
-    .request_shutdown   = nbd_export_request_shutdown,
+    .type                   = BLOCK_EXPORT_TYPE_NBD,
+    .instance_size          = sizeof(NBDExport),
+    .supports_inactive      = true,
+    .supports_multithread   = true,
+    .create                 = nbd_export_create,
+    .delete                 = nbd_export_delete,
+    .request_shutdown       = nbd_export_request_shutdown,
+    .query_threads          = nbd_export_query_threads,
 };
 
-static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
-                                        unsigned niov, Error **errp)
+/*
+ * Decide whether a read payload of @bytes can be sent with MSG_ZEROCOPY, and
+ * account for it if so.
+ */
+static bool nbd_client_try_zero_copy(NBDClient *client, size_t bytes)
+{
+    if (!client->zero_copy || bytes < NBD_ZERO_COPY_MIN_BYTES) {
+        return false;
+    }
+
+    QEMU_LOCK_GUARD(&client->lock);
+    nbd_client_reap_zero_copy(client);
+    if (client->zero_copy_pending + bytes > NBD_ZERO_COPY_MAX_PENDING) {
+        return false;
+    }
+    client->zero_copy_pending += bytes;
+    return true;
+}
+
+/* Undo nbd_client_try_zero_copy() for a payload that was not sent that way */
+static void nbd_client_cancel_zero_copy(NBDClient *client, size_t bytes)
+{
+    QEMU_LOCK_GUARD(&client->lock);
+    client->zero_copy_pending -= bytes;
+}
+
+/*
+ * Send the read payload @iov, which points into @req->data, with MSG_ZEROCOPY.
+ * If the kernel cannot pin any more pages (ENOBUFS, usually because of the
+ * locked memory limit), the rest is copied and zero copy is turned off for
+ * the client.  Must be called with client->send_lock held.
+ *
+ * The payload must have been accounted with nbd_client_try_zero_copy(); on
+ * return, @req owns that accounting, even if sending failed.
+ */
+static int coroutine_fn nbd_co_send_zero_copy(NBDClient *client,
+                                              NBDRequestData *req,
+                                              struct iovec *iov,
+                                              Error **errp)
+{
+    struct iovec local_iov = *iov;
+    int flags = QIO_CHANNEL_WRITE_FLAG_ZERO_COPY;
+    Error *local_err = NULL;
+    ssize_t len;
+    int ret = 0;
+
+    while (local_iov.iov_len) {
+        len = qio_channel_writev_full(client->ioc, &local_iov, 1, NULL, 0,
+                                      flags, &local_err);
+        if (len == QIO_CHANNEL_ERR_BLOCK) {
+            qio_channel_yield(client->ioc, G_IO_OUT);
+            continue;
+        }
+        if (len < 0) {
+            if (!flags || errno != ENOBUFS) {
+                error_propagate(errp, local_err);
+                ret = -1;
+                break;
+            }
+            trace_nbd_co_send_zero_copy_fallback(client,
+                                                 error_get_pretty(local_err));
+            error_free(local_err);
+            local_err = NULL;
+            client->zero_copy = false;
+            flags = 0;
+            continue;
+        }
+        local_iov.iov_base += len;
+        local_iov.iov_len -= len;
+    }
+
+    /*
+     * Even if this payload ended up being copied or failed, an earlier part of
+     * @req->data may still be in flight, so keep the buffer until the sends
+     * queued so far have completed.  If nothing was ever queued, there is
+     * nothing to wait for.
+     */
+    if (client->sioc->zero_copy_queued) {
+        req->zero_copy_seq = client->sioc->zero_copy_queued;
+        req->zero_copy_bytes += iov->iov_len;
+    } else {
+        nbd_client_cancel_zero_copy(client, iov->iov_len);
+    }
+    return ret;
+}
+
+/*
+ * Send @iov to the client.  If @req is non-NULL, the last element of @iov
+ * points into @req->data, which may then be sent without copying; in this
+ * case nbd_request_put() takes care of keeping the buffer alive for as long
+ * as the kernel needs it.
+ */
+static int coroutine_fn nbd_co_send_iov_full(NBDClient *client,
+                                             NBDRequestData *req,
+                                             struct iovec *iov, unsigned niov,
+                                             Error **errp)
 {
     int ret;
 
@@ -2041,7 +2325,18 @@ static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
     qemu_co_mutex_lock(&client->send_lock);
     client->send_coroutine = qemu_coroutine_self();
 
-    ret = qio_channel_writev_all(client->ioc, iov, niov, errp) < 0 ? -EIO : 0;
+    if (req && nbd_client_try_zero_copy(client, iov[niov - 1].iov_len)) {
+        /* The header lives on the stack, so it must be copied */
+        ret = qio_channel_writev_all(client->ioc, iov, niov - 1, errp);
+        if (ret == 0) {
+            ret = nbd_co_send_zero_copy(client, req, &iov[niov - 1], errp);
+        } else {
+            nbd_client_cancel_zero_copy(client, iov[niov - 1].iov_len);
+        }
+    } else {
+        ret = qio_channel_writev_all(client->ioc, iov, niov, errp);
+    }
+    ret = ret < 0 ? -EIO : 0;
 
     client->send_coroutine = NULL;
     qemu_co_mutex_unlock(&client->send_lock);
@@ -2049,6 +2344,12 @@ static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
     return ret;
 }
 
+static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
+                                        unsigned niov, Error **errp)
+{
+    return nbd_co_send_iov_full(client, NULL, iov, niov, errp);
+}
+
 static inline void set_be_simple_reply(NBDSimpleReply *reply, uint64_t error,
                                        uint64_t cookie)
 {
@@ -2057,10 +2358,14 @@ static inline void set_be_simple_reply(NBDSimpleReply *reply, uint64_t error,
     stq_be_p(&reply->cookie, cookie);
 }
 
+/*
+ * Send a simple reply.  If @len is non-zero, the first @len bytes of
+ * @req->data are sent as its payload.
+ */
 static int coroutine_fn nbd_co_send_simple_reply(NBDClient *client,
                                                  NBDRequest *request,
                                                  uint32_t error,
-                                                 void *data,
+                                                 NBDRequestData *req,
                                                  uint64_t len,
                                                  Error **errp)
 {
@@ -2068,7 +2373,7 @@ static int coroutine_fn nbd_co_send_simple_reply(NBDClient *client,
     int nbd_err = system_errno_to_nbd_errno(error);
     struct iovec iov[] = {
         {.iov_base = &reply, .iov_len = sizeof(reply)},
-        {.iov_base = data, .iov_len = len}
+        {.iov_base = len ? req->data : NULL, .iov_len = len}
     };
 
     assert(!len || !nbd_err);
@@ -2080,7 +2385,7 @@ static int coroutine_fn nbd_co_send_simple_reply(NBDClient *client,
                                    nbd_err_lookup(nbd_err), len);
     set_be_simple_reply(&reply, nbd_err, request->cookie);
 
-    return nbd_co_send_iov(client, iov, 2, errp);
+    return nbd_co_send_iov_full(client, len ? req : NULL, iov, 2, errp);
 }
 
 /*
@@ -2141,6 +2446,7 @@ static int coroutine_fn nbd_co_send_chunk_done(NBDClient *client,
 
 static int coroutine_fn nbd_co_send_chunk_read(NBDClient *client,
                                                NBDRequest *request,
+                                               NBDRequestData *req,
                                                uint64_t offset,
                                                void *data,
                                                uint64_t size,
@@ -2161,7 +2467,7 @@ static int coroutine_fn nbd_co_send_chunk_read(NBDClient *client,
                  NBD_REPLY_TYPE_OFFSET_DATA, request);
     stq_be_p(&chunk.offset, offset);
 
-    return nbd_co_send_iov(client, iov, 3, errp);
+    return nbd_co_send_iov_full(client, req, iov, 3, errp);
 }
 
 static int coroutine_fn nbd_co_send_chunk_error(NBDClient *client,
@@ -2197,12 +2503,13 @@ static int coroutine_fn nbd_co_send_chunk_error(NBDClient *client,
 static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
                                                 NBDRequest *request,
                                                 uint64_t offset,
-                                                uint8_t *data,
+                                                NBDRequestData *req,
                                                 uint64_t size,
                                                 Error **errp)
 {
     int ret = 0;
     NBDExport *exp = client->exp;
+    uint8_t *data = req->data;
     size_t progress = 0;
 
     assert(size <= NBD_MAX_BUFFER_SIZE);
@@ -2247,8 +2554,9 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
                 error_setg_errno(errp, -ret, "reading from file failed");
                 break;
             }
-            ret = nbd_co_send_chunk_read(client, request, offset + progress,
-                                         data + progress, pnum, final, errp);
+            ret = nbd_co_send_chunk_read(client, request, req,
+                                         offset + progress, data + progress,
+                                         pnum, final, errp);
         }
 
         if (ret < 0) {
@@ -2843,10 +3151,11 @@ static coroutine_fn int nbd_send_generic_reply(NBDClient *client,
  * Return -errno if sending fails. Other errors are reported directly to the
  * client as an error reply. */
 static coroutine_fn int nbd_do_cmd_read(NBDClient *client, NBDRequest *request,
-                                        uint8_t *data, Error **errp)
+                                        NBDRequestData *req, Error **errp)
 {
     int ret;
     NBDExport *exp = client->exp;
+    uint8_t *data = req->data;
 
     assert(request->type == NBD_CMD_READ);
     assert(request->len <= NBD_MAX_BUFFER_SIZE);
@@ -2864,7 +3173,7 @@ static coroutine_fn int nbd_do_cmd_read(NBDClient *client, NBDRequest *request,
         !(request->flags & NBD_CMD_FLAG_DF) && request->len)
     {
         return nbd_co_send_sparse_read(client, request, request->from,
-                                       data, request->len, errp);
+                                       req, request->len, errp);
     }
 
     ret = blk_co_pread(exp->common.blk, request->from, request->len, data, 0);
@@ -2875,14 +3184,14 @@ static coroutine_fn int nbd_do_cmd_read(NBDClient *client, NBDRequest *request,
 
     if (client->mode >= NBD_MODE_STRUCTURED) {
         if (request->len) {
-            return nbd_co_send_chunk_read(client, request, request->from, data,
-                                          request->len, true, errp);
+            return nbd_co_send_chunk_read(client, request, req, request->from,
+                                          data, request->len, true, errp);
         } else {
             return nbd_co_send_chunk_done(client, request, errp);
         }
     } else {
         return nbd_co_send_simple_reply(client, request, 0,
-                                        data, request->len, errp);
+                                        req, request->len, errp);
     }
 }
 
@@ -2914,7 +3223,7 @@ static coroutine_fn int nbd_do_cmd_cache(NBDClient *client, NBDRequest *request,
  * client as an error reply. */
 static coroutine_fn int nbd_handle_request(NBDClient *client,
                                            NBDRequest *request,
-                                           uint8_t *data, Error **errp)
+                                           NBDRequestData *req, Error **errp)
 {
     int ret;
     int flags;
@@ -2943,7 +3252,9 @@ static coroutine_fn int nbd_handle_request(NBDClient *client,
         return nbd_do_cmd_cache(client, request, errp);
 
     case NBD_CMD_READ:
-        return nbd_do_cmd_read(client, request, data, errp);
+        stat64_add(&client->thread->rd_ops, 1);
+        stat64_add(&client->thread->rd_bytes, request->len);
+        return nbd_do_cmd_read(client, request, req, errp);
 
     case NBD_CMD_WRITE:
         flags = 0;
@@ -2951,8 +3262,10 @@ static coroutine_fn int nbd_handle_request(NBDClient *client,
             flags |= BDRV_REQ_FUA;
         }
         assert(request->len <= NBD_MAX_BUFFER_SIZE);
-        ret = blk_co_pwrite(exp->common.blk, request->from, request->len, data,
-                            flags);
+        stat64_add(&client->thread->wr_ops, 1);
+        stat64_add(&client->thread->wr_bytes, request->len);
+        ret = blk_co_pwrite(exp->common.blk, request->from, request->len,
+                            req->data, flags);
         return nbd_send_generic_reply(client, request, ret,
                                       "writing to file failed", errp);
 
@@ -3145,7 +3458,7 @@ static coroutine_fn void nbd_trip(void *opaque)
                                      error_get_pretty(export_err), &local_err);
         error_free(export_err);
     } else {
-        ret = nbd_handle_request(client, &request, req->data, &local_err);
+        ret = nbd_handle_request(client, &request, req, &local_err);
     }
     if (request.contexts && request.contexts != &client->contexts) {
         assert(request.type == NBD_CMD_BLOCK_STATUS);
@@ -3207,7 +3520,7 @@ static void nbd_client_receive_next_request(NBDClient *client)
         nbd_client_get(client);
         req = nbd_request_get(client);
         client->recv_coroutine = qemu_coroutine_create(nbd_trip, req);
-        aio_co_schedule(client->exp->common.ctx, client->recv_coroutine);
+        aio_co_schedule(nbd_client_aio_context(client), client->recv_coroutine);
     }
 }
 
@@ -3276,6 +3589,7 @@ void nbd_client_new(QIOChannelSocket *sioc,
 
     client = g_new0(NBDClient, 1);
     qemu_mutex_init(&client->lock);
+    QSIMPLEQ_INIT(&client->zero_copy_buffers);
     client->refcount = 1;
     client->tlscreds = tlscreds;
     if (tlscreds) {
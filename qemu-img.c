@@ -44,6 +44,7 @@
 #include "qemu/sockets.h"
 #include "qemu/units.h"
 #include "qemu/memalign.h"
+#include "qemu/bitmap.h"
 #include "qom/object_interfaces.h"
 #include "system/block-backend.h"
 #include "block/block_int.h"
@@ -86,6 +87,9 @@ enum {
     OPTION_BITMAPS = 275,
     OPTION_FORCE = 276,
     OPTION_SKIP_BROKEN = 277,
+    OPTION_CHECKPOINT = 278,
+    OPTION_RESUME = 279,
+    OPTION_TIMING = 280,
 };
 
 typedef enum OutputFormat {
@@ -201,12 +205,15 @@ void help(void)
            "       '-r leaks' repairs only cluster leaks, whereas '-r all' fixes all\n"
            "       kinds of errors, with a higher risk of choosing the wrong fix or\n"
            "       hiding corruption that has already occurred.\n"
+           "  '--timing' reports the time spent in the phases of the check\n"
            "\n"
            "Parameters to convert subcommand:\n"
            "  '--bitmaps' copies all top-level persistent bitmaps to destination\n"
            "  '-m' specifies how many coroutines work in parallel during the convert\n"
            "       process (defaults to 8)\n"
            "  '-W' allow to write to the target out of order rather than sequential\n"
+           "  '--checkpoint' records the progress in a file so that an interrupted\n"
+           "       conversion can be continued with '-n --resume'\n"
            "\n"
            "Parameters to snapshot subcommand:\n"
            "  'snapshot' is the name of the snapshot to create, apply or delete\n"
@@ -666,15 +673,43 @@ static void dump_human_image_check(ImageCheck *check, bool quiet)
         qprintf(quiet,
                 "Image end offset: %" PRId64 "\n", check->image_end_offset);
     }
+
+    if (check->phases) {
+        ImageCheckPhaseList *elem;
+
+        qprintf(quiet, "Check phases:\n");
+        for (elem = check->phases; elem; elem = elem->next) {
+            qprintf(quiet, "    %s: %0.3f s\n", elem->value->name,
+                    elem->value->duration_ns / (double)NANOSECONDS_PER_SECOND);
+        }
+    }
+}
+
+static void image_check_add_phase(ImageCheck *check, const char *name,
+                                  int64_t duration_ns)
+{
+    ImageCheckPhaseList **tail = &check->phases;
+    ImageCheckPhase *phase = g_new(ImageCheckPhase, 1);
+
+    *phase = (ImageCheckPhase) {
+        .name           = g_strdup(name),
+        .duration_ns    = duration_ns,
+    };
+
+    while (*tail) {
+        tail = &(*tail)->next;
+    }
+    QAPI_LIST_APPEND(tail, phase);
 }
 
 static int collect_image_check(BlockDriverState *bs,
                    ImageCheck *check,
                    const char *filename,
                    const char *fmt,
-                   int fix)
+                   int fix,
+                   bool timing)
 {
-    int ret;
+    int ret, i;
     BdrvCheckResult result;
 
     ret = bdrv_check(bs, &result, fix);
@@ -704,6 +739,11 @@ static int collect_image_check(BlockDriverState *bs,
     check->compressed_clusters      = result.bfi.compressed_clusters;
     check->has_compressed_clusters  = result.bfi.compressed_clusters != 0;
 
+    for (i = 0; timing && i < result.nb_phases; i++) {
+        image_check_add_phase(check, result.phases[i].name,
+                              result.phases[i].duration_ns);
+    }
+
     return 0;
 }
 
@@ -730,6 +770,7 @@ static int img_check(int argc, char **argv)
     bool quiet = false;
     bool image_opts = false;
     bool force_share = false;
+    bool timing = false;
 
     fmt = NULL;
     output = NULL;
@@ -745,6 +786,7 @@ static int img_check(int argc, char **argv)
             {"object", required_argument, 0, OPTION_OBJECT},
             {"image-opts", no_argument, 0, OPTION_IMAGE_OPTS},
             {"force-share", no_argument, 0, 'U'},
+            {"timing", no_argument, 0, OPTION_TIMING},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv, ":hf:r:T:qU",
@@ -795,6 +837,9 @@ static int img_check(int argc, char **argv)
         case OPTION_IMAGE_OPTS:
             image_opts = true;
             break;
+        case OPTION_TIMING:
+            timing = true;
+            break;
         }
     }
     if (optind != argc - 1) {
@@ -825,7 +870,7 @@ static int img_check(int argc, char **argv)
     bs = blk_bs(blk);
 
     check = g_new0(ImageCheck, 1);
-    ret = collect_image_check(bs, check, filename, fmt, fix);
+    ret = collect_image_check(bs, check, filename, fmt, fix, timing);
 
     if (ret == -ENOTSUP) {
         error_report("This image format does not support checks");
@@ -836,6 +881,8 @@ static int img_check(int argc, char **argv)
     if (check->corruptions_fixed || check->leaks_fixed) {
         int corruptions_fixed, leaks_fixed;
         bool has_leaks_fixed, has_corruptions_fixed;
+        ImageCheckPhaseList *phases, *elem;
+        int64_t double_check_ns = 0;
 
         leaks_fixed         = check->leaks_fixed;
         has_leaks_fixed     = check->has_leaks_fixed;
@@ -852,14 +899,26 @@ static int img_check(int argc, char **argv)
                     check->corruptions_fixed);
         }
 
+        /* Report the phases of the repair, and the double check as one */
+        phases = g_steal_pointer(&check->phases);
+
         qapi_free_ImageCheck(check);
         check = g_new0(ImageCheck, 1);
-        ret = collect_image_check(bs, check, filename, fmt, 0);
+        ret = collect_image_check(bs, check, filename, fmt, 0, timing);
 
         check->leaks_fixed          = leaks_fixed;
         check->has_leaks_fixed      = has_leaks_fixed;
         check->corruptions_fixed    = corruptions_fixed;
         check->has_corruptions_fixed = has_corruptions_fixed;
+
+        for (elem = check->phases; elem; elem = elem->next) {
+            double_check_ns += elem->value->duration_ns;
+        }
+        qapi_free_ImageCheckPhaseList(check->phases);
+        check->phases = phases;
+        if (timing && phases) {
+            image_check_add_phase(check, "double check", double_check_ns);
+        }
     }
 
     if (!ret) {
@@ -1273,6 +1332,34 @@ static int is_allocated_sectors_min(const uint8_t *buf, int n, int *pnum,
     return 1;
 }
 
+/*
+ * Like is_allocated_sectors, but for targets that can only write whole
+ * clusters (compressed images): returns true if the first cluster of the
+ * buffer contains non-zero data, and sets *pnum to the number of sectors of
+ * the following clusters that are all zero or all non-zero, respectively.
+ * Only the last cluster of the buffer may be shorter than 'cluster_sectors'.
+ */
+static int is_allocated_clusters(const uint8_t *buf, int n, int *pnum,
+                                 int cluster_sectors)
+{
+    bool is_zero;
+    int i, len;
+
+    len = MIN(n, cluster_sectors);
+    is_zero = buffer_is_zero(buf, len * BDRV_SECTOR_SIZE);
+
+    for (i = len; i < n; i += len) {
+        len = MIN(n - i, cluster_sectors);
+        if (buffer_is_zero(buf + i * BDRV_SECTOR_SIZE,
+                           len * BDRV_SECTOR_SIZE) != is_zero) {
+            break;
+        }
+    }
+
+    *pnum = i;
+    return !is_zero;
+}
+
 /*
  * Compares two buffers chunk by chunk, where @chsize is the chunk size.
  * If @chsize is 0, default chunk size of BDRV_SECTOR_SIZE is used.
@@ -1667,6 +1754,42 @@ enum ImgConvertBlockStatus {
 #define MAX_COROUTINES 16
 #define CONVERT_THROTTLE_GROUP "img_convert"
 
+/*
+ * Checkpoint of a conversion (--checkpoint): the input is divided into
+ * granules, and a granule is recorded as done once all of it has been
+ * written to the target.  The bitmap of done granules is saved to a file
+ * periodically, so that an interrupted conversion can skip these granules
+ * when it is continued with --resume.
+ */
+typedef struct ImgConvertCheckpoint {
+    char *filename;
+    int64_t total_sectors;
+    int64_t target_sectors;
+    int64_t cluster_sectors; /* of the target */
+    int64_t granule_sectors;
+    int64_t nb_granules;
+    unsigned long *done;
+    uint32_t *copied; /* sectors written by this run, per granule */
+    int64_t last_save; /* g_get_monotonic_time() */
+    bool saving;
+} ImgConvertCheckpoint;
+
+typedef struct QEMU_PACKED ImgConvertCheckpointHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t total_size;
+    uint64_t granule_size;
+    uint64_t target_size;
+    uint64_t target_cluster_size;
+} ImgConvertCheckpointHeader;
+
+#define CONVERT_CHECKPOINT_MAGIC "QIMGCKPT"
+#define CONVERT_CHECKPOINT_VERSION 1
+#define CONVERT_CHECKPOINT_MIN_GRANULE (1 * MiB)
+#define CONVERT_CHECKPOINT_MAX_GRANULES (1 << 20)
+#define CONVERT_CHECKPOINT_INTERVAL (10 * G_USEC_PER_SEC)
+
 typedef struct ImgConvertState {
     BlockBackend **src;
     int64_t *src_sectors;
@@ -1693,6 +1816,7 @@ typedef struct ImgConvertState {
     int alignment;
     size_t cluster_sectors;
     size_t buf_sectors;
+    ImgConvertCheckpoint *checkpoint;
     long num_coroutines;
     int running_coroutines;
     Coroutine *co[MAX_COROUTINES];
@@ -1713,6 +1837,235 @@ static void convert_select_part(ImgConvertState *s, int64_t sector_num,
     }
 }
 
+static void convert_checkpoint_free(ImgConvertCheckpoint *c)
+{
+    if (c) {
+        g_free(c->filename);
+        g_free(c->done);
+        g_free(c->copied);
+        g_free(c);
+    }
+}
+
+static int convert_checkpoint_load(ImgConvertCheckpoint *c, Error **errp)
+{
+    g_autofree char *buf = NULL;
+    g_autoptr(GError) gerr = NULL;
+    ImgConvertCheckpointHeader *header;
+    size_t len, bitmap_len;
+    uint64_t total_size, target_size, cluster_size, granule_size;
+
+    if (!g_file_get_contents(c->filename, &buf, &len, &gerr)) {
+        error_setg(errp, "Could not read checkpoint '%s': %s",
+                   c->filename, gerr->message);
+        return -1;
+    }
+
+    header = (ImgConvertCheckpointHeader *)buf;
+    if (len < sizeof(*header) ||
+        memcmp(header->magic, CONVERT_CHECKPOINT_MAGIC,
+               sizeof(header->magic))) {
+        error_setg(errp, "'%s' is not a convert checkpoint", c->filename);
+        return -1;
+    }
+    if (le32_to_cpu(header->version) != CONVERT_CHECKPOINT_VERSION) {
+        error_setg(errp, "Unsupported checkpoint version %" PRIu32,
+                   le32_to_cpu(header->version));
+        return -1;
+    }
+    total_size = c->total_sectors * BDRV_SECTOR_SIZE;
+    if (le64_to_cpu(header->total_size) != total_size) {
+        error_setg(errp, "Checkpoint is for an input of %" PRIu64 " bytes, "
+                   "but the input has %" PRIu64 " bytes",
+                   le64_to_cpu(header->total_size), total_size);
+        return -1;
+    }
+    target_size = c->target_sectors * BDRV_SECTOR_SIZE;
+    cluster_size = c->cluster_sectors * BDRV_SECTOR_SIZE;
+    if (le64_to_cpu(header->target_size) != target_size ||
+        le64_to_cpu(header->target_cluster_size) != cluster_size) {
+        error_setg(errp, "Checkpoint is for a target of %" PRIu64 " bytes "
+                   "with %" PRIu64 " byte clusters, but the target has %"
+                   PRIu64 " bytes with %" PRIu64 " byte clusters",
+                   le64_to_cpu(header->target_size),
+                   le64_to_cpu(header->target_cluster_size),
+                   target_size, cluster_size);
+        return -1;
+    }
+
+    granule_size = le64_to_cpu(header->granule_size);
+    if (!is_power_of_2(granule_size) || granule_size < BDRV_SECTOR_SIZE ||
+        DIV_ROUND_UP(total_size, granule_size) >
+        CONVERT_CHECKPOINT_MAX_GRANULES) {
+        error_setg(errp, "Invalid checkpoint granularity %" PRIu64,
+                   granule_size);
+        return -1;
+    }
+    c->granule_sectors = granule_size / BDRV_SECTOR_SIZE;
+    c->nb_granules = DIV_ROUND_UP(c->total_sectors, c->granule_sectors);
+
+    bitmap_len = BITS_TO_LONGS(c->nb_granules) * sizeof(unsigned long);
+    if (len != sizeof(*header) + bitmap_len) {
+        error_setg(errp, "Checkpoint '%s' is truncated", c->filename);
+        return -1;
+    }
+
+    c->done = bitmap_new(c->nb_granules);
+    bitmap_from_le(c->done, (unsigned long *)(buf + sizeof(*header)),
+                   c->nb_granules);
+    return 0;
+}
+
+/*
+ * Set up checkpointing of a conversion of @total_sectors into @filename.  If
+ * @resume is true, the progress recorded in the existing file is loaded; it
+ * must have been written for an input of the same size and a target of the
+ * same size (@target_sectors) and cluster size (@cluster_sectors).  Granules
+ * are at least one target cluster large.
+ */
+static ImgConvertCheckpoint *convert_checkpoint_new(const char *filename,
+                                                    int64_t total_sectors,
+                                                    int64_t target_sectors,
+                                                    int64_t cluster_sectors,
+                                                    bool resume, Error **errp)
+{
+    ImgConvertCheckpoint *c = g_new0(ImgConvertCheckpoint, 1);
+    uint64_t granule_size;
+
+    c->filename = g_strdup(filename);
+    c->total_sectors = total_sectors;
+    c->target_sectors = target_sectors;
+    c->cluster_sectors = cluster_sectors;
+
+    if (resume) {
+        if (convert_checkpoint_load(c, errp) < 0) {
+            convert_checkpoint_free(c);
+            return NULL;
+        }
+    } else {
+        granule_size = MAX(CONVERT_CHECKPOINT_MIN_GRANULE,
+                           cluster_sectors * BDRV_SECTOR_SIZE);
+        granule_size = MAX(granule_size,
+                           DIV_ROUND_UP(total_sectors * BDRV_SECTOR_SIZE,
+                                        CONVERT_CHECKPOINT_MAX_GRANULES));
+        granule_size = pow2ceil(granule_size);
+        c->granule_sectors = granule_size / BDRV_SECTOR_SIZE;
+        c->nb_granules = DIV_ROUND_UP(total_sectors, c->granule_sectors);
+        c->done = bitmap_new(c->nb_granules);
+    }
+
+    c->copied = g_new0(uint32_t, c->nb_granules);
+    c->last_save = g_get_monotonic_time();
+    return c;
+}
+
+/* Build the checkpoint file contents for the current state */
+static char *convert_checkpoint_serialize(ImgConvertCheckpoint *c,
+                                          size_t *len)
+{
+    size_t bitmap_len = BITS_TO_LONGS(c->nb_granules) * sizeof(unsigned long);
+    ImgConvertCheckpointHeader header = {
+        .version        = cpu_to_le32(CONVERT_CHECKPOINT_VERSION),
+        .total_size     = cpu_to_le64(c->total_sectors * BDRV_SECTOR_SIZE),
+        .granule_size   = cpu_to_le64(c->granule_sectors * BDRV_SECTOR_SIZE),
+        .target_size    = cpu_to_le64(c->target_sectors * BDRV_SECTOR_SIZE),
+        .target_cluster_size =
+            cpu_to_le64(c->cluster_sectors * BDRV_SECTOR_SIZE),
+    };
+    char *buf;
+
+    memcpy(header.magic, CONVERT_CHECKPOINT_MAGIC, sizeof(header.magic));
+    *len = sizeof(header) + bitmap_len;
+    buf = g_malloc0(*len);
+    memcpy(buf, &header, sizeof(header));
+    bitmap_to_le((unsigned long *)(buf + sizeof(header)), c->done,
+                 c->nb_granules);
+    return buf;
+}
+
+static int convert_checkpoint_write(ImgConvertCheckpoint *c, const char *buf,
+                                    size_t len, Error **errp)
+{
+    g_autoptr(GError) gerr = NULL;
+
+    /* g_file_set_contents() replaces the file atomically */
+    if (!g_file_set_contents(c->filename, buf, len, &gerr)) {
+        error_setg(errp, "Could not write checkpoint '%s': %s",
+                   c->filename, gerr->message);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Save the checkpoint after making sure that everything it records as done
+ * is actually written to the target.
+ */
+static int coroutine_mixed_fn convert_checkpoint_save(ImgConvertState *s,
+                                                      Error **errp)
+{
+    ImgConvertCheckpoint *c = s->checkpoint;
+    g_autofree char *buf = NULL;
+    size_t len;
+    int ret;
+
+    /* Granules completed while flushing are only recorded next time */
+    buf = convert_checkpoint_serialize(c, &len);
+
+    c->saving = true;
+    ret = blk_flush(s->target);
+    c->saving = false;
+    c->last_save = g_get_monotonic_time();
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not flush the target image");
+        return ret;
+    }
+
+    return convert_checkpoint_write(c, buf, len, errp);
+}
+
+/*
+ * Limit *n so that [sector_num, sector_num + *n) is either entirely in
+ * granules that an earlier run completed, or entirely outside of them.
+ * Returns true in the former case.
+ */
+static bool convert_checkpoint_skip(ImgConvertCheckpoint *c,
+                                    int64_t sector_num, int *n)
+{
+    int64_t granule = sector_num / c->granule_sectors;
+    int64_t next;
+    bool done = test_bit(granule, c->done);
+
+    if (done) {
+        next = find_next_zero_bit(c->done, c->nb_granules, granule);
+    } else {
+        next = find_next_bit(c->done, c->nb_granules, granule);
+    }
+    *n = MIN(*n, next * c->granule_sectors - sector_num);
+    return done;
+}
+
+/* Record that [sector_num, sector_num + n) has been written */
+static void convert_checkpoint_update(ImgConvertCheckpoint *c,
+                                      int64_t sector_num, int n)
+{
+    int64_t end = sector_num + n;
+
+    while (sector_num < end) {
+        int64_t granule = sector_num / c->granule_sectors;
+        int64_t granule_start = granule * c->granule_sectors;
+        int64_t granule_end = MIN(granule_start + c->granule_sectors,
+                                  c->total_sectors);
+        int64_t count = MIN(end, granule_end) - sector_num;
+
+        c->copied[granule] += count;
+        if (granule_start + c->copied[granule] == granule_end) {
+            set_bit(granule, c->done);
+        }
+        sector_num += count;
+    }
+}
+
 static int coroutine_mixed_fn GRAPH_RDLOCK
 convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
 {
@@ -1897,14 +2250,16 @@ static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
              * is real non-zero data, we must write it. Otherwise we can treat
              * it as zero sectors.
              * Compressed clusters need to be written as a whole, so in that
-             * case we can only save the write if the buffer is completely
-             * zeroed. */
+             * case we can only save the write for completely zeroed
+             * clusters. A run of non-zero clusters is written with a single
+             * request so that the format driver can compress them in
+             * parallel. */
             if (!s->min_sparse ||
                 (!s->compressed &&
                  is_allocated_sectors_min(buf, n, &n, s->min_sparse,
                                           sector_num, s->alignment)) ||
                 (s->compressed &&
-                 !buffer_is_zero(buf, n * BDRV_SECTOR_SIZE)))
+                 is_allocated_clusters(buf, n, &n, s->cluster_sectors)))
             {
                 ret = blk_co_pwrite(s->target, sector_num << BDRV_SECTOR_BITS,
                                     n << BDRV_SECTOR_BITS, buf, flags);
@@ -1969,6 +2324,24 @@ static int coroutine_fn convert_co_copy_range(ImgConvertState *s, int64_t sector
     return 0;
 }
 
+static void coroutine_fn convert_co_checkpoint_update(ImgConvertState *s,
+                                                      int64_t sector_num,
+                                                      int n)
+{
+    ImgConvertCheckpoint *c = s->checkpoint;
+    Error *local_err = NULL;
+
+    convert_checkpoint_update(c, sector_num, n);
+
+    if (!c->saving &&
+        g_get_monotonic_time() - c->last_save >= CONVERT_CHECKPOINT_INTERVAL) {
+        /* Failing to save a checkpoint does not fail the conversion */
+        if (convert_checkpoint_save(s, &local_err) < 0) {
+            warn_report_err(local_err);
+        }
+    }
+}
+
 static void coroutine_fn convert_co_do_copy(void *opaque)
 {
     ImgConvertState *s = opaque;
@@ -1992,6 +2365,7 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
         int64_t sector_num;
         enum ImgConvertBlockStatus status;
         bool copy_range;
+        bool skip = false;
 
         qemu_co_mutex_lock(&s->lock);
         if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
@@ -2012,12 +2386,17 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
         if (!s->min_sparse && s->status == BLK_ZERO) {
             n = MIN(n, s->buf_sectors);
         }
+        if (s->checkpoint) {
+            skip = convert_checkpoint_skip(s->checkpoint, sector_num, &n);
+        }
         /* increment global sector counter so that other coroutines can
          * already continue reading beyond this request */
         s->sector_num += n;
         qemu_co_mutex_unlock(&s->lock);
 
-        if (status == BLK_DATA || (!s->min_sparse && status == BLK_ZERO)) {
+        /* Skipped areas were accounted for in convert_do_copy() already */
+        if (!skip &&
+            (status == BLK_DATA || (!s->min_sparse && status == BLK_ZERO))) {
             s->allocated_done += n;
             qemu_progress_print(100.0 * s->allocated_done /
                                         s->allocated_sectors, 0);
@@ -2025,7 +2404,9 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
 
 retry:
         copy_range = s->copy_range && s->status == BLK_DATA;
-        if (status == BLK_DATA && !copy_range) {
+        if (skip) {
+            /* Completed by an earlier run, only keep the write order */
+        } else if (status == BLK_DATA && !copy_range) {
             ret = convert_co_read(s, sector_num, n, buf);
             if (ret < 0) {
                 error_report("error while reading at byte %lld: %s",
@@ -2046,7 +2427,7 @@ retry:
             s->wait_sector_num[index] = -1;
         }
 
-        if (s->ret == -EINPROGRESS) {
+        if (s->ret == -EINPROGRESS && !skip) {
             if (copy_range) {
                 WITH_GRAPH_RDLOCK_GUARD() {
                     ret = convert_co_copy_range(s, sector_num, n);
@@ -2062,6 +2443,8 @@ retry:
                 error_report("error while writing at byte %lld: %s",
                              sector_num * BDRV_SECTOR_SIZE, strerror(-ret));
                 s->ret = ret;
+            } else if (s->checkpoint) {
+                convert_co_checkpoint_update(s, sector_num, n);
             }
         }
 
@@ -2105,30 +2488,50 @@ static int convert_do_copy(ImgConvertState *s)
         bdrv_graph_rdunlock_main_loop();
     }
 
-    /* Allocate buffer for copied data. For compressed images, only one cluster
-     * can be copied at a time. */
+    /* Allocate buffer for copied data. For compressed images, only whole
+     * clusters can be copied. */
     if (s->compressed) {
         if (s->cluster_sectors <= 0 || s->cluster_sectors > s->buf_sectors) {
             error_report("invalid cluster size");
             return -EINVAL;
         }
-        s->buf_sectors = s->cluster_sectors;
+        s->buf_sectors = QEMU_ALIGN_DOWN(s->buf_sectors, s->cluster_sectors);
     }
 
     while (sector_num < s->total_sectors) {
+        bool done = false;
+
         bdrv_graph_rdlock_main_loop();
         n = convert_iteration_sectors(s, sector_num);
         bdrv_graph_rdunlock_main_loop();
         if (n < 0) {
             return n;
         }
+        if (s->checkpoint) {
+            done = convert_checkpoint_skip(s->checkpoint, sector_num, &n);
+        }
         if (s->status == BLK_DATA || (!s->min_sparse && s->status == BLK_ZERO))
         {
             s->allocated_sectors += n;
+            if (done) {
+                s->allocated_done += n;
+            }
         }
         sector_num += n;
     }
 
+    if (s->checkpoint) {
+        /*
+         * Start from what an earlier run already copied, so that the rate
+         * only covers the data that is actually copied now.
+         */
+        if (s->allocated_sectors) {
+            qemu_progress_print(100.0 * s->allocated_done /
+                                        s->allocated_sectors, 0);
+        }
+        qemu_progress_enable_rate(s->allocated_sectors * BDRV_SECTOR_SIZE);
+    }
+
     /* Do the copy */
     s->sector_next_status = 0;
     s->ret = -EINPROGRESS;
@@ -2254,6 +2657,8 @@ static int img_convert(int argc, char **argv)
     bool bitmaps = false;
     bool skip_broken = false;
     int64_t rate_limit = 0;
+    const char *checkpoint = NULL;
+    bool resume = false;
 
     ImgConvertState s = (ImgConvertState) {
         /* Need at least 4k of zeros for sparse detection */
@@ -2275,6 +2680,8 @@ static int img_convert(int argc, char **argv)
             {"target-is-zero", no_argument, 0, OPTION_TARGET_IS_ZERO},
             {"bitmaps", no_argument, 0, OPTION_BITMAPS},
             {"skip-broken-bitmaps", no_argument, 0, OPTION_SKIP_BROKEN},
+            {"checkpoint", required_argument, 0, OPTION_CHECKPOINT},
+            {"resume", no_argument, 0, OPTION_RESUME},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv, ":hf:O:B:CcF:o:l:S:pt:T:qnm:WUr:",
@@ -2409,6 +2816,12 @@ static int img_convert(int argc, char **argv)
         case OPTION_SKIP_BROKEN:
             skip_broken = true;
             break;
+        case OPTION_CHECKPOINT:
+            checkpoint = optarg;
+            break;
+        case OPTION_RESUME:
+            resume = true;
+            break;
         }
     }
 
@@ -2451,6 +2864,21 @@ static int img_convert(int argc, char **argv)
         goto fail_getopt;
     }
 
+    if (resume && !checkpoint) {
+        error_report("--resume requires --checkpoint");
+        goto fail_getopt;
+    }
+
+    if (resume && !skip_create) {
+        error_report("--resume requires use of -n flag");
+        goto fail_getopt;
+    }
+
+    if (checkpoint && s.compressed) {
+        error_report("Cannot use --checkpoint when -c is used");
+        goto fail_getopt;
+    }
+
     s.src_num = argc - optind - 1;
     out_filename = s.src_num >= 1 ? argv[argc - 1] : NULL;
 
@@ -2779,12 +3207,52 @@ static int img_convert(int argc, char **argv)
         s.cluster_sectors = bdi.cluster_size / BDRV_SECTOR_SIZE;
     }
 
+    if (checkpoint) {
+        int64_t target_sectors;
+
+        if (s.compressed) {
+            error_report("Cannot use --checkpoint with a target that needs "
+                         "compressed writes");
+            ret = -1;
+            goto out;
+        }
+        target_sectors = blk_nb_sectors(s.target);
+        if (target_sectors < 0) {
+            error_report("unable to get output image length: %s",
+                         strerror(-target_sectors));
+            ret = -1;
+            goto out;
+        }
+        s.checkpoint = convert_checkpoint_new(checkpoint, s.total_sectors,
+                                              target_sectors,
+                                              s.cluster_sectors, resume,
+                                              &local_err);
+        if (!s.checkpoint) {
+            error_report_err(local_err);
+            ret = -1;
+            goto out;
+        }
+        if (!resume && convert_checkpoint_save(&s, &local_err) < 0) {
+            error_report_err(local_err);
+            ret = -1;
+            goto out;
+        }
+    }
+
     if (rate_limit) {
         set_rate_limit(s.target, rate_limit);
     }
 
     ret = convert_do_copy(&s);
 
+    if (ret < 0 && s.checkpoint) {
+        /* Record as much progress as possible for --resume */
+        if (convert_checkpoint_save(&s, &local_err) < 0) {
+            warn_report_err(local_err);
+            local_err = NULL;
+        }
+    }
+
     /* Now copy the bitmaps */
     if (bitmaps && ret == 0) {
         ret = convert_copy_bitmaps(blk_bs(s.src[0]), out_bs, skip_broken);
@@ -2795,6 +3263,12 @@ out:
         qemu_progress_print(100, 0);
     }
     qemu_progress_end();
+    if (s.checkpoint) {
+        if (!ret) {
+            unlink(s.checkpoint->filename);
+        }
+        convert_checkpoint_free(s.checkpoint);
+    }
     qemu_opts_del(opts);
     qemu_opts_free(create_opts);
     qobject_unref(open_opts);
@@ -1475,6 +1475,10 @@ SRST
             supporting platforms, and 0 on other platforms. Setting it
             to 0 disables this feature.
 
+        ``compressed-cache-size``
+            The maximum size of the cache of decompressed clusters in
+            bytes (default: 0, which disables the cache)
+
         ``pass-discard-request``
             Whether discard requests to the qcow2 device should be
             forwarded to the data source (on/off; default: on if
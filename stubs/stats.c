@@ -0,0 +1,26 @@
+#include "qemu/osdep.h"
+#include "system/stats.h"
+
+void add_stats_callbacks(StatsProvider provider,
+                         StatRetrieveFunc *stats_fn,
+                         SchemaRetrieveFunc *schemas_fn)
+{
+}
+
+void add_stats_entry(StatsResultList **stats_results, StatsProvider provider,
+                     const char *qom_path, StatsList *stats_list)
+{
+    g_assert_not_reached();
+}
+
+void add_stats_schema(StatsSchemaList **schema_results,
+                      StatsProvider provider, StatsTarget target,
+                      StatsSchemaValueList *stats_list)
+{
+    g_assert_not_reached();
+}
+
+bool apply_str_list_filter(const char *string, strList *list)
+{
+    g_assert_not_reached();
+}
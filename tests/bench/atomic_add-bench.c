@@ -28,6 +28,7 @@ static const char commands_string[] =
     " -n = number of threads\n"
     " -m = use mutexes instead of atomic increments\n"
     " -p = enable sync profiler\n"
+    " -s = enable sync profiler in sampling mode\n"
     " -d = duration in seconds\n"
     " -r = range (will be rounded up to pow2)";
 
@@ -143,7 +144,7 @@ static void parse_args(int argc, char *argv[])
     int c;
 
     for (;;) {
-        c = getopt(argc, argv, "hd:n:mpr:");
+        c = getopt(argc, argv, "hd:n:mpr:s");
         if (c < 0) {
             break;
         }
@@ -163,6 +164,9 @@ static void parse_args(int argc, char *argv[])
         case 'p':
             qsp_enable();
             break;
+        case 's':
+            qsp_enable_sampling(QSP_SAMPLE_PERIOD, QSP_SAMPLE_THRESHOLD_NS);
+            break;
         case 'r':
             range = pow2ceil(atoi(optarg));
             break;
@@ -11,6 +11,7 @@
  * top-level directory.
  */
 #include "qemu/osdep.h"
+#include "qemu/bswap.h"
 #include "qemu/units.h"
 #include "crypto/init.h"
 #include "crypto/cipher.h"
@@ -100,6 +101,98 @@ static void test_cipher_speed(size_t chunk_size,
 }
 
 
+/*
+ * Encrypt requests of @chunk_size bytes the way disk encryption does, as
+ * a sequence of 512 byte sectors that each use their sector number as IV.
+ */
+static void test_cipher_speed_sectors(size_t chunk_size,
+                                      QCryptoCipherMode mode,
+                                      QCryptoCipherAlgo alg)
+{
+    QCryptoCipher *cipher;
+    Error *err = NULL;
+    uint8_t *key = NULL, *iv = NULL;
+    uint8_t *buf = NULL;
+    size_t nkey;
+    size_t niv;
+    const size_t sector_size = 512;
+    const size_t total = 2 * GiB;
+    uint64_t sector = 0;
+    size_t remain, offset;
+
+    if (!qcrypto_cipher_supports(alg, mode)) {
+        return;
+    }
+
+    nkey = qcrypto_cipher_get_key_len(alg);
+    niv = qcrypto_cipher_get_iv_len(alg, mode);
+    if (mode == QCRYPTO_CIPHER_MODE_XTS) {
+        nkey *= 2;
+    }
+
+    key = g_new0(uint8_t, nkey);
+    memset(key, g_test_rand_int(), nkey);
+
+    iv = g_new0(uint8_t, niv);
+
+    buf = g_new0(uint8_t, chunk_size);
+    memset(buf, g_test_rand_int(), chunk_size);
+
+    cipher = qcrypto_cipher_new(alg, mode,
+                                key, nkey, &err);
+    g_assert(cipher != NULL);
+
+    g_test_timer_start();
+    remain = total;
+    while (remain) {
+        for (offset = 0; offset < chunk_size; offset += sector_size) {
+            stq_le_p(iv, sector++);
+            g_assert(qcrypto_cipher_setiv(cipher, iv, niv, &err) == 0);
+            g_assert(qcrypto_cipher_encrypt(cipher,
+                                            buf + offset,
+                                            buf + offset,
+                                            sector_size,
+                                            &err) == 0);
+        }
+        remain -= chunk_size;
+    }
+    g_test_timer_elapsed();
+
+    g_test_message("enc(%s-%s) %zu byte sectors, chunk %zu bytes %.2f MB/sec ",
+                   QCryptoCipherAlgo_str(alg),
+                   QCryptoCipherMode_str(mode), sector_size,
+                   chunk_size, (double)total / MiB / g_test_timer_last());
+
+    sector = 0;
+    g_test_timer_start();
+    remain = total;
+    while (remain) {
+        for (offset = 0; offset < chunk_size; offset += sector_size) {
+            stq_le_p(iv, sector++);
+            g_assert(qcrypto_cipher_setiv(cipher, iv, niv, &err) == 0);
+            g_assert(qcrypto_cipher_decrypt(cipher,
+                                            buf + offset,
+                                            buf + offset,
+                                            sector_size,
+                                            &err) == 0);
+        }
+        remain -= chunk_size;
+    }
+    g_test_timer_elapsed();
+
+    g_test_message("dec(%s-%s) %zu byte sectors, chunk %zu bytes %.2f MB/sec ",
+                   QCryptoCipherAlgo_str(alg),
+                   QCryptoCipherMode_str(mode), sector_size,
+                   chunk_size, (double)total / MiB / g_test_timer_last());
+
+    qcrypto_cipher_free(cipher);
+    g_free(buf);
+    g_free(iv);
+    g_free(key);
+}
+#endif
+
+
 static void test_cipher_speed_ecb_aes_128(const void *opaque)
 {
     size_t chunk_size = (size_t)opaque;
@@ -164,6 +257,22 @@ static void test_cipher_speed_xts_aes_256(const void *opaque)
                       QCRYPTO_CIPHER_ALGO_AES_256);
 }
 
+static void test_cipher_speed_xts_sectors_aes_128(const void *opaque)
+{
+    size_t chunk_size = (size_t)opaque;
+    test_cipher_speed_sectors(chunk_size,
+                              QCRYPTO_CIPHER_MODE_XTS,
+                              QCRYPTO_CIPHER_ALGO_AES_128);
+}
+
+static void test_cipher_speed_xts_sectors_aes_256(const void *opaque)
+{
+    size_t chunk_size = (size_t)opaque;
+    test_cipher_speed_sectors(chunk_size,
+                              QCRYPTO_CIPHER_MODE_XTS,
+                              QCRYPTO_CIPHER_ALGO_AES_256);
+}
+
 
 int main(int argc, char **argv)
 {
@@ -204,5 +313,11 @@ int main(int argc, char **argv)
     ADD_TESTS(16384);
     ADD_TESTS(65536);
 
+    /* Multi-sector requests as used by LUKS */
+    ADD_TEST(xts_sectors, aes, 128, 65536);
+    ADD_TEST(xts_sectors, aes, 256, 65536);
+    ADD_TEST(xts_sectors, aes, 128, 1048576);
+    ADD_TEST(xts_sectors, aes, 256, 1048576);
+
     return g_test_run();
 }
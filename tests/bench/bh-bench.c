@@ -0,0 +1,198 @@
+/*
+ * Bottom half scheduling benchmark
+ *
+ * Measures how fast bottom halves scheduled from other threads, as done
+ * by completion-heavy workloads, can be run by one AioContext.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "block/aio.h"
+#include "qemu/main-loop.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+
+typedef struct {
+    QemuThread thread;
+    QEMUBH *bh;
+    unsigned int scheduled;
+} Producer;
+
+static AioContext *ctx;
+static Producer *producers;
+static unsigned int n_producers = 4;
+static unsigned int n_ops = 1000000;
+static bool test_start;
+static bool test_stop;
+static unsigned int n_run;
+
+static const char commands_string[] =
+    " -n = number of producer threads\n"
+    " -o = number of bottom halves scheduled per producer thread";
+
+static void usage_complete(char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+}
+
+static void bh_cb(void *opaque)
+{
+    /* Only ever run in the main thread */
+    n_run++;
+}
+
+static void *oneshot_func(void *opaque)
+{
+    Producer *p = opaque;
+    unsigned int i;
+
+    while (!qatomic_read(&test_start)) {
+        cpu_relax();
+    }
+    for (i = 0; i < n_ops; i++) {
+        aio_bh_schedule_oneshot(ctx, bh_cb, NULL);
+    }
+    p->scheduled = n_ops;
+    return NULL;
+}
+
+static void *schedule_func(void *opaque)
+{
+    Producer *p = opaque;
+
+    while (!qatomic_read(&test_start)) {
+        cpu_relax();
+    }
+    while (!qatomic_read(&test_stop)) {
+        qemu_bh_schedule(p->bh);
+        p->scheduled++;
+    }
+    return NULL;
+}
+
+static void pr_result(const char *name, unsigned int ops, int64_t ns)
+{
+    printf(" %-20s %10.1f ns/BH  %8.2f MBH/s\n",
+           name, (double)ns / ops, ops / (ns / 1e9) / 1e6);
+}
+
+/* One-shot bottom halves, e.g. request completions from other threads */
+static void bench_oneshot(void)
+{
+    unsigned int total = n_ops * n_producers;
+    unsigned int i;
+    int64_t t;
+
+    n_run = 0;
+    qatomic_set(&test_start, false);
+    for (i = 0; i < n_producers; i++) {
+        qemu_thread_create(&producers[i].thread, "bh-producer", oneshot_func,
+                           &producers[i], QEMU_THREAD_JOINABLE);
+    }
+
+    t = get_clock();
+    qatomic_set(&test_start, true);
+    while (n_run < total) {
+        aio_poll(ctx, true);
+    }
+    t = get_clock() - t;
+
+    for (i = 0; i < n_producers; i++) {
+        qemu_thread_join(&producers[i].thread);
+    }
+    pr_result("oneshot", total, t);
+}
+
+/*
+ * Persistent bottom halves rescheduled as fast as possible; each schedule
+ * that finds the BH still pending is coalesced.
+ */
+static void bench_schedule(void)
+{
+    unsigned int scheduled = 0;
+    unsigned int i;
+    int64_t t;
+
+    n_run = 0;
+    qatomic_set(&test_start, false);
+    qatomic_set(&test_stop, false);
+    for (i = 0; i < n_producers; i++) {
+        producers[i].bh = aio_bh_new(ctx, bh_cb, NULL);
+        producers[i].scheduled = 0;
+        qemu_thread_create(&producers[i].thread, "bh-producer", schedule_func,
+                           &producers[i], QEMU_THREAD_JOINABLE);
+    }
+
+    t = get_clock();
+    qatomic_set(&test_start, true);
+    while (n_run < n_ops) {
+        aio_poll(ctx, true);
+    }
+    t = get_clock() - t;
+    qatomic_set(&test_stop, true);
+
+    for (i = 0; i < n_producers; i++) {
+        qemu_thread_join(&producers[i].thread);
+        scheduled += producers[i].scheduled;
+    }
+    /* Run what the producers left behind before deleting the BHs */
+    while (aio_poll(ctx, false)) {
+        /* nothing */
+    }
+    for (i = 0; i < n_producers; i++) {
+        qemu_bh_delete(producers[i].bh);
+    }
+    aio_poll(ctx, false);
+
+    pr_result("schedule (run)", n_run, t);
+    printf(" %-20s %10.2f schedules/run\n", "coalescing",
+           (double)scheduled / n_run);
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "hn:o:");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'h':
+            usage_complete(argv);
+            exit(0);
+        case 'n':
+            n_producers = MAX(atoi(optarg), 1);
+            break;
+        case 'o':
+            n_ops = MAX(atoi(optarg), 1);
+            break;
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    qemu_init_main_loop(&error_fatal);
+    parse_args(argc, argv);
+
+    ctx = aio_context_new(&error_fatal);
+    producers = g_new0(Producer, n_producers);
+
+    printf("Parameters:\n");
+    printf(" # of producers:    %u\n", n_producers);
+    printf(" # of operations:   %u\n", n_ops);
+    printf("Results:\n");
+
+    bench_oneshot();
+    bench_schedule();
+
+    aio_context_unref(ctx);
+    g_free(producers);
+    return 0;
+}
@@ -0,0 +1,149 @@
+/*
+ * QEMU HBitmap speed benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/hbitmap.h"
+#include "qemu/units.h"
+
+/*
+ * 1 TiB disk tracked at 64 KiB granularity.  A flat last level would take
+ * 2 MiB.  On 64-bit hosts it is split into pages of 4096 bits instead,
+ * which needs a 32 KiB page table plus 512 bytes for each page that has
+ * both clear and set bits.
+ */
+#define BENCH_BITS  (16 * MiB)
+
+typedef enum {
+    PATTERN_SPARSE,     /* a few isolated dirty bits */
+    PATTERN_DENSE,      /* nearly everything dirty */
+    PATTERN_FRAGMENTED, /* short dirty runs everywhere */
+} Pattern;
+
+static const char *pattern_name[] = {
+    [PATTERN_SPARSE] = "sparse",
+    [PATTERN_DENSE] = "dense",
+    [PATTERN_FRAGMENTED] = "fragmented",
+};
+
+static HBitmap *bench_bitmap_new(Pattern pattern)
+{
+    HBitmap *hb = hbitmap_alloc(BENCH_BITS, 0);
+    uint64_t i;
+
+    switch (pattern) {
+    case PATTERN_SPARSE:
+        for (i = 0; i < BENCH_BITS; i += 1 * MiB + 4097) {
+            hbitmap_set(hb, i, 1);
+        }
+        break;
+    case PATTERN_DENSE:
+        hbitmap_set(hb, 0, BENCH_BITS);
+        for (i = 0; i < BENCH_BITS; i += 1 * MiB + 4097) {
+            hbitmap_reset(hb, i, 1);
+        }
+        break;
+    case PATTERN_FRAGMENTED:
+        for (i = 0; i < BENCH_BITS; i += 64) {
+            hbitmap_set(hb, i + (i / 64) % 32, 7);
+        }
+        break;
+    }
+
+    return hb;
+}
+
+static void bench_next_dirty_area(const void *opaque)
+{
+    Pattern pattern = (uintptr_t)opaque;
+    HBitmap *hb = bench_bitmap_new(pattern);
+    uint64_t passes = 0;
+
+    g_test_timer_start();
+    do {
+        int64_t offset = 0;
+        int64_t bytes;
+
+        while (hbitmap_next_dirty_area(hb, offset, BENCH_BITS, INT64_MAX,
+                                       &offset, &bytes)) {
+            offset += bytes;
+        }
+        passes++;
+    } while (g_test_timer_elapsed() < 0.5);
+
+    g_test_message("next_dirty_area %-10s %8.1f scans/sec, %6" PRIu64 " KiB",
+                   pattern_name[pattern], passes / g_test_timer_last(),
+                   hbitmap_allocated_bytes(hb) / KiB);
+    hbitmap_free(hb);
+}
+
+static void bench_next_zero(const void *opaque)
+{
+    Pattern pattern = (uintptr_t)opaque;
+    HBitmap *hb = bench_bitmap_new(pattern);
+    uint64_t passes = 0;
+
+    g_test_timer_start();
+    do {
+        int64_t offset = 0;
+
+        while (offset < BENCH_BITS) {
+            offset = hbitmap_next_zero(hb, offset, INT64_MAX);
+            if (offset < 0) {
+                break;
+            }
+            offset++;
+        }
+        passes++;
+    } while (g_test_timer_elapsed() < 0.5);
+
+    g_test_message("next_zero       %-10s %8.1f scans/sec",
+                   pattern_name[pattern], passes / g_test_timer_last());
+    hbitmap_free(hb);
+}
+
+static void bench_merge(const void *opaque)
+{
+    Pattern pattern = (uintptr_t)opaque;
+    HBitmap *a = bench_bitmap_new(pattern);
+    HBitmap *b = bench_bitmap_new(PATTERN_SPARSE);
+    HBitmap *dst = hbitmap_alloc(BENCH_BITS, 0);
+    uint64_t merges = 0;
+
+    g_test_timer_start();
+    do {
+        hbitmap_merge(a, b, dst);
+        merges++;
+    } while (g_test_timer_elapsed() < 0.5);
+
+    g_test_message("merge           %-10s %8.1f merges/sec, %6" PRIu64 " KiB",
+                   pattern_name[pattern], merges / g_test_timer_last(),
+                   hbitmap_allocated_bytes(dst) / KiB);
+    hbitmap_free(a);
+    hbitmap_free(b);
+    hbitmap_free(dst);
+}
+
+int main(int argc, char **argv)
+{
+    Pattern p;
+
+    g_test_init(&argc, &argv, NULL);
+    for (p = PATTERN_SPARSE; p <= PATTERN_FRAGMENTED; p++) {
+        g_autofree char *area = g_strdup_printf(
+            "/hbitmap/next_dirty_area/%s", pattern_name[p]);
+        g_autofree char *zero = g_strdup_printf(
+            "/hbitmap/next_zero/%s", pattern_name[p]);
+        g_autofree char *merge = g_strdup_printf(
+            "/hbitmap/merge/%s", pattern_name[p]);
+
+        g_test_add_data_func(area, (void *)(uintptr_t)p,
+                             bench_next_dirty_area);
+        g_test_add_data_func(zero, (void *)(uintptr_t)p, bench_next_zero);
+        g_test_add_data_func(merge, (void *)(uintptr_t)p, bench_merge);
+    }
+    return g_test_run();
+}
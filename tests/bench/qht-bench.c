@@ -11,6 +11,7 @@
 #include "qemu/rcu.h"
 #include "qemu/xxhash.h"
 #include "qemu/memalign.h"
+#include "qemu/timer.h"
 
 struct thread_stats {
     size_t rd;
@@ -21,6 +22,10 @@ struct thread_stats {
     size_t not_rm;
     size_t rz;
     size_t not_rz;
+    int64_t rz_ns;
+    int64_t rz_max_ns;
+    size_t stalls;
+    int64_t max_ns;
 };
 
 struct thread_info {
@@ -62,6 +67,8 @@ static unsigned int n_rz_threads = 1;
 static QemuThread *rz_threads;
 static bool precompute_hash;
 
+static int64_t stall_threshold_ns; /* 0 to disable latency tracking */
+
 static double update_rate; /* 0.0 to 1.0 */
 static uint64_t update_threshold;
 static uint64_t resize_threshold;
@@ -93,7 +100,14 @@ static const char commands_string[] =
     " -R = enable auto-resize\n"
     " -S = resize rate (0.0 to 100.0)\n"
     " -D = delay (in us) between potential resizes\n"
-    " -N = number of resize threads";
+    " -N = number of resize threads\n"
+    "\n"
+    " -L = track operations slower than this (in us) as stalls\n"
+    "\n"
+    "Resize-under-load scenarios, e.g. with -L 50:\n"
+    " -n 4 -u 20 -S 100 -D 1000 = resizes racing with updates\n"
+    " -n 4 -u 0 -S 100 -D 0 -N 2 = back-to-back resizes racing with lookups\n"
+    " -n 4 -u 50 -R -k 0 -s 1 = auto-resize while the table fills up";
 
 static void usage_complete(int argc, char *argv[])
 {
@@ -142,13 +156,17 @@ static void do_rz(struct thread_info *info)
 
     if (r < resize_threshold) {
         size_t size = info->resize_down ? resize_min : resize_max;
+        int64_t t = get_clock();
         bool resized;
 
         resized = qht_resize(&ht, size);
         info->resize_down = !info->resize_down;
 
         if (resized) {
+            t = get_clock() - t;
             stats->rz++;
+            stats->rz_ns += t;
+            stats->rz_max_ns = MAX(stats->rz_max_ns, t);
         } else {
             stats->not_rz++;
         }
@@ -204,6 +222,20 @@ static void do_rw(struct thread_info *info)
     }
 }
 
+/* time the operation, so that resize stalls show up in the results */
+static void do_rw_timed(struct thread_info *info)
+{
+    struct thread_stats *stats = &info->stats;
+    int64_t t = get_clock();
+
+    do_rw(info);
+    t = get_clock() - t;
+    if (t > stall_threshold_ns) {
+        stats->stalls++;
+    }
+    stats->max_ns = MAX(stats->max_ns, t);
+}
+
 static void *thread_func(void *p)
 {
     struct thread_info *info = p;
@@ -263,7 +295,8 @@ th_create_n(QemuThread **threads, struct thread_info **infos, const char *name,
 
 static void create_threads(void)
 {
-    th_create_n(&rw_threads, &rw_info, "rw", do_rw, 0, n_rw_threads);
+    th_create_n(&rw_threads, &rw_info, "rw",
+                stall_threshold_ns ? do_rw_timed : do_rw, 0, n_rw_threads);
     th_create_n(&rz_threads, &rz_info, "rz", do_rz, n_rw_threads, n_rz_threads);
 }
 
@@ -281,6 +314,10 @@ static void pr_params(void)
         printf(" resize range:      %zu-%zu\n", resize_min, resize_max);
         printf(" # resize threads   %u\n", n_rz_threads);
     }
+    if (stall_threshold_ns) {
+        printf(" stall threshold:   %" PRId64 " us\n",
+               stall_threshold_ns / SCALE_US);
+    }
     printf(" update rate:       %f%%\n", update_rate * 100.0);
     printf(" offset:            %ld\n", populate_offset);
     printf(" initial key range: %zu\n", init_range);
@@ -384,6 +421,11 @@ static void add_stats(struct thread_stats *s, struct thread_info *info, int n)
 
         s->rz += stats->rz;
         s->not_rz += stats->not_rz;
+        s->rz_ns += stats->rz_ns;
+        s->rz_max_ns = MAX(s->rz_max_ns, stats->rz_max_ns);
+
+        s->stalls += stats->stalls;
+        s->max_ns = MAX(s->max_ns, stats->max_ns);
     }
 }
 
@@ -400,6 +442,11 @@ static void pr_stats(void)
     if (resize_rate) {
         printf(" Resizes:           %zu (%.2f%% of %zu)\n",
                s.rz, (double)s.rz / (s.rz + s.not_rz) * 100, s.rz + s.not_rz);
+        if (s.rz) {
+            printf(" Resize time:       %.2f us avg, %.2f us max\n",
+                   (double)s.rz_ns / s.rz / SCALE_US,
+                   (double)s.rz_max_ns / SCALE_US);
+        }
     }
 
     printf(" Read:              %.2f M (%.2f%% of %.2fM)\n",
@@ -418,6 +465,11 @@ static void pr_stats(void)
     tx = (s.rd + s.not_rd + s.in + s.not_in + s.rm + s.not_rm) / 1e6 / duration;
     printf(" Throughput:        %.2f MT/s\n", tx);
     printf(" Throughput/thread: %.2f MT/s/thread\n", tx / n_rw_threads);
+    if (stall_threshold_ns) {
+        printf(" Stalls:            %zu (%.4f%%)\n", s.stalls,
+               (double)s.stalls / (tx * 1e6 * duration) * 100);
+        printf(" Max latency:       %.2f us\n", (double)s.max_ns / SCALE_US);
+    }
 }
 
 static void run_test(void)
@@ -445,7 +497,7 @@ static void parse_args(int argc, char *argv[])
     int c;
 
     for (;;) {
-        c = getopt(argc, argv, "d:D:g:k:K:l:hn:N:o:pr:Rs:S:u:");
+        c = getopt(argc, argv, "d:D:g:k:K:l:L:hn:N:o:pr:Rs:S:u:");
         if (c < 0) {
             break;
         }
@@ -475,6 +527,9 @@ static void parse_args(int argc, char *argv[])
         case 'l':
             lookup_range = pow2ceil(atol(optarg));
             break;
+        case 'L':
+            stall_threshold_ns = MAX(atol(optarg), 1) * SCALE_US;
+            break;
         case 'n':
             n_rw_threads = atoi(optarg);
             break;
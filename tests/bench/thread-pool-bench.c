@@ -0,0 +1,281 @@
+/*
+ * Thread pool benchmark
+ *
+ * Measures the submit-to-complete latency and the throughput of
+ * thread_pool_submit_aio() for increasing numbers of requests in flight,
+ * optionally with several AioContexts submitting at the same time.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/defer-call.h"
+#include "qemu/main-loop.h"
+#include "qemu/module.h"
+#include "qemu/processor.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "block/aio.h"
+#include "block/thread-pool.h"
+
+/* Latency samples kept per thread and concurrency level */
+#define MAX_SAMPLES (1 << 20)
+
+typedef struct BenchThread BenchThread;
+
+typedef struct BenchRequest {
+    BenchThread *t;
+    int64_t submit_ns;
+} BenchRequest;
+
+struct BenchThread {
+    QemuThread thread;
+    AioContext *ctx;
+    BenchRequest *reqs;
+    unsigned int in_flight;
+    uint64_t ops;
+    int64_t *samples;
+    unsigned int n_samples;
+} QEMU_ALIGNED(64);
+
+static BenchThread *threads;
+static unsigned int n_threads = 1;
+static unsigned int max_depth = 64;
+static unsigned int duration = 1;
+static unsigned int work_ns;
+static unsigned int depth;
+static unsigned int generation;
+static unsigned int n_ready_threads;
+static bool test_stop;
+static bool test_exit;
+
+static const char commands_string[] =
+    " -n = number of submitting threads (AioContexts)\n"
+    " -q = maximum number of requests in flight per thread; the test is\n"
+    "      run for 1, 2, 4, ... up to this number\n"
+    " -d = duration in seconds of each run\n"
+    " -w = time spent by the worker on each request, in nanoseconds";
+
+static void usage_complete(char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+}
+
+static int bench_work(void *opaque)
+{
+    int64_t end;
+
+    if (work_ns) {
+        end = get_clock() + work_ns;
+        while (get_clock() < end) {
+            cpu_relax();
+        }
+    }
+    return 0;
+}
+
+static void bench_submit(BenchRequest *req);
+
+static void bench_cb(void *opaque, int ret)
+{
+    BenchRequest *req = opaque;
+    BenchThread *t = req->t;
+    int64_t latency = get_clock() - req->submit_ns;
+
+    assert(ret == 0);
+    t->ops++;
+    if (t->n_samples < MAX_SAMPLES) {
+        t->samples[t->n_samples++] = latency;
+    }
+
+    if (qatomic_read(&test_stop)) {
+        t->in_flight--;
+    } else {
+        bench_submit(req);
+    }
+}
+
+static void bench_submit(BenchRequest *req)
+{
+    req->submit_ns = get_clock();
+    thread_pool_submit_aio(bench_work, req, bench_cb, req);
+}
+
+static void bench_run(BenchThread *t)
+{
+    unsigned int i;
+
+    t->ops = 0;
+    t->n_samples = 0;
+    t->in_flight = depth;
+
+    /* Submit the initial requests as one batch */
+    defer_call_begin();
+    for (i = 0; i < depth; i++) {
+        t->reqs[i].t = t;
+        bench_submit(&t->reqs[i]);
+    }
+    defer_call_end();
+
+    while (t->in_flight) {
+        aio_poll(t->ctx, true);
+    }
+}
+
+static void *thread_func(void *arg)
+{
+    BenchThread *t = arg;
+    unsigned int gen = 0;
+
+    qemu_set_current_aio_context(t->ctx);
+
+    for (;;) {
+        qatomic_inc(&n_ready_threads);
+        while (qatomic_read(&generation) == gen) {
+            if (qatomic_read(&test_exit)) {
+                return NULL;
+            }
+            cpu_relax();
+        }
+        gen = qatomic_read(&generation);
+        bench_run(t);
+    }
+}
+
+static void create_threads(void)
+{
+    unsigned int i;
+
+    threads = g_new0(BenchThread, n_threads);
+    for (i = 0; i < n_threads; i++) {
+        BenchThread *t = &threads[i];
+
+        t->ctx = aio_context_new(&error_fatal);
+        t->reqs = g_new0(BenchRequest, max_depth);
+        t->samples = g_new(int64_t, MAX_SAMPLES);
+        qemu_thread_create(&t->thread, NULL, thread_func, t,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void pr_stats(void)
+{
+    g_autofree int64_t *samples = NULL;
+    unsigned int i, n = 0;
+    uint64_t ops = 0;
+    double sum = 0;
+
+    for (i = 0; i < n_threads; i++) {
+        ops += threads[i].ops;
+        n += threads[i].n_samples;
+    }
+
+    samples = g_new(int64_t, MAX(n, 1));
+    n = 0;
+    for (i = 0; i < n_threads; i++) {
+        memcpy(&samples[n], threads[i].samples,
+               threads[i].n_samples * sizeof(int64_t));
+        n += threads[i].n_samples;
+    }
+    qsort(samples, n, sizeof(int64_t), cmp_int64);
+    for (i = 0; i < n; i++) {
+        sum += samples[i];
+    }
+
+    printf(" %5u  %12.3f  %10.1f  %10.1f  %10.1f\n",
+           depth, (double)ops / duration / 1e6,
+           n ? sum / n / 1000 : 0.0,
+           n ? samples[n / 2] / 1000.0 : 0.0,
+           n ? samples[(uint64_t)n * 99 / 100] / 1000.0 : 0.0);
+}
+
+static void run_test(void)
+{
+    unsigned int i;
+
+    printf("Results (latency in us):\n");
+    printf(" depth        MIOPS        mean         p50         p99\n");
+
+    for (depth = 1; depth <= max_depth; depth *= 2) {
+        while (qatomic_read(&n_ready_threads) != n_threads) {
+            g_usleep(1000);
+        }
+        qatomic_set(&n_ready_threads, 0);
+        qatomic_set(&test_stop, false);
+        qatomic_inc(&generation);
+
+        g_usleep(duration * G_USEC_PER_SEC);
+        qatomic_set(&test_stop, true);
+
+        while (qatomic_read(&n_ready_threads) != n_threads) {
+            g_usleep(1000);
+        }
+        pr_stats();
+    }
+
+    qatomic_set(&test_exit, true);
+    for (i = 0; i < n_threads; i++) {
+        qemu_thread_join(&threads[i].thread);
+    }
+}
+
+static void pr_params(void)
+{
+    printf("Parameters:\n");
+    printf(" # of threads:      %u\n", n_threads);
+    printf(" max. depth:        %u\n", max_depth);
+    printf(" work per request:  %u ns\n", work_ns);
+    printf(" duration:          %u\n", duration);
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "hd:n:q:w:");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'h':
+            usage_complete(argv);
+            exit(0);
+        case 'd':
+            duration = MAX(atoi(optarg), 1);
+            break;
+        case 'n':
+            n_threads = MAX(atoi(optarg), 1);
+            break;
+        case 'q':
+            max_depth = MAX(atoi(optarg), 1);
+            break;
+        case 'w':
+            work_ns = atoi(optarg);
+            break;
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    qemu_init_main_loop(&error_fatal);
+    module_call_init(MODULE_INIT_QOM);
+
+    parse_args(argc, argv);
+    pr_params();
+    create_threads();
+    run_test();
+    return 0;
+}
@@ -0,0 +1,214 @@
+/*
+ * Throttle group benchmark
+ *
+ * Measures the per-request overhead of throttle_group_co_io_limits_intercept()
+ * with many group members that are served by several threads.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/coroutine.h"
+#include "qemu/main-loop.h"
+#include "qemu/module.h"
+#include "qemu/processor.h"
+#include "qemu/thread.h"
+#include "block/aio.h"
+#include "block/throttle-groups.h"
+
+typedef struct BenchThread {
+    QemuThread thread;
+    AioContext *ctx;
+    ThrottleGroupMember *members;
+    unsigned int n_members;
+    uint64_t ops;
+    bool done;
+} QEMU_ALIGNED(64) BenchThread;
+
+static BenchThread *threads;
+static unsigned int n_threads = 1;
+static unsigned int n_members = 64;
+static unsigned int n_ready_threads;
+static unsigned int duration = 1;
+static unsigned int request_size = 4096;
+static uint64_t iops_limit;
+static bool test_start;
+static bool test_stop;
+
+static const char commands_string[] =
+    " -n = number of threads\n"
+    " -m = number of group members (spread over the threads)\n"
+    " -d = duration in seconds\n"
+    " -s = request size in bytes\n"
+    " -i = IOPS limit of the group (default: no effective limit)";
+
+static void usage_complete(char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+}
+
+static void coroutine_fn bench_co(void *opaque)
+{
+    BenchThread *t = opaque;
+    unsigned int i = 0;
+
+    while (!qatomic_read(&test_stop)) {
+        ThrottleGroupMember *tgm = &t->members[i];
+
+        throttle_group_co_io_limits_intercept(tgm, request_size,
+                                              THROTTLE_READ);
+        t->ops++;
+        if (++i == t->n_members) {
+            i = 0;
+        }
+    }
+    t->done = true;
+}
+
+static void *thread_func(void *arg)
+{
+    BenchThread *t = arg;
+
+    qemu_set_current_aio_context(t->ctx);
+
+    qatomic_inc(&n_ready_threads);
+    while (!qatomic_read(&test_start)) {
+        cpu_relax();
+    }
+
+    aio_co_enter(t->ctx, qemu_coroutine_create(bench_co, t));
+    while (!t->done) {
+        aio_poll(t->ctx, true);
+    }
+    return NULL;
+}
+
+static void create_threads(void)
+{
+    ThrottleConfig cfg;
+    unsigned int i, j;
+
+    throttle_config_init(&cfg);
+    cfg.buckets[THROTTLE_OPS_TOTAL].avg =
+        iops_limit ? iops_limit : THROTTLE_VALUE_MAX;
+
+    threads = g_new0(BenchThread, n_threads);
+    for (i = 0; i < n_threads; i++) {
+        BenchThread *t = &threads[i];
+
+        t->ctx = aio_context_new(&error_fatal);
+        t->n_members = n_members / n_threads + (i < n_members % n_threads);
+        t->n_members = MAX(t->n_members, 1);
+        t->members = g_new0(ThrottleGroupMember, t->n_members);
+        for (j = 0; j < t->n_members; j++) {
+            throttle_group_register_tgm(&t->members[j], "bench", t->ctx);
+        }
+    }
+    throttle_group_config(&threads[0].members[0], &cfg);
+
+    for (i = 0; i < n_threads; i++) {
+        qemu_thread_create(&threads[i].thread, NULL, thread_func, &threads[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void run_test(void)
+{
+    unsigned int i;
+
+    while (qatomic_read(&n_ready_threads) != n_threads) {
+        cpu_relax();
+    }
+
+    qatomic_set(&test_start, true);
+    g_usleep(duration * G_USEC_PER_SEC);
+    qatomic_set(&test_stop, true);
+
+    for (i = 0; i < n_threads; i++) {
+        qemu_thread_join(&threads[i].thread);
+    }
+}
+
+static void pr_params(void)
+{
+    printf("Parameters:\n");
+    printf(" # of threads:      %u\n", n_threads);
+    printf(" # of members:      %u\n", n_members);
+    printf(" request size:      %u\n", request_size);
+    if (iops_limit) {
+        printf(" IOPS limit:        %" PRIu64 "\n", iops_limit);
+    } else {
+        printf(" IOPS limit:        none\n");
+    }
+    printf(" duration:          %u\n", duration);
+}
+
+static void pr_stats(void)
+{
+    uint64_t ops = 0;
+    unsigned int i;
+    double tx;
+
+    for (i = 0; i < n_threads; i++) {
+        ops += threads[i].ops;
+    }
+    tx = (double)ops / duration;
+
+    printf("Results:\n");
+    printf("Duration:            %u s\n", duration);
+    printf(" Throughput:         %.2f MIOPS\n", tx / 1e6);
+    printf(" Throughput/thread:  %.2f MIOPS/thread\n", tx / n_threads / 1e6);
+    if (ops) {
+        printf(" Time/request:       %.1f ns/thread\n",
+               1e9 * duration * n_threads / ops);
+    }
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "hd:n:m:s:i:");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'h':
+            usage_complete(argv);
+            exit(0);
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'n':
+            n_threads = MAX(atoi(optarg), 1);
+            break;
+        case 'm':
+            n_members = MAX(atoi(optarg), 1);
+            break;
+        case 's':
+            request_size = atoi(optarg);
+            break;
+        case 'i':
+            iops_limit = MIN(g_ascii_strtoull(optarg, NULL, 0),
+                             THROTTLE_VALUE_MAX);
+            break;
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    qemu_init_main_loop(&error_fatal);
+    module_call_init(MODULE_INIT_QOM);
+
+    parse_args(argc, argv);
+    pr_params();
+    create_threads();
+    run_test();
+    pr_stats();
+    return 0;
+}
@@ -0,0 +1,182 @@
+/*
+ * Timer list benchmark
+ *
+ * Measures the cost of timer_mod(), timer_del() and timerlist_run_timers()
+ * with many active timers on a single timer list.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/main-loop.h"
+#include "qemu/timer.h"
+
+static QEMUTimerListGroup tlg;
+static QEMUTimerList *timer_list;
+static QEMUTimer *timers;
+static unsigned int n_timers = 4096;
+static unsigned int n_ops = 10000000;
+static uint64_t n_fired;
+
+static const char commands_string[] =
+    " -n = number of active timers\n"
+    " -o = number of operations per test";
+
+static void usage_complete(char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+}
+
+static void bench_notify(void *opaque, QEMUClockType type)
+{
+}
+
+static void bench_cb(void *opaque)
+{
+    n_fired++;
+}
+
+static void arm_all(int64_t base)
+{
+    unsigned int i;
+
+    for (i = 0; i < n_timers; i++) {
+        timer_mod_ns(&timers[i], base + g_random_int_range(0, 10 * SCALE_MS));
+    }
+}
+
+/* A time far enough in the future that no timer expires during a test */
+static int64_t future_base(void)
+{
+    return qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + 60 * NANOSECONDS_PER_SECOND;
+}
+
+static void pr_result(const char *name, unsigned int ops, int64_t ns)
+{
+    printf(" %-20s %10.1f ns/op  %8.2f Mops/s\n",
+           name, (double)ns / ops, ops / (ns / 1e9) / 1e6);
+}
+
+/* Re-arm random timers with random deadlines, e.g. coalescing timers */
+static void bench_mod_random(void)
+{
+    int64_t base = future_base();
+    int64_t t;
+    unsigned int i;
+
+    arm_all(base);
+    t = get_clock();
+    for (i = 0; i < n_ops; i++) {
+        QEMUTimer *ts = &timers[g_random_int_range(0, n_timers)];
+
+        timer_mod_ns(ts, base + g_random_int_range(0, 10 * SCALE_MS));
+    }
+    pr_result("mod (random)", n_ops, get_clock() - t);
+}
+
+/* Push timers to the back of the list, e.g. periodic or throttle timers */
+static void bench_mod_later(void)
+{
+    int64_t base = future_base();
+    int64_t t;
+    unsigned int i;
+
+    arm_all(base);
+    t = get_clock();
+    for (i = 0; i < n_ops; i++) {
+        timer_mod_ns(&timers[i % n_timers], base + 10 * SCALE_MS + i);
+    }
+    pr_result("mod (later)", n_ops, get_clock() - t);
+}
+
+static void bench_del_mod(void)
+{
+    int64_t base = future_base();
+    int64_t t;
+    unsigned int i;
+
+    arm_all(base);
+    t = get_clock();
+    for (i = 0; i < n_ops / 2; i++) {
+        QEMUTimer *ts = &timers[g_random_int_range(0, n_timers)];
+
+        timer_del(ts);
+        timer_mod_ns(ts, base + g_random_int_range(0, 10 * SCALE_MS));
+    }
+    pr_result("del + mod", n_ops / 2 * 2, get_clock() - t);
+}
+
+static void bench_run_timers(void)
+{
+    uint64_t fired = 0;
+    int64_t elapsed = 0, t;
+
+    n_fired = 0;
+    while (fired < n_ops) {
+        arm_all(qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - 20 * SCALE_MS);
+        t = get_clock();
+        timerlist_run_timers(timer_list);
+        elapsed += get_clock() - t;
+        fired += n_timers;
+    }
+    assert(n_fired == fired);
+    pr_result("run expired", fired, elapsed);
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "hn:o:");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'h':
+            usage_complete(argv);
+            exit(0);
+        case 'n':
+            n_timers = MAX(atoi(optarg), 1);
+            break;
+        case 'o':
+            n_ops = MAX(atoi(optarg), 1);
+            break;
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int i;
+
+    qemu_init_main_loop(&error_fatal);
+    parse_args(argc, argv);
+
+    timerlistgroup_init(&tlg, bench_notify, NULL);
+    timer_list = tlg.tl[QEMU_CLOCK_REALTIME];
+    timers = g_new0(QEMUTimer, n_timers);
+    for (i = 0; i < n_timers; i++) {
+        timer_init_full(&timers[i], &tlg, QEMU_CLOCK_REALTIME, SCALE_NS, 0,
+                        bench_cb, NULL);
+    }
+
+    printf("Parameters:\n");
+    printf(" # of timers:       %u\n", n_timers);
+    printf(" # of operations:   %u\n", n_ops);
+    printf("Results:\n");
+
+    bench_mod_random();
+    bench_mod_later();
+    bench_del_mod();
+    bench_run_timers();
+
+    for (i = 0; i < n_timers; i++) {
+        timer_del(&timers[i]);
+    }
+    timerlistgroup_deinit(&tlg);
+    return 0;
+}
@@ -0,0 +1,136 @@
+/*
+ * QTest testcase for the IOThread statistics in query-stats
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+#include "qobject/qdict.h"
+#include "qobject/qlist.h"
+
+static const char * const poll_stats[] = {
+    "poll-attempts",
+    "poll-successes",
+    "poll-time",
+    "poll-wasted-time",
+};
+
+static QDict *find_by_name(QList *list, const char *name)
+{
+    QListEntry *e;
+
+    QLIST_FOREACH_ENTRY(list, e) {
+        QDict *d = qobject_to(QDict, qlist_entry_obj(e));
+
+        if (!strcmp(qdict_get_str(d, "name"), name)) {
+            return d;
+        }
+    }
+    return NULL;
+}
+
+static void test_query_stats(void)
+{
+    QTestState *qts;
+    QDict *resp;
+    QList *results;
+    QListEntry *e;
+    int n = 0;
+    int i;
+
+    qts = qtest_init("-machine none "
+                     "-object iothread,id=iothread0 "
+                     "-object iothread,id=iothread1");
+
+    resp = qtest_qmp(qts, "{ 'execute': 'query-stats', 'arguments': {"
+                     " 'target': 'iothread',"
+                     " 'providers': [ { 'provider': 'aio' } ] } }");
+    results = qdict_get_qlist(resp, "return");
+    g_assert(results);
+
+    QLIST_FOREACH_ENTRY(results, e) {
+        QDict *result = qobject_to(QDict, qlist_entry_obj(e));
+        const char *path = qdict_get_str(result, "qom-path");
+        QList *stats = qdict_get_qlist(result, "stats");
+
+        g_assert_cmpstr(qdict_get_str(result, "provider"), ==, "aio");
+        g_assert(!strcmp(path, "/objects/iothread0") ||
+                 !strcmp(path, "/objects/iothread1"));
+        for (i = 0; i < ARRAY_SIZE(poll_stats); i++) {
+            QDict *stat = find_by_name(stats, poll_stats[i]);
+
+            g_assert(stat);
+            g_assert(qdict_haskey(stat, "value"));
+        }
+        n++;
+    }
+    g_assert_cmpint(n, ==, 2);
+    qobject_unref(resp);
+
+    /* Only the requested statistics are returned */
+    resp = qtest_qmp(qts, "{ 'execute': 'query-stats', 'arguments': {"
+                     " 'target': 'iothread',"
+                     " 'providers': [ { 'provider': 'aio',"
+                     "                  'names': [ 'poll-time' ] } ] } }");
+    results = qdict_get_qlist(resp, "return");
+    g_assert(results);
+    QLIST_FOREACH_ENTRY(results, e) {
+        QDict *result = qobject_to(QDict, qlist_entry_obj(e));
+        QList *stats = qdict_get_qlist(result, "stats");
+
+        g_assert_cmpint(qlist_size(stats), ==, 1);
+        g_assert(find_by_name(stats, "poll-time"));
+    }
+    qobject_unref(resp);
+
+    qtest_quit(qts);
+}
+
+static void test_query_stats_schemas(void)
+{
+    QTestState *qts;
+    QDict *resp;
+    QList *schemas;
+    QDict *schema;
+    QList *stats;
+    int i;
+
+    qts = qtest_init("-machine none -object iothread,id=iothread0");
+
+    resp = qtest_qmp(qts, "{ 'execute': 'query-stats-schemas',"
+                     " 'arguments': { 'provider': 'aio' } }");
+    schemas = qdict_get_qlist(resp, "return");
+    g_assert(schemas);
+    g_assert_cmpint(qlist_size(schemas), ==, 1);
+
+    schema = qobject_to(QDict, qlist_peek(schemas));
+    g_assert_cmpstr(qdict_get_str(schema, "provider"), ==, "aio");
+    g_assert_cmpstr(qdict_get_str(schema, "target"), ==, "iothread");
+    stats = qdict_get_qlist(schema, "stats");
+    for (i = 0; i < ARRAY_SIZE(poll_stats); i++) {
+        QDict *stat = find_by_name(stats, poll_stats[i]);
+
+        g_assert(stat);
+        g_assert_cmpstr(qdict_get_str(stat, "type"), ==, "cumulative");
+    }
+    g_assert_cmpstr(qdict_get_str(find_by_name(stats, "poll-time"), "unit"),
+                    ==, "seconds");
+    g_assert_cmpint(qdict_get_int(find_by_name(stats, "poll-time"),
+                                  "exponent"), ==, -9);
+    qobject_unref(resp);
+
+    qtest_quit(qts);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("iothread/stats/query-stats", test_query_stats);
+    qtest_add_func("iothread/stats/query-stats-schemas",
+                   test_query_stats_schemas);
+
+    return g_test_run();
+}
@@ -334,7 +334,11 @@ static void *rcu_update_stress_test(void *arg)
                            rcu_stress_array[i].age + 1);
             }
         }
-        synchronize_rcu();
+        if (n_updates & 1) {
+            synchronize_rcu_expedited();
+        } else {
+            synchronize_rcu();
+        }
         n_updates++;
     }
 
@@ -14,7 +14,9 @@
 #include "block/aio.h"
 #include "qemu/coroutine.h"
 #include "qemu/thread.h"
+#include "qemu/rcu.h"
 #include "qemu/error-report.h"
+#include "qapi/error.h"
 #include "iothread.h"
 
 /* AioContext management */
@@ -104,6 +106,107 @@ static void test_lifecycle(void)
     join_aio_contexts();
 }
 
+#ifdef CONFIG_LINUX_IO_URING
+/* aio_add_sqe test.  */
+
+static CqeHandler nop_cqe_handler;
+static bool nop_done;
+
+static void prep_nop_sqe(struct io_uring_sqe *sqe, void *opaque)
+{
+    io_uring_prep_nop(sqe);
+}
+
+static void nop_cqe_cb(CqeHandler *cqe_handler)
+{
+    g_assert(cqe_handler == &nop_cqe_handler);
+    g_assert_cmpint(cqe_handler->cqe.res, ==, 0);
+    qatomic_set(&nop_done, true);
+}
+
+static void add_sqe_cb(void *opaque)
+{
+    bool *has_io_uring = opaque;
+
+    *has_io_uring = aio_has_io_uring(ctx[id]);
+    if (*has_io_uring) {
+        nop_cqe_handler.cb = nop_cqe_cb;
+        aio_add_sqe(prep_nop_sqe, NULL, &nop_cqe_handler);
+    }
+}
+
+static void test_add_sqe(void)
+{
+    bool has_io_uring;
+
+    create_aio_contexts();
+    ctx_run(0, add_sqe_cb, &has_io_uring);
+    if (has_io_uring) {
+        while (!qatomic_read(&nop_done)) {
+            g_usleep(1000);
+        }
+    } else {
+        g_test_skip("io_uring is not available");
+    }
+    join_aio_contexts();
+}
+
+/*
+ * Switching to the glib main loop tears down the io_uring; requests that are
+ * still in flight must complete first.  Use a thread of our own, because
+ * IOThreads switch to the glib main loop as soon as they are created.
+ */
+static CqeHandler g_source_cqe_handler;
+static bool g_source_nop_done;
+
+static void g_source_nop_cqe_cb(CqeHandler *cqe_handler)
+{
+    g_assert(cqe_handler == &g_source_cqe_handler);
+    g_assert_cmpint(cqe_handler->cqe.res, ==, 0);
+    g_source_nop_done = true;
+}
+
+static void *add_sqe_g_source_thread(void *opaque)
+{
+    bool *has_io_uring = opaque;
+    AioContext *thread_ctx;
+    GSource *source;
+
+    rcu_register_thread();
+    thread_ctx = aio_context_new(&error_abort);
+    qemu_set_current_aio_context(thread_ctx);
+
+    *has_io_uring = aio_has_io_uring(thread_ctx);
+    if (*has_io_uring) {
+        g_source_cqe_handler.cb = g_source_nop_cqe_cb;
+        aio_add_sqe(prep_nop_sqe, NULL, &g_source_cqe_handler);
+        g_assert(!g_source_nop_done);
+
+        source = aio_get_g_source(thread_ctx);
+        g_assert(g_source_nop_done);
+        g_assert(!aio_has_io_uring(thread_ctx));
+        g_source_unref(source);
+    }
+
+    aio_context_unref(thread_ctx);
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void test_add_sqe_g_source(void)
+{
+    QemuThread thread;
+    bool has_io_uring;
+
+    qemu_thread_create(&thread, "add-sqe-g-source", add_sqe_g_source_thread,
+                       &has_io_uring, QEMU_THREAD_JOINABLE);
+    qemu_thread_join(&thread);
+    if (!has_io_uring) {
+        g_test_skip("io_uring is not available");
+    }
+}
+#endif
+
 /* aio_co_schedule test.  */
 
 static Coroutine *to_schedule[NUM_CONTEXTS];
@@ -445,6 +548,10 @@ int main(int argc, char **argv)
 
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/aio/multi/lifecycle", test_lifecycle);
+#ifdef CONFIG_LINUX_IO_URING
+    g_test_add_func("/aio/multi/add-sqe", test_add_sqe);
+    g_test_add_func("/aio/multi/add-sqe-g-source", test_add_sqe_g_source);
+#endif
     if (g_test_quick()) {
         g_test_add_func("/aio/multi/schedule", test_multi_co_schedule_1);
         g_test_add_func("/aio/multi/mutex/contended", test_multi_co_mutex_1);
@@ -255,6 +255,38 @@ static void test_bh_flush(void)
     qemu_bh_delete(data.bh);
 }
 
+static void bh_oneshot_cb(void *opaque)
+{
+    BHTestData *data = opaque;
+
+    if (++data->n < data->max) {
+        aio_bh_schedule_oneshot(ctx, bh_oneshot_cb, data);
+    }
+}
+
+static void test_bh_schedule_oneshot_many(void)
+{
+    BHTestData data = { .n = 0, .max = 1 };
+    BHTestData resched = { .n = 0, .max = 2 };
+    int i;
+
+    /* Overflow the BH ring into the BH list */
+    for (i = 0; i < BH_RING_SIZE * 2; i++) {
+        aio_bh_schedule_oneshot(ctx, bh_oneshot_cb, &data);
+    }
+    aio_bh_schedule_oneshot(ctx, bh_oneshot_cb, &resched);
+    g_assert_cmpint(data.n, ==, 0);
+
+    /* A rescheduled one-shot BH runs in the next aio_bh_poll() call */
+    g_assert(aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, BH_RING_SIZE * 2);
+    g_assert_cmpint(resched.n, ==, 1);
+
+    g_assert(aio_poll(ctx, false));
+    g_assert_cmpint(resched.n, ==, 2);
+    g_assert(!aio_poll(ctx, false));
+}
+
 static void test_set_event_notifier(void)
 {
     EventNotifierTestData data = { .n = 0, .active = 0 };
@@ -424,6 +456,78 @@ static void test_timer_schedule(void)
     timer_del(&data.timer);
 }
 
+#define ORDER_TIMERS 64
+
+typedef struct {
+    QEMUTimer timer;
+    int64_t expire_time;
+    int index;
+    int arm_order;
+    int *fired;
+    int *n_fired;
+} OrderTimerData;
+
+static void order_timer_cb(void *opaque)
+{
+    OrderTimerData *data = opaque;
+
+    data->fired[(*data->n_fired)++] = data->index;
+}
+
+static void test_timer_order(void)
+{
+    OrderTimerData data[ORDER_TIMERS];
+    int fired[ORDER_TIMERS];
+    int n_fired = 0, n_armed = 0;
+    int64_t base = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - SCALE_MS;
+    int i;
+
+    for (i = 0; i < ORDER_TIMERS; i++) {
+        data[i].index = i;
+        data[i].fired = fired;
+        data[i].n_fired = &n_fired;
+        aio_timer_init(ctx, &data[i].timer, QEMU_CLOCK_REALTIME, SCALE_NS,
+                       order_timer_cb, &data[i]);
+    }
+
+    /* Arm in scrambled order, with many timers sharing an expiry time */
+    for (i = 0; i < ORDER_TIMERS; i++) {
+        int j = (i * 37) % ORDER_TIMERS;
+
+        data[j].expire_time = base + (j * 11) % 8;
+        data[j].arm_order = n_armed++;
+        timer_mod(&data[j].timer, data[j].expire_time);
+    }
+
+    /* Re-arming a timer moves it behind the others with the same expiry */
+    for (i = 0; i < ORDER_TIMERS; i += 5) {
+        data[i].arm_order = n_armed++;
+        timer_mod(&data[i].timer, data[i].expire_time);
+    }
+
+    /* Deleted timers don't fire */
+    for (i = 3; i < ORDER_TIMERS; i += 7) {
+        timer_del(&data[i].timer);
+    }
+
+    while (aio_poll(ctx, false)) {
+        /* Run all expired timers */
+    }
+
+    g_assert_cmpint(n_fired, ==, ORDER_TIMERS - (ORDER_TIMERS - 3 + 6) / 7);
+    for (i = 1; i < n_fired; i++) {
+        OrderTimerData *a = &data[fired[i - 1]];
+        OrderTimerData *b = &data[fired[i]];
+
+        g_assert(a->expire_time < b->expire_time ||
+                 (a->expire_time == b->expire_time &&
+                  a->arm_order < b->arm_order));
+    }
+    for (i = 0; i < ORDER_TIMERS; i++) {
+        g_assert(!timer_pending(&data[i].timer));
+    }
+}
+
 /* Now the same tests, using the context as a GSource.  They are
  * very similar to the ones above, with g_main_context_iteration
  * replacing aio_poll.  However:
@@ -842,11 +946,14 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/bh/callback-delete/one",  test_bh_delete_from_cb);
     g_test_add_func("/aio/bh/callback-delete/many", test_bh_delete_from_cb_many);
     g_test_add_func("/aio/bh/flush",                test_bh_flush);
+    g_test_add_func("/aio/bh/oneshot-many",
+                    test_bh_schedule_oneshot_many);
     g_test_add_func("/aio/event/add-remove",        test_set_event_notifier);
     g_test_add_func("/aio/event/wait",              test_wait_event_notifier);
     g_test_add_func("/aio/event/wait/no-flush-cb",  test_wait_event_notifier_noflush);
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
     g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
+    g_test_add_func("/aio/timer/order",             test_timer_order);
 
     g_test_add_func("/aio/coroutine/queue-chaining", test_queue_chaining);
     g_test_add_func("/aio/coroutine/worker-thread-co-enter", test_worker_thread_co_enter);
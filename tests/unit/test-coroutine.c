@@ -194,6 +194,31 @@ static void test_no_dangling_access(void)
     *c1 = tmp;
 }
 
+/*
+ * Check that terminated coroutines are reused
+ */
+
+static void coroutine_fn pool_fn(void *opaque)
+{
+}
+
+static void test_pool_stats(void)
+{
+    CoroutinePoolStats before, after;
+    int i;
+
+    qemu_coroutine_get_pool_stats(&before);
+    for (i = 0; i < 10; i++) {
+        qemu_coroutine_enter(qemu_coroutine_create(pool_fn, NULL));
+    }
+    qemu_coroutine_get_pool_stats(&after);
+
+    /* At most the first coroutine is new, the others come from the pool */
+    g_assert_cmpuint(after.created - before.created, <=, 1);
+    g_assert_cmpuint(after.created - before.created +
+                     after.pool_hits - before.pool_hits, ==, 10);
+}
+
 static bool locked;
 static int done_count;
 
@@ -647,6 +672,7 @@ int main(int argc, char **argv)
      */
     if (IS_ENABLED(CONFIG_COROUTINE_POOL)) {
         g_test_add_func("/basic/no-dangling-access", test_no_dangling_access);
+        g_test_add_func("/basic/pool-stats", test_pool_stats);
     }
 
     g_test_add_func("/basic/lifecycle", test_lifecycle);
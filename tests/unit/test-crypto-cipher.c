@@ -523,6 +523,85 @@ static QCryptoCipherTestData test_data[] = {
             "eb4a427d1923ce3ff262735779a418f2"
             "0a282df920147beabe421ee5319d0568",
     },
+    {
+        /* #10, 64 byte key, 512 byte PTX */
+        .path = "/crypto/cipher/aes-xts-256-1",
+        .alg = QCRYPTO_CIPHER_ALGO_AES_256,
+        .mode = QCRYPTO_CIPHER_MODE_XTS,
+        .key =
+            "27182818284590452353602874713526"
+            "62497757247093699959574966967627"
+            "31415926535897932384626433832795"
+            "02884197169399375105820974944592",
+        .iv =
+            "ff000000000000000000000000000000",
+        .plaintext =
+            "000102030405060708090a0b0c0d0e0f"
+            "101112131415161718191a1b1c1d1e1f"
+            "202122232425262728292a2b2c2d2e2f"
+            "303132333435363738393a3b3c3d3e3f"
+            "404142434445464748494a4b4c4d4e4f"
+            "505152535455565758595a5b5c5d5e5f"
+            "606162636465666768696a6b6c6d6e6f"
+            "707172737475767778797a7b7c7d7e7f"
+            "808182838485868788898a8b8c8d8e8f"
+            "909192939495969798999a9b9c9d9e9f"
+            "a0a1a2a3a4a5a6a7a8a9aaabacadaeaf"
+            "b0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+            "c0c1c2c3c4c5c6c7c8c9cacbcccdcecf"
+            "d0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+            "e0e1e2e3e4e5e6e7e8e9eaebecedeeef"
+            "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff"
+            "000102030405060708090a0b0c0d0e0f"
+            "101112131415161718191a1b1c1d1e1f"
+            "202122232425262728292a2b2c2d2e2f"
+            "303132333435363738393a3b3c3d3e3f"
+            "404142434445464748494a4b4c4d4e4f"
+            "505152535455565758595a5b5c5d5e5f"
+            "606162636465666768696a6b6c6d6e6f"
+            "707172737475767778797a7b7c7d7e7f"
+            "808182838485868788898a8b8c8d8e8f"
+            "909192939495969798999a9b9c9d9e9f"
+            "a0a1a2a3a4a5a6a7a8a9aaabacadaeaf"
+            "b0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+            "c0c1c2c3c4c5c6c7c8c9cacbcccdcecf"
+            "d0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+            "e0e1e2e3e4e5e6e7e8e9eaebecedeeef"
+            "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff",
+        .ciphertext =
+            "1c3b3a102f770386e4836c99e370cf9b"
+            "ea00803f5e482357a4ae12d414a3e63b"
+            "5d31e276f8fe4a8d66b317f9ac683f44"
+            "680a86ac35adfc3345befecb4bb188fd"
+            "5776926c49a3095eb108fd1098baec70"
+            "aaa66999a72a82f27d848b21d4a741b0"
+            "c5cd4d5fff9dac89aeba122961d03a75"
+            "7123e9870f8acf1000020887891429ca"
+            "2a3e7a7d7df7b10355165c8b9a6d0a7d"
+            "e8b062c4500dc4cd120c0f7418dae3d0"
+            "b5781c34803fa75421c790dfe1de1834"
+            "f280d7667b327f6c8cd7557e12ac3a0f"
+            "93ec05c52e0493ef31a12d3d9260f79a"
+            "289d6a379bc70c50841473d1a8cc81ec"
+            "583e9645e07b8d9670655ba5bbcfecc6"
+            "dc3966380ad8fecb17b6ba02469a020a"
+            "84e18e8f84252070c13e9f1f289be54f"
+            "bc481457778f616015e1327a02b140f1"
+            "505eb309326d68378f8374595c849d84"
+            "f4c333ec4423885143cb47bd71c5edae"
+            "9be69a2ffeceb1bec9de244fbe15992b"
+            "11b77c040f12bd8f6a975a44a0f90c29"
+            "a9abc3d4d893927284c58754cce29452"
+            "9f8614dcd2aba991925fedc4ae74ffac"
+            "6e333b93eb4aff0479da9a410e4450e0"
+            "dd7ae4c6e2910900575da401fc07059f"
+            "645e8b7e9bfdef33943054ff84011493"
+            "c27b3429eaedb4ed5376441a77ed4385"
+            "1ad77f16f541dfd269d50d6a5f14fb0a"
+            "ab1cbb4c1550be97f7ab4066193c4caa"
+            "773dad38014bd2092fa755c824bb5e54"
+            "c4f36ffda9fcea70b9c6e693e148c151",
+    },
     {
         /* Bad config - cast5-128 has 8 byte block size
          * which is incompatible with XTS
@@ -398,6 +398,36 @@ static void test_hbitmap_reset_all(TestHBitmapData *data,
     hbitmap_test_reset_all(data);
 }
 
+static void test_hbitmap_allocated_bytes(TestHBitmapData *data,
+                                        const void *unused)
+{
+    uint64_t empty;
+
+    hbitmap_test_init(data, L3 * 2, 0);
+    empty = hbitmap_allocated_bytes(data->hb);
+
+    /* All-ones and all-zeroes pages are shared, not allocated */
+    hbitmap_test_set(data, 0, L3 * 2);
+    g_assert_cmpuint(hbitmap_allocated_bytes(data->hb), ==, empty);
+    hbitmap_test_reset(data, 0, L3 * 2);
+    g_assert_cmpuint(hbitmap_allocated_bytes(data->hb), ==, empty);
+
+    /* Each page holds L2 bits, so bits in two pages cost two pages */
+    hbitmap_test_set(data, 1, 1);
+    hbitmap_test_set(data, L3 + 17, 3);
+    g_assert_cmpuint(hbitmap_allocated_bytes(data->hb), ==,
+                     empty + 2 * L2 / BITS_PER_BYTE);
+
+    /* Pages are released again once they are empty */
+    hbitmap_test_reset(data, 0, 2);
+    hbitmap_test_reset(data, L3 + 17, 3);
+    g_assert_cmpuint(hbitmap_allocated_bytes(data->hb), ==, empty);
+
+    hbitmap_test_set(data, L3 / 2, L3);
+    hbitmap_test_reset_all(data);
+    g_assert_cmpuint(hbitmap_allocated_bytes(data->hb), ==, empty);
+}
+
 static void test_hbitmap_granularity(TestHBitmapData *data,
                                      const void *unused)
 {
@@ -1061,6 +1091,8 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/reset/empty", test_hbitmap_reset_empty);
     hbitmap_test_add("/hbitmap/reset/general", test_hbitmap_reset);
     hbitmap_test_add("/hbitmap/reset/all", test_hbitmap_reset_all);
+    hbitmap_test_add("/hbitmap/allocated_bytes",
+                     test_hbitmap_allocated_bytes);
     hbitmap_test_add("/hbitmap/granularity", test_hbitmap_granularity);
 
     hbitmap_test_add("/hbitmap/truncate/nop", test_hbitmap_truncate_nop);
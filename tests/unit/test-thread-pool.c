@@ -3,6 +3,7 @@
 #include "block/thread-pool.h"
 #include "block/block.h"
 #include "qapi/error.h"
+#include "qemu/defer-call.h"
 #include "qemu/timer.h"
 #include "qemu/error-report.h"
 #include "qemu/main-loop.h"
@@ -134,6 +135,45 @@ static void test_submit_many(void)
     }
 }
 
+static void test_submit_batch(void)
+{
+    WorkerTestData data[16];
+    int i;
+
+    /* Requests submitted in a defer_call section are only queued... */
+    defer_call_begin();
+    for (i = 0; i < 16; i++) {
+        data[i].n = 0;
+        data[i].ret = -EINPROGRESS;
+        data[i].aiocb = thread_pool_submit_aio(worker_cb, &data[i],
+                                               done_cb, &data[i]);
+    }
+    active = 16;
+
+    /* ...so they can still be canceled before any worker sees them...  */
+    for (i = 0; i < 16; i += 2) {
+        data[i].ret = -ECANCELED;
+        bdrv_aio_cancel_async(data[i].aiocb);
+    }
+
+    g_usleep(100000);
+    for (i = 0; i < 16; i++) {
+        g_assert_cmpint(qatomic_read(&data[i].n), ==, 0);
+    }
+
+    /* ...and the others are submitted at the end of the section.  */
+    defer_call_end();
+
+    while (active > 0) {
+        aio_poll(ctx, true);
+    }
+    for (i = 0; i < 16; i++) {
+        g_assert(data[i].aiocb == NULL);
+        g_assert_cmpint(data[i].n, ==, i % 2);
+        g_assert_cmpint(data[i].ret, ==, i % 2 ? 0 : -ECANCELED);
+    }
+}
+
 static void do_test_cancel(bool sync)
 {
     WorkerTestData data[100];
@@ -240,6 +280,7 @@ int main(int argc, char **argv)
     g_test_add_func("/thread-pool/submit-aio", test_submit_aio);
     g_test_add_func("/thread-pool/submit-co", test_submit_co);
     g_test_add_func("/thread-pool/submit-many", test_submit_many);
+    g_test_add_func("/thread-pool/submit-batch", test_submit_batch);
     g_test_add_func("/thread-pool/cancel", test_cancel);
     g_test_add_func("/thread-pool/cancel-async", test_cancel_async);
 
@@ -734,6 +734,62 @@ static void test_accounting(void)
                                 (64.0 / 13)));
 }
 
+static void test_headroom(void)
+{
+    double bytes, units;
+    int64_t now;
+
+    throttle_config_init(&cfg);
+    cfg.buckets[THROTTLE_OPS_TOTAL].avg = 1000;
+    cfg.buckets[THROTTLE_BPS_READ].avg = 1000000;
+    throttle_init(&ts);
+    throttle_config(&ts, QEMU_CLOCK_VIRTUAL, &cfg);
+    now = ts.previous_leak;
+
+    /* limited by the size of the buckets */
+    bytes = units = 1e12;
+    throttle_headroom(&ts, THROTTLE_READ, now, NANOSECONDS_PER_SECOND,
+                      &bytes, &units);
+    g_assert(double_cmp(bytes, 100000));
+    g_assert(double_cmp(units, 100));
+
+    /* there is no bps limit for writes */
+    bytes = units = 1e12;
+    throttle_headroom(&ts, THROTTLE_WRITE, now, NANOSECONDS_PER_SECOND,
+                      &bytes, &units);
+    g_assert(double_cmp(bytes, 1e12));
+    g_assert(double_cmp(units, 100));
+
+    /* limited by the period */
+    bytes = units = 1e12;
+    throttle_headroom(&ts, THROTTLE_READ, now, 10 * SCALE_MS,
+                      &bytes, &units);
+    g_assert(double_cmp(bytes, 10000));
+    g_assert(double_cmp(units, 10));
+
+    /* reads and writes share the ops bucket */
+    throttle_account_units(&ts, THROTTLE_READ, 60000, 40);
+    bytes = units = 1e12;
+    throttle_headroom(&ts, THROTTLE_READ, now, NANOSECONDS_PER_SECOND,
+                      &bytes, &units);
+    g_assert(double_cmp(bytes, 40000));
+    g_assert(double_cmp(units, 60));
+    bytes = units = 1e12;
+    throttle_headroom(&ts, THROTTLE_WRITE, now, NANOSECONDS_PER_SECOND,
+                      &bytes, &units);
+    g_assert(double_cmp(units, 60));
+
+    /* giving back more than was accounted empties the buckets */
+    throttle_account_units(&ts, THROTTLE_READ, -100000, -100);
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_BPS_READ].level, 0));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_OPS_TOTAL].level, 0));
+    bytes = units = 1e12;
+    throttle_headroom(&ts, THROTTLE_READ, now, NANOSECONDS_PER_SECOND,
+                      &bytes, &units);
+    g_assert(double_cmp(bytes, 100000));
+    g_assert(double_cmp(units, 100));
+}
+
 static void test_groups(void)
 {
     ThrottleConfig cfg1, cfg2;
@@ -829,6 +885,7 @@ int main(int argc, char **argv)
                     test_iops_size_is_missing_limit);
     g_test_add_func("/throttle/config_functions",   test_config_functions);
     g_test_add_func("/throttle/accounting",         test_accounting);
+    g_test_add_func("/throttle/headroom",           test_headroom);
     g_test_add_func("/throttle/groups",             test_groups);
     return g_test_run();
 }
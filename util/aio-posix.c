@@ -28,6 +28,15 @@
 /* Stop userspace polling on a handler if it isn't active for some time */
 #define POLL_IDLE_INTERVAL_NS (7 * NANOSECONDS_PER_SECOND)
 
+/* Weight of a new sample in AioHandler::poll_interval_ns is 1/8 */
+#define POLL_INTERVAL_WEIGHT_SHIFT 3
+
+/*
+ * Poll at most this many average event intervals, so that handlers with events
+ * slightly later than usual are still caught.
+ */
+#define POLL_BUDGET_INTERVALS 2
+
 bool aio_poll_disabled(AioContext *ctx)
 {
     return qatomic_read(&ctx->poll_disable_cnt);
@@ -98,13 +107,14 @@ static bool aio_remove_fd_handler(AioContext *ctx, AioHandler *node)
     return true;
 }
 
-void aio_set_fd_handler(AioContext *ctx,
-                        int fd,
-                        IOHandler *io_read,
-                        IOHandler *io_write,
-                        AioPollFn *io_poll,
-                        IOHandler *io_poll_ready,
-                        void *opaque)
+static void aio_set_fd_handler_common(AioContext *ctx,
+                                      int fd,
+                                      IOHandler *io_read,
+                                      IOHandler *io_write,
+                                      AioPollFn *io_poll,
+                                      IOHandler *io_poll_ready,
+                                      void *opaque,
+                                      bool edge_triggered)
 {
     AioHandler *node;
     AioHandler *new_node = NULL;
@@ -144,6 +154,7 @@ void aio_set_fd_handler(AioContext *ctx,
         new_node->io_poll = io_poll;
         new_node->io_poll_ready = io_poll_ready;
         new_node->opaque = opaque;
+        new_node->edge_triggered = edge_triggered;
 
         if (is_new) {
             new_node->pfd.fd = fd;
@@ -179,6 +190,18 @@ void aio_set_fd_handler(AioContext *ctx,
     }
 }
 
+void aio_set_fd_handler(AioContext *ctx,
+                        int fd,
+                        IOHandler *io_read,
+                        IOHandler *io_write,
+                        AioPollFn *io_poll,
+                        IOHandler *io_poll_ready,
+                        void *opaque)
+{
+    aio_set_fd_handler_common(ctx, fd, io_read, io_write, io_poll,
+                              io_poll_ready, opaque, false);
+}
+
 static void aio_set_fd_poll(AioContext *ctx, int fd,
                             IOHandler *io_poll_begin,
                             IOHandler *io_poll_end)
@@ -199,9 +222,13 @@ void aio_set_event_notifier(AioContext *ctx,
                             AioPollFn *io_poll,
                             EventNotifierHandler *io_poll_ready)
 {
-    aio_set_fd_handler(ctx, event_notifier_get_fd(notifier),
-                       (IOHandler *)io_read, NULL, io_poll,
-                       (IOHandler *)io_poll_ready, notifier);
+    /*
+     * EventNotifier handlers call event_notifier_test_and_clear(), which
+     * resets the counter, so they do not need level-triggered monitoring.
+     */
+    aio_set_fd_handler_common(ctx, event_notifier_get_fd(notifier),
+                              (IOHandler *)io_read, NULL, io_poll,
+                              (IOHandler *)io_poll_ready, notifier, true);
 }
 
 void aio_set_event_notifier_poll(AioContext *ctx,
@@ -318,6 +345,39 @@ static void aio_free_deleted_handlers(AioContext *ctx)
     qemu_lockcnt_inc_and_unlock(&ctx->list_lock);
 }
 
+static bool fdmon_supports_polling(AioContext *ctx)
+{
+    return ctx->fdmon_ops->need_wait != aio_poll_disabled;
+}
+
+/* Update the average time between events of a handler */
+static void poll_record_event(AioHandler *node, int64_t now)
+{
+    if (node->poll_last_event) {
+        int64_t interval = now - node->poll_last_event;
+
+        if (node->poll_interval_ns) {
+            node->poll_interval_ns += (interval - node->poll_interval_ns) >>
+                                      POLL_INTERVAL_WEIGHT_SHIFT;
+        } else {
+            node->poll_interval_ns = interval;
+        }
+    }
+    node->poll_last_event = now;
+}
+
+/*
+ * Are events of @node usually too far apart to be caught by busy polling?
+ * Such handlers only waste CPU time while polling, so leave them to fd
+ * monitoring.  This needs fd monitoring to work while polling, or fds of
+ * handlers that are not polled would be starved.
+ */
+static bool poll_handler_is_sparse(AioContext *ctx, AioHandler *node)
+{
+    return fdmon_supports_polling(ctx) &&
+           node->poll_interval_ns > ctx->poll_max_ns;
+}
+
 static bool aio_dispatch_handler(AioContext *ctx, AioHandler *node)
 {
     bool progress = false;
@@ -330,15 +390,20 @@ static bool aio_dispatch_handler(AioContext *ctx, AioHandler *node)
     poll_ready = node->poll_ready;
     node->poll_ready = false;
 
+    /* Events found by polling were recorded by run_poll_handlers_once() */
+    if (revents && node->io_poll && ctx->poll_max_ns) {
+        poll_record_event(node, qemu_clock_get_ns(QEMU_CLOCK_REALTIME));
+    }
+
     /*
      * Start polling AioHandlers when they become ready because activity is
-     * likely to continue.  Note that starvation is theoretically possible when
-     * fdmon_supports_polling(), but only until the fd fires for the first
-     * time.
+     * likely to continue, unless past events were too far apart.  Note that
+     * starvation is theoretically possible when fdmon_supports_polling(), but
+     * only until the fd fires for the first time.
      */
     if (!QLIST_IS_INSERTED(node, node_deleted) &&
         !QLIST_IS_INSERTED(node, node_poll) &&
-        node->io_poll) {
+        node->io_poll && !poll_handler_is_sparse(ctx, node)) {
         trace_poll_add(ctx, node, node->pfd.fd, revents);
         if (ctx->poll_started && node->io_poll_begin) {
             node->io_poll_begin(node->opaque);
@@ -443,6 +508,7 @@ static bool run_poll_handlers_once(AioContext *ctx,
             aio_add_poll_ready_handler(ready_list, node);
 
             node->poll_idle_timeout = now + POLL_IDLE_INTERVAL_NS;
+            poll_record_event(node, qemu_clock_get_ns(QEMU_CLOCK_REALTIME));
 
             /*
              * Polling was successful, exit try_poll_mode immediately
@@ -460,11 +526,6 @@ static bool run_poll_handlers_once(AioContext *ctx,
     return progress;
 }
 
-static bool fdmon_supports_polling(AioContext *ctx)
-{
-    return ctx->fdmon_ops->need_wait != aio_poll_disabled;
-}
-
 static bool remove_idle_poll_handlers(AioContext *ctx,
                                       AioHandlerList *ready_list,
                                       int64_t now)
@@ -486,7 +547,9 @@ static bool remove_idle_poll_handlers(AioContext *ctx,
     QLIST_FOREACH_SAFE(node, &ctx->poll_aio_handlers, node_poll, tmp) {
         if (node->poll_idle_timeout == 0LL) {
             node->poll_idle_timeout = now + POLL_IDLE_INTERVAL_NS;
-        } else if (now >= node->poll_idle_timeout) {
+        } else if (now >= node->poll_idle_timeout ||
+                   (poll_handler_is_sparse(ctx, node) &&
+                    now - node->poll_last_event > ctx->poll_max_ns)) {
             trace_poll_remove(ctx, node, node->pfd.fd);
             node->poll_idle_timeout = 0LL;
             QLIST_SAFE_REMOVE(node, node_poll);
@@ -549,6 +612,14 @@ static bool run_poll_handlers(AioContext *ctx, AioHandlerList *ready_list,
         assert(!(max_ns && progress));
     } while (elapsed_time < max_ns && !ctx->fdmon_ops->need_wait(ctx));
 
+    stat64_inc(&ctx->poll_attempts);
+    stat64_add(&ctx->poll_time_ns, elapsed_time);
+    if (progress) {
+        stat64_inc(&ctx->poll_successes);
+    } else {
+        stat64_add(&ctx->poll_wasted_ns, elapsed_time);
+    }
+
     if (remove_idle_poll_handlers(ctx, ready_list,
                                   start_time + elapsed_time)) {
         *timeout = 0;
@@ -566,6 +637,25 @@ static bool run_poll_handlers(AioContext *ctx, AioHandlerList *ready_list,
     return progress;
 }
 
+/*
+ * How long is it worth polling for?  Each handler is given a budget of a few
+ * times its average event interval.  Handlers without a history could become
+ * ready any time.
+ */
+static int64_t poll_budget_ns(AioContext *ctx)
+{
+    AioHandler *node;
+    int64_t budget = 0;
+
+    QLIST_FOREACH(node, &ctx->poll_aio_handlers, node_poll) {
+        if (!node->poll_interval_ns) {
+            return ctx->poll_ns;
+        }
+        budget = MAX(budget, node->poll_interval_ns * POLL_BUDGET_INTERVALS);
+    }
+    return MIN(budget, ctx->poll_ns);
+}
+
 /* try_poll_mode:
  * @ctx: the AioContext
  * @ready_list: list to add handlers that need to be run
@@ -585,7 +675,7 @@ static bool try_poll_mode(AioContext *ctx, AioHandlerList *ready_list,
         return false;
     }
 
-    max_ns = qemu_soonest_timeout(*timeout, ctx->poll_ns);
+    max_ns = qemu_soonest_timeout(*timeout, poll_budget_ns(ctx));
     if (max_ns && !ctx->fdmon_ops->need_wait(ctx)) {
         /*
          * Enable poll mode. It pairs with the poll_set_started() in
@@ -722,6 +812,9 @@ bool aio_poll(AioContext *ctx, bool blocking)
 
     progress |= aio_bh_poll(ctx);
     progress |= aio_dispatch_ready_handlers(ctx, &ready_list);
+    if (ctx->fdmon_ops->dispatch) {
+        progress |= ctx->fdmon_ops->dispatch(ctx);
+    }
 
     aio_free_deleted_handlers(ctx);
 
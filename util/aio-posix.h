@@ -37,7 +37,15 @@ struct AioHandler {
     unsigned flags; /* see fdmon-io_uring.c */
 #endif
     int64_t poll_idle_timeout; /* when to stop userspace polling */
+    int64_t poll_last_event; /* when the handler last became ready */
+    int64_t poll_interval_ns; /* moving average of time between events */
     bool poll_ready; /* has polling detected an event? */
+
+    /*
+     * io_read consumes all pending events, so the fd only needs to be
+     * reported when new events arrive (see aio_set_event_notifier())
+     */
+    bool edge_triggered;
 };
 
 /* Add a handler to a ready list */
@@ -30,7 +30,9 @@
 #include "block/graph-lock.h"
 #include "qemu/main-loop.h"
 #include "qemu/atomic.h"
+#include "qemu/bitmap.h"
 #include "qemu/lockcnt.h"
+#include "qemu/memalign.h"
 #include "qemu/rcu_queue.h"
 #include "block/raw-aio.h"
 #include "qemu/coroutine_int.h"
@@ -69,31 +71,124 @@ struct QEMUBH {
     MemReentrancyGuard *reentrancy_guard;
 };
 
-/* Called concurrently from any thread */
-static void aio_bh_enqueue(QEMUBH *bh, unsigned new_flags)
+typedef struct BHRingEntry {
+    /* pos + 1 once filled in for position pos, pos + BH_RING_SIZE once free */
+    unsigned long seq;
+    /* NULL if @opaque is a QEMUBH */
+    QEMUBHFunc *cb;
+    void *opaque;
+    const char *name;
+} BHRingEntry;
+
+/*
+ * A bounded multi-producer, single-consumer queue.  Producers reserve a
+ * position with a cmpxchg on @tail and publish the entry through its
+ * sequence number; the consumer only ever writes entry sequence numbers
+ * and its private @head, so draining a batch causes no contended atomics.
+ */
+struct BHRing {
+    unsigned long tail QEMU_ALIGNED(64);
+    unsigned long head QEMU_ALIGNED(64);
+    BHRingEntry entries[BH_RING_SIZE] QEMU_ALIGNED(64);
+};
+
+static BHRing *aio_bh_ring_new(void)
 {
-    AioContext *ctx = bh->ctx;
-    unsigned old_flags;
+    BHRing *ring = qemu_memalign(64, sizeof(*ring));
+    unsigned long i;
+
+    memset(ring, 0, sizeof(*ring));
+    for (i = 0; i < BH_RING_SIZE; i++) {
+        ring->entries[i].seq = i;
+    }
+    return ring;
+}
+
+/* Called concurrently from any thread.  Returns false if the ring is full. */
+static bool aio_bh_ring_push(BHRing *ring, QEMUBHFunc *cb, void *opaque,
+                             const char *name)
+{
+    unsigned long pos = qatomic_read(&ring->tail);
+    BHRingEntry *e;
+
+    for (;;) {
+        long diff;
+
+        e = &ring->entries[pos & (BH_RING_SIZE - 1)];
+
+        /* Pairs with qatomic_store_release() in aio_bh_ring_pop() */
+        diff = qatomic_load_acquire(&e->seq) - pos;
+        if (diff == 0) {
+            unsigned long old = qatomic_cmpxchg(&ring->tail, pos, pos + 1);
+
+            if (old == pos) {
+                break;
+            }
+            pos = old;
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = qatomic_read(&ring->tail);
+        }
+    }
+
+    e->cb = cb;
+    e->opaque = opaque;
+    e->name = name;
 
     /*
-     * Synchronizes with atomic_fetch_and() in aio_bh_dequeue(), ensuring that
-     * insertion starts after BH_PENDING is set.
+     * At this point the entry becomes visible to aio_bh_poll().  Pairs with
+     * qatomic_load_acquire() in aio_bh_ring_pop(), for the same reasons as
+     * QSLIST_INSERT_HEAD_ATOMIC() in aio_bh_enqueue().
      */
-    old_flags = qatomic_fetch_or(&bh->flags, BH_PENDING | new_flags);
+    qatomic_store_release(&e->seq, pos + 1);
+    return true;
+}
 
-    if (!(old_flags & BH_PENDING)) {
-        /*
-         * At this point the bottom half becomes visible to aio_bh_poll().
-         * This insertion thus synchronizes with QSLIST_MOVE_ATOMIC in
-         * aio_bh_poll(), ensuring that:
-         * 1. any writes needed by the callback are visible from the callback
-         *    after aio_bh_dequeue() returns bh.
-         * 2. ctx is loaded before the callback has a chance to execute and bh
-         *    could be freed.
-         */
-        QSLIST_INSERT_HEAD_ATOMIC(&ctx->bh_list, bh, next);
+/*
+ * Only called from aio_bh_poll() and aio_ctx_finalize().  Entries up to
+ * @end are taken; an entry that has been reserved but not filled in yet
+ * ends the batch, its producer will call aio_notify() when done.
+ */
+static bool aio_bh_ring_pop(BHRing *ring, unsigned long end, BHRingEntry *out)
+{
+    unsigned long pos = ring->head;
+    BHRingEntry *e;
+
+    /* a nested aio_bh_poll() may have gone past @end */
+    if ((long)(end - pos) <= 0) {
+        return false;
     }
 
+    e = &ring->entries[pos & (BH_RING_SIZE - 1)];
+    if (qatomic_load_acquire(&e->seq) != pos + 1) {
+        return false;
+    }
+    *out = *e;
+
+    /* Take the entry before any callback can start a nested aio_bh_poll() */
+    ring->head = pos + 1;
+    qatomic_store_release(&e->seq, pos + BH_RING_SIZE);
+    return true;
+}
+
+/*
+ * Only called from the thread that runs aio_bh_poll().  An entry that has
+ * been reserved but not filled in yet does not count, because
+ * aio_bh_ring_pop() could not take it anyway; its producer will call
+ * aio_notify() once the entry is published.  Pairs with
+ * qatomic_store_release() in aio_bh_ring_push().
+ */
+static bool aio_bh_ring_pending(BHRing *ring)
+{
+    unsigned long pos = ring->head;
+    BHRingEntry *e = &ring->entries[pos & (BH_RING_SIZE - 1)];
+
+    return qatomic_load_acquire(&e->seq) == pos + 1;
+}
+
+static void aio_bh_notify(AioContext *ctx)
+{
     aio_notify(ctx);
     if (unlikely(icount_enabled())) {
         /*
@@ -106,6 +201,51 @@ static void aio_bh_enqueue(QEMUBH *bh, unsigned new_flags)
     }
 }
 
+/* Called concurrently from any thread */
+static void aio_bh_enqueue(QEMUBH *bh, unsigned new_flags)
+{
+    AioContext *ctx = bh->ctx;
+    unsigned old_flags;
+
+    /*
+     * Synchronizes with atomic_fetch_and() in aio_bh_clear_pending(),
+     * ensuring that insertion starts after BH_PENDING is set.
+     */
+    old_flags = qatomic_fetch_or(&bh->flags, BH_PENDING | new_flags);
+
+    if (!(old_flags & BH_PENDING)) {
+        /*
+         * Idle bottom halves stay on the list, so that they do not make
+         * aio_compute_timeout() return zero.
+         */
+        if ((new_flags & BH_IDLE) ||
+            !aio_bh_ring_push(ctx->bh_ring, NULL, bh, NULL)) {
+            /*
+             * At this point the bottom half becomes visible to aio_bh_poll().
+             * This insertion thus synchronizes with QSLIST_MOVE_ATOMIC in
+             * aio_bh_poll(), ensuring that:
+             * 1. any writes needed by the callback are visible from the
+             *    callback after aio_bh_dequeue() returns bh.
+             * 2. ctx is loaded before the callback has a chance to execute
+             *    and bh could be freed.
+             */
+            QSLIST_INSERT_HEAD_ATOMIC(&ctx->bh_list, bh, next);
+        }
+    }
+
+    aio_bh_notify(ctx);
+}
+
+/*
+ * Synchronizes with qatomic_fetch_or() in aio_bh_enqueue(), ensuring that
+ * the removal finishes before BH_PENDING is reset.
+ */
+static unsigned aio_bh_clear_pending(QEMUBH *bh)
+{
+    return qatomic_fetch_and(&bh->flags,
+                             ~(BH_PENDING | BH_SCHEDULED | BH_IDLE));
+}
+
 /* Only called from aio_bh_poll() and aio_ctx_finalize() */
 static QEMUBH *aio_bh_dequeue(BHList *head, unsigned *flags)
 {
@@ -116,13 +256,7 @@ static QEMUBH *aio_bh_dequeue(BHList *head, unsigned *flags)
     }
 
     QSLIST_REMOVE_HEAD(head, next);
-
-    /*
-     * Synchronizes with qatomic_fetch_or() in aio_bh_enqueue(), ensuring that
-     * the removal finishes before BH_PENDING is reset.
-     */
-    *flags = qatomic_fetch_and(&bh->flags,
-                              ~(BH_PENDING | BH_SCHEDULED | BH_IDLE));
+    *flags = aio_bh_clear_pending(bh);
     return bh;
 }
 
@@ -130,6 +264,12 @@ void aio_bh_schedule_oneshot_full(AioContext *ctx, QEMUBHFunc *cb,
                                   void *opaque, const char *name)
 {
     QEMUBH *bh;
+
+    if (aio_bh_ring_push(ctx->bh_ring, cb, opaque, name)) {
+        aio_bh_notify(ctx);
+        return;
+    }
+
     bh = g_new(QEMUBH, 1);
     *bh = (QEMUBH){
         .ctx = ctx,
@@ -176,13 +316,41 @@ void aio_bh_call(QEMUBH *bh)
     }
 }
 
+/* Returns 1 if the callback of @bh was invoked and counts as progress */
+static int aio_bh_run(QEMUBH *bh, unsigned flags)
+{
+    int ret = 0;
+
+    if ((flags & (BH_SCHEDULED | BH_DELETED)) == BH_SCHEDULED) {
+        /* Idle BHs don't count as progress */
+        if (!(flags & BH_IDLE)) {
+            ret = 1;
+        }
+        aio_bh_call(bh);
+    }
+    if (flags & (BH_DELETED | BH_ONESHOT)) {
+        g_free(bh);
+    }
+    return ret;
+}
+
 /* Multiple occurrences of aio_bh_poll cannot be called concurrently. */
 int aio_bh_poll(AioContext *ctx)
 {
+    BHRing *ring = ctx->bh_ring;
+    BHRingEntry entry;
+    unsigned long end;
     BHListSlice slice;
     BHListSlice *s;
     int ret = 0;
 
+    /*
+     * Like the list slice below, only run what was queued on the ring
+     * before this point; bottom halves that reschedule themselves run in
+     * the next aio_bh_poll() call.
+     */
+    end = qatomic_read(&ring->tail);
+
     /* Synchronizes with QSLIST_INSERT_HEAD_ATOMIC in aio_bh_enqueue().  */
     QSLIST_MOVE_ATOMIC(&slice.bh_list, &ctx->bh_list);
 
@@ -201,6 +369,17 @@ int aio_bh_poll(AioContext *ctx)
 #pragma GCC diagnostic pop
 #endif
 
+    while (aio_bh_ring_pop(ring, end, &entry)) {
+        if (entry.cb) {
+            ret = 1;
+            entry.cb(entry.opaque);
+        } else {
+            QEMUBH *bh = entry.opaque;
+
+            ret |= aio_bh_run(bh, aio_bh_clear_pending(bh));
+        }
+    }
+
     while ((s = QSIMPLEQ_FIRST(&ctx->bh_slice_list))) {
         QEMUBH *bh;
         unsigned flags;
@@ -211,16 +390,7 @@ int aio_bh_poll(AioContext *ctx)
             continue;
         }
 
-        if ((flags & (BH_SCHEDULED | BH_DELETED)) == BH_SCHEDULED) {
-            /* Idle BHs don't count as progress */
-            if (!(flags & BH_IDLE)) {
-                ret = 1;
-            }
-            aio_bh_call(bh);
-        }
-        if (flags & (BH_DELETED | BH_ONESHOT)) {
-            g_free(bh);
-        }
+        ret |= aio_bh_run(bh, flags);
     }
 
     return ret;
@@ -279,6 +449,10 @@ aio_compute_timeout(AioContext *ctx)
     int64_t deadline;
     int timeout = -1;
 
+    if (aio_bh_ring_pending(ctx->bh_ring)) {
+        return 0;
+    }
+
     timeout = aio_compute_bh_timeout(&ctx->bh_list, timeout);
     if (timeout == 0) {
         return 0;
@@ -334,6 +508,10 @@ aio_ctx_check(GSource *source)
     qatomic_store_release(&ctx->notify_me, qatomic_read(&ctx->notify_me) & ~1);
     aio_notify_accept(ctx);
 
+    if (aio_bh_ring_pending(ctx->bh_ring)) {
+        return true;
+    }
+
     QSLIST_FOREACH_RCU(bh, &ctx->bh_list, next) {
         if ((bh->flags & (BH_SCHEDULED | BH_DELETED)) == BH_SCHEDULED) {
             return true;
@@ -366,10 +544,12 @@ static void
 aio_ctx_finalize(GSource     *source)
 {
     AioContext *ctx = (AioContext *) source;
+    BHRingEntry entry;
     QEMUBH *bh;
     unsigned flags;
 
     thread_pool_free(ctx->thread_pool);
+    g_free(ctx->thread_pool_cpus);
 
 #ifdef CONFIG_LINUX_AIO
     if (ctx->linux_aio) {
@@ -393,6 +573,19 @@ aio_ctx_finalize(GSource     *source)
     /* There must be no aio_bh_poll() calls going on */
     assert(QSIMPLEQ_EMPTY(&ctx->bh_slice_list));
 
+    /* See below; one-shot BHs cannot be deleted, so they always leak */
+    while (aio_bh_ring_pop(ctx->bh_ring, qatomic_read(&ctx->bh_ring->tail),
+                           &entry)) {
+        bh = entry.opaque;
+        if (unlikely(entry.cb || !(aio_bh_clear_pending(bh) & BH_DELETED))) {
+            fprintf(stderr, "%s: BH '%s' leaked, aborting...\n",
+                    __func__, entry.cb ? entry.name : bh->name);
+            abort();
+        }
+        g_free(bh);
+    }
+    qemu_vfree(ctx->bh_ring);
+
     while ((bh = aio_bh_dequeue(&ctx->bh_list, &flags))) {
         /*
          * qemu_bh_delete() must have been called on BHs in this AioContext. In
@@ -499,7 +692,20 @@ void aio_notify(AioContext *ctx)
      * Pairs with smp_mb() in aio_ctx_prepare or aio_poll.
      */
     smp_mb();
-    if (qatomic_read(&ctx->notify_me)) {
+    if (!qatomic_read(&ctx->notify_me)) {
+        /* The AioContext is running or polling and will see ctx->notified */
+        return;
+    }
+
+    /*
+     * The AioContext may be sleeping.  If another thread has already written
+     * the EventNotifier, and the AioContext has not cleared the flag yet, the
+     * wakeup is already pending, or aio_context_notifier_cb() will see
+     * ctx->notified and write the EventNotifier again.  Pairs with smp_mb()
+     * in aio_context_notifier_cb().
+     */
+    if (!qatomic_read(&ctx->notifier_kicked) &&
+        !qatomic_xchg(&ctx->notifier_kicked, true)) {
         event_notifier_set(&ctx->notifier);
     }
 }
@@ -526,6 +732,27 @@ static void aio_context_notifier_cb(EventNotifier *e)
     AioContext *ctx = container_of(e, AioContext, notifier);
 
     event_notifier_test_and_clear(&ctx->notifier);
+
+    /*
+     * Only allow aio_notify() to write the EventNotifier again after reading
+     * it.  Clearing the flag first would let the read consume a write made
+     * after the clear, leaving the flag set with no wakeup pending, so that
+     * no later aio_notify() would write the EventNotifier ever again.
+     */
+    qatomic_set(&ctx->notifier_kicked, false);
+
+    /*
+     * An aio_notify() between the read and the clear still saw the flag set
+     * and skipped the write.  Write ctx->notifier_kicked before reading
+     * ctx->notified; pairs with smp_mb() in aio_notify().  Either the
+     * aio_notify() sees the cleared flag and writes the EventNotifier, or
+     * its notification is seen here and the EventNotifier is written again.
+     */
+    smp_mb();
+    if (qatomic_read(&ctx->notified) &&
+        !qatomic_xchg(&ctx->notifier_kicked, true)) {
+        event_notifier_set(&ctx->notifier);
+    }
 }
 
 /* Returns true if aio_notify() was called (e.g. a BH was scheduled) */
@@ -578,6 +805,7 @@ AioContext *aio_context_new(Error **errp)
     AioContext *ctx;
 
     ctx = (AioContext *) g_source_new(&aio_source_funcs, sizeof(AioContext));
+    ctx->bh_ring = aio_bh_ring_new();
     QSLIST_INIT(&ctx->bh_list);
     QSIMPLEQ_INIT(&ctx->bh_slice_list);
     aio_context_setup(ctx);
@@ -618,6 +846,8 @@ AioContext *aio_context_new(Error **errp)
 
     ctx->thread_pool_min = 0;
     ctx->thread_pool_max = THREAD_POOL_MAX_THREADS_DEFAULT;
+    ctx->thread_pool_cpus = NULL;
+    ctx->thread_pool_nr_cpus = 0;
 
     register_aiocontext(ctx);
 
@@ -743,6 +973,14 @@ void qemu_set_current_aio_context(AioContext *ctx)
     set_my_aiocontext(ctx);
 }
 
+void aio_context_get_poll_stats(AioContext *ctx, AioPollStats *stats)
+{
+    stats->attempts = stat64_get(&ctx->poll_attempts);
+    stats->successes = stat64_get(&ctx->poll_successes);
+    stats->time_ns = stat64_get(&ctx->poll_time_ns);
+    stats->wasted_ns = stat64_get(&ctx->poll_wasted_ns);
+}
+
 void aio_context_set_thread_pool_params(AioContext *ctx, int64_t min,
                                         int64_t max, Error **errp)
 {
@@ -759,3 +997,29 @@ void aio_context_set_thread_pool_params(AioContext *ctx, int64_t min,
         thread_pool_update_params(ctx->thread_pool, ctx);
     }
 }
+
+void aio_context_set_thread_pool_cpus(AioContext *ctx, const uint16List *cpus,
+                                      Error **errp)
+{
+    const uint16List *l;
+    unsigned long nr_cpus = 0;
+
+    for (l = cpus; l; l = l->next) {
+        nr_cpus = MAX(nr_cpus, l->value + 1);
+    }
+
+    g_free(ctx->thread_pool_cpus);
+    ctx->thread_pool_cpus = NULL;
+    ctx->thread_pool_nr_cpus = nr_cpus;
+
+    if (nr_cpus) {
+        ctx->thread_pool_cpus = bitmap_new(nr_cpus);
+        for (l = cpus; l; l = l->next) {
+            set_bit(l->value, ctx->thread_pool_cpus);
+        }
+    }
+
+    if (ctx->thread_pool) {
+        thread_pool_update_params(ctx->thread_pool, ctx);
+    }
+}
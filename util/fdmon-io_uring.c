@@ -19,13 +19,19 @@
  * 4. Nanosecond timeouts are supported so it requires fewer syscalls than
  *    epoll(7).
  *
- * This code only monitors file descriptors and does not do asynchronous disk
- * I/O.  Implementing disk I/O efficiently has other requirements and should
- * use a separate io_uring so it does not make sense to unify the code.
+ * Other users can submit their own requests to the same ring with
+ * aio_add_sqe(), for example the io_uring block driver.  Their completion
+ * callbacks are invoked from aio_poll() after fd handlers.  This way one
+ * io_uring_enter(2) call per event loop iteration submits block I/O together
+ * with fd monitoring changes and waits for all of them.
  *
  * File descriptor monitoring is implemented using the following operations:
  *
- * 1. IORING_OP_POLL_ADD - adds a file descriptor to be monitored.
+ * 1. IORING_OP_POLL_ADD - adds a file descriptor to be monitored.  Handlers
+ *    that consume all pending events, such as EventNotifier handlers, use
+ *    multishot poll so that they are not re-armed after each event.  Other
+ *    handlers need level-triggered semantics and use one-shot poll, which is
+ *    re-armed each time it completes.
  * 2. IORING_OP_POLL_REMOVE - removes a file descriptor being monitored.  When
  *    the poll mask changes for a file descriptor it is first removed and then
  *    re-added with the new poll mask, so this operation is also used as part
@@ -57,6 +63,12 @@ enum {
     FDMON_IO_URING_REMOVE   = (1 << 2),
 };
 
+/*
+ * user_data of sqes submitted with aio_add_sqe() is a CqeHandler pointer with
+ * the lowest bit set, to tell them apart from AioHandler pointers.
+ */
+#define FDMON_IO_URING_CQE_HANDLER 1
+
 static inline int poll_events_from_pfd(int pfd_events)
 {
     return (pfd_events & G_IO_IN ? POLLIN : 0) |
@@ -75,7 +87,7 @@ static inline int pfd_events_from_poll(int poll_events)
 
 /*
  * Returns an sqe for submitting a request.  Only be called within
- * fdmon_io_uring_wait().
+ * fdmon_io_uring_wait() or aio_add_sqe() in the AioContext's home thread.
  */
 static struct io_uring_sqe *get_sqe(AioContext *ctx)
 {
@@ -166,12 +178,26 @@ static void fdmon_io_uring_update(AioContext *ctx,
     }
 }
 
+static bool use_multishot(AioContext *ctx, AioHandler *node)
+{
+#ifdef IORING_POLL_ADD_MULTI
+    return node->edge_triggered && ctx->fdmon_io_uring_multishot;
+#else
+    return false;
+#endif
+}
+
 static void add_poll_add_sqe(AioContext *ctx, AioHandler *node)
 {
     struct io_uring_sqe *sqe = get_sqe(ctx);
     int events = poll_events_from_pfd(node->pfd.events);
 
     io_uring_prep_poll_add(sqe, node->pfd.fd, events);
+#ifdef IORING_POLL_ADD_MULTI
+    if (use_multishot(ctx, node)) {
+        sqe->len |= IORING_POLL_ADD_MULTI;
+    }
+#endif
     io_uring_sqe_set_data(sqe, node);
 }
 
@@ -226,29 +252,64 @@ static bool process_cqe(AioContext *ctx,
                         AioHandlerList *ready_list,
                         struct io_uring_cqe *cqe)
 {
-    AioHandler *node = io_uring_cqe_get_data(cqe);
+    uintptr_t data = (uintptr_t)io_uring_cqe_get_data(cqe);
+    AioHandler *node;
     unsigned flags;
+    bool more;
 
     /* poll_timeout and poll_remove have a zero user_data field */
-    if (!node) {
+    if (!data) {
         return false;
     }
 
+    if (data & FDMON_IO_URING_CQE_HANDLER) {
+        CqeHandler *cqe_handler = (CqeHandler *)(data &
+                                                 ~FDMON_IO_URING_CQE_HANDLER);
+
+        cqe_handler->cqe = *cqe;
+        QSIMPLEQ_INSERT_TAIL(&ctx->cqe_handler_ready_list, cqe_handler, next);
+        assert(ctx->fdmon_io_uring_inflight > 0);
+        ctx->fdmon_io_uring_inflight--;
+        return true;
+    }
+
+    node = (AioHandler *)data;
+    more = cqe->flags & IORING_CQE_F_MORE;
+
     /*
      * Deletion can only happen when IORING_OP_POLL_ADD completes.  If we race
      * with enqueue() here then we can safely clear the FDMON_IO_URING_REMOVE
      * bit before IORING_OP_POLL_REMOVE is submitted.
+     *
+     * A multishot IORING_OP_POLL_ADD is still armed while its cqes have
+     * IORING_CQE_F_MORE, so wait for the last one.
      */
-    flags = qatomic_fetch_and(&node->flags, ~FDMON_IO_URING_REMOVE);
+    if (more) {
+        flags = qatomic_read(&node->flags);
+    } else {
+        flags = qatomic_fetch_and(&node->flags, ~FDMON_IO_URING_REMOVE);
+    }
     if (flags & FDMON_IO_URING_REMOVE) {
-        QLIST_INSERT_HEAD_RCU(&ctx->deleted_aio_handlers, node, node_deleted);
+        if (!more) {
+            QLIST_INSERT_HEAD_RCU(&ctx->deleted_aio_handlers, node,
+                                  node_deleted);
+        }
+        return false;
+    }
+
+    if (cqe->res == -EINVAL && use_multishot(ctx, node)) {
+        /* The kernel does not support multishot poll, fall back */
+        ctx->fdmon_io_uring_multishot = false;
+        add_poll_add_sqe(ctx, node);
         return false;
     }
 
     aio_add_ready_handler(ready_list, node, pfd_events_from_poll(cqe->res));
 
-    /* IORING_OP_POLL_ADD is one-shot so we must re-arm it */
-    add_poll_add_sqe(ctx, node);
+    /* One-shot IORING_OP_POLL_ADD, or multishot that ended, must be re-armed */
+    if (!more) {
+        add_poll_add_sqe(ctx, node);
+    }
     return true;
 }
 
@@ -278,6 +339,11 @@ static int fdmon_io_uring_wait(AioContext *ctx, AioHandlerList *ready_list,
     unsigned wait_nr = 1; /* block until at least one cqe is ready */
     int ret;
 
+    /* Completion callbacks from a previous iteration are still pending */
+    if (!QSIMPLEQ_EMPTY(&ctx->cqe_handler_ready_list)) {
+        timeout = 0;
+    }
+
     if (timeout == 0) {
         wait_nr = 0; /* non-blocking */
     } else if (timeout > 0) {
@@ -312,15 +378,59 @@ static bool fdmon_io_uring_need_wait(AioContext *ctx)
         return true;
     }
 
+    /* Are completion callbacks waiting to be invoked? */
+    if (!QSIMPLEQ_EMPTY(&ctx->cqe_handler_ready_list)) {
+        return true;
+    }
+
     return false;
 }
 
+static bool fdmon_io_uring_dispatch(AioContext *ctx)
+{
+    CqeHandler *cqe_handler;
+    bool progress = false;
+
+    /*
+     * Callbacks may run a nested aio_poll(), which dispatches the rest of the
+     * list, so remove each handler before invoking it.
+     */
+    while ((cqe_handler = QSIMPLEQ_FIRST(&ctx->cqe_handler_ready_list))) {
+        QSIMPLEQ_REMOVE_HEAD(&ctx->cqe_handler_ready_list, next);
+        cqe_handler->cb(cqe_handler);
+        progress = true;
+    }
+
+    return progress;
+}
+
 static const FDMonOps fdmon_io_uring_ops = {
     .update = fdmon_io_uring_update,
     .wait = fdmon_io_uring_wait,
     .need_wait = fdmon_io_uring_need_wait,
+    .dispatch = fdmon_io_uring_dispatch,
 };
 
+bool aio_has_io_uring(AioContext *ctx)
+{
+    return ctx->fdmon_ops == &fdmon_io_uring_ops;
+}
+
+void aio_add_sqe(void (*prep_sqe)(struct io_uring_sqe *sqe, void *opaque),
+                 void *opaque, CqeHandler *cqe_handler)
+{
+    AioContext *ctx = qemu_get_current_aio_context();
+    struct io_uring_sqe *sqe;
+
+    assert(aio_has_io_uring(ctx));
+
+    sqe = get_sqe(ctx);
+    prep_sqe(sqe, opaque);
+    io_uring_sqe_set_data(sqe, (void *)((uintptr_t)cqe_handler |
+                                        FDMON_IO_URING_CQE_HANDLER));
+    ctx->fdmon_io_uring_inflight++;
+}
+
 bool fdmon_io_uring_setup(AioContext *ctx)
 {
     int ret;
@@ -331,15 +441,56 @@ bool fdmon_io_uring_setup(AioContext *ctx)
     }
 
     QSLIST_INIT(&ctx->submit_list);
+    QSIMPLEQ_INIT(&ctx->cqe_handler_ready_list);
+    ctx->fdmon_io_uring_inflight = 0;
+    ctx->fdmon_io_uring_multishot = true;
     ctx->fdmon_ops = &fdmon_io_uring_ops;
     return true;
 }
 
+/*
+ * Wait for the requests submitted with aio_add_sqe() and invoke their
+ * completion callbacks, which may submit further requests.  This is needed
+ * before the ring is torn down, or the callbacks would never run.
+ *
+ * AioHandlers that become ready meanwhile are not dispatched: their file
+ * descriptors are still readable or writable, so the next fd monitoring
+ * implementation will report them again.
+ */
+static void fdmon_io_uring_drain(AioContext *ctx)
+{
+    AioHandlerList ready_list = QLIST_HEAD_INITIALIZER(ready_list);
+    AioHandler *node;
+    int ret;
+
+    while (ctx->fdmon_io_uring_inflight ||
+           !QSIMPLEQ_EMPTY(&ctx->cqe_handler_ready_list)) {
+        if (ctx->fdmon_io_uring_inflight) {
+            do {
+                ret = io_uring_submit_and_wait(&ctx->fdmon_io_uring, 1);
+            } while (ret == -EINTR);
+            assert(ret >= 0);
+
+            process_cq_ring(ctx, &ready_list);
+            while ((node = QLIST_FIRST(&ready_list))) {
+                QLIST_SAFE_REMOVE(node, node_ready);
+            }
+        }
+
+        fdmon_io_uring_dispatch(ctx);
+    }
+}
+
 void fdmon_io_uring_destroy(AioContext *ctx)
 {
     if (ctx->fdmon_ops == &fdmon_io_uring_ops) {
         AioHandler *node;
 
+        /* The ring is used by the AioContext's home thread only */
+        assert(!ctx->fdmon_io_uring_inflight ||
+               ctx == qemu_get_current_aio_context());
+        fdmon_io_uring_drain(ctx);
+
         io_uring_queue_exit(&ctx->fdmon_io_uring);
 
         /* Move handlers due to be removed onto the deleted list */
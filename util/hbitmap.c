@@ -50,8 +50,28 @@
  * extremely sparse, this is also O(m + m/W + m/W^2 + ...), so the amortized
  * cost of advancing from one bit to the next is usually constant (worst case
  * O(logB n) as in the non-amortized complexity).
+ *
+ * The last level, which takes up almost all of the memory, is not stored as
+ * one array but in pages of BITS_PER_LONG words, so that each page is
+ * described by exactly one word of the 2nd-last level.  Pages that are all
+ * zeroes or all ones are not allocated, but point to a shared constant page
+ * instead; a private copy is only made when a bit in them changes.  This
+ * is a simple form of the containers used by compressed bitmap formats: the
+ * memory used by a large, sparse (or mostly full) bitmap is proportional to
+ * the number of pages that actually contain both zeroes and ones.  Scans
+ * can skip constant pages without looking at their contents.
  */
 
+/* Words per page of the last level */
+#define HB_PAGE_WORDS   BITS_PER_LONG
+#define HB_PAGE_BYTES   (HB_PAGE_WORDS * sizeof(unsigned long))
+#define HB_LAST_LEVEL   (HBITMAP_LEVELS - 1)
+
+static const unsigned long hb_zero_page[HB_PAGE_WORDS];
+static const unsigned long hb_ones_page[HB_PAGE_WORDS] = {
+    [0 ... HB_PAGE_WORDS - 1] = ~0UL
+};
+
 struct HBitmap {
     /*
      * Size of the bitmap, as requested in hbitmap_alloc or in hbitmap_truncate.
@@ -93,14 +113,175 @@ struct HBitmap {
      * actual bitmap.
      *
      * Note that all bitmaps have the same number of levels.  Even a 1-bit
-     * bitmap will still allocate HBITMAP_LEVELS arrays.
+     * bitmap will still allocate HBITMAP_LEVELS arrays.  The last level is
+     * stored in @pages instead, levels[HB_LAST_LEVEL] is NULL.
      */
     unsigned long *levels[HBITMAP_LEVELS];
 
-    /* The length of each levels[] array. */
+    /* The pages of the last level, see the comment at the top of the file. */
+    unsigned long **pages;
+
+    /* Number of pages that are not shared constant pages. */
+    uint64_t allocated_pages;
+
+    /* The length of each levels[] array (in words, also for the last). */
     uint64_t sizes[HBITMAP_LEVELS];
 };
 
+static inline size_t hb_nb_pages(uint64_t words)
+{
+    return DIV_ROUND_UP(words, HB_PAGE_WORDS);
+}
+
+static inline bool hb_page_is_const(const unsigned long *page)
+{
+    return page == hb_zero_page || page == hb_ones_page;
+}
+
+/* Read word @pos of the last level */
+static inline unsigned long hb_last_word(const HBitmap *hb, size_t pos)
+{
+    return hb->pages[pos >> BITS_PER_LEVEL][pos & (HB_PAGE_WORDS - 1)];
+}
+
+/* Read word @pos of level @level */
+static inline unsigned long hb_word(const HBitmap *hb, int level, size_t pos)
+{
+    if (level == HB_LAST_LEVEL) {
+        return hb_last_word(hb, pos);
+    }
+    return hb->levels[level][pos];
+}
+
+/* Make page @page of the last level private, so that it can be modified */
+static unsigned long *hb_page_writable(HBitmap *hb, size_t page)
+{
+    if (hb_page_is_const(hb->pages[page])) {
+        hb->pages[page] = g_memdup2(hb->pages[page], HB_PAGE_BYTES);
+        hb->allocated_pages++;
+    }
+    return hb->pages[page];
+}
+
+/* Replace page @page of the last level by the constant page @value */
+static void hb_page_set_const(HBitmap *hb, size_t page,
+                              const unsigned long *value)
+{
+    assert(hb_page_is_const(value));
+    if (!hb_page_is_const(hb->pages[page])) {
+        g_free(hb->pages[page]);
+        hb->allocated_pages--;
+    }
+    hb->pages[page] = (unsigned long *)value;
+}
+
+/* Return a pointer to word @pos of level @level, which may be modified */
+static inline unsigned long *hb_elem(HBitmap *hb, int level, size_t pos)
+{
+    if (level == HB_LAST_LEVEL) {
+        return &hb_page_writable(hb, pos >> BITS_PER_LEVEL)
+                                [pos & (HB_PAGE_WORDS - 1)];
+    }
+    return &hb->levels[level][pos];
+}
+
+/* Set word @pos of the last level, without copying a page if unchanged */
+static inline void hb_set_last_word(HBitmap *hb, size_t pos,
+                                    unsigned long value)
+{
+    if (hb_last_word(hb, pos) != value) {
+        *hb_elem(hb, HB_LAST_LEVEL, pos) = value;
+    }
+}
+
+/*
+ * Return the index of the first word in [@pos, @end) of the last level that
+ * is not equal to @skip (which is either 0 or ~0UL), or @end if there is
+ * none.
+ */
+static size_t hb_find_word_not(const HBitmap *hb, size_t pos, size_t end,
+                               unsigned long skip)
+{
+    const unsigned long *skip_page = skip ? hb_ones_page : hb_zero_page;
+
+    while (pos < end) {
+        const unsigned long *page = hb->pages[pos >> BITS_PER_LEVEL];
+        size_t i = pos & (HB_PAGE_WORDS - 1);
+        size_t n = MIN(HB_PAGE_WORDS - i, end - pos);
+
+        if (page == skip_page) {
+            pos += n;
+            continue;
+        }
+
+        /*
+         * Look at four words at a time; compilers turn this into vector
+         * instructions where available.
+         */
+        for (; n >= 4; n -= 4, i += 4, pos += 4) {
+            unsigned long x = (page[i] ^ skip) | (page[i + 1] ^ skip) |
+                              (page[i + 2] ^ skip) | (page[i + 3] ^ skip);
+            if (x) {
+                break;
+            }
+        }
+        for (; n > 0; n--, i++, pos++) {
+            if (page[i] != skip) {
+                return pos;
+            }
+        }
+    }
+
+    return end;
+}
+
+/*
+ * Set words [@pos, @end) of level @level to all ones (if @set) or to zero.
+ * Returns true if this changes whether any of the words is zero.
+ */
+static bool hb_fill_words(HBitmap *hb, int level, size_t pos, size_t end,
+                          bool set)
+{
+    unsigned long value = set ? ~0UL : 0;
+    const unsigned long *const_page = set ? hb_ones_page : hb_zero_page;
+    bool changed = false;
+
+    if (level != HB_LAST_LEVEL) {
+        for (; pos < end; pos++) {
+            changed |= set ? hb->levels[level][pos] == 0
+                           : hb->levels[level][pos] != 0;
+            hb->levels[level][pos] = value;
+        }
+        return changed;
+    }
+
+    while (pos < end) {
+        size_t page = pos >> BITS_PER_LEVEL;
+        size_t i = pos & (HB_PAGE_WORDS - 1);
+        size_t n = MIN(HB_PAGE_WORDS - i, end - pos);
+        unsigned long *words = hb->pages[page];
+        size_t j;
+
+        if (words != const_page) {
+            if (set) {
+                for (j = i; j < i + n && !changed; j++) {
+                    changed = words[j] == 0;
+                }
+            } else {
+                changed |= hb_find_word_not(hb, pos, pos + n, 0) < pos + n;
+            }
+            if (n == HB_PAGE_WORDS) {
+                hb_page_set_const(hb, page, const_page);
+            } else {
+                words = hb_page_writable(hb, page);
+                memset(&words[i], set ? 0xff : 0, n * sizeof(unsigned long));
+            }
+        }
+        pos += n;
+    }
+    return changed;
+}
+
 /* Advance hbi to the next nonzero word and return it.  hbi->pos
  * is updated.  Returns zero if we reach the end of the bitmap.
  */
@@ -136,7 +317,7 @@ static unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi)
         hbi->cur[i] = cur & (cur - 1);
 
         /* Set up next level for iteration.  */
-        cur = hb->levels[i + 1][pos];
+        cur = hb_word(hb, i + 1, pos);
     }
 
     hbi->pos = pos;
@@ -149,7 +330,7 @@ static unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi)
 int64_t hbitmap_iter_next(HBitmapIter *hbi)
 {
     unsigned long cur = hbi->cur[HBITMAP_LEVELS - 1] &
-            hbi->hb->levels[HBITMAP_LEVELS - 1][hbi->pos];
+            hb_last_word(hbi->hb, hbi->pos);
     int64_t item;
 
     if (cur == 0) {
@@ -182,7 +363,7 @@ void hbitmap_iter_init(HBitmapIter *hbi, const HBitmap *hb, uint64_t first)
         pos >>= BITS_PER_LEVEL;
 
         /* Drop bits representing items before first.  */
-        hbi->cur[i] = hb->levels[i][pos] & ~((1UL << bit) - 1);
+        hbi->cur[i] = hb_word(hb, i, pos) & ~((1UL << bit) - 1);
 
         /* We have already added level i+1, so the lowest set bit has
          * been processed.  Clear it.
@@ -219,9 +400,8 @@ int64_t hbitmap_next_dirty(const HBitmap *hb, int64_t start, int64_t count)
 
 int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
 {
-    size_t pos = (start >> hb->granularity) >> BITS_PER_LEVEL;
-    unsigned long *last_lev = hb->levels[HBITMAP_LEVELS - 1];
-    unsigned long cur = last_lev[pos];
+    size_t pos;
+    unsigned long cur;
     unsigned start_bit_offset;
     uint64_t end_bit, sz;
     int64_t res;
@@ -232,6 +412,9 @@ int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
         return -1;
     }
 
+    pos = (start >> hb->granularity) >> BITS_PER_LEVEL;
+    cur = hb_last_word(hb, pos);
+
     end_bit = count > hb->orig_size - start ?
                 hb->size :
                 ((start + count - 1) >> hb->granularity) + 1;
@@ -245,15 +428,12 @@ int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
     assert((start >> hb->granularity) < hb->size);
 
     if (cur == (unsigned long)-1) {
-        do {
-            pos++;
-        } while (pos < sz && last_lev[pos] == (unsigned long)-1);
-
+        pos = hb_find_word_not(hb, pos + 1, sz, ~0UL);
         if (pos >= sz) {
             return -1;
         }
 
-        cur = last_lev[pos];
+        cur = hb_last_word(hb, pos);
     }
 
     res = (pos << BITS_PER_LEVEL) + ctol(cur);
@@ -408,6 +588,40 @@ static uint64_t hb_count_between(HBitmap *hb, uint64_t start, uint64_t last)
     return count;
 }
 
+/*
+ * Count the number of set bits in the whole bitmap, not accounting for the
+ * granularity.  Faster than hb_count_between() for dense bitmaps.
+ */
+static uint64_t hb_count_all(const HBitmap *hb)
+{
+    uint64_t nb_words = hb->sizes[HB_LAST_LEVEL];
+    uint64_t count = 0;
+    size_t page, i, n;
+    unsigned tail = hb->size & (BITS_PER_LONG - 1);
+
+    for (page = 0; page < hb_nb_pages(nb_words); page++) {
+        const unsigned long *words = hb->pages[page];
+
+        n = MIN(HB_PAGE_WORDS, nb_words - (uint64_t)page * HB_PAGE_WORDS);
+        if (words == hb_zero_page) {
+            continue;
+        } else if (words == hb_ones_page) {
+            count += n * BITS_PER_LONG;
+            continue;
+        }
+        for (i = 0; i < n; i++) {
+            count += ctpopl(words[i]);
+        }
+    }
+
+    /* Don't count bits beyond the end of the bitmap */
+    if (tail) {
+        count -= ctpopl(hb_last_word(hb, nb_words - 1) & ~((1UL << tail) - 1));
+    }
+
+    return count;
+}
+
 /* Setting starts at the last layer and propagates up if an element
  * changes.
  */
@@ -439,18 +653,12 @@ static bool hb_set_between(HBitmap *hb, int level, uint64_t start,
     i = pos;
     if (i < lastpos) {
         uint64_t next = (start | (BITS_PER_LONG - 1)) + 1;
-        changed |= hb_set_elem(&hb->levels[level][i], start, next - 1);
-        for (;;) {
-            start = next;
-            next += BITS_PER_LONG;
-            if (++i == lastpos) {
-                break;
-            }
-            changed |= (hb->levels[level][i] == 0);
-            hb->levels[level][i] = ~0UL;
-        }
+        changed |= hb_set_elem(hb_elem(hb, level, i), start, next - 1);
+        changed |= hb_fill_words(hb, level, i + 1, lastpos, true);
+        i = lastpos;
+        start = (uint64_t)lastpos << BITS_PER_LEVEL;
     }
-    changed |= hb_set_elem(&hb->levels[level][i], start, last);
+    changed |= hb_set_elem(hb_elem(hb, level, i), start, last);
 
     /* If there was any change in this layer, we may have to update
      * the one above.
@@ -461,6 +669,26 @@ static bool hb_set_between(HBitmap *hb, int level, uint64_t start,
     return changed;
 }
 
+/*
+ * Replace page @page of the last level by a constant page if it became all
+ * zeroes or all ones.  Only the pages at the edges of a range need this,
+ * hb_fill_words() takes care of whole pages.
+ */
+static void hb_page_trim(HBitmap *hb, size_t page)
+{
+    const unsigned long *p = hb->pages[page];
+
+    if (hb_page_is_const(p)) {
+        return;
+    }
+    if (!hb->levels[HB_LAST_LEVEL - 1][page]) {
+        hb_page_set_const(hb, page, hb_zero_page);
+    } else if (p[0] == ~0UL && p[HB_PAGE_WORDS - 1] == ~0UL &&
+               !memcmp(p, hb_ones_page, HB_PAGE_BYTES)) {
+        hb_page_set_const(hb, page, hb_ones_page);
+    }
+}
+
 void hbitmap_set(HBitmap *hb, uint64_t start, uint64_t count)
 {
     /* Compute range in the last layer.  */
@@ -484,8 +712,12 @@ void hbitmap_set(HBitmap *hb, uint64_t start, uint64_t count)
         hb->meta) {
         hbitmap_set(hb->meta, start, count);
     }
+
+    hb_page_trim(hb, first >> (2 * BITS_PER_LEVEL));
+    hb_page_trim(hb, last >> (2 * BITS_PER_LEVEL));
 }
 
+
 /* Resetting works the other way round: propagate up if the new
  * value is zero.
  */
@@ -523,25 +755,19 @@ static bool hb_reset_between(HBitmap *hb, int level, uint64_t start,
          * unless the lower-level word became entirely zero.  So, remove pos
          * from the upper-level range if bits remain set.
          */
-        if (hb_reset_elem(&hb->levels[level][i], start, next - 1)) {
+        if (hb_reset_elem(hb_elem(hb, level, i), start, next - 1)) {
             changed = true;
         } else {
             pos++;
         }
 
-        for (;;) {
-            start = next;
-            next += BITS_PER_LONG;
-            if (++i == lastpos) {
-                break;
-            }
-            changed |= (hb->levels[level][i] != 0);
-            hb->levels[level][i] = 0UL;
-        }
+        changed |= hb_fill_words(hb, level, i + 1, lastpos, false);
+        i = lastpos;
+        start = (uint64_t)lastpos << BITS_PER_LEVEL;
     }
 
     /* Same as above, this time for lastpos.  */
-    if (hb_reset_elem(&hb->levels[level][i], start, last)) {
+    if (hb_reset_elem(hb_elem(hb, level, i), start, last)) {
         changed = true;
     } else {
         lastpos--;
@@ -581,14 +807,25 @@ void hbitmap_reset(HBitmap *hb, uint64_t start, uint64_t count)
         hb->meta) {
         hbitmap_set(hb->meta, start, count);
     }
+
+    /*
+     * Pages in the middle of the range are constant zero pages now, but the
+     * first and last one may have become all zeroes, too
+     */
+    hb_page_trim(hb, first >> (2 * BITS_PER_LEVEL));
+    hb_page_trim(hb, last >> (2 * BITS_PER_LEVEL));
 }
 
 void hbitmap_reset_all(HBitmap *hb)
 {
     unsigned int i;
+    size_t page;
 
     /* Same as hbitmap_alloc() except for memset() instead of malloc() */
-    for (i = HBITMAP_LEVELS; --i >= 1; ) {
+    for (page = 0; page < hb_nb_pages(hb->sizes[HB_LAST_LEVEL]); page++) {
+        hb_page_set_const(hb, page, hb_zero_page);
+    }
+    for (i = HB_LAST_LEVEL; --i >= 1; ) {
         memset(hb->levels[i], 0, hb->sizes[i] * sizeof(unsigned long));
     }
 
@@ -621,7 +858,7 @@ bool hbitmap_get(const HBitmap *hb, uint64_t item)
     unsigned long bit = 1UL << (pos & (BITS_PER_LONG - 1));
     assert(pos < hb->size);
 
-    return (hb->levels[HBITMAP_LEVELS - 1][pos >> BITS_PER_LEVEL] & bit) != 0;
+    return (hb_last_word(hb, pos >> BITS_PER_LEVEL) & bit) != 0;
 }
 
 uint64_t hbitmap_serialization_align(const HBitmap *hb)
@@ -638,7 +875,7 @@ uint64_t hbitmap_serialization_align(const HBitmap *hb)
  */
 static void serialization_chunk(const HBitmap *hb,
                                 uint64_t start, uint64_t count,
-                                unsigned long **first_el, uint64_t *el_count)
+                                uint64_t *first_el, uint64_t *el_count)
 {
     uint64_t last = start + count - 1;
     uint64_t gran = hbitmap_serialization_align(hb);
@@ -652,20 +889,19 @@ static void serialization_chunk(const HBitmap *hb,
     start = (start >> hb->granularity) >> BITS_PER_LEVEL;
     last = (last >> hb->granularity) >> BITS_PER_LEVEL;
 
-    *first_el = &hb->levels[HBITMAP_LEVELS - 1][start];
+    *first_el = start;
     *el_count = last - start + 1;
 }
 
 uint64_t hbitmap_serialization_size(const HBitmap *hb,
                                     uint64_t start, uint64_t count)
 {
-    uint64_t el_count;
-    unsigned long *cur;
+    uint64_t first, el_count;
 
     if (!count) {
         return 0;
     }
-    serialization_chunk(hb, start, count, &cur, &el_count);
+    serialization_chunk(hb, start, count, &first, &el_count);
 
     return el_count * sizeof(unsigned long);
 }
@@ -673,22 +909,21 @@ uint64_t hbitmap_serialization_size(const HBitmap *hb,
 void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
                             uint64_t start, uint64_t count)
 {
-    uint64_t el_count;
-    unsigned long *cur, *end;
+    uint64_t pos, end, el_count;
 
     if (!count) {
         return;
     }
-    serialization_chunk(hb, start, count, &cur, &el_count);
-    end = cur + el_count;
+    serialization_chunk(hb, start, count, &pos, &el_count);
+    end = pos + el_count;
 
-    while (cur != end) {
+    for (; pos != end; pos++) {
+        unsigned long cur = hb_last_word(hb, pos);
         unsigned long el =
-            (BITS_PER_LONG == 32 ? cpu_to_le32(*cur) : cpu_to_le64(*cur));
+            (BITS_PER_LONG == 32 ? cpu_to_le32(cur) : cpu_to_le64(cur));
 
         memcpy(buf, &el, sizeof(el));
         buf += sizeof(el);
-        cur++;
     }
 }
 
@@ -696,26 +931,22 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
                               uint64_t start, uint64_t count,
                               bool finish)
 {
-    uint64_t el_count;
-    unsigned long *cur, *end;
+    uint64_t pos, end, el_count;
+    unsigned long cur;
 
     if (!count) {
         return;
     }
-    serialization_chunk(hb, start, count, &cur, &el_count);
-    end = cur + el_count;
+    serialization_chunk(hb, start, count, &pos, &el_count);
+    end = pos + el_count;
 
-    while (cur != end) {
-        memcpy(cur, buf, sizeof(*cur));
-
-        if (BITS_PER_LONG == 32) {
-            le32_to_cpus((uint32_t *)cur);
-        } else {
-            le64_to_cpus((uint64_t *)cur);
-        }
+    for (; pos != end; pos++) {
+        memcpy(&cur, buf, sizeof(cur));
+        cur = (BITS_PER_LONG == 32 ? le32_to_cpu(cur) : le64_to_cpu(cur));
 
+        /* Keeps constant pages shared if their content does not change */
+        hb_set_last_word(hb, pos, cur);
         buf += sizeof(unsigned long);
-        cur++;
     }
     if (finish) {
         hbitmap_deserialize_finish(hb);
@@ -725,15 +956,14 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
 void hbitmap_deserialize_zeroes(HBitmap *hb, uint64_t start, uint64_t count,
                                 bool finish)
 {
-    uint64_t el_count;
-    unsigned long *first;
+    uint64_t first, el_count;
 
     if (!count) {
         return;
     }
     serialization_chunk(hb, start, count, &first, &el_count);
 
-    memset(first, 0, el_count * sizeof(unsigned long));
+    hb_fill_words(hb, HB_LAST_LEVEL, first, first + el_count, false);
     if (finish) {
         hbitmap_deserialize_finish(hb);
     }
@@ -742,25 +972,51 @@ void hbitmap_deserialize_zeroes(HBitmap *hb, uint64_t start, uint64_t count,
 void hbitmap_deserialize_ones(HBitmap *hb, uint64_t start, uint64_t count,
                               bool finish)
 {
-    uint64_t el_count;
-    unsigned long *first;
+    uint64_t first, el_count;
 
     if (!count) {
         return;
     }
     serialization_chunk(hb, start, count, &first, &el_count);
 
-    memset(first, 0xff, el_count * sizeof(unsigned long));
+    hb_fill_words(hb, HB_LAST_LEVEL, first, first + el_count, true);
     if (finish) {
         hbitmap_deserialize_finish(hb);
     }
 }
 
+/*
+ * Replace all private pages of the last level that are all zeroes or all
+ * ones by the respective constant page.
+ */
+static void hb_compact_pages(HBitmap *hb)
+{
+    uint64_t nb_words = hb->sizes[HB_LAST_LEVEL];
+    size_t page, n;
+
+    for (page = 0; page < hb_nb_pages(nb_words); page++) {
+        if (hb_page_is_const(hb->pages[page])) {
+            continue;
+        }
+
+        /* Only full pages can be replaced by the ones page */
+        n = MIN(HB_PAGE_WORDS, nb_words - (uint64_t)page * HB_PAGE_WORDS);
+        if (!memcmp(hb->pages[page], hb_zero_page, n * sizeof(unsigned long))) {
+            hb_page_set_const(hb, page, hb_zero_page);
+        } else if (n == HB_PAGE_WORDS &&
+                   !memcmp(hb->pages[page], hb_ones_page, HB_PAGE_BYTES)) {
+            hb_page_set_const(hb, page, hb_ones_page);
+        }
+    }
+}
+
 void hbitmap_deserialize_finish(HBitmap *bitmap)
 {
     int64_t i, size, prev_size;
     int lev;
 
+    hb_compact_pages(bitmap);
+
     /* restore levels starting from penultimate to zero level, assuming
      * that the last level is ok */
     size = MAX((bitmap->size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
@@ -770,7 +1026,13 @@ void hbitmap_deserialize_finish(HBitmap *bitmap)
         memset(bitmap->levels[lev], 0, size * sizeof(unsigned long));
 
         for (i = 0; i < prev_size; ++i) {
-            if (bitmap->levels[lev + 1][i]) {
+            if (lev + 1 == HB_LAST_LEVEL &&
+                bitmap->pages[i >> BITS_PER_LEVEL] == hb_zero_page) {
+                /* Skip the rest of the page */
+                i |= HB_PAGE_WORDS - 1;
+                continue;
+            }
+            if (hb_word(bitmap, lev + 1, i)) {
                 bitmap->levels[lev][i >> BITS_PER_LEVEL] |=
                     1UL << (i & (BITS_PER_LONG - 1));
             }
@@ -778,13 +1040,20 @@ void hbitmap_deserialize_finish(HBitmap *bitmap)
     }
 
     bitmap->levels[0][0] |= 1UL << (BITS_PER_LONG - 1);
-    bitmap->count = hb_count_between(bitmap, 0, bitmap->size - 1);
+    bitmap->count = hb_count_all(bitmap);
 }
 
 void hbitmap_free(HBitmap *hb)
 {
     unsigned i;
+    size_t page;
+
     assert(!hb->meta);
+    for (page = 0; page < hb_nb_pages(hb->sizes[HB_LAST_LEVEL]); page++) {
+        hb_page_set_const(hb, page, hb_zero_page);
+    }
+    assert(hb->allocated_pages == 0);
+    g_free(hb->pages);
     for (i = HBITMAP_LEVELS; i-- > 0; ) {
         g_free(hb->levels[i]);
     }
@@ -795,6 +1064,7 @@ HBitmap *hbitmap_alloc(uint64_t size, int granularity)
 {
     HBitmap *hb = g_new0(struct HBitmap, 1);
     unsigned i;
+    size_t page;
 
     assert(size <= INT64_MAX);
     hb->orig_size = size;
@@ -808,7 +1078,14 @@ HBitmap *hbitmap_alloc(uint64_t size, int granularity)
     for (i = HBITMAP_LEVELS; i-- > 0; ) {
         size = MAX((size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
         hb->sizes[i] = size;
-        hb->levels[i] = g_new0(unsigned long, size);
+        if (i == HB_LAST_LEVEL) {
+            hb->pages = g_new(unsigned long *, hb_nb_pages(size));
+            for (page = 0; page < hb_nb_pages(size); page++) {
+                hb->pages[page] = (unsigned long *)hb_zero_page;
+            }
+        } else {
+            hb->levels[i] = g_new0(unsigned long, size);
+        }
     }
 
     /* We necessarily have free bits in level 0 due to the definition
@@ -820,6 +1097,20 @@ HBitmap *hbitmap_alloc(uint64_t size, int granularity)
     return hb;
 }
 
+static void hb_truncate_pages(HBitmap *hb, size_t old_pages, size_t new_pages)
+{
+    size_t page;
+
+    /* The pages that are dropped have been cleared by hbitmap_reset() */
+    for (page = new_pages; page < old_pages; page++) {
+        hb_page_set_const(hb, page, hb_zero_page);
+    }
+    hb->pages = g_renew(unsigned long *, hb->pages, new_pages);
+    for (page = old_pages; page < new_pages; page++) {
+        hb->pages[page] = (unsigned long *)hb_zero_page;
+    }
+}
+
 void hbitmap_truncate(HBitmap *hb, uint64_t size)
 {
     bool shrink;
@@ -862,6 +1153,10 @@ void hbitmap_truncate(HBitmap *hb, uint64_t size)
         }
         old = hb->sizes[i];
         hb->sizes[i] = size;
+        if (i == HB_LAST_LEVEL) {
+            hb_truncate_pages(hb, hb_nb_pages(old), hb_nb_pages(size));
+            continue;
+        }
         hb->levels[i] = g_renew(unsigned long, hb->levels[i], size);
         if (!shrink) {
             memset(&hb->levels[i][old], 0x00,
@@ -892,6 +1187,39 @@ static void hbitmap_sparse_merge(HBitmap *dst, const HBitmap *src)
     }
 }
 
+/* Merge page @page of the last level of @a and @b into @result */
+static void hb_merge_page(const HBitmap *a, const HBitmap *b, HBitmap *result,
+                          size_t page)
+{
+    const unsigned long *pa = a->pages[page];
+    const unsigned long *pb = b->pages[page];
+    const unsigned long *src = NULL;
+    unsigned long *dst;
+    size_t i;
+
+    if (pb == hb_zero_page || pa == hb_ones_page) {
+        src = pa;
+    } else if (pa == hb_zero_page || pb == hb_ones_page) {
+        src = pb;
+    }
+
+    if (src) {
+        /* The result is equal to one of the inputs */
+        if (hb_page_is_const(src)) {
+            hb_page_set_const(result, page, src);
+        } else if (result->pages[page] != src) {
+            dst = hb_page_writable(result, page);
+            memcpy(dst, src, HB_PAGE_BYTES);
+        }
+        return;
+    }
+
+    dst = hb_page_writable(result, page);
+    for (i = 0; i < HB_PAGE_WORDS; i++) {
+        dst[i] = pa[i] | pb[i];
+    }
+}
+
 /**
  * Given HBitmaps A and B, let R := A (BITOR) B.
  * Bitmaps A and B will not be modified,
@@ -930,26 +1258,54 @@ void hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
     }
 
     /* This merge is O(size), as BITS_PER_LONG and HBITMAP_LEVELS are constant.
-     * It may be possible to improve running times for sparsely populated maps
-     * by using hbitmap_iter_next, but this is suboptimal for dense maps.
+     * However, constant pages of the last level are merged without looking
+     * at their contents, so merging sparse (or full) bitmaps is cheap.
      */
     assert(a->size == b->size);
-    for (i = HBITMAP_LEVELS - 1; i >= 0; i--) {
+    for (j = 0; j < hb_nb_pages(a->sizes[HB_LAST_LEVEL]); j++) {
+        hb_merge_page(a, b, result, j);
+    }
+    for (i = HB_LAST_LEVEL - 1; i >= 0; i--) {
         for (j = 0; j < a->sizes[i]; j++) {
             result->levels[i][j] = a->levels[i][j] | b->levels[i][j];
         }
     }
 
     /* Recompute the dirty count */
-    result->count = hb_count_between(result, 0, result->size - 1);
+    result->count = hb_count_all(result);
 }
 
 char *hbitmap_sha256(const HBitmap *bitmap, Error **errp)
 {
-    size_t size = bitmap->sizes[HBITMAP_LEVELS - 1] * sizeof(unsigned long);
-    char *data = (char *)bitmap->levels[HBITMAP_LEVELS - 1];
+    uint64_t nb_words = bitmap->sizes[HB_LAST_LEVEL];
+    size_t nb_pages = hb_nb_pages(nb_words);
+    g_autofree struct iovec *iov = g_new(struct iovec, nb_pages);
     char *hash = NULL;
-    qcrypto_hash_digest(QCRYPTO_HASH_ALGO_SHA256, data, size, &hash, errp);
+    size_t page;
+
+    for (page = 0; page < nb_pages; page++) {
+        iov[page] = (struct iovec) {
+            .iov_base = bitmap->pages[page],
+            .iov_len = MIN(HB_PAGE_WORDS,
+                           nb_words - (uint64_t)page * HB_PAGE_WORDS) *
+                       sizeof(unsigned long),
+        };
+    }
+    qcrypto_hash_digestv(QCRYPTO_HASH_ALGO_SHA256, iov, nb_pages, &hash, errp);
 
     return hash;
 }
+
+uint64_t hbitmap_allocated_bytes(const HBitmap *hb)
+{
+    uint64_t bytes = sizeof(*hb);
+    unsigned i;
+
+    for (i = 0; i < HB_LAST_LEVEL; i++) {
+        bytes += hb->sizes[i] * sizeof(unsigned long);
+    }
+    bytes += hb_nb_pages(hb->sizes[HB_LAST_LEVEL]) * sizeof(unsigned long *);
+    bytes += hb->allocated_pages * HB_PAGE_BYTES;
+
+    return bytes;
+}
@@ -19,12 +19,24 @@
 #include "qemu/coroutine_int.h"
 #include "qemu/coroutine-tls.h"
 #include "qemu/cutils.h"
+#include "qemu/stats64.h"
+#include "qemu/timer.h"
 #include "block/aio.h"
 
+#ifdef CONFIG_LINUX
+#include <sys/syscall.h>
+#endif
+
 enum {
     COROUTINE_POOL_BATCH_MAX_SIZE = 128,
+
+    /* Hosts with more nodes share global pools between nodes */
+    COROUTINE_POOL_MAX_NODES = 8,
 };
 
+/* Batches that stay unused for this long are freed */
+#define COROUTINE_POOL_TRIM_INTERVAL_NS (10 * NANOSECONDS_PER_SECOND)
+
 /*
  * Coroutine creation and deletion is expensive so a pool of unused coroutines
  * is kept as a cache. When the pool has coroutines available, they are
@@ -37,8 +49,13 @@ enum {
  * batches whereas the maximum size of the global pool is controlled by the
  * qemu_coroutine_inc_pool_size() API.
  *
+ * The stack of a coroutine is faulted in by the thread that first runs it, so
+ * it lives on that thread's NUMA node. The global pool is split by node and
+ * threads only exchange batches with the pool of the node they run on, so that
+ * iothreads pinned to different nodes do not pick up each other's stacks.
+ *
  * .-----------------------------------.
- * | Batch 1 | Batch 2 | Batch 3 | ... | global_pool
+ * | Batch 1 | Batch 2 | Batch 3 | ... | global_pool[node]
  * `-----------------------------------'
  *
  * .-------------------.
@@ -59,14 +76,60 @@ typedef QSLIST_HEAD(, CoroutinePoolBatch) CoroutinePool;
 /* Host operating system limit on number of pooled coroutines */
 static unsigned int global_pool_hard_max_size;
 
+typedef struct CoroutineNodePool {
+    CoroutinePool batches;
+
+    /* Number of coroutines in @batches */
+    unsigned int size;
+
+    /* Smallest value of @size since the last trim */
+    unsigned int low_water;
+} CoroutineNodePool;
+
 static QemuMutex global_pool_lock; /* protects the following variables */
-static CoroutinePool global_pool = QSLIST_HEAD_INITIALIZER(global_pool);
+static CoroutineNodePool global_pool[COROUTINE_POOL_MAX_NODES];
 static unsigned int global_pool_size;
 static unsigned int global_pool_max_size = COROUTINE_POOL_BATCH_MAX_SIZE;
+static int64_t global_pool_next_trim;
+
+static struct {
+    Stat64 created;
+    Stat64 pool_hits;
+    Stat64 global_gets;
+    Stat64 global_puts;
+    Stat64 discarded;
+    Stat64 trimmed;
+} coroutine_stats;
 
 QEMU_DEFINE_STATIC_CO_TLS(CoroutinePool, local_pool);
 QEMU_DEFINE_STATIC_CO_TLS(Notifier, local_pool_cleanup_notifier);
 
+/* Local pool hits not yet added to coroutine_stats.pool_hits */
+QEMU_DEFINE_STATIC_CO_TLS(unsigned int, local_pool_hits);
+
+static void local_pool_flush_hits(void)
+{
+    unsigned int hits = get_local_pool_hits();
+
+    if (hits) {
+        stat64_add(&coroutine_stats.pool_hits, hits);
+        set_local_pool_hits(0);
+    }
+}
+
+/* Return the index of the global pool for the NUMA node we are running on */
+static unsigned int coroutine_pool_node(void)
+{
+#ifdef CONFIG_LINUX
+    unsigned int cpu, node;
+
+    if (syscall(__NR_getcpu, &cpu, &node, NULL) == 0) {
+        return node % COROUTINE_POOL_MAX_NODES;
+    }
+#endif
+    return 0;
+}
+
 static CoroutinePoolBatch *coroutine_pool_batch_new(void)
 {
     CoroutinePoolBatch *batch = g_new(CoroutinePoolBatch, 1);
@@ -94,6 +157,7 @@ static void local_pool_cleanup(Notifier *n, void *value)
     CoroutinePoolBatch *batch;
     CoroutinePoolBatch *tmp;
 
+    local_pool_flush_hits();
     QSLIST_FOREACH_SAFE(batch, local_pool, next, tmp) {
         QSLIST_REMOVE_HEAD(local_pool, next);
         coroutine_pool_batch_delete(batch);
@@ -129,25 +193,94 @@ static Coroutine *coroutine_pool_get_local(void)
         QSLIST_REMOVE_HEAD(local_pool, next);
         coroutine_pool_batch_delete(batch);
     }
+    set_local_pool_hits(get_local_pool_hits() + 1);
     return co;
 }
 
+static void coroutine_pool_delete_batches(CoroutinePool *batches)
+{
+    CoroutinePoolBatch *batch;
+    CoroutinePoolBatch *tmp;
+
+    QSLIST_FOREACH_SAFE(batch, batches, next, tmp) {
+        QSLIST_REMOVE_HEAD(batches, next);
+        coroutine_pool_batch_delete(batch);
+    }
+}
+
+/*
+ * Move batches out of the global pool into @victims, until @target
+ * coroutines have been removed or the pools are empty.  Batches of each node
+ * are removed only while they fit in that node's low water mark, unless
+ * @idle_only is false.
+ */
+static void coroutine_pool_trim_locked(unsigned int target, bool idle_only,
+                                       CoroutinePool *victims)
+{
+    unsigned int trimmed = 0;
+    int i;
+
+    for (i = 0; i < COROUTINE_POOL_MAX_NODES && trimmed < target; i++) {
+        CoroutineNodePool *pool = &global_pool[i];
+        unsigned int limit = idle_only ? pool->low_water : pool->size;
+        CoroutinePoolBatch *batch;
+
+        while (trimmed < target &&
+               (batch = QSLIST_FIRST(&pool->batches)) &&
+               batch->size <= limit) {
+            QSLIST_REMOVE_HEAD(&pool->batches, next);
+            QSLIST_INSERT_HEAD(victims, batch, next);
+            pool->size -= batch->size;
+            limit -= batch->size;
+            trimmed += batch->size;
+        }
+        pool->low_water = pool->size;
+    }
+
+    global_pool_size -= trimmed;
+    stat64_add(&coroutine_stats.trimmed, trimmed);
+}
+
+/*
+ * Called with global_pool_lock held whenever a batch enters or leaves the
+ * global pool.  Coroutines that stayed in the pool for a whole trim interval
+ * are not needed by the current workload, so give their memory back.
+ */
+static void coroutine_pool_maybe_trim_locked(CoroutinePool *victims)
+{
+    int64_t now = get_clock();
+
+    if (now >= global_pool_next_trim) {
+        global_pool_next_trim = now + COROUTINE_POOL_TRIM_INTERVAL_NS;
+        coroutine_pool_trim_locked(UINT_MAX, true, victims);
+    }
+}
+
 /* Get the next batch from the global pool */
 static void coroutine_pool_refill_local(void)
 {
     CoroutinePool *local_pool = get_ptr_local_pool();
+    CoroutinePool victims = QSLIST_HEAD_INITIALIZER(victims);
+    CoroutineNodePool *pool = &global_pool[coroutine_pool_node()];
     CoroutinePoolBatch *batch = NULL;
 
+    local_pool_flush_hits();
+
     WITH_QEMU_LOCK_GUARD(&global_pool_lock) {
-        batch = QSLIST_FIRST(&global_pool);
+        batch = QSLIST_FIRST(&pool->batches);
 
         if (batch) {
-            QSLIST_REMOVE_HEAD(&global_pool, next);
+            QSLIST_REMOVE_HEAD(&pool->batches, next);
+            pool->size -= batch->size;
+            pool->low_water = MIN(pool->low_water, pool->size);
             global_pool_size -= batch->size;
         }
+        coroutine_pool_maybe_trim_locked(&victims);
     }
 
+    coroutine_pool_delete_batches(&victims);
     if (batch) {
+        stat64_inc(&coroutine_stats.global_gets);
         QSLIST_INSERT_HEAD(local_pool, batch, next);
         local_pool_cleanup_init_once();
     }
@@ -156,21 +289,32 @@ static void coroutine_pool_refill_local(void)
 /* Add a batch of coroutines to the global pool */
 static void coroutine_pool_put_global(CoroutinePoolBatch *batch)
 {
+    CoroutinePool victims = QSLIST_HEAD_INITIALIZER(victims);
+    CoroutineNodePool *pool = &global_pool[coroutine_pool_node()];
+
     WITH_QEMU_LOCK_GUARD(&global_pool_lock) {
         unsigned int max = MIN(global_pool_max_size,
                                global_pool_hard_max_size);
 
+        coroutine_pool_maybe_trim_locked(&victims);
         if (global_pool_size < max) {
-            QSLIST_INSERT_HEAD(&global_pool, batch, next);
+            QSLIST_INSERT_HEAD(&pool->batches, batch, next);
 
             /* Overshooting the max pool size is allowed */
+            pool->size += batch->size;
             global_pool_size += batch->size;
-            return;
+            batch = NULL;
         }
     }
 
-    /* The global pool was full, so throw away this batch */
-    coroutine_pool_batch_delete(batch);
+    coroutine_pool_delete_batches(&victims);
+    if (batch) {
+        /* The global pool was full, so throw away this batch */
+        stat64_add(&coroutine_stats.discarded, batch->size);
+        coroutine_pool_batch_delete(batch);
+    } else {
+        stat64_inc(&coroutine_stats.global_puts);
+    }
 }
 
 /* Get the next unused coroutine from the pool or return NULL */
@@ -224,6 +368,7 @@ Coroutine *qemu_coroutine_create(CoroutineEntry *entry, void *opaque)
 
     if (!co) {
         co = qemu_coroutine_new();
+        stat64_inc(&coroutine_stats.created);
     }
 
     co->entry = entry;
@@ -357,8 +502,34 @@ void qemu_coroutine_inc_pool_size(unsigned int additional_pool_size)
 
 void qemu_coroutine_dec_pool_size(unsigned int removing_pool_size)
 {
-    QEMU_LOCK_GUARD(&global_pool_lock);
-    global_pool_max_size -= removing_pool_size;
+    CoroutinePool victims = QSLIST_HEAD_INITIALIZER(victims);
+
+    WITH_QEMU_LOCK_GUARD(&global_pool_lock) {
+        global_pool_max_size -= removing_pool_size;
+        if (global_pool_size > global_pool_max_size) {
+            coroutine_pool_trim_locked(global_pool_size - global_pool_max_size,
+                                       false, &victims);
+        }
+    }
+    coroutine_pool_delete_batches(&victims);
+}
+
+void qemu_coroutine_get_pool_stats(CoroutinePoolStats *stats)
+{
+    /* Other threads' hits are added when they next refill their local pool */
+    local_pool_flush_hits();
+    stats->created = stat64_get(&coroutine_stats.created);
+    stats->pool_hits = stat64_get(&coroutine_stats.pool_hits);
+    stats->global_gets = stat64_get(&coroutine_stats.global_gets);
+    stats->global_puts = stat64_get(&coroutine_stats.global_puts);
+    stats->discarded = stat64_get(&coroutine_stats.discarded);
+    stats->trimmed = stat64_get(&coroutine_stats.trimmed);
+
+    WITH_QEMU_LOCK_GUARD(&global_pool_lock) {
+        stats->pool_size = global_pool_size;
+        stats->pool_max_size = MIN(global_pool_max_size,
+                                   global_pool_hard_max_size);
+    }
 }
 
 static unsigned int get_global_pool_hard_max_size(void)
@@ -23,6 +23,7 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/cutils.h"
 #include "qemu/qemu-progress.h"
 
 struct progress_state {
@@ -31,11 +32,37 @@ struct progress_state {
     float min_skip;
     void (*print)(void);
     void (*end)(void);
+
+    /* Rate reporting, see qemu_progress_enable_rate() */
+    uint64_t rate_total;
+    float rate_start;
+    int64_t rate_start_time;
 };
 
 static struct progress_state state;
 static volatile sig_atomic_t print_pending;
 
+static void progress_print_state(FILE *stream, const char *end)
+{
+    g_autofree char *rate = NULL;
+    int64_t elapsed;
+
+    if (!state.rate_total) {
+        fprintf(stream, "    (%3.2f/100%%)%s", state.current, end);
+        return;
+    }
+
+    elapsed = g_get_monotonic_time() - state.rate_start_time;
+    if (elapsed > 0 && state.current > state.rate_start) {
+        rate = size_to_str((uint64_t)((state.current - state.rate_start) /
+                                      100 * state.rate_total *
+                                      G_USEC_PER_SEC / elapsed));
+    } else {
+        rate = size_to_str(0);
+    }
+    fprintf(stream, "    (%3.2f/100%%, %s/s)    %s", state.current, rate, end);
+}
+
 /*
  * Simple progress print function.
  * @percent relative percent of current operation
@@ -43,7 +70,7 @@ static volatile sig_atomic_t print_pending;
  */
 static void progress_simple_print(void)
 {
-    printf("    (%3.2f/100%%)\r", state.current);
+    progress_print_state(stdout, "\r");
     fflush(stdout);
 }
 
@@ -68,7 +95,7 @@ static void sigusr_print(int signal)
 static void progress_dummy_print(void)
 {
     if (print_pending) {
-        fprintf(stderr, "    (%3.2f/100%%)\n", state.current);
+        progress_print_state(stderr, "\n");
         print_pending = 0;
     }
 }
@@ -160,3 +187,17 @@ void qemu_progress_print(float delta, int max)
         state.print();
     }
 }
+
+/*
+ * Also report the rate at which the operation progresses, where 100% of the
+ * operation correspond to @total_bytes.  The rate is measured from the
+ * progress at the time of this call, so any work that is accounted for before
+ * (e.g. because it was already done by an earlier, interrupted run) does not
+ * distort it.
+ */
+void qemu_progress_enable_rate(uint64_t total_bytes)
+{
+    state.rate_total = total_bytes;
+    state.rate_start = state.current;
+    state.rate_start_time = g_get_monotonic_time();
+}
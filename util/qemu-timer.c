@@ -61,12 +61,23 @@ static QEMUClock qemu_clocks[QEMU_CLOCK_MAX];
  * used by different AioContexts / threads. Each clock also has
  * a list of the QEMUTimerLists associated with it, in order that
  * reenabling the clock can call all the notifiers.
+ *
+ * The active timers are kept in a 4-ary min-heap ordered by expiry time,
+ * so that timer_mod() and timer_del() are O(log n) even with thousands of
+ * active timers.  Timers with the same expiry time are ordered by the time
+ * they were armed, like in a sorted list where new timers are inserted after
+ * all timers that expire at the same time.
  */
 
+#define TIMER_HEAP_ARITY 4
+
 struct QEMUTimerList {
     QEMUClock *clock;
     QemuMutex active_timers_lock;
-    QEMUTimer *active_timers;
+    QEMUTimer **active_timers;  /* min-heap, protected by active_timers_lock */
+    unsigned int nr_active;     /* also read without the lock */
+    unsigned int heap_size;
+    uint64_t arm_seq;           /* protected by active_timers_lock */
     QLIST_ENTRY(QEMUTimerList) list;
     QEMUTimerListNotifyCB *notify_cb;
     void *notify_opaque;
@@ -93,6 +104,132 @@ static bool timer_expired_ns(QEMUTimer *timer_head, int64_t current_time)
     return timer_head && (timer_head->expire_time <= current_time);
 }
 
+/* Called with active_timers_lock held */
+static QEMUTimer *timerlist_first(QEMUTimerList *timer_list)
+{
+    return timer_list->nr_active ? timer_list->active_timers[0] : NULL;
+}
+
+static inline bool timer_before(QEMUTimer *a, QEMUTimer *b)
+{
+    return a->expire_time < b->expire_time ||
+           (a->expire_time == b->expire_time && a->arm_seq < b->arm_seq);
+}
+
+static inline void timer_heap_set(QEMUTimerList *timer_list, unsigned int i,
+                                  QEMUTimer *ts)
+{
+    timer_list->active_timers[i] = ts;
+    ts->heap_index = i;
+}
+
+static void timer_heap_sift_up(QEMUTimerList *timer_list, unsigned int i)
+{
+    QEMUTimer *ts = timer_list->active_timers[i];
+
+    while (i > 0) {
+        unsigned int parent = (i - 1) / TIMER_HEAP_ARITY;
+        QEMUTimer *p = timer_list->active_timers[parent];
+
+        if (!timer_before(ts, p)) {
+            break;
+        }
+        timer_heap_set(timer_list, i, p);
+        i = parent;
+    }
+    timer_heap_set(timer_list, i, ts);
+}
+
+static void timer_heap_sift_down(QEMUTimerList *timer_list, unsigned int i)
+{
+    QEMUTimer *ts = timer_list->active_timers[i];
+    unsigned int n = timer_list->nr_active;
+
+    for (;;) {
+        unsigned int first = i * TIMER_HEAP_ARITY + 1;
+        unsigned int last = MIN(first + TIMER_HEAP_ARITY, n);
+        unsigned int min = i, c;
+        QEMUTimer *min_ts = ts;
+
+        for (c = first; c < last; c++) {
+            if (timer_before(timer_list->active_timers[c], min_ts)) {
+                min = c;
+                min_ts = timer_list->active_timers[c];
+            }
+        }
+        if (min == i) {
+            break;
+        }
+        timer_heap_set(timer_list, i, min_ts);
+        i = min;
+    }
+    timer_heap_set(timer_list, i, ts);
+}
+
+static void timer_heap_insert(QEMUTimerList *timer_list, QEMUTimer *ts)
+{
+    unsigned int n = timer_list->nr_active;
+
+    if (n == timer_list->heap_size) {
+        timer_list->heap_size = MAX(timer_list->heap_size * 2, 16);
+        timer_list->active_timers = g_renew(QEMUTimer *,
+                                            timer_list->active_timers,
+                                            timer_list->heap_size);
+    }
+
+    timer_list->active_timers[n] = ts;
+    qatomic_set(&timer_list->nr_active, n + 1);
+    timer_heap_sift_up(timer_list, n);
+}
+
+static void timer_heap_remove(QEMUTimerList *timer_list, QEMUTimer *ts)
+{
+    unsigned int i = ts->heap_index;
+    unsigned int n = timer_list->nr_active - 1;
+    QEMUTimer *last;
+
+    assert(i <= n && timer_list->active_timers[i] == ts);
+    qatomic_set(&timer_list->nr_active, n);
+
+    last = timer_list->active_timers[n];
+    if (i == n) {
+        return;
+    }
+
+    timer_heap_set(timer_list, i, last);
+    if (i > 0 && timer_before(last,
+            timer_list->active_timers[(i - 1) / TIMER_HEAP_ARITY])) {
+        timer_heap_sift_up(timer_list, i);
+    } else {
+        timer_heap_sift_down(timer_list, i);
+    }
+}
+
+/*
+ * Find the first timer in the heap below @i whose attributes are all in
+ * @attr_mask, skipping subtrees that cannot beat @best.
+ */
+static QEMUTimer *timer_heap_find_first(QEMUTimerList *timer_list,
+                                        unsigned int i, int attr_mask,
+                                        QEMUTimer *best)
+{
+    QEMUTimer *ts = timer_list->active_timers[i];
+    unsigned int c, first = i * TIMER_HEAP_ARITY + 1;
+
+    if (best && !timer_before(ts, best)) {
+        return best;
+    }
+    if (!(ts->attributes & ~attr_mask)) {
+        return ts;
+    }
+
+    for (c = first; c < first + TIMER_HEAP_ARITY &&
+                    c < timer_list->nr_active; c++) {
+        best = timer_heap_find_first(timer_list, c, attr_mask, best);
+    }
+    return best;
+}
+
 QEMUTimerList *timerlist_new(QEMUClockType type,
                              QEMUTimerListNotifyCB *cb,
                              void *opaque)
@@ -117,6 +254,7 @@ void timerlist_free(QEMUTimerList *timer_list)
         QLIST_REMOVE(timer_list, list);
     }
     qemu_mutex_destroy(&timer_list->active_timers_lock);
+    g_free(timer_list->active_timers);
     g_free(timer_list);
 }
 
@@ -171,7 +309,7 @@ void qemu_clock_enable(QEMUClockType type, bool enabled)
 
 bool timerlist_has_timers(QEMUTimerList *timer_list)
 {
-    return !!qatomic_read(&timer_list->active_timers);
+    return !!qatomic_read(&timer_list->nr_active);
 }
 
 bool qemu_clock_has_timers(QEMUClockType type)
@@ -184,15 +322,15 @@ bool timerlist_expired(QEMUTimerList *timer_list)
 {
     int64_t expire_time = 0;
 
-    if (!qatomic_read(&timer_list->active_timers)) {
+    if (!qatomic_read(&timer_list->nr_active)) {
         return false;
     }
 
     WITH_QEMU_LOCK_GUARD(&timer_list->active_timers_lock) {
-        if (!timer_list->active_timers) {
+        if (!timer_list->nr_active) {
             return false;
         }
-        expire_time = timer_list->active_timers->expire_time;
+        expire_time = timerlist_first(timer_list)->expire_time;
     }
 
     return expire_time <= qemu_clock_get_ns(timer_list->clock->type);
@@ -214,7 +352,7 @@ int64_t timerlist_deadline_ns(QEMUTimerList *timer_list)
     int64_t delta;
     int64_t expire_time = 0;
 
-    if (!qatomic_read(&timer_list->active_timers)) {
+    if (!qatomic_read(&timer_list->nr_active)) {
         return -1;
     }
 
@@ -227,10 +365,10 @@ int64_t timerlist_deadline_ns(QEMUTimerList *timer_list)
      * the caller should notice the change and there is no race condition.
      */
     WITH_QEMU_LOCK_GUARD(&timer_list->active_timers_lock) {
-        if (!timer_list->active_timers) {
+        if (!timer_list->nr_active) {
             return -1;
         }
-        expire_time = timer_list->active_timers->expire_time;
+        expire_time = timerlist_first(timer_list)->expire_time;
     }
 
     delta = expire_time - qemu_clock_get_ns(timer_list->clock->type);
@@ -261,14 +399,14 @@ int64_t qemu_clock_deadline_ns_all(QEMUClockType type, int attr_mask)
     }
 
     QLIST_FOREACH(timer_list, &clock->timerlists, list) {
-        if (!qatomic_read(&timer_list->active_timers)) {
+        if (!qatomic_read(&timer_list->nr_active)) {
             continue;
         }
         qemu_mutex_lock(&timer_list->active_timers_lock);
-        ts = timer_list->active_timers;
         /* Skip all external timers */
-        while (ts && (ts->attributes & ~attr_mask)) {
-            ts = ts->next;
+        ts = NULL;
+        if (timer_list->nr_active) {
+            ts = timer_heap_find_first(timer_list, 0, attr_mask, NULL);
         }
         if (!ts) {
             qemu_mutex_unlock(&timer_list->active_timers_lock);
@@ -370,41 +508,21 @@ void timer_deinit(QEMUTimer *ts)
 
 static void timer_del_locked(QEMUTimerList *timer_list, QEMUTimer *ts)
 {
-    QEMUTimer **pt, *t;
-
-    ts->expire_time = -1;
-    pt = &timer_list->active_timers;
-    for(;;) {
-        t = *pt;
-        if (!t)
-            break;
-        if (t == ts) {
-            qatomic_set(pt, t->next);
-            break;
-        }
-        pt = &t->next;
+    if (ts->expire_time != -1) {
+        timer_heap_remove(timer_list, ts);
     }
+    ts->expire_time = -1;
 }
 
 static bool timer_mod_ns_locked(QEMUTimerList *timer_list,
                                 QEMUTimer *ts, int64_t expire_time)
 {
-    QEMUTimer **pt, *t;
-
-    /* add the timer in the sorted list */
-    pt = &timer_list->active_timers;
-    for (;;) {
-        t = *pt;
-        if (!timer_expired_ns(t, expire_time)) {
-            break;
-        }
-        pt = &t->next;
-    }
+    /* add the timer to the heap */
     ts->expire_time = MAX(expire_time, 0);
-    ts->next = *pt;
-    qatomic_set(pt, ts);
+    ts->arm_seq = timer_list->arm_seq++;
+    timer_heap_insert(timer_list, ts);
 
-    return pt == &timer_list->active_timers;
+    return ts->heap_index == 0;
 }
 
 static void timerlist_rearm(QEMUTimerList *timer_list)
@@ -496,7 +614,7 @@ bool timerlist_run_timers(QEMUTimerList *timer_list)
     QEMUTimerCB *cb;
     void *opaque;
 
-    if (!qatomic_read(&timer_list->active_timers)) {
+    if (!qatomic_read(&timer_list->nr_active)) {
         return false;
     }
 
@@ -535,7 +653,7 @@ bool timerlist_run_timers(QEMUTimerList *timer_list)
      */
     current_time = qemu_clock_get_ns(timer_list->clock->type);
     qemu_mutex_lock(&timer_list->active_timers_lock);
-    while ((ts = timer_list->active_timers)) {
+    while ((ts = timerlist_first(timer_list))) {
         if (!timer_expired_ns(ts, current_time)) {
             /* No expired timers left.  The checkpoint can be skipped
              * if no timers fired or they were all external.
@@ -554,10 +672,8 @@ bool timerlist_run_timers(QEMUTimerList *timer_list)
             goto out;
         }
 
-        /* remove timer from the list before calling the callback */
-        timer_list->active_timers = ts->next;
-        ts->next = NULL;
-        ts->expire_time = -1;
+        /* remove timer from the heap before calling the callback */
+        timer_del_locked(timer_list, ts);
         cb = ts->cb;
         opaque = ts->opaque;
 
@@ -24,6 +24,15 @@
  * synchronization objects this might be expensive, but note that it is
  * very rarely called -- reports are generated only when requested by users.
  *
+ * Profiling every acquisition is too expensive to leave enabled in
+ * production, so QSP also has a sampling mode.  In sampling mode, locks are
+ * first acquired with a trylock; only if that fails is the acquisition
+ * timed.  One acquisition out of every "period" (counted per thread) is
+ * recorded with a weight of "period", so that counts and times remain
+ * estimates of the totals, and acquisitions that waited for longer than a
+ * threshold are always recorded.  The hash table is only looked up for the
+ * acquisitions that are recorded.
+ *
  * Reports are generated as a table where each row represents a call site. A
  * call site is the triplet formed by the __file__ and __LINE__ of the caller
  * as well as the address of the "object" (i.e. mutex, rec. mutex or condvar)
@@ -65,13 +74,6 @@
 #include "qemu/rcu.h"
 #include "qemu/xxhash.h"
 
-enum QSPType {
-    QSP_MUTEX,
-    QSP_BQL_MUTEX,
-    QSP_REC_MUTEX,
-    QSP_CONDVAR,
-};
-
 struct QSPCallSite {
     const void *obj;
     const char *file; /* i.e. __FILE__; shortened later */
@@ -107,6 +109,11 @@ static size_t qsp_qemu_path_len;
 /* the address of qsp_thread gives us a unique 'thread ID' */
 static __thread int qsp_thread;
 
+/* sampling mode parameters, see qsp_enable_sampling() */
+static unsigned int qsp_sample_period;
+static int64_t qsp_sample_threshold_ns;
+static __thread unsigned int qsp_sample_countdown;
+
 /*
  * Call sites are the same for all threads, so we track them in a separate hash
  * table to save memory.
@@ -344,17 +351,44 @@ static QSPEntry *qsp_entry_get(const void *obj, const char *file, int line,
  * @e is in the global hash table; it is only written to by the current thread,
  * so we write to it atomically (as in "write once") to prevent torn reads.
  */
-static inline void do_qsp_entry_record(QSPEntry *e, int64_t delta, bool acq)
+static inline void do_qsp_entry_record(QSPEntry *e, int64_t delta,
+                                       uint64_t n_acqs)
 {
     qatomic_set_u64(&e->ns, e->ns + delta);
-    if (acq) {
-        qatomic_set_u64(&e->n_acqs, e->n_acqs + 1);
+    if (n_acqs) {
+        qatomic_set_u64(&e->n_acqs, e->n_acqs + n_acqs);
     }
 }
 
 static inline void qsp_entry_record(QSPEntry *e, int64_t delta)
 {
-    do_qsp_entry_record(e, delta, true);
+    do_qsp_entry_record(e, delta, 1);
+}
+
+/*
+ * Decide whether an acquisition that waited for @delta ns is recorded in
+ * sampling mode.  Returns the number of acquisitions that the record stands
+ * for, or 0 if it must not be recorded.
+ */
+static inline unsigned int qsp_sample_weight(int64_t delta)
+{
+    unsigned int period = MAX(qatomic_read(&qsp_sample_period), 1);
+    int64_t threshold = qatomic_read(&qsp_sample_threshold_ns);
+    bool sampled;
+
+    /* count all acquisitions, so that the samples are not biased */
+    if (qsp_sample_countdown) {
+        qsp_sample_countdown--;
+        sampled = false;
+    } else {
+        qsp_sample_countdown = period - 1;
+        sampled = true;
+    }
+
+    if (threshold && delta >= threshold) {
+        return 1;
+    }
+    return sampled ? period : 0;
 }
 
 #define QSP_GEN_VOID(type_, qsp_t_, func_, impl_)                       \
@@ -387,6 +421,45 @@ static inline void qsp_entry_record(QSPEntry *e, int64_t delta)
         return err;                                                     \
     }
 
+/* Only time the acquisition if the lock is contended */
+#define QSP_GEN_SAMPLE_VOID(type_, qsp_t_, func_, impl_, trylock_)      \
+    static void func_(type_ *obj, const char *file, int line)           \
+    {                                                                   \
+        unsigned int weight;                                            \
+        int64_t delta = 0;                                              \
+                                                                        \
+        if (trylock_(obj, file, line)) {                                \
+            int64_t t0 = get_clock();                                   \
+                                                                        \
+            impl_(obj, file, line);                                     \
+            delta = get_clock() - t0;                                   \
+        }                                                               \
+                                                                        \
+        weight = qsp_sample_weight(delta);                              \
+        if (weight) {                                                   \
+            QSPEntry *e = qsp_entry_get(obj, file, line, qsp_t_);       \
+                                                                        \
+            do_qsp_entry_record(e, delta * weight, weight);             \
+        }                                                               \
+    }
+
+#define QSP_GEN_SAMPLE_RET1(type_, qsp_t_, func_, impl_)                \
+    static int func_(type_ *obj, const char *file, int line)            \
+    {                                                                   \
+        int err = impl_(obj, file, line);                               \
+                                                                        \
+        if (!err) {                                                     \
+            unsigned int weight = qsp_sample_weight(0);                 \
+                                                                        \
+            if (weight) {                                               \
+                QSPEntry *e = qsp_entry_get(obj, file, line, qsp_t_);   \
+                                                                        \
+                do_qsp_entry_record(e, 0, weight);                      \
+            }                                                           \
+        }                                                               \
+        return err;                                                     \
+    }
+
 QSP_GEN_VOID(QemuMutex, QSP_BQL_MUTEX, qsp_bql_mutex_lock, qemu_mutex_lock_impl)
 QSP_GEN_VOID(QemuMutex, QSP_MUTEX, qsp_mutex_lock, qemu_mutex_lock_impl)
 QSP_GEN_RET1(QemuMutex, QSP_MUTEX, qsp_mutex_trylock, qemu_mutex_trylock_impl)
@@ -396,6 +469,20 @@ QSP_GEN_VOID(QemuRecMutex, QSP_REC_MUTEX, qsp_rec_mutex_lock,
 QSP_GEN_RET1(QemuRecMutex, QSP_REC_MUTEX, qsp_rec_mutex_trylock,
              qemu_rec_mutex_trylock_impl)
 
+QSP_GEN_SAMPLE_VOID(QemuMutex, QSP_BQL_MUTEX, qsp_sample_bql_mutex_lock,
+                    qemu_mutex_lock_impl, qemu_mutex_trylock_impl)
+QSP_GEN_SAMPLE_VOID(QemuMutex, QSP_MUTEX, qsp_sample_mutex_lock,
+                    qemu_mutex_lock_impl, qemu_mutex_trylock_impl)
+QSP_GEN_SAMPLE_RET1(QemuMutex, QSP_MUTEX, qsp_sample_mutex_trylock,
+                    qemu_mutex_trylock_impl)
+
+QSP_GEN_SAMPLE_VOID(QemuRecMutex, QSP_REC_MUTEX, qsp_sample_rec_mutex_lock,
+                    qemu_rec_mutex_lock_impl, qemu_rec_mutex_trylock_impl)
+QSP_GEN_SAMPLE_RET1(QemuRecMutex, QSP_REC_MUTEX, qsp_sample_rec_mutex_trylock,
+                    qemu_rec_mutex_trylock_impl)
+
+#undef QSP_GEN_SAMPLE_RET1
+#undef QSP_GEN_SAMPLE_VOID
 #undef QSP_GEN_RET1
 #undef QSP_GEN_VOID
 
@@ -430,9 +517,58 @@ qsp_cond_timedwait(QemuCond *cond, QemuMutex *mutex, int ms,
     return ret;
 }
 
+/* condition variables always block, so they are timed in sampling mode too */
+static void qsp_sample_cond_wait(QemuCond *cond, QemuMutex *mutex,
+                                 const char *file, int line)
+{
+    unsigned int weight;
+    int64_t t0, delta;
+
+    t0 = get_clock();
+    qemu_cond_wait_impl(cond, mutex, file, line);
+    delta = get_clock() - t0;
+
+    weight = qsp_sample_weight(delta);
+    if (weight) {
+        QSPEntry *e = qsp_entry_get(cond, file, line, QSP_CONDVAR);
+
+        do_qsp_entry_record(e, delta * weight, weight);
+    }
+}
+
+static bool qsp_sample_cond_timedwait(QemuCond *cond, QemuMutex *mutex,
+                                      int ms, const char *file, int line)
+{
+    unsigned int weight;
+    int64_t t0, delta;
+    bool ret;
+
+    t0 = get_clock();
+    ret = qemu_cond_timedwait_impl(cond, mutex, ms, file, line);
+    delta = get_clock() - t0;
+
+    weight = qsp_sample_weight(delta);
+    if (weight) {
+        QSPEntry *e = qsp_entry_get(cond, file, line, QSP_CONDVAR);
+
+        do_qsp_entry_record(e, delta * weight, weight);
+    }
+    return ret;
+}
+
 bool qsp_is_enabled(void)
 {
-    return qatomic_read(&qemu_mutex_lock_func) == qsp_mutex_lock;
+    return qatomic_read(&qemu_mutex_lock_func) != qemu_mutex_lock_impl;
+}
+
+bool qsp_is_sampling(unsigned int *period, int64_t *threshold_ns)
+{
+    if (qatomic_read(&qemu_mutex_lock_func) != qsp_sample_mutex_lock) {
+        return false;
+    }
+    *period = qatomic_read(&qsp_sample_period);
+    *threshold_ns = qatomic_read(&qsp_sample_threshold_ns);
+    return true;
 }
 
 void qsp_enable(void)
@@ -446,6 +582,20 @@ void qsp_enable(void)
     qatomic_set(&qemu_cond_timedwait_func, qsp_cond_timedwait);
 }
 
+void qsp_enable_sampling(unsigned int period, int64_t threshold_ns)
+{
+    qatomic_set(&qsp_sample_period, MAX(period, 1));
+    qatomic_set(&qsp_sample_threshold_ns, MAX(threshold_ns, 0));
+
+    qatomic_set(&qemu_mutex_lock_func, qsp_sample_mutex_lock);
+    qatomic_set(&qemu_mutex_trylock_func, qsp_sample_mutex_trylock);
+    qatomic_set(&bql_mutex_lock_func, qsp_sample_bql_mutex_lock);
+    qatomic_set(&qemu_rec_mutex_lock_func, qsp_sample_rec_mutex_lock);
+    qatomic_set(&qemu_rec_mutex_trylock_func, qsp_sample_rec_mutex_trylock);
+    qatomic_set(&qemu_cond_wait_func, qsp_sample_cond_wait);
+    qatomic_set(&qemu_cond_timedwait_func, qsp_sample_cond_timedwait);
+}
+
 void qsp_disable(void)
 {
     qatomic_set(&qemu_mutex_lock_func, qemu_mutex_lock_impl);
@@ -658,17 +808,6 @@ static char *qsp_at(const QSPCallSite *callsite)
     return g_string_free(s, FALSE);
 }
 
-struct QSPReportEntry {
-    const void *obj;
-    char *callsite_at;
-    const char *typename;
-    double time_s;
-    double ns_avg;
-    uint64_t n_acqs;
-    unsigned int n_objs;
-};
-typedef struct QSPReportEntry QSPReportEntry;
-
 struct QSPReport {
     QSPReportEntry *entries;
     size_t n_entries;
@@ -691,7 +830,9 @@ static gboolean qsp_tree_report(gpointer key, gpointer value, gpointer udata)
     entry->obj = e->callsite->obj;
     entry->n_objs = e->n_objs;
     entry->callsite_at = qsp_at(e->callsite);
+    entry->type = e->callsite->type;
     entry->typename = qsp_typenames[e->callsite->type];
+    entry->ns = e->ns;
     entry->time_s = e->ns * 1e-9;
     entry->n_acqs = e->n_acqs;
     entry->ns_avg = e->n_acqs ? e->ns / e->n_acqs : 0;
@@ -765,26 +906,46 @@ static void report_destroy(QSPReport *rep)
     g_free(rep->entries);
 }
 
-void qsp_report(size_t max, enum QSPSortBy sort_by,
-                bool callsite_coalesce)
+static void report_init(QSPReport *rep, size_t max, enum QSPSortBy sort_by,
+                        bool callsite_coalesce)
 {
     GTree *tree = g_tree_new_full(qsp_tree_cmp, &sort_by, g_free, NULL);
-    QSPReport rep;
 
     qsp_init();
 
-    rep.entries = g_new0(QSPReportEntry, max);
-    rep.n_entries = 0;
-    rep.max_n_entries = max;
+    rep->entries = g_new0(QSPReportEntry, max);
+    rep->n_entries = 0;
+    rep->max_n_entries = max;
 
     qsp_mktree(tree, callsite_coalesce);
-    g_tree_foreach(tree, qsp_tree_report, &rep);
+    g_tree_foreach(tree, qsp_tree_report, rep);
     g_tree_destroy(tree);
+}
+
+void qsp_report(size_t max, enum QSPSortBy sort_by,
+                bool callsite_coalesce)
+{
+    QSPReport rep;
 
+    report_init(&rep, max, sort_by, callsite_coalesce);
     pr_report(&rep);
     report_destroy(&rep);
 }
 
+void qsp_report_foreach(size_t max, enum QSPSortBy sort_by,
+                        bool callsite_coalesce, QSPReportFunc *func,
+                        void *opaque)
+{
+    QSPReport rep;
+    size_t i;
+
+    report_init(&rep, max, sort_by, callsite_coalesce);
+    for (i = 0; i < rep.n_entries; i++) {
+        func(&rep.entries[i], opaque);
+    }
+    report_destroy(&rep);
+}
+
 static void qsp_snapshot_destroy(QSPSnapshot *snap)
 {
     qht_iter(&snap->ht, qsp_ht_delete, NULL);
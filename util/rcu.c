@@ -32,6 +32,8 @@
 #include "qemu/thread.h"
 #include "qemu/main-loop.h"
 #include "qemu/lockable.h"
+#include "qemu/stats64.h"
+#include "qemu/timer.h"
 #if defined(CONFIG_MALLOC_TRIM)
 #include <malloc.h>
 #endif
@@ -50,6 +52,27 @@ static int in_drain_call_rcu;
 static QemuMutex rcu_registry_lock;
 static QemuMutex rcu_sync_lock;
 
+/*
+ * Grace period sequence number, odd while a grace period is in progress.
+ * Lets synchronize_rcu() return early if a whole grace period ran while it
+ * was waiting for rcu_sync_lock.
+ */
+static unsigned long rcu_gp_seq;
+
+/* Statistics for rcu_get_stats() */
+static struct {
+    Stat64 grace_periods;
+    Stat64 expedited;
+    Stat64 shared;
+    Stat64 total_ns;
+    Stat64 max_ns;
+    Stat64 callbacks;
+    Stat64 batches;
+} rcu_stats;
+
+/* Number of times an expedited grace period polls readers before sleeping */
+#define RCU_EXPEDITED_SPIN      1000
+
 /*
  * Check whether a quiescent state was crossed between the beginning of
  * update_counter_and_wait and now.
@@ -72,10 +95,12 @@ typedef QLIST_HEAD(, rcu_reader_data) ThreadList;
 static ThreadList registry = QLIST_HEAD_INITIALIZER(registry);
 
 /* Wait for previous parity/grace period to be empty of readers.  */
-static void wait_for_readers(void)
+static void wait_for_readers(bool expedited)
 {
     ThreadList qsreaders = QLIST_HEAD_INITIALIZER(qsreaders);
     struct rcu_reader_data *index, *tmp;
+    int spin = expedited ? RCU_EXPEDITED_SPIN : 0;
+    bool polling = false;
 
     for (;;) {
         /* We want to be notified of changes made to rcu_gp_ongoing
@@ -94,8 +119,20 @@ static void wait_for_readers(void)
          * If this is the last iteration, this barrier also prevents
          * frees from seeping upwards, and orders the two wait phases
          * on architectures with 32-bit longs; see synchronize_rcu().
+         *
+         * While polling, the previous global barrier already made the
+         * readers' stores to index->ctr visible, and nobody sleeps on
+         * index->waiting, so a local barrier is enough to order our loads
+         * of index->ctr before the frees.
          */
-        smp_mb_global();
+        if (polling) {
+            /* Only orders our own loads, see above */
+            smp_mb();
+        } else if (expedited) {
+            smp_mb_global_expedited();
+        } else {
+            smp_mb_global();
+        }
 
         QLIST_FOREACH_SAFE(index, &registry, node, tmp) {
             if (!rcu_gp_ongoing(&index->ctr)) {
@@ -106,7 +143,8 @@ static void wait_for_readers(void)
                  * get some extra futex wakeups.
                  */
                 qatomic_set(&index->waiting, false);
-            } else if (qatomic_read(&in_drain_call_rcu)) {
+            } else if ((expedited && !polling) ||
+                       qatomic_read(&in_drain_call_rcu)) {
                 notifier_list_notify(&index->force_rcu, NULL);
             }
         }
@@ -115,6 +153,20 @@ static void wait_for_readers(void)
             break;
         }
 
+        /*
+         * Read-side critical sections are usually short, so an expedited
+         * grace period polls for a while instead of sleeping right away.
+         */
+        if (spin > 0) {
+            spin--;
+            polling = true;
+            qemu_mutex_unlock(&rcu_registry_lock);
+            cpu_relax();
+            qemu_mutex_lock(&rcu_registry_lock);
+            continue;
+        }
+        polling = false;
+
         /* Wait for one thread to report a quiescent state and try again.
          * Release rcu_registry_lock, so rcu_(un)register_thread() doesn't
          * wait too much time.
@@ -141,9 +193,28 @@ static void wait_for_readers(void)
     QLIST_SWAP(&registry, &qsreaders, node);
 }
 
-void synchronize_rcu(void)
+static void do_synchronize_rcu(bool expedited)
 {
+    unsigned long snap;
+    int64_t start, elapsed;
+
+    /*
+     * Write RCU-protected pointers before reading rcu_gp_seq: any grace
+     * period that starts after this point also covers our updates.
+     */
+    smp_mb();
+
+    /* The end of the first grace period that starts after now */
+    snap = (qatomic_load_acquire(&rcu_gp_seq) + 3) & ~1UL;
+
     QEMU_LOCK_GUARD(&rcu_sync_lock);
+    if ((long)(qatomic_load_acquire(&rcu_gp_seq) - snap) >= 0) {
+        stat64_add(&rcu_stats.shared, 1);
+        return;
+    }
+
+    start = get_clock();
+    qatomic_set(&rcu_gp_seq, rcu_gp_seq + 1);
 
     /* Write RCU-protected pointers before reading p_rcu_reader->ctr.
      * Pairs with smp_mb_placeholder() in rcu_read_lock().
@@ -151,31 +222,72 @@ void synchronize_rcu(void)
      * Also orders write to RCU-protected pointers before
      * write to rcu_gp_ctr.
      */
-    smp_mb_global();
-
-    QEMU_LOCK_GUARD(&rcu_registry_lock);
-    if (!QLIST_EMPTY(&registry)) {
-        if (sizeof(rcu_gp_ctr) < 8) {
-            /* For architectures with 32-bit longs, a two-subphases algorithm
-             * ensures we do not encounter overflow bugs.
-             *
-             * Switch parity: 0 -> 1, 1 -> 0.
-             */
-            qatomic_set(&rcu_gp_ctr, rcu_gp_ctr ^ RCU_GP_CTR);
-            wait_for_readers();
-            qatomic_set(&rcu_gp_ctr, rcu_gp_ctr ^ RCU_GP_CTR);
-        } else {
-            /* Increment current grace period.  */
-            qatomic_set(&rcu_gp_ctr, rcu_gp_ctr + RCU_GP_CTR);
+    if (expedited) {
+        smp_mb_global_expedited();
+    } else {
+        smp_mb_global();
+    }
+
+    WITH_QEMU_LOCK_GUARD(&rcu_registry_lock) {
+        if (!QLIST_EMPTY(&registry)) {
+            if (sizeof(rcu_gp_ctr) < 8) {
+                /*
+                 * For architectures with 32-bit longs, a two-subphases
+                 * algorithm ensures we do not encounter overflow bugs.
+                 *
+                 * Switch parity: 0 -> 1, 1 -> 0.
+                 */
+                qatomic_set(&rcu_gp_ctr, rcu_gp_ctr ^ RCU_GP_CTR);
+                wait_for_readers(expedited);
+                qatomic_set(&rcu_gp_ctr, rcu_gp_ctr ^ RCU_GP_CTR);
+            } else {
+                /* Increment current grace period.  */
+                qatomic_set(&rcu_gp_ctr, rcu_gp_ctr + RCU_GP_CTR);
+            }
+
+            wait_for_readers(expedited);
         }
+    }
+
+    /* Pairs with qatomic_load_acquire() in callers that share this period */
+    qatomic_store_release(&rcu_gp_seq, rcu_gp_seq + 1);
 
-        wait_for_readers();
+    elapsed = get_clock() - start;
+    stat64_add(&rcu_stats.grace_periods, 1);
+    if (expedited) {
+        stat64_add(&rcu_stats.expedited, 1);
     }
+    stat64_add(&rcu_stats.total_ns, elapsed);
+    stat64_max(&rcu_stats.max_ns, elapsed);
+}
+
+void synchronize_rcu(void)
+{
+    do_synchronize_rcu(false);
+}
+
+void synchronize_rcu_expedited(void)
+{
+    do_synchronize_rcu(true);
+}
+
+void rcu_get_stats(RCUStats *stats)
+{
+    stats->grace_periods = stat64_get(&rcu_stats.grace_periods);
+    stats->expedited = stat64_get(&rcu_stats.expedited);
+    stats->shared = stat64_get(&rcu_stats.shared);
+    stats->total_ns = stat64_get(&rcu_stats.total_ns);
+    stats->max_ns = stat64_get(&rcu_stats.max_ns);
+    stats->callbacks = stat64_get(&rcu_stats.callbacks);
+    stats->batches = stat64_get(&rcu_stats.batches);
 }
 
 
 #define RCU_CALL_MIN_SIZE        30
 
+/* Maximum number of callbacks in a per-thread batch before it is flushed */
+#define RCU_BATCH_MAX_SIZE       64
+
 /* Multi-producer, single-consumer queue based on urcu/static/wfqueue.h
  * from liburcu.  Note that head is only used by the consumer.
  */
@@ -184,27 +296,64 @@ static struct rcu_head *head = &dummy, **tail = &dummy.next;
 static int rcu_call_count;
 static QemuEvent rcu_call_ready_event;
 
-static void enqueue(struct rcu_head *node)
+/* Callbacks registered in a call_rcu_batch_begin/end section */
+typedef struct {
+    unsigned nesting_level;
+    int count;
+    struct rcu_head *first;
+    struct rcu_head **last_next;
+} RCUBatch;
+
+QEMU_DEFINE_STATIC_CO_TLS(RCUBatch, rcu_batch)
+
+/*
+ * Add the nodes from @first to the one whose next pointer is @last_next,
+ * which must be NULL, to the queue.
+ */
+static void enqueue_list(struct rcu_head *first, struct rcu_head **last_next)
 {
     struct rcu_head **old_tail;
 
-    node->next = NULL;
-
     /*
-     * Make this node the tail of the list.  The node will be
-     * used by further enqueue operations, but it will not
+     * Make the last node the tail of the list.  The nodes will be
+     * used by further enqueue operations, but they will not
      * be dequeued yet...
      */
-    old_tail = qatomic_xchg(&tail, &node->next);
+    old_tail = qatomic_xchg(&tail, last_next);
 
     /*
-     * ... until it is pointed to from another item in the list.
+     * ... until the first is pointed to from another item in the list.
      * In the meantime, try_dequeue() will find a NULL next pointer
      * and loop.
      *
      * Synchronizes with qatomic_load_acquire() in try_dequeue().
      */
-    qatomic_store_release(old_tail, node);
+    qatomic_store_release(old_tail, first);
+}
+
+static void enqueue(struct rcu_head *node)
+{
+    node->next = NULL;
+    enqueue_list(node, &node->next);
+}
+
+/* Hand @n callbacks that were just enqueued to the call_rcu thread */
+static void call_rcu_kick(int n)
+{
+    stat64_add(&rcu_stats.batches, 1);
+    qatomic_add(&rcu_call_count, n);
+    qemu_event_set(&rcu_call_ready_event);
+}
+
+static void call_rcu_flush_batch(RCUBatch *batch)
+{
+    if (batch->count) {
+        enqueue_list(batch->first, batch->last_next);
+        call_rcu_kick(batch->count);
+        batch->first = NULL;
+        batch->last_next = NULL;
+        batch->count = 0;
+    }
 }
 
 static struct rcu_head *try_dequeue(void)
@@ -266,7 +415,8 @@ static void *call_rcu_thread(void *opaque)
          * Fetch rcu_call_count now, we only must process elements that were
          * added before synchronize_rcu() starts.
          */
-        while (n == 0 || (n < RCU_CALL_MIN_SIZE && ++tries <= 5)) {
+        while (n == 0 || (n < RCU_CALL_MIN_SIZE && ++tries <= 5 &&
+                          !qatomic_read(&in_drain_call_rcu))) {
             g_usleep(10000);
             if (n == 0) {
                 qemu_event_reset(&rcu_call_ready_event);
@@ -282,7 +432,13 @@ static void *call_rcu_thread(void *opaque)
         }
 
         qatomic_sub(&rcu_call_count, n);
-        synchronize_rcu();
+        if (qatomic_read(&in_drain_call_rcu)) {
+            /* Somebody is waiting for the callbacks, don't make them wait */
+            synchronize_rcu_expedited();
+        } else {
+            synchronize_rcu();
+        }
+        stat64_add(&rcu_stats.callbacks, n);
         bql_lock();
         while (n > 0) {
             node = try_dequeue();
@@ -307,10 +463,49 @@ static void *call_rcu_thread(void *opaque)
 
 void call_rcu1(struct rcu_head *node, void (*func)(struct rcu_head *node))
 {
+    RCUBatch *batch = get_ptr_rcu_batch();
+
     node->func = func;
-    enqueue(node);
-    qatomic_inc(&rcu_call_count);
-    qemu_event_set(&rcu_call_ready_event);
+    if (batch->nesting_level == 0) {
+        enqueue(node);
+        call_rcu_kick(1);
+        return;
+    }
+
+    node->next = NULL;
+    if (batch->count++) {
+        *batch->last_next = node;
+    } else {
+        batch->first = node;
+    }
+    batch->last_next = &node->next;
+
+    if (batch->count == RCU_BATCH_MAX_SIZE) {
+        call_rcu_flush_batch(batch);
+    }
+}
+
+/**
+ * call_rcu_batch_begin:
+ *
+ * Start a section in which call_rcu() callbacks are collected in a
+ * per-thread batch, and handed to the call_rcu thread all at once by the
+ * outermost call_rcu_batch_end().  Sections can be nested.  The caller must
+ * not yield from a coroutine before the matching call_rcu_batch_end().
+ */
+void call_rcu_batch_begin(void)
+{
+    get_ptr_rcu_batch()->nesting_level++;
+}
+
+void call_rcu_batch_end(void)
+{
+    RCUBatch *batch = get_ptr_rcu_batch();
+
+    assert(batch->nesting_level > 0);
+    if (--batch->nesting_level == 0) {
+        call_rcu_flush_batch(batch);
+    }
 }
 
 
@@ -360,7 +555,10 @@ void drain_call_rcu(void)
      */
 
     qatomic_inc(&in_drain_call_rcu);
-    call_rcu1(&rcu_drain.rcu, drain_rcu_callback);
+    call_rcu_flush_batch(get_ptr_rcu_batch());
+    rcu_drain.rcu.func = drain_rcu_callback;
+    enqueue(&rcu_drain.rcu);
+    call_rcu_kick(1);
     qemu_event_wait(&rcu_drain.drain_complete_event);
     qatomic_dec(&in_drain_call_rcu);
 
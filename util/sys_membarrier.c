@@ -14,6 +14,8 @@
 #include <linux/membarrier.h>
 #include <sys/syscall.h>
 
+static bool have_private_expedited;
+
 static int
 membarrier(int cmd, int flags)
 {
@@ -32,6 +34,22 @@ void smp_mb_global(void)
 #endif
 }
 
+/*
+ * Like smp_mb_global(), but interrupt the CPUs that run threads of this
+ * process instead of waiting for all CPUs to go through a scheduler grace
+ * period.  This is much faster, at the cost of IPIs to other CPUs.
+ */
+void smp_mb_global_expedited(void)
+{
+#ifdef CONFIG_LINUX
+    if (have_private_expedited &&
+        membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0) == 0) {
+        return;
+    }
+#endif
+    smp_mb_global();
+}
+
 void smp_mb_global_init(void)
 {
 #ifdef CONFIG_LINUX
@@ -46,5 +64,9 @@ void smp_mb_global_init(void)
         error_report("Please upgrade your system to a newer version of Linux");
         exit(1);
     }
+    if ((ret & MEMBARRIER_CMD_PRIVATE_EXPEDITED) &&
+        membarrier(MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) == 0) {
+        have_private_expedited = true;
+    }
 #endif
 }
@@ -15,6 +15,7 @@
  * GNU GPL, version 2 or (at your option) any later version.
  */
 #include "qemu/osdep.h"
+#include "qemu/bitmap.h"
 #include "qemu/defer-call.h"
 #include "qemu/queue.h"
 #include "qemu/thread.h"
@@ -23,9 +24,26 @@
 #include "block/thread-pool.h"
 #include "qemu/main-loop.h"
 
+/*
+ * Requests are distributed over several queues, each with its own lock and
+ * condition variable, so that submitting requests and waking up workers does
+ * not serialise on a single lock when many requests are in flight.  Every
+ * worker has a home queue that it sleeps on, but takes requests from any
+ * queue ("work stealing") before going to sleep.
+ */
+#define THREAD_POOL_NR_QUEUES 8
+
+/*
+ * Requests submitted in a defer_call_begin()/defer_call_end() section are
+ * queued in a batch and handed to the workers at once, unless the batch grows
+ * larger than this.
+ */
+#define THREAD_POOL_MAX_BATCH 32
+
 static void do_spawn_thread(ThreadPool *pool);
 
 typedef struct ThreadPoolElement ThreadPoolElement;
+typedef struct ThreadPoolQueue ThreadPoolQueue;
 
 enum ThreadState {
     THREAD_QUEUED,
@@ -39,100 +57,309 @@ struct ThreadPoolElement {
     ThreadPoolFunc *func;
     void *arg;
 
-    /* Moving state out of THREAD_QUEUED is protected by lock.  After
-     * that, only the worker thread can write to it.  Reads and writes
+    /* The queue the request was submitted to, NULL while it is batched */
+    ThreadPoolQueue *queue;
+
+    /*
+     * Moving state out of THREAD_QUEUED is protected by the queue lock.
+     * After that, only the worker thread can write to it.  Reads and writes
      * of state and ret are ordered with memory barriers.
      */
     enum ThreadState state;
     int ret;
 
-    /* Access to this list is protected by lock.  */
+    /*
+     * Access to this list is protected by the queue lock, or only done by
+     * the pool's AioContext while the request is batched.
+     */
     QTAILQ_ENTRY(ThreadPoolElement) reqs;
 
+    /* Completed requests, see ThreadPool.completed and ThreadPool.done_list */
+    QSLIST_ENTRY(ThreadPoolElement) done;
+    QSIMPLEQ_ENTRY(ThreadPoolElement) done_list;
+
     /* This list is only written by the thread pool's mother thread.  */
     QLIST_ENTRY(ThreadPoolElement) all;
 };
 
+struct ThreadPoolQueue {
+    ThreadPool *pool;
+    QemuMutex lock;
+    QemuCond request_cond;
+
+    /* The following variables are protected by lock.  */
+    QTAILQ_HEAD(, ThreadPoolElement) request_list;
+
+    /* Written under lock, read without it to find work or idle workers */
+    int nr_requests;
+    int idle_threads;
+} QEMU_ALIGNED(64);
+
 struct ThreadPool {
     AioContext *ctx;
     QEMUBH *completion_bh;
     QemuMutex lock;
     QemuCond worker_stopped;
-    QemuCond request_cond;
     QEMUBH *new_thread_bh;
 
+    ThreadPoolQueue queues[THREAD_POOL_NR_QUEUES];
+
+    /*
+     * Requests that have completed, pushed by the workers.  Only the first
+     * completion after the list was emptied schedules completion_bh.
+     */
+    QSLIST_HEAD(, ThreadPoolElement) completed;
+
     /* The following variables are only accessed from one AioContext. */
     QLIST_HEAD(, ThreadPoolElement) head;
+    QTAILQ_HEAD(, ThreadPoolElement) batch;
+    int batch_len;
+    unsigned next_queue;
 
-    /* The following variables are protected by lock.  */
-    QTAILQ_HEAD(, ThreadPoolElement) request_list;
+    /* Completed requests taken from completed, in completion order */
+    QSIMPLEQ_HEAD(, ThreadPoolElement) done_list;
+
+    /*
+     * The following variables are protected by lock.  cur_threads and
+     * max_threads are also read without the lock.
+     */
     int cur_threads;
-    int idle_threads;
     int new_threads;     /* backlog of threads we need to create */
     int pending_threads; /* threads created but not running yet */
     int min_threads;
     int max_threads;
+    unsigned next_home;  /* home queue of the next thread */
+
+    /* CPUs that workers run on, NULL for no restriction */
+    unsigned long *cpus;
+    unsigned long nr_cpus;
+    unsigned affinity_gen;
 };
 
+static void thread_pool_push_completed(ThreadPool *pool,
+                                       ThreadPoolElement *elem)
+{
+    ThreadPoolElement *first;
+
+    do {
+        first = qatomic_read(&pool->completed.slh_first);
+        elem->done.sle_next = first;
+    } while (qatomic_cmpxchg(&pool->completed.slh_first, first, elem) != first);
+
+    if (!first) {
+        qemu_bh_schedule(pool->completion_bh);
+    }
+}
+
+static void thread_pool_worker_set_affinity(ThreadPool *pool, unsigned *gen)
+{
+    g_autofree unsigned long *cpus = NULL;
+    unsigned long nr_cpus = 0;
+    QemuThread self;
+
+    if (qatomic_read(&pool->affinity_gen) == *gen) {
+        return;
+    }
+
+    WITH_QEMU_LOCK_GUARD(&pool->lock) {
+        *gen = pool->affinity_gen;
+        if (pool->cpus) {
+            nr_cpus = pool->nr_cpus;
+            cpus = bitmap_new(nr_cpus);
+            bitmap_copy(cpus, pool->cpus, nr_cpus);
+        }
+    }
+
+    if (cpus) {
+        qemu_thread_get_self(&self);
+        qemu_thread_set_affinity(&self, cpus, nr_cpus);
+    }
+}
+
+static ThreadPoolElement *thread_pool_queue_pop(ThreadPoolQueue *q)
+{
+    ThreadPoolElement *req;
+
+    if (!qatomic_read(&q->nr_requests)) {
+        return NULL;
+    }
+
+    QEMU_LOCK_GUARD(&q->lock);
+    req = QTAILQ_FIRST(&q->request_list);
+    if (req) {
+        QTAILQ_REMOVE(&q->request_list, req, reqs);
+        qatomic_set(&q->nr_requests, q->nr_requests - 1);
+        req->state = THREAD_ACTIVE;
+    }
+    return req;
+}
+
+/* Take a request from @home, or steal one from another queue */
+static ThreadPoolElement *thread_pool_get_request(ThreadPool *pool,
+                                                  ThreadPoolQueue *home)
+{
+    int home_idx = home - pool->queues;
+    ThreadPoolElement *req;
+    int i;
+
+    for (i = 0; i < THREAD_POOL_NR_QUEUES; i++) {
+        ThreadPoolQueue *q = &pool->queues[(home_idx + i) %
+                                           THREAD_POOL_NR_QUEUES];
+
+        req = thread_pool_queue_pop(q);
+        if (req) {
+            if (q != home) {
+                trace_thread_pool_steal(pool, req, q - pool->queues, home_idx);
+            }
+            return req;
+        }
+    }
+    return NULL;
+}
+
+static bool thread_pool_has_requests(ThreadPool *pool)
+{
+    int i;
+
+    for (i = 0; i < THREAD_POOL_NR_QUEUES; i++) {
+        if (qatomic_read(&pool->queues[i].nr_requests)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Wake up to @n idle workers after requests have been added to queues that
+ * didn't have enough idle workers of their own.  The caller must have executed
+ * a full memory barrier after adding the requests; this pairs with the barrier
+ * in worker_thread() between becoming idle and checking for requests.
+ *
+ * Returns the number of workers that were woken up.
+ */
+static int thread_pool_kick_idle(ThreadPool *pool, int n)
+{
+    int i, woken = 0;
+
+    for (i = 0; i < THREAD_POOL_NR_QUEUES && woken < n; i++) {
+        ThreadPoolQueue *q = &pool->queues[i];
+
+        if (!qatomic_read(&q->idle_threads)) {
+            continue;
+        }
+
+        QEMU_LOCK_GUARD(&q->lock);
+        while (woken < n && woken < q->idle_threads) {
+            qemu_cond_signal(&q->request_cond);
+            woken++;
+        }
+    }
+    return woken;
+}
+
+/*
+ * Try to exit the calling worker.  @idle_timeout is true if the worker has
+ * been idle for a while, false if it was told to exit because there are more
+ * than max_threads workers.  Returns true if the worker must exit.
+ */
+static bool thread_pool_worker_exit(ThreadPool *pool, bool idle_timeout)
+{
+    QEMU_LOCK_GUARD(&pool->lock);
+
+    if (idle_timeout ? pool->cur_threads <= pool->min_threads
+                     : pool->cur_threads <= pool->max_threads) {
+        return false;
+    }
+
+    qatomic_set(&pool->cur_threads, pool->cur_threads - 1);
+
+    /*
+     * Pairs with the barrier in thread_pool_flush(): either the submitter sees
+     * the lower thread count and spawns a new worker, or we see its requests.
+     */
+    smp_mb();
+    if (thread_pool_has_requests(pool)) {
+        if (idle_timeout || pool->cur_threads == 0) {
+            /* Don't leave requests behind without a worker */
+            qatomic_set(&pool->cur_threads, pool->cur_threads + 1);
+            return false;
+        }
+        thread_pool_kick_idle(pool, 1);
+    }
+
+    qemu_cond_signal(&pool->worker_stopped);
+    return true;
+}
+
 static void *worker_thread(void *opaque)
 {
-    ThreadPool *pool = opaque;
+    ThreadPoolQueue *home = opaque;
+    ThreadPool *pool = home->pool;
+    unsigned affinity_gen = 0;
 
     qemu_mutex_lock(&pool->lock);
     pool->pending_threads--;
     do_spawn_thread(pool);
+    qemu_mutex_unlock(&pool->lock);
 
-    while (pool->cur_threads <= pool->max_threads) {
+    for (;;) {
         ThreadPoolElement *req;
+        bool timed_out;
         int ret;
 
-        if (QTAILQ_EMPTY(&pool->request_list)) {
-            pool->idle_threads++;
-            ret = qemu_cond_timedwait(&pool->request_cond, &pool->lock, 10000);
-            pool->idle_threads--;
-            if (ret == 0 &&
-                QTAILQ_EMPTY(&pool->request_list) &&
-                pool->cur_threads > pool->min_threads) {
-                /* Timed out + no work to do + no need for warm threads = exit.  */
-                break;
-            }
-            /*
-             * Even if there was some work to do, check if there aren't
-             * too many worker threads before picking it up.
-             */
-            continue;
+        thread_pool_worker_set_affinity(pool, &affinity_gen);
+
+        if (qatomic_read(&pool->cur_threads) > qatomic_read(&pool->max_threads)
+            && thread_pool_worker_exit(pool, false)) {
+            break;
         }
 
-        req = QTAILQ_FIRST(&pool->request_list);
-        QTAILQ_REMOVE(&pool->request_list, req, reqs);
-        req->state = THREAD_ACTIVE;
-        qemu_mutex_unlock(&pool->lock);
+        req = thread_pool_get_request(pool, home);
+        if (req) {
+            ret = req->func(req->arg);
 
-        ret = req->func(req->arg);
+            req->ret = ret;
+            /* Write ret before state.  */
+            smp_wmb();
+            req->state = THREAD_DONE;
 
-        req->ret = ret;
-        /* Write ret before state.  */
-        smp_wmb();
-        req->state = THREAD_DONE;
+            thread_pool_push_completed(pool, req);
+            continue;
+        }
 
-        qemu_bh_schedule(pool->completion_bh);
-        qemu_mutex_lock(&pool->lock);
-    }
+        qemu_mutex_lock(&home->lock);
+        qatomic_set(&home->idle_threads, home->idle_threads + 1);
+
+        /*
+         * Pairs with the barrier in thread_pool_flush(): either we see the
+         * new requests, or the submitter sees us idle and signals us.
+         */
+        smp_mb();
+        if (thread_pool_has_requests(pool) ||
+            qatomic_read(&pool->cur_threads) >
+            qatomic_read(&pool->max_threads)) {
+            timed_out = false;
+        } else {
+            timed_out = !qemu_cond_timedwait(&home->request_cond, &home->lock,
+                                             10000);
+        }
 
-    pool->cur_threads--;
-    qemu_cond_signal(&pool->worker_stopped);
+        qatomic_set(&home->idle_threads, home->idle_threads - 1);
+        qemu_mutex_unlock(&home->lock);
+
+        /* Timed out + no work to do + no need for warm threads = exit.  */
+        if (timed_out && !thread_pool_has_requests(pool) &&
+            thread_pool_worker_exit(pool, true)) {
+            break;
+        }
+    }
 
-    /*
-     * Wake up another thread, in case we got a wakeup but decided
-     * to exit due to pool->cur_threads > pool->max_threads.
-     */
-    qemu_cond_signal(&pool->request_cond);
-    qemu_mutex_unlock(&pool->lock);
     return NULL;
 }
 
 static void do_spawn_thread(ThreadPool *pool)
 {
+    ThreadPoolQueue *home;
     QemuThread t;
 
     /* Runs with lock taken.  */
@@ -143,7 +370,8 @@ static void do_spawn_thread(ThreadPool *pool)
     pool->new_threads--;
     pool->pending_threads++;
 
-    qemu_thread_create(&t, "worker", worker_thread, pool, QEMU_THREAD_DETACHED);
+    home = &pool->queues[pool->next_home++ % THREAD_POOL_NR_QUEUES];
+    qemu_thread_create(&t, "worker", worker_thread, home, QEMU_THREAD_DETACHED);
 }
 
 static void spawn_thread_bh_fn(void *opaque)
@@ -157,7 +385,7 @@ static void spawn_thread_bh_fn(void *opaque)
 
 static void spawn_thread(ThreadPool *pool)
 {
-    pool->cur_threads++;
+    qatomic_set(&pool->cur_threads, pool->cur_threads + 1);
     pool->new_threads++;
     /* If there are threads being created, they will spawn new workers, so
      * we don't spend time creating many threads in a loop holding a mutex or
@@ -174,15 +402,27 @@ static void spawn_thread(ThreadPool *pool)
 static void thread_pool_completion_bh(void *opaque)
 {
     ThreadPool *pool = opaque;
-    ThreadPoolElement *elem, *next;
+    QSLIST_HEAD(, ThreadPoolElement) completed;
+    QSIMPLEQ_HEAD(, ThreadPoolElement) batch =
+        QSIMPLEQ_HEAD_INITIALIZER(batch);
+    ThreadPoolElement *elem;
+
+    /*
+     * Workers push completed requests in LIFO order, reverse them so that
+     * callbacks run in completion order.
+     */
+    QSLIST_MOVE_ATOMIC(&completed, &pool->completed);
+    while ((elem = QSLIST_FIRST(&completed))) {
+        QSLIST_REMOVE_HEAD(&completed, done);
+        QSIMPLEQ_INSERT_HEAD(&batch, elem, done_list);
+    }
+    QSIMPLEQ_CONCAT(&pool->done_list, &batch);
 
     defer_call_begin(); /* cb() may use defer_call() to coalesce work */
 
-restart:
-    QLIST_FOREACH_SAFE(elem, &pool->head, all, next) {
-        if (elem->state != THREAD_DONE) {
-            continue;
-        }
+    while ((elem = QSIMPLEQ_FIRST(&pool->done_list))) {
+        QSIMPLEQ_REMOVE_HEAD(&pool->done_list, done_list);
+        assert(elem->state == THREAD_DONE);
 
         trace_thread_pool_complete(pool, elem, elem->common.opaque,
                                    elem->ret);
@@ -200,16 +440,16 @@ restart:
             elem->common.cb(elem->common.opaque, elem->ret);
 
             /* We can safely cancel the completion_bh here regardless of someone
-             * else having scheduled it meanwhile because we reenter the
-             * completion function anyway (goto restart).
+             * else having scheduled it meanwhile because we process the whole
+             * done_list anyway.  Requests that complete from now on will
+             * schedule it again.
              */
             qemu_bh_cancel(pool->completion_bh);
-
-            qemu_aio_unref(elem);
-            goto restart;
-        } else {
-            qemu_aio_unref(elem);
+            if (qatomic_read(&pool->completed.slh_first)) {
+                qemu_bh_schedule(pool->completion_bh);
+            }
         }
+        qemu_aio_unref(elem);
     }
 
     defer_call_end();
@@ -219,18 +459,26 @@ static void thread_pool_cancel(BlockAIOCB *acb)
 {
     ThreadPoolElement *elem = (ThreadPoolElement *)acb;
     ThreadPool *pool = elem->pool;
+    ThreadPoolQueue *q = elem->queue;
 
     trace_thread_pool_cancel(elem, elem->common.opaque);
 
-    QEMU_LOCK_GUARD(&pool->lock);
-    if (elem->state == THREAD_QUEUED) {
-        QTAILQ_REMOVE(&pool->request_list, elem, reqs);
-        qemu_bh_schedule(pool->completion_bh);
-
-        elem->state = THREAD_DONE;
-        elem->ret = -ECANCELED;
+    if (!q) {
+        /* Still batched, so we're in the submitting AioContext */
+        QTAILQ_REMOVE(&pool->batch, elem, reqs);
+        pool->batch_len--;
+    } else {
+        QEMU_LOCK_GUARD(&q->lock);
+        if (elem->state != THREAD_QUEUED) {
+            return;
+        }
+        QTAILQ_REMOVE(&q->request_list, elem, reqs);
+        qatomic_set(&q->nr_requests, q->nr_requests - 1);
     }
 
+    elem->state = THREAD_DONE;
+    elem->ret = -ECANCELED;
+    thread_pool_push_completed(pool, elem);
 }
 
 static const AIOCBInfo thread_pool_aiocb_info = {
@@ -238,6 +486,92 @@ static const AIOCBInfo thread_pool_aiocb_info = {
     .cancel_async       = thread_pool_cancel,
 };
 
+/*
+ * Hand all batched requests to the workers.  Requests go to queues with idle
+ * workers first, so that each of them is woken up at most once, and the rest
+ * is spread over all queues for the busy workers to pick up.  Requests that
+ * no idle worker was woken up for cause new workers to be spawned, up to
+ * max_threads.
+ */
+static void thread_pool_flush(void *opaque)
+{
+    ThreadPool *pool = opaque;
+    QTAILQ_HEAD(, ThreadPoolElement) lists[THREAD_POOL_NR_QUEUES];
+    int counts[THREAD_POOL_NR_QUEUES] = { 0 };
+    int idle[THREAD_POOL_NR_QUEUES];
+    int i, total_idle = 0, unserved = 0;
+    ThreadPoolElement *req;
+
+    if (!pool->batch_len) {
+        return;
+    }
+
+    trace_thread_pool_flush(pool, pool->batch_len);
+
+    for (i = 0; i < THREAD_POOL_NR_QUEUES; i++) {
+        QTAILQ_INIT(&lists[i]);
+        idle[i] = qatomic_read(&pool->queues[i].idle_threads);
+        total_idle += idle[i];
+    }
+
+    while ((req = QTAILQ_FIRST(&pool->batch))) {
+        QTAILQ_REMOVE(&pool->batch, req, reqs);
+
+        i = pool->next_queue++ % THREAD_POOL_NR_QUEUES;
+        if (total_idle) {
+            while (!idle[i]) {
+                i = pool->next_queue++ % THREAD_POOL_NR_QUEUES;
+            }
+            idle[i]--;
+            total_idle--;
+        }
+
+        req->queue = &pool->queues[i];
+        QTAILQ_INSERT_TAIL(&lists[i], req, reqs);
+        counts[i]++;
+    }
+    pool->batch_len = 0;
+
+    for (i = 0; i < THREAD_POOL_NR_QUEUES; i++) {
+        ThreadPoolQueue *q = &pool->queues[i];
+        int wake;
+
+        if (!counts[i]) {
+            continue;
+        }
+
+        QEMU_LOCK_GUARD(&q->lock);
+        QTAILQ_CONCAT(&q->request_list, &lists[i], reqs);
+        qatomic_set(&q->nr_requests, q->nr_requests + counts[i]);
+
+        wake = MIN(counts[i], q->idle_threads);
+        unserved += counts[i] - wake;
+        while (wake--) {
+            qemu_cond_signal(&q->request_cond);
+        }
+    }
+
+    if (!unserved) {
+        return;
+    }
+
+    /*
+     * Pairs with the barriers in worker_thread() and
+     * thread_pool_worker_exit(): make the new requests visible before
+     * looking at idle_threads and cur_threads.
+     */
+    smp_mb();
+
+    unserved -= thread_pool_kick_idle(pool, unserved);
+    if (unserved &&
+        qatomic_read(&pool->cur_threads) < qatomic_read(&pool->max_threads)) {
+        QEMU_LOCK_GUARD(&pool->lock);
+        while (unserved-- && pool->cur_threads < pool->max_threads) {
+            spawn_thread(pool);
+        }
+    }
+}
+
 BlockAIOCB *thread_pool_submit_aio(ThreadPoolFunc *func, void *arg,
                                    BlockCompletionFunc *cb, void *opaque)
 {
@@ -253,18 +587,18 @@ BlockAIOCB *thread_pool_submit_aio(ThreadPoolFunc *func, void *arg,
     req->arg = arg;
     req->state = THREAD_QUEUED;
     req->pool = pool;
+    req->queue = NULL;
 
     QLIST_INSERT_HEAD(&pool->head, req, all);
 
     trace_thread_pool_submit(pool, req, arg);
 
-    qemu_mutex_lock(&pool->lock);
-    if (pool->idle_threads == 0 && pool->cur_threads < pool->max_threads) {
-        spawn_thread(pool);
+    QTAILQ_INSERT_TAIL(&pool->batch, req, reqs);
+    if (++pool->batch_len >= THREAD_POOL_MAX_BATCH) {
+        thread_pool_flush(pool);
+    } else {
+        defer_call(thread_pool_flush, pool);
     }
-    QTAILQ_INSERT_TAIL(&pool->request_list, req, reqs);
-    qemu_mutex_unlock(&pool->lock);
-    qemu_cond_signal(&pool->request_cond);
     return &req->common;
 }
 
@@ -295,12 +629,32 @@ void thread_pool_submit(ThreadPoolFunc *func, void *arg)
     thread_pool_submit_aio(func, arg, NULL, NULL);
 }
 
+static void thread_pool_wake_all(ThreadPool *pool)
+{
+    int i;
+
+    for (i = 0; i < THREAD_POOL_NR_QUEUES; i++) {
+        WITH_QEMU_LOCK_GUARD(&pool->queues[i].lock) {
+            qemu_cond_broadcast(&pool->queues[i].request_cond);
+        }
+    }
+}
+
 void thread_pool_update_params(ThreadPool *pool, AioContext *ctx)
 {
     qemu_mutex_lock(&pool->lock);
 
     pool->min_threads = ctx->thread_pool_min;
-    pool->max_threads = ctx->thread_pool_max;
+    qatomic_set(&pool->max_threads, ctx->thread_pool_max);
+
+    g_free(pool->cpus);
+    pool->cpus = NULL;
+    pool->nr_cpus = ctx->thread_pool_nr_cpus;
+    if (ctx->thread_pool_cpus) {
+        pool->cpus = bitmap_new(pool->nr_cpus);
+        bitmap_copy(pool->cpus, ctx->thread_pool_cpus, pool->nr_cpus);
+    }
+    qatomic_set(&pool->affinity_gen, pool->affinity_gen + 1);
 
     /*
      * We either have to:
@@ -315,15 +669,16 @@ void thread_pool_update_params(ThreadPool *pool, AioContext *ctx)
         spawn_thread(pool);
     }
 
-    for (int i = pool->cur_threads; i > pool->max_threads; i--) {
-        qemu_cond_signal(&pool->request_cond);
-    }
-
     qemu_mutex_unlock(&pool->lock);
+
+    /* Let idle workers exit or pick up the new affinity */
+    thread_pool_wake_all(pool);
 }
 
 static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
 {
+    int i;
+
     if (!ctx) {
         ctx = qemu_get_aio_context();
     }
@@ -333,11 +688,20 @@ static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
     pool->completion_bh = aio_bh_new(ctx, thread_pool_completion_bh, pool);
     qemu_mutex_init(&pool->lock);
     qemu_cond_init(&pool->worker_stopped);
-    qemu_cond_init(&pool->request_cond);
     pool->new_thread_bh = aio_bh_new(ctx, spawn_thread_bh_fn, pool);
 
+    for (i = 0; i < THREAD_POOL_NR_QUEUES; i++) {
+        ThreadPoolQueue *q = &pool->queues[i];
+
+        q->pool = pool;
+        qemu_mutex_init(&q->lock);
+        qemu_cond_init(&q->request_cond);
+        QTAILQ_INIT(&q->request_list);
+    }
+
     QLIST_INIT(&pool->head);
-    QTAILQ_INIT(&pool->request_list);
+    QTAILQ_INIT(&pool->batch);
+    QSIMPLEQ_INIT(&pool->done_list);
 
     thread_pool_update_params(pool, ctx);
 }
@@ -351,6 +715,8 @@ ThreadPool *thread_pool_new(AioContext *ctx)
 
 void thread_pool_free(ThreadPool *pool)
 {
+    int i;
+
     if (!pool) {
         return;
     }
@@ -361,21 +727,27 @@ void thread_pool_free(ThreadPool *pool)
 
     /* Stop new threads from spawning */
     qemu_bh_delete(pool->new_thread_bh);
-    pool->cur_threads -= pool->new_threads;
+    qatomic_set(&pool->cur_threads, pool->cur_threads - pool->new_threads);
     pool->new_threads = 0;
 
     /* Wait for worker threads to terminate */
-    pool->max_threads = 0;
-    qemu_cond_broadcast(&pool->request_cond);
+    qatomic_set(&pool->max_threads, 0);
+    qemu_mutex_unlock(&pool->lock);
+    thread_pool_wake_all(pool);
+
+    qemu_mutex_lock(&pool->lock);
     while (pool->cur_threads > 0) {
         qemu_cond_wait(&pool->worker_stopped, &pool->lock);
     }
-
     qemu_mutex_unlock(&pool->lock);
 
     qemu_bh_delete(pool->completion_bh);
-    qemu_cond_destroy(&pool->request_cond);
+    for (i = 0; i < THREAD_POOL_NR_QUEUES; i++) {
+        qemu_cond_destroy(&pool->queues[i].request_cond);
+        qemu_mutex_destroy(&pool->queues[i].lock);
+    }
     qemu_cond_destroy(&pool->worker_stopped);
     qemu_mutex_destroy(&pool->lock);
+    g_free(pool->cpus);
     g_free(pool);
 }
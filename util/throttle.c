@@ -87,6 +87,34 @@ static int64_t throttle_do_compute_wait(double limit, double extra)
     return wait;
 }
 
+/*
+ * Compute the size of a leaky bucket
+ *
+ * @bkt:               the leaky bucket we operate on
+ * @bucket_size:       I/O before throttling to bkt->avg
+ * @burst_bucket_size: I/O before throttling to bkt->max
+ */
+static void throttle_bucket_size(LeakyBucket *bkt, double *bucket_size,
+                                 double *burst_bucket_size)
+{
+    if (!bkt->max) {
+        /*
+         * If bkt->max is 0 we still want to allow short bursts of I/O
+         * from the guest, otherwise every other request will be throttled
+         * and performance will suffer considerably.
+         */
+        *bucket_size = (double) bkt->avg / 10;
+        *burst_bucket_size = 0;
+    } else {
+        /*
+         * If we have a burst limit then we have to wait until all I/O
+         * at burst rate has finished before throttling to bkt->avg
+         */
+        *bucket_size = bkt->max * bkt->burst_length;
+        *burst_bucket_size = (double) bkt->max / 10;
+    }
+}
+
 /* This function compute the wait time in ns that a leaky bucket should trigger
  *
  * @bkt: the leaky bucket we operate on
@@ -102,18 +130,7 @@ int64_t throttle_compute_wait(LeakyBucket *bkt)
         return 0;
     }
 
-    if (!bkt->max) {
-        /* If bkt->max is 0 we still want to allow short bursts of I/O
-         * from the guest, otherwise every other request will be throttled
-         * and performance will suffer considerably. */
-        bucket_size = (double) bkt->avg / 10;
-        burst_bucket_size = 0;
-    } else {
-        /* If we have a burst limit then we have to wait until all I/O
-         * at burst rate has finished before throttling to bkt->avg */
-        bucket_size = bkt->max * bkt->burst_length;
-        burst_bucket_size = (double) bkt->max / 10;
-    }
+    throttle_bucket_size(bkt, &bucket_size, &burst_bucket_size);
 
     /* If the main bucket is full then we have to wait */
     extra = bkt->level - bucket_size;
@@ -196,6 +213,77 @@ static bool throttle_compute_timer(ThrottleState *ts,
     return false;
 }
 
+/*
+ * Compute how much I/O a leaky bucket accepts before it must wait
+ *
+ * @bkt:       the leaky bucket we operate on
+ * @period_ns: only return what the bucket leaks in this period at most
+ * @ret:       the number of units, or -1 if the bucket has no limit
+ */
+static double throttle_bucket_headroom(LeakyBucket *bkt, int64_t period_ns)
+{
+    double bucket_size, burst_bucket_size, room;
+
+    if (!bkt->avg) {
+        return -1;
+    }
+
+    throttle_bucket_size(bkt, &bucket_size, &burst_bucket_size);
+    room = bucket_size - bkt->level;
+    if (bkt->burst_length > 1) {
+        room = MIN(room, burst_bucket_size - bkt->burst_level);
+    }
+    room = MIN(room, (bkt->avg * (double) period_ns) / NANOSECONDS_PER_SECOND);
+
+    return MAX(room, 0);
+}
+
+/*
+ * Compute how much I/O can be accounted for a direction without having to
+ * wait.  This is used to hand out budget in advance, see
+ * throttle_account_units() for giving back the part that was not used.
+ *
+ * @direction: throttle direction
+ * @now:       the current clock timestamp
+ * @period_ns: limit the result to what the buckets leak in this period
+ * @bytes:     lowered to the number of bytes that are available
+ * @units:     lowered to the number of operations that are available
+ */
+void throttle_headroom(ThrottleState *ts, ThrottleDirection direction,
+                       int64_t now, int64_t period_ns,
+                       double *bytes, double *units)
+{
+    static const BucketType bucket_types_size[THROTTLE_MAX][2] = {
+        { THROTTLE_BPS_TOTAL, THROTTLE_BPS_READ },
+        { THROTTLE_BPS_TOTAL, THROTTLE_BPS_WRITE }
+    };
+    static const BucketType bucket_types_units[THROTTLE_MAX][2] = {
+        { THROTTLE_OPS_TOTAL, THROTTLE_OPS_READ },
+        { THROTTLE_OPS_TOTAL, THROTTLE_OPS_WRITE }
+    };
+    double room;
+    unsigned i;
+
+    assert(direction < THROTTLE_MAX);
+    throttle_do_leak(ts, now);
+
+    for (i = 0; i < ARRAY_SIZE(bucket_types_size[THROTTLE_READ]); i++) {
+        LeakyBucket *bkt;
+
+        bkt = &ts->cfg.buckets[bucket_types_size[direction][i]];
+        room = throttle_bucket_headroom(bkt, period_ns);
+        if (room >= 0) {
+            *bytes = MIN(*bytes, room);
+        }
+
+        bkt = &ts->cfg.buckets[bucket_types_units[direction][i]];
+        room = throttle_bucket_headroom(bkt, period_ns);
+        if (room >= 0) {
+            *units = MIN(*units, room);
+        }
+    }
+}
+
 /* Add timers to event loop */
 void throttle_timers_attach_aio_context(ThrottleTimers *tt,
                                         AioContext *new_context)
@@ -469,6 +557,29 @@ bool throttle_schedule_timer(ThrottleState *ts,
  */
 void throttle_account(ThrottleState *ts, ThrottleDirection direction,
                       uint64_t size)
+{
+    double units = 1.0;
+
+    /* if cfg.op_size is defined and smaller than size we compute unit count */
+    if (ts->cfg.op_size && size > ts->cfg.op_size) {
+        units = (double) size / ts->cfg.op_size;
+    }
+
+    throttle_account_units(ts, direction, size, units);
+}
+
+/*
+ * do the accounting for a given amount of bytes and operations
+ *
+ * Negative values give back budget that was accounted in advance (see
+ * throttle_headroom()) but was not used in the end.
+ *
+ * @direction: throttle direction
+ * @bytes:     the number of bytes
+ * @units:     the number of operations
+ */
+void throttle_account_units(ThrottleState *ts, ThrottleDirection direction,
+                            double bytes, double units)
 {
     static const BucketType bucket_types_size[THROTTLE_MAX][2] = {
         { THROTTLE_BPS_TOTAL, THROTTLE_BPS_READ },
@@ -478,28 +589,23 @@ void throttle_account(ThrottleState *ts, ThrottleDirection direction,
         { THROTTLE_OPS_TOTAL, THROTTLE_OPS_READ },
         { THROTTLE_OPS_TOTAL, THROTTLE_OPS_WRITE }
     };
-    double units = 1.0;
     unsigned i;
 
     assert(direction < THROTTLE_MAX);
-    /* if cfg.op_size is defined and smaller than size we compute unit count */
-    if (ts->cfg.op_size && size > ts->cfg.op_size) {
-        units = (double) size / ts->cfg.op_size;
-    }
 
     for (i = 0; i < ARRAY_SIZE(bucket_types_size[THROTTLE_READ]); i++) {
         LeakyBucket *bkt;
 
         bkt = &ts->cfg.buckets[bucket_types_size[direction][i]];
-        bkt->level += size;
+        bkt->level = MAX(bkt->level + bytes, 0);
         if (bkt->burst_length > 1) {
-            bkt->burst_level += size;
+            bkt->burst_level = MAX(bkt->burst_level + bytes, 0);
         }
 
         bkt = &ts->cfg.buckets[bucket_types_units[direction][i]];
-        bkt->level += units;
+        bkt->level = MAX(bkt->level + units, 0);
         if (bkt->burst_length > 1) {
-            bkt->burst_level += units;
+            bkt->burst_level = MAX(bkt->burst_level + units, 0);
         }
     }
 }